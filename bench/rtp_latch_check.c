@@ -0,0 +1,230 @@
+// rtp_latch_check.c - 對稱 RTP 鎖定的回環檢查：鎖定、其他 SSRC 不影響發送目的地，
+// 以及對方媒體改變 (早期媒體轉為接通、故障轉移、re-INVITE) 後以新的 SSRC 重新鎖定；任何檢查失敗時返回非零
+#include "lib/sip_client.h"
+#include "lib/sip_dialog.h"
+#include "lib/sip_pacer.h"
+#include "lib/sip_parser.h"
+
+#define RX_PORT 46100
+#define EARLY_PORT 46102      // 早期媒體 (放音伺服器)
+#define FINAL_PORT 46104      // 接通後的媒體
+#define OTHER_PORT 46106      // 其他來源
+#define REINVITE_PORT 46108   // re-INVITE 改變後的媒體
+#define ACK_PORT 46110        // 我方 offer 後 ACK 中 answer 的媒體
+#define PEER_SIP_PORT 46112   // 對方的 SIP 端口 (接收我方的回應)
+#define LATCH_PACKETS 3
+
+static int failures = 0;
+
+static int bind_loopback(int port) {
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons(port) };
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (fd < 0 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        perror("bind");
+        exit(1);
+    }
+    return fd;
+}
+
+static void send_packets(int fd, uint32_t ssrc, int payload_type, int count) {
+    unsigned char packet[sizeof(rtp_header_t) + 160];
+    struct sockaddr_in to = { .sin_family = AF_INET, .sin_port = htons(RX_PORT) };
+    to.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    memset(packet, 0xFF, sizeof(packet));
+    for (int i = 0; i < count; i++) {
+        init_rtp_header((rtp_header_t *)packet, payload_type, (unsigned short)i, (unsigned int)i * 160, ssrc);
+        sendto(fd, packet, sizeof(packet), 0, (struct sockaddr *)&to, sizeof(to));
+    }
+    usleep(50000);   // 等待接收線程處理
+}
+
+static void set_remote(rtp_receiver_t *rx, int port, int payload_type) {
+    sip_media_t media;
+    struct in_addr loopback = { htonl(INADDR_LOOPBACK) };
+    sip_media_init(&media, &loopback, port);
+    media.payload_type = payload_type;
+    rtp_receiver_set_remote(rx, &media);
+}
+
+// 發送目的地應為 expect_port (0 表示未鎖定，送到 SDP 地址)
+static void check_dest(const char *step, rtp_receiver_t *rx, int expect_port) {
+    struct sockaddr_in dest = { .sin_family = AF_INET, .sin_port = htons(1) };
+    int latched = rtp_latch_apply(rtp_receiver_latch(rx), &dest);
+    int port = latched ? ntohs(dest.sin_port) : 0;
+
+    printf("  %-36s %s (目的端口 %d)\n", step, port == expect_port ? "通過" : "失敗", port);
+    if (port != expect_port) failures++;
+}
+
+// 與 ws_audio_server 的 on_call_media_change 相同：接收器重新鎖定，播放中的串流改送到新的地址與編碼
+static int call_stream;
+static const unsigned char *call_payloads[128];
+
+static void on_media_change(sip_dialog_t *dialog) {
+    sip_media_t *media = &dialog->session.media;
+    struct sockaddr_in dest = { .sin_family = AF_INET, .sin_port = htons(media->remote_port) };
+    dest.sin_addr = media->remote_addr;
+
+    rtp_receiver_set_remote(dialog->rtp, media);
+    sip_pacer_redirect(call_stream, &dest, media->payload_type, call_payloads[media->payload_type]);
+}
+
+// 對方在對話中的請求 (帶 SDP 時媒體指向 port，負載類型為 payload_type)
+static void peer_request(sip_session_t *session, int sip_fd, const char *method, int cseq, int port, int payload_type) {
+    char sdp[256] = "", buf[1024];
+    sip_msg_t msg;
+    struct sockaddr_in from = { .sin_family = AF_INET, .sin_port = htons(PEER_SIP_PORT) };
+    from.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    if (port > 0) {
+        snprintf(sdp, sizeof(sdp),
+                 "v=0\r\no=peer 1 %d IN IP4 127.0.0.1\r\ns=-\r\nc=IN IP4 127.0.0.1\r\nt=0 0\r\n"
+                 "m=audio %d RTP/AVP %d\r\na=ptime:20\r\n", cseq, port, payload_type);
+    }
+    int len = snprintf(buf, sizeof(buf),
+                       "%s sip:check@127.0.0.1 SIP/2.0\r\n"
+                       "Via: SIP/2.0/UDP 127.0.0.1:%d;branch=z9hG4bK-latch-%s-%d\r\n"
+                       "From: <sip:peer@127.0.0.1>;tag=peer\r\nTo: <sip:check@127.0.0.1>;tag=%s\r\n"
+                       "Call-ID: %s\r\nCSeq: %d %s\r\nContact: <sip:peer@127.0.0.1:%d>\r\n"
+                       "%sContent-Length: %zu\r\n\r\n%s",
+                       method, PEER_SIP_PORT, method, cseq, session->tag, session->callid, cseq, method, PEER_SIP_PORT,
+                       sdp[0] ? "Content-Type: application/sdp\r\n" : "", strlen(sdp), sdp);
+    if (sip_parse_message(buf, len, &msg) != 0) {
+        printf("  無法解析 %s\n", method);
+        failures++;
+        return;
+    }
+    sip_session_on_unmatched(session, &msg, &from);
+    usleep(50000);   // 等待節拍線程以新的目的地發送
+    while (recv(sip_fd, buf, sizeof(buf), MSG_DONTWAIT) > 0) {}
+}
+
+// 播放中的串流應發送到 fd (負載類型 payload_type)
+static void check_stream(const char *step, int fd, int payload_type) {
+    unsigned char packet[sizeof(rtp_header_t) + 160];
+    int got = -1;
+
+    while (recv(fd, packet, sizeof(packet), MSG_DONTWAIT) > 0) {}   // 丟棄改變前已送達的封包
+    if (recv_with_timeout(fd, (char *)packet, sizeof(packet), NULL, NULL, 200) > 0) {
+        got = ((rtp_header_t *)packet)->m_pt & 0x7F;
+    }
+    printf("  %-36s %s (負載類型 %d)\n", step, got == payload_type ? "通過" : "失敗", got);
+    if (got != payload_type) failures++;
+}
+
+// re-INVITE 改變 c=/m= (以及我方 offer 後 ACK 中的 answer)：解除鎖定，播放中的串流改送到新的地址
+static void check_reinvite(rtp_receiver_t *rx, int final) {
+    static unsigned char pcmu[8000 * 10], pcma[8000 * 10];
+    static sip_dialog_t dialog;
+    sip_session_t *session = &dialog.session;
+    struct in_addr loopback = { htonl(INADDR_LOOPBACK) };
+
+    dialog.state = DIALOG_CONFIRMED;
+    dialog.rtp = rx;
+    dialog.on_media_change = on_media_change;
+    session->dialog = &dialog;
+    session->call_established = 1;
+    snprintf(session->callid, sizeof(session->callid), "latch-check");
+    snprintf(session->tag, sizeof(session->tag), "local");
+    sip_media_init(&session->media, &loopback, FINAL_PORT);
+    session->media.payload_type = 8;
+    session->media.ptime = 20;
+    int sip_fd = bind_loopback(PEER_SIP_PORT);
+    session->sockfd = sip_fd;
+    int reinvite = bind_loopback(REINVITE_PORT);
+    int ack = bind_loopback(ACK_PORT);
+
+    // 通話中正在以 PCMA 播放提示音 (從接收器的 socket 發出，依鎖定的來源改變目的地)
+    memset(pcmu, 0xFF, sizeof(pcmu));
+    memset(pcma, 0xD5, sizeof(pcma));
+    call_payloads[0] = pcmu;
+    call_payloads[8] = pcma;
+    sip_pacer_stream_params_t params = {
+        .sockfd = rtp_receiver_get_sockfd(rx), .latch = rtp_receiver_latch(rx),
+        .payload = pcma, .length = sizeof(pcma), .packet_bytes = 160, .ptime = 20, .payload_type = 8,
+        .ssrc = 0x6666
+    };
+    params.dest.sin_family = AF_INET;
+    params.dest.sin_addr = loopback;
+    params.dest.sin_port = htons(FINAL_PORT);
+    call_stream = sip_pacer_start(&params);
+    check_stream("播放中的串流送到鎖定的地址", final, 8);
+
+    peer_request(session, sip_fd, "INVITE", 2, REINVITE_PORT, 0);
+    check_dest("re-INVITE 改變媒體後解除鎖定", rx, 0);
+    check_stream("播放中的串流改送到新的地址與編碼", reinvite, 0);
+    send_packets(reinvite, 0x5555, 0, LATCH_PACKETS);
+    check_dest("re-INVITE 後以新的來源重新鎖定", rx, REINVITE_PORT);
+
+    // 沒有 SDP 的 re-INVITE：我方在 2xx 中提出 offer，對方的 answer 在 ACK 中
+    peer_request(session, sip_fd, "INVITE", 3, 0, 0);
+    check_dest("answer 到達前維持鎖定", rx, REINVITE_PORT);
+    peer_request(session, sip_fd, "ACK", 3, ACK_PORT, 8);
+    check_dest("ACK 中的 answer 改變媒體後解除鎖定", rx, 0);
+    check_stream("播放中的串流改送到 answer 的地址", ack, 8);
+
+    sip_pacer_stop(call_stream);
+    sip_pacer_shutdown();
+    close(sip_fd);
+    close(reinvite);
+    close(ack);
+}
+
+int main(void) {
+    char buf[256];
+
+    setenv("SIP_CFG_RTP_LATCH_PACKETS", "3", 1);
+    setenv("SIP_CFG_TRACE_FILE", "", 1);
+    if (sip_config_load("/dev/null") != 0) return 1;
+
+    rtp_receiver_t *rx = rtp_receiver_create(RX_PORT, NULL, NULL, NULL);
+    if (!rx) return 1;
+    int early = bind_loopback(EARLY_PORT);
+    int final = bind_loopback(FINAL_PORT);
+    int other = bind_loopback(OTHER_PORT);
+
+    printf("對稱 RTP 鎖定檢查 (%d 個連續封包)\n", LATCH_PACKETS);
+
+    // 183 早期媒體：SDP 指向 EARLY_PORT
+    set_remote(rx, EARLY_PORT, 0);
+    send_packets(early, 0x1111, 0, LATCH_PACKETS - 1);
+    check_dest("不足鎖定封包數時不鎖定", rx, 0);
+    send_packets(early, 0x1111, 0, 1);
+    check_dest("早期媒體鎖定", rx, EARLY_PORT);
+    send_packets(other, 0x2222, 0, LATCH_PACKETS * 2);
+    check_dest("其他 SSRC 不改變目的地", rx, EARLY_PORT);
+    send_packets(other, 0x1111, 8, LATCH_PACKETS * 2);
+    check_dest("非協商負載類型不改變目的地", rx, EARLY_PORT);
+
+    // 200 OK：媒體改由另一台伺服器以新的 SSRC 發送
+    set_remote(rx, FINAL_PORT, 0);
+    check_dest("對方媒體改變後立即解除鎖定", rx, 0);
+    send_packets(final, 0x3333, 0, LATCH_PACKETS);
+    check_dest("接通後以新的 SSRC 重新鎖定", rx, FINAL_PORT);
+
+    // 相同的 SDP 再次設定 (例如重送的 200 OK) 不解除鎖定
+    set_remote(rx, FINAL_PORT, 0);
+    send_packets(final, 0x3333, 0, 1);
+    check_dest("相同的 SDP 不解除鎖定", rx, FINAL_PORT);
+
+    // 只改變負載類型 (re-INVITE 改用 PCMA) 也重新鎖定
+    set_remote(rx, FINAL_PORT, 8);
+    send_packets(final, 0x3333, 0, LATCH_PACKETS);
+    check_dest("負載類型改變後舊負載不鎖定", rx, 0);
+    send_packets(final, 0x4444, 8, LATCH_PACKETS);
+    check_dest("負載類型改變後重新鎖定", rx, FINAL_PORT);
+
+    check_reinvite(rx, final);
+
+    rtp_latch_format(buf, sizeof(buf));
+    printf("  %s", buf);
+
+    rtp_receiver_destroy(rx);
+    close(early);
+    close(final);
+    close(other);
+    printf("%s\n", failures == 0 ? "全部通過" : "有檢查失敗");
+    return failures == 0 ? 0 : 1;
+}
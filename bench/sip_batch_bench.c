@@ -0,0 +1,149 @@
+// sip_batch_bench.c - SIP UDP 收發吞吐量比較：逐個 sendmsg/recvfrom 與 sendmmsg/recvmmsg 批量收發 (本機回環)
+#include "lib/sip_client.h"
+#include "lib/sip_batch.h"
+#include <sys/socket.h>
+#include <poll.h>
+
+#define DEFAULT_DATAGRAMS 1000000
+#define DEFAULT_BURST 32
+
+// 每輪由發送端送出一批數據報，接收端全部讀完後再開始下一輪 (模擬一次事件循環處理一批訊息)，
+// 批次不超過接收緩衝區，因此不會因丟包影響比較
+static const char *sample_invite =
+    "INVITE sip:0938220136@192.168.1.170 SIP/2.0\r\n"
+    "Via: SIP/2.0/UDP 192.168.157.126:5062;branch=z9hG4bK6ad25b25000004\r\n"
+    "Max-Forwards: 70\r\n"
+    "From: \"0921367101\" <sip:0921367101@192.168.1.170>;tag=6ad259670008\r\n"
+    "To: <sip:0938220136@192.168.1.170>\r\n"
+    "Call-ID: 6ad25967-00000008@192.168.1.170\r\n"
+    "CSeq: 102 INVITE\r\n"
+    "Contact: <sip:0921367101@192.168.157.126:5062>\r\n"
+    "User-Agent: Custom SIP Client\r\n"
+    "Content-Type: application/sdp\r\n"
+    "Content-Length: 0\r\n"
+    "\r\n";
+
+static long batch_received = 0;
+
+static double elapsed_seconds(const struct timespec *start, const struct timespec *end) {
+    return (end->tv_sec - start->tv_sec) + (end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static int open_socket(struct sockaddr_in *addr) {
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    int rcvbuf = 4 * 1024 * 1024;
+    socklen_t len = sizeof(*addr);
+
+    if (fd < 0) return -1;
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+    memset(addr, 0, sizeof(*addr));
+    addr->sin_family = AF_INET;
+    addr->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(fd, (struct sockaddr *)addr, sizeof(*addr)) != 0 ||
+        getsockname(fd, (struct sockaddr *)addr, &len) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static void wait_readable(int fd) {
+    struct pollfd pfd = { fd, POLLIN, 0 };
+    poll(&pfd, 1, 1000);
+}
+
+static void on_datagram(int sockfd, const char *data, int len, const struct sockaddr_in *from) {
+    (void)sockfd;
+    (void)data;
+    (void)len;
+    (void)from;
+    batch_received++;
+}
+
+// 逐個數據報：每個訊息一次 sendmsg 與一次 recvfrom
+static long run_single(int tx, int rx, const struct sockaddr_in *dest, long total, int burst, long *syscalls) {
+    struct iovec iov = { (void *)sample_invite, strlen(sample_invite) };
+    char buf[BUF_SIZE];
+    long received = 0;
+
+    *syscalls = 0;
+    for (long sent = 0; sent < total; ) {
+        int n = total - sent < burst ? (int)(total - sent) : burst;
+        for (int i = 0; i < n; i++) {
+            sip_send_iov(tx, dest, &iov, 1);
+            (*syscalls)++;
+        }
+        sent += n;
+        for (int got = 0; got < n; ) {
+            ssize_t r = recvfrom(rx, buf, sizeof(buf) - 1, MSG_DONTWAIT, NULL, NULL);
+            (*syscalls)++;
+            if (r < 0) {
+                if (errno != EAGAIN && errno != EWOULDBLOCK) return received;
+                wait_readable(rx);
+                continue;
+            }
+            got++;
+            received++;
+        }
+    }
+    return received;
+}
+
+// 批量：sip_batch_send 排入佇列後一次 sendmmsg，sip_batch_recv 以 recvmmsg 讀取
+static long run_batch(int tx, int rx, const struct sockaddr_in *dest, long total, int burst, long *syscalls) {
+    struct iovec iov = { (void *)sample_invite, strlen(sample_invite) };
+    sip_batch_stats_t before, after;
+
+    batch_received = 0;
+    sip_batch_get_stats(&before);
+    for (long sent = 0; sent < total; ) {
+        int n = total - sent < burst ? (int)(total - sent) : burst;
+        for (int i = 0; i < n; i++) {
+            sip_batch_send(tx, dest, &iov, 1);
+        }
+        sip_batch_flush();
+        sent += n;
+        while (batch_received < sent) {
+            if (sip_batch_recv(rx, on_datagram) == 0) wait_readable(rx);
+        }
+    }
+    sip_batch_get_stats(&after);
+    *syscalls = (after.send_calls - before.send_calls) + (after.recv_calls - before.recv_calls);
+    return batch_received;
+}
+
+int main(int argc, char *argv[]) {
+    long total = argc > 1 ? atol(argv[1]) : DEFAULT_DATAGRAMS;
+    int burst = argc > 2 ? atoi(argv[2]) : DEFAULT_BURST;
+    if (total <= 0) total = DEFAULT_DATAGRAMS;
+    if (burst <= 0 || burst > SIP_BATCH_QUEUE) burst = DEFAULT_BURST;
+
+    struct sockaddr_in tx_addr, rx_addr;
+    int tx = open_socket(&tx_addr);
+    int rx = open_socket(&rx_addr);
+    if (tx < 0 || rx < 0) {
+        fprintf(stderr, "無法建立 UDP socket: %s\n", strerror(errno));
+        return 1;
+    }
+
+    printf("SIP UDP 收發基準測試：%ld 個數據報 (%zu 字節)，每批 %d 個\n", total, strlen(sample_invite), burst);
+
+    struct timespec t0, t1;
+    long syscalls;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    long got = run_single(tx, rx, &rx_addr, total, burst, &syscalls);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    double single = elapsed_seconds(&t0, &t1);
+    printf("  逐個 sendmsg/recvfrom : %10.0f 數據報/秒，系統調用 %ld (收到 %ld)\n", got / single, syscalls, got);
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    long got_batch = run_batch(tx, rx, &rx_addr, total, burst, &syscalls);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    double batch = elapsed_seconds(&t0, &t1);
+    printf("  批量 sendmmsg/recvmmsg: %10.0f 數據報/秒，系統調用 %ld (收到 %ld)\n", got_batch / batch, syscalls, got_batch);
+    printf("  加速比 %.2fx\n", (got_batch / batch) / (got / single));
+
+    close(tx);
+    close(rx);
+    return got == total && got_batch == total ? 0 : 1;
+}
@@ -0,0 +1,166 @@
+// sip_id_stress.c - 識別碼產生器壓力測試：多線程產生 branch/tag/Call-ID，量測速率並檢查格式與重複
+#include "lib/sip_client.h"
+#include "lib/sip_id.h"
+#include <sys/wait.h>
+
+#define DEFAULT_THREADS 8
+#define DEFAULT_PER_THREAD 250000
+
+// 以 128 位元鍵比較 (branch/Call-ID 為 96 位元，tag 為 64 位元)
+typedef struct {
+    uint64_t hi;
+    uint64_t lo;
+} id_key_t;
+
+typedef struct {
+    long count;
+    id_key_t *branches;
+    id_key_t *tags;
+    id_key_t *callids;
+    long bad_format;
+    double seconds;
+} worker_t;
+
+static double elapsed_seconds(const struct timespec *start, const struct timespec *end) {
+    return (end->tv_sec - start->tv_sec) + (end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static int hex_value(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    return -1;
+}
+
+// 解析恰好 nbytes 個位元組的小寫十六進位字串，end 為其後應出現的字元
+static int decode_hex(const char *s, size_t nbytes, char end, id_key_t *key) {
+    key->hi = key->lo = 0;
+    for (size_t i = 0; i < nbytes * 2; i++) {
+        int v = hex_value(s[i]);
+        if (v < 0) return -1;
+        if (i < 16) key->hi = (key->hi << 4) | v;
+        else key->lo = (key->lo << 4) | v;
+    }
+    return s[nbytes * 2] == end ? 0 : -1;
+}
+
+static void* worker_run(void *arg) {
+    worker_t *w = (worker_t *)arg;
+    char branch[64], tag[32], callid[128];
+    struct timespec t0, t1;
+    size_t cookie_len = strlen(SIP_ID_BRANCH_COOKIE);
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (long i = 0; i < w->count; i++) {
+        sip_id_branch(branch, sizeof(branch));
+        sip_id_tag(tag, sizeof(tag));
+        sip_id_callid(callid, sizeof(callid), "192.0.2.1");
+
+        if (strncmp(branch, SIP_ID_BRANCH_COOKIE, cookie_len) != 0 ||
+            decode_hex(branch + cookie_len, SIP_ID_BRANCH_BYTES, '\0', &w->branches[i]) != 0 ||
+            decode_hex(tag, SIP_ID_TAG_BYTES, '\0', &w->tags[i]) != 0 ||
+            decode_hex(callid, SIP_ID_CALLID_BYTES, '@', &w->callids[i]) != 0 ||
+            strcmp(callid + SIP_ID_CALLID_BYTES * 2, "@192.0.2.1") != 0) {
+            w->bad_format++;
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    w->seconds = elapsed_seconds(&t0, &t1);
+    return NULL;
+}
+
+static int key_compare(const void *a, const void *b) {
+    const id_key_t *x = a, *y = b;
+    if (x->hi != y->hi) return x->hi < y->hi ? -1 : 1;
+    if (x->lo != y->lo) return x->lo < y->lo ? -1 : 1;
+    return 0;
+}
+
+static long count_duplicates(id_key_t *keys, long n) {
+    long dups = 0;
+    qsort(keys, n, sizeof(*keys), key_compare);
+    for (long i = 1; i < n; i++) {
+        if (key_compare(&keys[i - 1], &keys[i]) == 0) dups++;
+    }
+    return dups;
+}
+
+// fork 後父子進程必須產生不同的序列
+static int check_fork(void) {
+    int fds[2];
+    char parent_tag[32], child_tag[32] = "";
+
+    sip_id_tag(parent_tag, sizeof(parent_tag));   // 確保父進程已播種
+    if (pipe(fds) != 0) return -1;
+    pid_t pid = fork();
+    if (pid < 0) return -1;
+    if (pid == 0) {
+        char tag[32];
+        sip_id_tag(tag, sizeof(tag));
+        ssize_t n = write(fds[1], tag, strlen(tag) + 1);
+        _exit(n > 0 ? 0 : 1);
+    }
+    close(fds[1]);
+    ssize_t n = read(fds[0], child_tag, sizeof(child_tag) - 1);
+    close(fds[0]);
+    waitpid(pid, NULL, 0);
+    if (n <= 0) return -1;
+    child_tag[n] = '\0';
+
+    sip_id_tag(parent_tag, sizeof(parent_tag));
+    return strcmp(parent_tag, child_tag) != 0 ? 0 : -1;
+}
+
+int main(int argc, char *argv[]) {
+    int threads = argc > 1 ? atoi(argv[1]) : DEFAULT_THREADS;
+    long per_thread = argc > 2 ? atol(argv[2]) : DEFAULT_PER_THREAD;
+    if (threads <= 0) threads = DEFAULT_THREADS;
+    if (per_thread <= 0) per_thread = DEFAULT_PER_THREAD;
+
+    long total = (long)threads * per_thread;
+    id_key_t *branches = malloc(total * sizeof(id_key_t));
+    id_key_t *tags = malloc(total * sizeof(id_key_t));
+    id_key_t *callids = malloc(total * sizeof(id_key_t));
+    worker_t *workers = calloc(threads, sizeof(worker_t));
+    pthread_t *tids = calloc(threads, sizeof(pthread_t));
+    if (!branches || !tags || !callids || !workers || !tids) {
+        fprintf(stderr, "記憶體不足\n");
+        return 1;
+    }
+
+    printf("識別碼壓力測試 (%d 線程，每線程 %ld 組 branch/tag/Call-ID)\n", threads, per_thread);
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (int i = 0; i < threads; i++) {
+        workers[i].count = per_thread;
+        workers[i].branches = branches + (long)i * per_thread;
+        workers[i].tags = tags + (long)i * per_thread;
+        workers[i].callids = callids + (long)i * per_thread;
+        pthread_create(&tids[i], NULL, worker_run, &workers[i]);
+    }
+    long bad_format = 0;
+    double busiest = 0;
+    for (int i = 0; i < threads; i++) {
+        pthread_join(tids[i], NULL);
+        bad_format += workers[i].bad_format;
+        if (workers[i].seconds > busiest) busiest = workers[i].seconds;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    double wall = elapsed_seconds(&t0, &t1);
+
+    printf("產生 %ld 組識別碼，耗時 %.3f 秒：%.0f 組/秒 (單線程 %.0f 組/秒)\n",
+           total, wall, total / wall, per_thread / busiest);
+
+    long dup_branch = count_duplicates(branches, total);
+    long dup_tag = count_duplicates(tags, total);
+    long dup_callid = count_duplicates(callids, total);
+    int fork_ok = check_fork() == 0;
+    printf("格式錯誤 %ld，重複 branch %ld / tag %ld / Call-ID %ld，fork 後序列%s\n",
+           bad_format, dup_branch, dup_tag, dup_callid, fork_ok ? "不同" : "相同");
+
+    free(branches);
+    free(tags);
+    free(callids);
+    free(workers);
+    free(tids);
+    return (bad_format || dup_branch || dup_tag || dup_callid || !fork_ok) ? 1 : 0;
+}
@@ -0,0 +1,133 @@
+// sip_pacer_bench.c - RTP 發送時間誤差：比較舊做法 (每個串流一個線程，發送後 usleep 一個封包間隔)
+// 與 RTP 節拍器 (依絕對期限發送) 在多個串流同時發送時，實際發送時間與理想時間 (起點 + n × ptime) 的差距
+#include "lib/sip_client.h"
+#include "lib/sip_pacer.h"
+#include "lib/sip_metrics.h"
+
+#define DEFAULT_STREAMS 200
+#define DEFAULT_SECONDS 5
+#define PTIME_MS 20
+#define PACKET_BYTES 160
+
+static struct sockaddr_in sink_addr;
+static volatile int sink_running = 1;
+static int finished = 0;
+
+// 接收並丟棄所有封包，避免接收緩衝區滿
+static void* sink_thread(void *arg) {
+    int fd = *(int *)arg;
+    char buf[512];
+    while (sink_running) {
+        recv(fd, buf, sizeof(buf), 0);
+    }
+    return NULL;
+}
+
+typedef struct {
+    int sockfd;
+    const unsigned char *payload;
+    size_t length;
+} usleep_stream_t;
+
+// 舊做法：發送後睡一個封包間隔，系統調用與排程延遲逐包累積
+static void* usleep_stream(void *arg) {
+    usleep_stream_t *s = (usleep_stream_t *)arg;
+    unsigned char packet[sizeof(rtp_header_t) + PACKET_BYTES];
+    uint64_t start = sip_now_us();
+    uint16_t seq = 0;
+
+    for (size_t offset = 0; offset < s->length; offset += PACKET_BYTES, seq++) {
+        init_rtp_header((rtp_header_t *)packet, 0, seq, (unsigned int)offset, 0x1234);
+        memcpy(packet + sizeof(rtp_header_t), s->payload + offset, PACKET_BYTES);
+        sip_metrics_record_since(SIP_PHASE_RTP_PACING, start + (uint64_t)seq * PTIME_MS * 1000);
+        sendto(s->sockfd, packet, sizeof(packet), 0, (struct sockaddr *)&sink_addr, sizeof(sink_addr));
+        usleep(PTIME_MS * 1000);
+    }
+    return NULL;
+}
+
+static void pacer_done(int stream, sip_pacer_result_t result, unsigned long packets, void *user_data) {
+    (void)stream; (void)result; (void)packets; (void)user_data;
+    __atomic_add_fetch(&finished, 1, __ATOMIC_RELEASE);
+}
+
+static void print_result(const char *name, double seconds) {
+    sip_phase_stats_t s;
+    sip_metrics_get(SIP_PHASE_RTP_PACING, &s);
+    printf("  %-22s 封包 %8llu  誤差 (毫秒) 平均 %6.2f p50 %6.2f p99 %6.2f p999 %6.2f 最大 %7.2f  (%.2f 秒)\n",
+           name, (unsigned long long)s.count, s.mean_us / 1000.0, s.p50_us / 1000.0, s.p99_us / 1000.0,
+           s.p999_us / 1000.0, s.max_us / 1000.0, seconds);
+}
+
+int main(int argc, char *argv[]) {
+    int streams = argc > 1 ? atoi(argv[1]) : DEFAULT_STREAMS;
+    int seconds = argc > 2 ? atoi(argv[2]) : DEFAULT_SECONDS;
+    if (streams <= 0 || streams > SIP_PACER_MAX_STREAMS) streams = DEFAULT_STREAMS;
+    if (seconds <= 0) seconds = DEFAULT_SECONDS;
+
+    // 只套用環境變數 (例如 SIP_CFG_PACER_THREADS=2)
+    if (sip_config_load("/dev/null") != 0) return 1;
+
+    int sink = socket(AF_INET, SOCK_DGRAM, 0);
+    int sender = socket(AF_INET, SOCK_DGRAM, 0);
+    socklen_t addr_len = sizeof(sink_addr);
+    sink_addr.sin_family = AF_INET;
+    sink_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (sink < 0 || sender < 0 || bind(sink, (struct sockaddr *)&sink_addr, sizeof(sink_addr)) != 0 ||
+        getsockname(sink, (struct sockaddr *)&sink_addr, &addr_len) != 0) {
+        perror("socket");
+        return 1;
+    }
+    pthread_t sink_tid;
+    pthread_create(&sink_tid, NULL, sink_thread, &sink);
+
+    size_t length = (size_t)seconds * 1000 / PTIME_MS * PACKET_BYTES;
+    unsigned char *payload = malloc(length);
+    if (!payload) return 1;
+    memset(payload, 0xFF, length);
+
+    printf("RTP 發送時間誤差：%d 個串流，每個 %d 秒 (%d ms/包)\n", streams, seconds, PTIME_MS);
+
+    // 舊做法
+    usleep_stream_t *args = calloc(streams, sizeof(usleep_stream_t));
+    pthread_t *tids = calloc(streams, sizeof(pthread_t));
+    uint64_t t0 = sip_now_us();
+    for (int i = 0; i < streams; i++) {
+        args[i] = (usleep_stream_t){ sender, payload, length };
+        pthread_create(&tids[i], NULL, usleep_stream, &args[i]);
+    }
+    for (int i = 0; i < streams; i++) {
+        pthread_join(tids[i], NULL);
+    }
+    print_result("每串流線程 + usleep", (sip_now_us() - t0) / 1e6);
+
+    // RTP 節拍器
+    sip_metrics_reset();
+    t0 = sip_now_us();
+    for (int i = 0; i < streams; i++) {
+        sip_pacer_stream_params_t params = {
+            .sockfd = sender, .dest = sink_addr, .payload = payload, .length = length,
+            .packet_bytes = PACKET_BYTES, .ptime = PTIME_MS, .payload_type = 0,
+            .ssrc = (uint32_t)i, .done = pacer_done
+        };
+        if (sip_pacer_start(&params) < 0) {
+            __atomic_add_fetch(&finished, 1, __ATOMIC_RELEASE);
+        }
+    }
+    while (__atomic_load_n(&finished, __ATOMIC_ACQUIRE) < streams) {
+        usleep(10000);
+    }
+    print_result("RTP 節拍器", (sip_now_us() - t0) / 1e6);
+
+    char buf[256];
+    sip_pacer_format(buf, sizeof(buf));
+    printf("  %s", buf);
+
+    // 不在結束時輸出延遲統計
+    sip_metrics_reset();
+    sink_running = 0;
+    free(args);
+    free(tids);
+    free(payload);
+    return 0;
+}
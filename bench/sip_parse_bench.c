@@ -0,0 +1,146 @@
+// sip_parse_bench.c - SIP 解析器微基準測試：典型 100/183/200/401 回應的每秒解析訊息數
+#include "lib/sip_client.h"
+#include "lib/sip_parser.h"
+
+#define DEFAULT_ITERATIONS 1000000
+
+static const char *msg_100 =
+    "SIP/2.0 100 Trying\r\n"
+    "Via: SIP/2.0/UDP 192.168.157.126:5062;branch=z9hG4bK6ad25b25000004;rport=5062\r\n"
+    "From: \"0921367101\" <sip:0921367101@192.168.1.170>;tag=6ad259670008\r\n"
+    "To: <sip:0938220136@192.168.1.170>\r\n"
+    "Call-ID: 6ad25967-00000008@192.168.1.170\r\n"
+    "CSeq: 102 INVITE\r\n"
+    "User-Agent: Gateway\r\n"
+    "Content-Length: 0\r\n"
+    "\r\n";
+
+static const char *msg_183 =
+    "SIP/2.0 183 Session Progress\r\n"
+    "Via: SIP/2.0/UDP 192.168.157.126:5062;branch=z9hG4bK6ad25b25000004;rport=5062\r\n"
+    "Record-Route: <sip:192.168.1.170;lr>\r\n"
+    "From: \"0921367101\" <sip:0921367101@192.168.1.170>;tag=6ad259670008\r\n"
+    "To: <sip:0938220136@192.168.1.170>;tag=as5f3c2a1b\r\n"
+    "Call-ID: 6ad25967-00000008@192.168.1.170\r\n"
+    "CSeq: 102 INVITE\r\n"
+    "Contact: <sip:0938220136@192.168.1.170:5060>\r\n"
+    "Content-Type: application/sdp\r\n"
+    "Content-Length: 176\r\n"
+    "\r\n"
+    "v=0\r\n"
+    "o=root 1 1 IN IP4 192.168.1.170\r\n"
+    "s=Gateway\r\n"
+    "c=IN IP4 192.168.1.170\r\n"
+    "t=0 0\r\n"
+    "m=audio 32004 RTP/AVP 0 101\r\n"
+    "a=rtpmap:0 PCMU/8000\r\n"
+    "a=rtpmap:101 telephone-event/8000\r\n"
+    "a=ptime:20\r\n";
+
+static const char *msg_200 =
+    "SIP/2.0 200 OK\r\n"
+    "Via: SIP/2.0/UDP 192.168.157.126:5062;branch=z9hG4bK6ad25b25000004;rport=5062\r\n"
+    "Record-Route: <sip:192.168.1.170;lr>\r\n"
+    "From: \"0921367101\" <sip:0921367101@192.168.1.170>;tag=6ad259670008\r\n"
+    "To: <sip:0938220136@192.168.1.170>;tag=as5f3c2a1b\r\n"
+    "Call-ID: 6ad25967-00000008@192.168.1.170\r\n"
+    "CSeq: 102 INVITE\r\n"
+    "Contact: <sip:0938220136@192.168.1.170:5060>\r\n"
+    "Allow: INVITE, ACK, CANCEL, OPTIONS, BYE, REFER, NOTIFY\r\n"
+    "Supported: replaces, timer\r\n"
+    "Content-Type: application/sdp\r\n"
+    "Content-Length: 176\r\n"
+    "\r\n"
+    "v=0\r\n"
+    "o=root 1 1 IN IP4 192.168.1.170\r\n"
+    "s=Gateway\r\n"
+    "c=IN IP4 192.168.1.170\r\n"
+    "t=0 0\r\n"
+    "m=audio 32004 RTP/AVP 0 101\r\n"
+    "a=rtpmap:0 PCMU/8000\r\n"
+    "a=rtpmap:101 telephone-event/8000\r\n"
+    "a=ptime:20\r\n";
+
+static const char *msg_401 =
+    "SIP/2.0 401 Unauthorized\r\n"
+    "Via: SIP/2.0/UDP 192.168.157.126:5062;branch=z9hG4bK6ad25b25000004;rport=5062\r\n"
+    "From: \"0921367101\" <sip:0921367101@192.168.1.170>;tag=6ad259670008\r\n"
+    "To: <sip:0938220136@192.168.1.170>;tag=as1a2b3c4d\r\n"
+    "Call-ID: 6ad25967-00000008@192.168.1.170\r\n"
+    "CSeq: 102 INVITE\r\n"
+    "User-Agent: Gateway\r\n"
+    "WWW-Authenticate: Digest algorithm=MD5, realm=\"asterisk\", nonce=\"1f4e2a7b\"\r\n"
+    "Content-Length: 0\r\n"
+    "\r\n";
+
+// 舊實作：每個欄位各自以 strstr 掃描整個訊息 (不檢查標頭邊界，"Reply-To:" 也會被當成 "To:")
+static int legacy_scan(const char *msg) {
+    char tag[128];
+    int code = parse_sip_status_code(msg);
+    const char *to = strstr(msg, "To:");
+    if (to) {
+        const char *t = strstr(to, "tag=");
+        if (t) {
+            size_t n = strcspn(t + 4, "\r\n;>");
+            if (n < sizeof(tag)) {
+                memcpy(tag, t + 4, n);
+                tag[n] = '\0';
+            }
+        }
+    }
+    const char *branch = strstr(msg, "branch=");
+    const char *cseq = strstr(msg, "CSeq:");
+    const char *sdp = strstr(msg, "\r\n\r\n");
+    const char *m = sdp ? strstr(sdp, "m=audio ") : NULL;
+    return code + (branch != NULL) + (cseq != NULL) + (m != NULL);
+}
+
+// 新解析器：單次掃描後從索引取出相同欄位
+static int parser_scan(const char *msg, int len) {
+    sip_msg_t parsed;
+    char tag[128], branch[64];
+    if (sip_parse_message(msg, len, &parsed) != 0) return -1;
+    sip_msg_header_param(&parsed, SIP_HDR_TO, "tag", tag, sizeof(tag));
+    sip_msg_header_param(&parsed, SIP_HDR_VIA, "branch", branch, sizeof(branch));
+    return parsed.status_code + parsed.cseq_num + sip_msg_sdp_audio_port(&parsed);
+}
+
+static double elapsed_seconds(const struct timespec *start, const struct timespec *end) {
+    return (end->tv_sec - start->tv_sec) + (end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static void run_case(const char *label, const char *msg, long iterations) {
+    struct timespec t0, t1;
+    volatile int sink = 0;
+    int len = strlen(msg);
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (long i = 0; i < iterations; i++) {
+        sink += parser_scan(msg, len);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    double parser_rate = iterations / elapsed_seconds(&t0, &t1);
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (long i = 0; i < iterations; i++) {
+        sink += legacy_scan(msg);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    double legacy_rate = iterations / elapsed_seconds(&t0, &t1);
+
+    printf("%-22s %4d 字節  解析器 %10.0f msg/s  舊 strstr 掃描 %10.0f msg/s\n",
+           label, len, parser_rate, legacy_rate);
+    (void)sink;
+}
+
+int main(int argc, char *argv[]) {
+    long iterations = argc > 1 ? atol(argv[1]) : DEFAULT_ITERATIONS;
+    if (iterations <= 0) iterations = DEFAULT_ITERATIONS;
+
+    printf("SIP 解析微基準測試 (每種訊息 %ld 次)\n", iterations);
+    run_case("100 Trying", msg_100, iterations);
+    run_case("183 Session Progress", msg_183, iterations);
+    run_case("200 OK (SDP)", msg_200, iterations);
+    run_case("401 Unauthorized", msg_401, iterations);
+    return 0;
+}
@@ -0,0 +1,145 @@
+// sip_trace_bench.c - 事件追蹤的開銷：以 log_with_timestamp 輸出完整 SIP 訊息 (標準輸出導向 /dev/null)
+// 與寫入二進位追蹤記錄 (SIP 訊息與 RTP 頭) 的每筆耗時，並以多線程同時寫入驗證記錄完整
+#include "lib/sip_client.h"
+#include "lib/sip_trace.h"
+
+#define DEFAULT_RECORDS 1000000
+#define DEFAULT_THREADS 4
+#define LOG_RECORDS 20000                 // 舊日誌路徑較慢，只量測這麼多次
+
+static const char *sample_invite =
+    "INVITE sip:0938220136@192.168.1.170 SIP/2.0\r\n"
+    "Via: SIP/2.0/UDP 192.168.157.126:5062;branch=z9hG4bK6ad25b25000004\r\n"
+    "Max-Forwards: 70\r\n"
+    "From: \"0921367101\" <sip:0921367101@192.168.1.170>;tag=6ad259670008\r\n"
+    "To: <sip:0938220136@192.168.1.170>\r\n"
+    "Call-ID: 6ad25967-00000008@192.168.1.170\r\n"
+    "CSeq: 102 INVITE\r\n"
+    "Contact: <sip:0921367101@192.168.157.126:5062>\r\n"
+    "User-Agent: Custom SIP Client\r\n"
+    "Content-Type: application/sdp\r\n"
+    "Content-Length: 0\r\n"
+    "\r\n";
+
+typedef struct {
+    long count;
+    double sip_seconds;
+    double rtp_seconds;
+} worker_t;
+
+static struct sockaddr_in peer;
+
+static double elapsed_seconds(const struct timespec *start, const struct timespec *end) {
+    return (end->tv_sec - start->tv_sec) + (end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+// 以線程 CPU 時間計算，線程數超過 CPU 數時結果不受排程影響
+static void* trace_worker(void *arg) {
+    worker_t *w = (worker_t *)arg;
+    unsigned char packet[172] = { 0x80, 0x00 };
+    size_t len = strlen(sample_invite);
+    struct timespec t0, t1;
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &t0);
+    for (long i = 0; i < w->count; i++) {
+        sip_trace_sip(SIP_TRACE_SIP_TX, (int)(i & 511), sample_invite, len, &peer);
+    }
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &t1);
+    w->sip_seconds = elapsed_seconds(&t0, &t1);
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &t0);
+    for (long i = 0; i < w->count; i++) {
+        packet[2] = (unsigned char)(i >> 8);
+        packet[3] = (unsigned char)i;
+        sip_trace_rtp(SIP_TRACE_RTP_RX, 10000, packet, sizeof(packet), &peer);
+    }
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &t1);
+    w->rtp_seconds = elapsed_seconds(&t0, &t1);
+    return NULL;
+}
+
+// 每個緩衝區中保留的記錄都應完整 (序號與位置一致)
+static long count_bad_records(const char *path) {
+    FILE *f = fopen(path, "rb");
+    if (!f) return -1;
+
+    sip_trace_header_t header;
+    sip_trace_ring_t *ring = malloc(sizeof(sip_trace_ring_t));
+    long bad = -1;
+    if (ring && fread(&header, sizeof(header), 1, f) == 1) {
+        bad = 0;
+        // 每個線程分配一個緩衝區，檔案只包含已分配的部分
+        for (uint32_t r = 0; r < header.rings_used; r++) {
+            if (fread(ring, sizeof(*ring), 1, f) != 1) {
+                bad++;
+                break;
+            }
+            uint64_t first = ring->head > SIP_TRACE_RING_RECORDS ? ring->head - SIP_TRACE_RING_RECORDS : 0;
+            for (uint64_t i = first; i < ring->head; i++) {
+                const sip_trace_record_t *rec = &ring->records[i % SIP_TRACE_RING_RECORDS];
+                if (rec->seq != i + 1 || (rec->type != SIP_TRACE_SIP_TX && rec->type != SIP_TRACE_RTP_RX)) bad++;
+            }
+        }
+    }
+    free(ring);
+    fclose(f);
+    return bad;
+}
+
+int main(int argc, char *argv[]) {
+    long total = argc > 1 ? atol(argv[1]) : DEFAULT_RECORDS;
+    int threads = argc > 2 ? atoi(argv[2]) : DEFAULT_THREADS;
+    if (total <= 0) total = DEFAULT_RECORDS;
+    // 每個線程使用專用的緩衝區 (不超過專用緩衝區數)
+    if (threads <= 0 || threads > SIP_TRACE_MAX_RINGS - 1) threads = DEFAULT_THREADS;
+
+    // 只套用環境變數 (例如 SIP_CFG_TRACE_FILE= 比較僅記憶體的緩衝區)
+    if (sip_config_load("/dev/null") != 0) return 1;
+
+    peer.sin_family = AF_INET;
+    peer.sin_port = htons(5060);
+    inet_pton(AF_INET, "192.168.1.170", &peer.sin_addr);
+
+    printf("事件追蹤基準測試：每線程 %ld 筆記錄，%d 個線程\n", total, threads);
+
+    // 舊路徑：完整訊息經由 log_with_timestamp 輸出 (localtime、strftime、printf)
+    fflush(stdout);
+    int saved_stdout = dup(STDOUT_FILENO);
+    struct timespec t0, t1;
+    if (!freopen("/dev/null", "w", stdout)) return 1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (long i = 0; i < LOG_RECORDS; i++) {
+        log_with_timestamp("發送 INVITE 請求 (%zu 字節):\n%s\n", strlen(sample_invite), sample_invite);
+    }
+    fflush(stdout);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    dup2(saved_stdout, STDOUT_FILENO);
+    close(saved_stdout);
+    double log_ns = elapsed_seconds(&t0, &t1) * 1e9 / LOG_RECORDS;
+
+    worker_t *workers = calloc(threads, sizeof(worker_t));
+    pthread_t *tids = calloc(threads, sizeof(pthread_t));
+    for (int i = 0; i < threads; i++) {
+        workers[i].count = total;
+        pthread_create(&tids[i], NULL, trace_worker, &workers[i]);
+    }
+    double sip_seconds = 0, rtp_seconds = 0;
+    for (int i = 0; i < threads; i++) {
+        pthread_join(tids[i], NULL);
+        sip_seconds += workers[i].sip_seconds;
+        rtp_seconds += workers[i].rtp_seconds;
+    }
+    double sip_ns = sip_seconds * 1e9 / ((double)total * threads);
+    double rtp_ns = rtp_seconds * 1e9 / ((double)total * threads);
+
+    printf("  log_with_timestamp 完整訊息: %8.1f ns/筆\n", log_ns);
+    printf("  sip_trace_sip              : %8.1f ns/筆 (%.0fx)\n", sip_ns, log_ns / sip_ns);
+    printf("  sip_trace_rtp              : %8.1f ns/筆\n", rtp_ns);
+
+    long bad = sip_trace_path()[0] ? count_bad_records(sip_trace_path()) : 0;
+    printf("  追蹤檔案 %s，不完整的記錄 %ld\n", sip_trace_path()[0] ? sip_trace_path() : "(僅記憶體)", bad);
+
+    free(workers);
+    free(tids);
+    return bad == 0 ? 0 : 1;
+}
@@ -1,20 +1,58 @@
 // rtp.c - 實現RTP音頻發送和接收功能
 #include "sip_client.h"
+#include "sip_metrics.h"
+#include "sip_id.h"
+#include "sip_trace.h"
+#include "sip_pacer.h"
+#include "sip_media_cache.h"
 #include <math.h>  // Add this to fix sinf() function reference
 #include <sched.h>  // Add this for pthread_setschedparam
 
-// 全局變量用於RTP接收
-static pthread_t rtp_thread;
-static int rtp_sockfd = -1;
-static int running = 0;
-static FILE *output_file = NULL;
-static FILE *raw_data_file = NULL;  // 用於保存原始RTP數據
-static int received_packet_count = 0;  // 添加計數器來跟踪收到的封包數量
-static unsigned int total_bytes_received = 0;  // 添加計數器來跟踪收到的數據總量
-static int real_audio_data_received = 0;  // 標記是否接收到實際RTP音頻數據
+// 鎖定的對方媒體地址：由接收線程寫入，RTP 節拍線程在每個封包發送前讀取
+struct rtp_latch {
+    uint64_t peer;                        // rtp_peer_pack() 的結果，0 表示尚未鎖定 (使用 SDP 地址)
+};
+
+// RTP接收器實例
+struct rtp_receiver {
+    pthread_t thread;
+    int sockfd;
+    int port;
+    volatile int running;
+    FILE *output_file;
+    FILE *raw_data_file;                  // 用於保存原始RTP數據 (僅舊式全局接收器)
+    int received_packet_count;            // 收到的封包數量
+    unsigned int total_bytes_received;    // 收到的數據總量
+    int real_audio_data_received;         // 標記是否接收到實際RTP音頻數據
+    rtp_stream_callback_t callback;
+    void *user_data;
+
+    // 對稱 RTP 鎖定 (以下除 expected、expected_pt 與 remote_changes 外只由接收線程存取)
+    rtp_latch_t *latch;
+    int latch_packets;                    // 需要的連續有效封包數 (0 表示停用)
+    uint64_t expected;                    // SDP 中的對方地址 (rtp_peer_pack)，由 rtp_receiver_set_remote 設定
+    int expected_pt;                      // 協商的負載類型，-1 表示未知
+    unsigned int remote_changes;          // SDP 地址或負載類型改變的次數 (rtp_receiver_set_remote 遞增)
+    unsigned int remote_seen;             // 接收線程已套用的 remote_changes
+    uint64_t candidate;                   // 正在累計的來源地址與 SSRC
+    uint32_t candidate_ssrc;
+    int candidate_count;
+    uint32_t latched_ssrc;
+    int latched;
+};
+
+// 鎖定統計 (所有接收器)
+static struct {
+    unsigned long latched;                // 鎖定次數 (含重新鎖定)
+    unsigned long moved;                  // 鎖定的地址與 SDP 不同，改送到實際來源
+    unsigned long relatched;              // 已鎖定後同一 SSRC 換了來源 (媒體中繼切換)
+    unsigned long rejected;               // 不計入鎖定的封包 (非 RTP v2、RTCP、非協商負載或其他 SSRC)
+} latch_stats;
+
+// 舊式全局接收器 (start_rtp_receiver/stop_rtp_receiver)
+static rtp_receiver_t *default_receiver = NULL;
 
 // 添加回調函數指針
-typedef void (*rtp_data_callback_t)(const unsigned char *rtp_data, size_t data_size);
 static rtp_data_callback_t global_rtp_callback = NULL;
 
 // 設置RTP數據回調函數
@@ -29,6 +67,84 @@ void clear_rtp_callback(void) {
     log_with_timestamp("RTP接收器回調函數已清除\n");
 }
 
+// 將全局回調轉接為實例回調
+static void default_receiver_callback(void *user_data, const unsigned char *rtp_data, size_t data_size) {
+    (void)user_data;
+    if (global_rtp_callback) {
+        global_rtp_callback(rtp_data, data_size);
+    }
+}
+
+// 地址與端口 (網路位元組序) 合成一個值，以單一原子操作讀寫；第 48 位元標記有效
+static uint64_t rtp_peer_pack(const struct sockaddr_in *addr) {
+    return (1ULL << 48) | ((uint64_t)addr->sin_addr.s_addr << 16) | addr->sin_port;
+}
+
+static void rtp_peer_unpack(uint64_t peer, struct sockaddr_in *addr) {
+    addr->sin_family = AF_INET;
+    addr->sin_addr.s_addr = (uint32_t)(peer >> 16);
+    addr->sin_port = (uint16_t)peer;
+}
+
+// 以收到的封包更新鎖定：同一來源、同一 SSRC 連續 latch_packets 個有效封包後鎖定該來源；
+// 已鎖定後只接受相同 SSRC 從新來源連續送達時重新鎖定，避免其他來源的封包劫持媒體
+static void rtp_latch_update(rtp_receiver_t *rx, const unsigned char *packet, const struct sockaddr_in *from) {
+    int pt = packet[1] & 0x7F;
+    uint32_t ssrc = ((uint32_t)packet[8] << 24) | ((uint32_t)packet[9] << 16) | ((uint32_t)packet[10] << 8) | packet[11];
+    uint64_t peer = rtp_peer_pack(from);
+    int expected_pt = __atomic_load_n(&rx->expected_pt, __ATOMIC_RELAXED);
+    unsigned int changes = __atomic_load_n(&rx->remote_changes, __ATOMIC_ACQUIRE);
+
+    // 對方媒體改變 (早期媒體轉為接通、網關故障轉移、re-INVITE)：舊的鎖定不再適用，重新累計
+    if (changes != rx->remote_seen) {
+        rx->remote_seen = changes;
+        rx->latched = 0;
+        rx->latched_ssrc = 0;
+        rx->candidate = 0;
+        rx->candidate_ssrc = 0;
+        rx->candidate_count = 0;
+        __atomic_store_n(&rx->latch->peer, 0, __ATOMIC_RELEASE);
+    }
+
+    if ((packet[0] >> 6) != 2 || (packet[1] >= 200 && packet[1] <= 204) ||
+        (expected_pt >= 0 && pt != expected_pt) || (rx->latched && ssrc != rx->latched_ssrc)) {
+        __atomic_fetch_add(&latch_stats.rejected, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    if (rx->latched && peer == __atomic_load_n(&rx->latch->peer, __ATOMIC_RELAXED)) {
+        rx->candidate_count = 0;
+        return;
+    }
+    if (peer != rx->candidate || ssrc != rx->candidate_ssrc) {
+        rx->candidate = peer;
+        rx->candidate_ssrc = ssrc;
+        rx->candidate_count = 0;
+    }
+    if (++rx->candidate_count < rx->latch_packets) return;
+
+    uint64_t expected = __atomic_load_n(&rx->expected, __ATOMIC_RELAXED);
+    __atomic_store_n(&rx->latch->peer, peer, __ATOMIC_RELEASE);
+    __atomic_fetch_add(&latch_stats.latched, 1, __ATOMIC_RELAXED);
+    if (rx->latched) {
+        __atomic_fetch_add(&latch_stats.relatched, 1, __ATOMIC_RELAXED);
+    }
+    if (expected && peer != expected) {
+        struct sockaddr_in sdp;
+        char sdp_ip[INET_ADDRSTRLEN];
+        rtp_peer_unpack(expected, &sdp);
+        inet_ntop(AF_INET, &sdp.sin_addr, sdp_ip, sizeof(sdp_ip));
+        __atomic_fetch_add(&latch_stats.moved, 1, __ATOMIC_RELAXED);
+        log_with_timestamp("RTP 鎖定 (端口 %d): SSRC %08x 來自 %s:%d，與 SDP 的 %s:%d 不同，改送到實際來源\n",
+                         rx->port, ssrc, inet_ntoa(from->sin_addr), ntohs(from->sin_port), sdp_ip, ntohs(sdp.sin_port));
+    } else {
+        log_with_timestamp("RTP 鎖定 (端口 %d): SSRC %08x 來自 %s:%d\n",
+                         rx->port, ssrc, inet_ntoa(from->sin_addr), ntohs(from->sin_port));
+    }
+    rx->latched = 1;
+    rx->latched_ssrc = ssrc;
+    rx->candidate_count = 0;
+}
+
 // 初始化RTP包頭
 void init_rtp_header(rtp_header_t *hdr, int payload_type, unsigned short seq_num, 
                     unsigned int timestamp, unsigned int ssrc) {
@@ -39,55 +155,122 @@ void init_rtp_header(rtp_header_t *hdr, int payload_type, unsigned short seq_num
     hdr->ssrc = htonl(ssrc);
 }
 
-// 發送RTP音頻數據包
+// G.711 μ-law 與 A-law 互轉表 (ITU-T G.711；音檔與錄音以 μ-law 儲存，協商為 PCMA 時逐樣本轉換)
+static unsigned char ulaw_to_alaw_table[256];
+static unsigned char alaw_to_ulaw_table[256];
+static pthread_once_t g711_once = PTHREAD_ONCE_INIT;
+
+static int ulaw_decode(unsigned char u) {
+    u = ~u;
+    int t = (((u & 0x0F) << 3) + 0x84) << ((u & 0x70) >> 4);
+    return (u & 0x80) ? 0x84 - t : t - 0x84;
+}
+
+static int alaw_decode(unsigned char a) {
+    a ^= 0x55;
+    int t = (a & 0x0F) << 4;
+    int seg = (a & 0x70) >> 4;
+    if (seg == 0) t += 8;
+    else if (seg == 1) t += 0x108;
+    else t = (t + 0x108) << (seg - 1);
+    return (a & 0x80) ? t : -t;
+}
+
+// 返回 val 所在的段 (第一個上界不小於 val 的段)，超出時返回 8
+static int g711_segment(int val, const int *ends) {
+    int seg = 0;
+    while (seg < 8 && val > ends[seg]) seg++;
+    return seg;
+}
+
+static unsigned char alaw_encode(int pcm) {
+    static const int seg_end[8] = { 0x1F, 0x3F, 0x7F, 0xFF, 0x1FF, 0x3FF, 0x7FF, 0xFFF };
+    int mask = 0xD5;
+
+    pcm >>= 3;
+    if (pcm < 0) {
+        mask = 0x55;
+        pcm = -pcm - 1;
+    }
+    int seg = g711_segment(pcm, seg_end);
+    if (seg >= 8) return (unsigned char)(0x7F ^ mask);
+    int aval = (seg << 4) | ((seg < 2 ? pcm >> 1 : pcm >> seg) & 0x0F);
+    return (unsigned char)(aval ^ mask);
+}
+
+static unsigned char ulaw_encode(int pcm) {
+    static const int seg_end[8] = { 0x3F, 0x7F, 0xFF, 0x1FF, 0x3FF, 0x7FF, 0xFFF, 0x1FFF };
+    int mask = 0xFF;
+
+    pcm >>= 2;
+    if (pcm < 0) {
+        mask = 0x7F;
+        pcm = -pcm;
+    }
+    if (pcm > 8159) pcm = 8159;
+    pcm += 0x84 >> 2;
+    int seg = g711_segment(pcm, seg_end);
+    if (seg >= 8) return (unsigned char)(0x7F ^ mask);
+    return (unsigned char)(((seg << 4) | ((pcm >> (seg + 1)) & 0x0F)) ^ mask);
+}
+
+static void g711_build_tables(void) {
+    for (int i = 0; i < 256; i++) {
+        ulaw_to_alaw_table[i] = alaw_encode(ulaw_decode((unsigned char)i));
+        alaw_to_ulaw_table[i] = ulaw_encode(alaw_decode((unsigned char)i));
+    }
+}
+
+void rtp_ulaw_to_alaw(unsigned char *data, size_t len) {
+    pthread_once(&g711_once, g711_build_tables);
+    for (size_t i = 0; i < len; i++) data[i] = ulaw_to_alaw_table[data[i]];
+}
+
+void rtp_alaw_to_ulaw(unsigned char *data, size_t len) {
+    pthread_once(&g711_once, g711_build_tables);
+    for (size_t i = 0; i < len; i++) data[i] = alaw_to_ulaw_table[data[i]];
+}
+
+// send_rtp_audio 等待節拍器發送完成
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int done;
+    sip_pacer_result_t result;
+    unsigned long packets;
+} rtp_send_wait_t;
+
+static void rtp_send_done(int stream, sip_pacer_result_t result, unsigned long packets, void *user_data) {
+    rtp_send_wait_t *wait = (rtp_send_wait_t *)user_data;
+    (void)stream;
+
+    pthread_mutex_lock(&wait->lock);
+    wait->done = 1;
+    wait->result = result;
+    wait->packets = packets;
+    pthread_cond_signal(&wait->cond);
+    pthread_mutex_unlock(&wait->lock);
+}
+
+// 發送RTP音頻數據包 (由 RTP 節拍器依絕對時間發送，本函數等待發送完成)
 void send_rtp_audio(int sockfd, struct sockaddr_in *dest_addr, const char *wav_file, int dest_port,
                    const char *callid, const char *tag, const char *to_tag, const char *cseq,
                    struct sockaddr_in *servaddr) {
-    int fd;
-    char buffer[RTP_PACKET_SIZE + sizeof(rtp_header_t)];
-    rtp_header_t *rtp_hdr = (rtp_header_t *)buffer;
-    char *payload = buffer + sizeof(rtp_header_t);
-    int bytes_read;
-    unsigned short seq_num = 0;
-    unsigned int timestamp = 0;
-    unsigned int ssrc = rand();  // 隨機SSRC
-    int samples_per_packet = RTP_PACKET_SIZE;  // 每個RTP包中的樣本數
-    struct stat st;
-    
     log_with_timestamp("開始發送RTP音頻: %s -> %s:%d\n", 
                      wav_file, inet_ntoa(dest_addr->sin_addr), dest_port);
     
     // 設置目標地址的端口
     dest_addr->sin_port = htons(dest_port);
     
-    // 打開WAV文件
-    fd = open(wav_file, O_RDONLY);
-    if (fd < 0) {
-        log_with_timestamp("錯誤: 無法打開WAV文件 %s: %s\n", wav_file, strerror(errno));
-        return;
-    }
-    
-    // 獲取文件大小
-    if (fstat(fd, &st) < 0) {
-        log_with_timestamp("錯誤: 無法獲取文件狀態: %s\n", strerror(errno));
-        close(fd);
-        return;
-    }
-    
-    log_with_timestamp("WAV文件大小: %ld 字節\n", (long)st.st_size);
-    
-    // 跳過WAV文件頭
-    if (lseek(fd, WAV_HEADER_SIZE, SEEK_SET) < 0) {
-        log_with_timestamp("錯誤: 無法跳過WAV頭: %s\n", strerror(errno));
-        close(fd);
-        return;
-    }
+    // 音頻取自提示音快取 (同一檔案重複播放時不再讀檔)
+    sip_prompt_t *prompt = sip_media_cache_acquire(wav_file);
+    if (!prompt) return;
     
     // 創建RTP socket
     int rtp_sockfd = socket(AF_INET, SOCK_DGRAM, 0);
     if (rtp_sockfd < 0) {
         log_with_timestamp("錯誤: 無法創建RTP socket: %s\n", strerror(errno));
-        close(fd);
+        sip_media_cache_release(prompt);
         return;
     }
     
@@ -102,51 +285,45 @@ void send_rtp_audio(int sockfd, struct sockaddr_in *dest_addr, const char *wav_f
         log_with_timestamp("錯誤: 無法綁定RTP socket到本地端口 %d: %s\n", 
                        LOCAL_RTP_SEND_PORT, strerror(errno));
         close(rtp_sockfd);
-        close(fd);
+        sip_media_cache_release(prompt);
         return;
     }
     
     log_with_timestamp("RTP發送socket綁定成功: %s:%d\n", LOCAL_IP, LOCAL_RTP_SEND_PORT);
     
-    // 讀取並發送音頻數據
-    while ((bytes_read = read(fd, payload, RTP_PACKET_SIZE)) > 0) {
-        // 初始化RTP頭
-        init_rtp_header(rtp_hdr, 0, seq_num, timestamp, ssrc);  // 0 = PCMU
-        
-        // 發送RTP包
-        int total_size = bytes_read + sizeof(rtp_header_t);
-        if (sendto(rtp_sockfd, buffer, total_size, 0, 
-                  (struct sockaddr *)dest_addr, sizeof(*dest_addr)) < 0) {
-            log_with_timestamp("錯誤: 發送RTP包失敗: %s\n", strerror(errno));
-            break;
+    // 每個RTP包 RTP_PACKET_SIZE 個樣本 (8000Hz 下 20ms)
+    rtp_send_wait_t wait = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0, SIP_PACER_DONE, 0 };
+    sip_pacer_stream_params_t params = {
+        .sockfd = rtp_sockfd,
+        .dest = *dest_addr,
+        .payload = sip_prompt_payload(prompt, 0),
+        .length = sip_prompt_length(prompt),
+        .packet_bytes = RTP_PACKET_SIZE,
+        .ptime = RTP_PACKET_SIZE / 8,
+        .payload_type = 0,               // 0 = PCMU
+        .ssrc = sip_id_ssrc(),           // 隨機SSRC
+        .done = rtp_send_done,
+        .user_data = &wait
+    };
+    if (sip_pacer_start(&params) < 0) {
+        log_with_timestamp("錯誤: 無法開始發送RTP音頻\n");
+    } else {
+        pthread_mutex_lock(&wait.lock);
+        while (!wait.done) {
+            pthread_cond_wait(&wait.cond, &wait.lock);
+        }
+        pthread_mutex_unlock(&wait.lock);
+        if (wait.result == SIP_PACER_SEND_ERROR) {
+            log_with_timestamp("錯誤: 發送RTP包失敗 (已發送 %lu 個)\n", wait.packets);
+        } else {
+            log_with_timestamp("RTP傳輸完成: %lu 個封包\n", wait.packets);
         }
-        
-        log_with_timestamp("發送RTP包: seq=%d, timestamp=%u, payload=%d bytes\n", 
-                         seq_num, timestamp, bytes_read);
-        
-        // 更新序列號和時間戳
-        seq_num++;
-        timestamp += samples_per_packet;
-        
-        // 每個RTP包之間等待20毫秒 (相當於音頻的時長)
-        usleep(20000);  // 20毫秒 = 20000微秒
     }
     
-    log_with_timestamp("RTP傳輸完成\n");
-    
-    // 在RTP發送完成後等待一段時間，避免過早斷開連接
-    log_with_timestamp("RTP傳輸完成，等待2秒...\n");
-    sleep(2);
-    
-    // 發送BYE請求來結束通話
-    send_bye(sockfd, servaddr, callid, tag, to_tag, cseq);
-    
-    // 等待3秒讓BYE請求完成
-    sleep(3);
-    
-    // 關閉資源
+    // 先釋放媒體資源，再發送BYE結束通話 (不等待回應，事務在背景完成重傳)
     close(rtp_sockfd);
-    close(fd);
+    sip_media_cache_release(prompt);
+    send_bye(sockfd, servaddr, callid, tag, to_tag, cseq);
 }
 
 // 創建測試音頻數據
@@ -218,7 +395,8 @@ void generate_test_audio(FILE *file, int duration_ms) {
 
 // RTP接收線程函數
 void* receive_rtp_thread(void *arg) {
-    int sockfd = *(int *)arg;
+    rtp_receiver_t *rx = (rtp_receiver_t *)arg;
+    int sockfd = rx->sockfd;
     char buffer[BUF_SIZE];
     struct sockaddr_in sender_addr;
     socklen_t sender_len = sizeof(sender_addr);
@@ -243,27 +421,12 @@ void* receive_rtp_thread(void *arg) {
         log_with_timestamp("警告: 無法設置接收超時: %s\n", strerror(errno));
     }
     
-    log_with_timestamp("RTP接收線程啟動，等待數據包...\n");
+    log_with_timestamp("RTP接收線程啟動 (端口 %d)，等待數據包...\n", rx->port);
     
     // 重設計數器
-    received_packet_count = 0;
-    total_bytes_received = 0;
-    real_audio_data_received = 0;
-    
-    // 在接收數據前，先檢查output_file是否有效
-    if (output_file == NULL) {
-        log_with_timestamp("嚴重錯誤: 輸出文件指針為NULL\n");
-    }
-    
-    // 創建一個原始數據文件，用於調試
-    if (raw_data_file == NULL) {
-        raw_data_file = fopen("rtp_raw_data.bin", "wb");
-        if (raw_data_file) {
-            log_with_timestamp("創建原始RTP數據文件用於調試\n");
-        } else {
-            log_with_timestamp("警告: 無法創建原始數據文件: %s\n", strerror(errno));
-        }
-    }
+    rx->received_packet_count = 0;
+    rx->total_bytes_received = 0;
+    rx->real_audio_data_received = 0;
     
     // 添加診斷變量
     time_t last_packet_time = time(NULL);
@@ -271,18 +434,19 @@ void* receive_rtp_thread(void *arg) {
     
     log_with_timestamp("準備接收實際RTP音頻數據...\n");
     
-    while (running) {
-        // 檢查停止標誌
-        if (!running) {
+    while (rx->running) {
+        sender_len = sizeof(sender_addr);
+        int n = recvfrom(sockfd, buffer, sizeof(buffer), 0, 
+                      (struct sockaddr *)&sender_addr, &sender_len);
+        
+        // 檢查停止標誌 (stop 會 shutdown socket 讓 recvfrom 立即返回)
+        if (!rx->running) {
             log_with_timestamp("RTP線程接收到停止信號\n");
             break;
         }
         
-        int n = recvfrom(sockfd, buffer, sizeof(buffer), 0, 
-                      (struct sockaddr *)&sender_addr, &sender_len);
-        
         // 處理接收結果
-        if (n > 0) {
+        if (n > (int)sizeof(rtp_header_t)) {
             // 成功接收到數據
             last_packet_time = time(NULL);
             consecutive_timeouts = 0;  // 重置超時計數器
@@ -292,61 +456,58 @@ void* receive_rtp_thread(void *arg) {
             int payload_size = n - sizeof(rtp_header_t);
             
             // 更新計數器
-            received_packet_count++;
-            total_bytes_received += payload_size;
-            real_audio_data_received = 1;  // 標記已接收到真實數據
+            rx->received_packet_count++;
+            rx->total_bytes_received += payload_size;
+            rx->real_audio_data_received = 1;  // 標記已接收到真實數據
+            sip_metrics_rtp_received(rx->port);
+            // 每個封包的 RTP 頭記錄到事件追蹤 (見 sip_trace.h)
+            sip_trace_rtp(SIP_TRACE_RTP_RX, rx->port, (const unsigned char *)buffer, n, &sender_addr);
+            if (rx->latch_packets > 0) {
+                rtp_latch_update(rx, (const unsigned char *)buffer, &sender_addr);
+            }
             
             // 簡化日誌記錄 - 只在前5個包和每50個包時記錄
-            if (received_packet_count <= 5 || received_packet_count % 50 == 0) {
+            if (rx->received_packet_count <= 5 || rx->received_packet_count % 50 == 0) {
                 log_with_timestamp("接收RTP包 #%d：來源=%s:%d, 序號=%d, 時間戳=%u, 大小=%d\n",
-                    received_packet_count,
+                    rx->received_packet_count,
                     inet_ntoa(sender_addr.sin_addr), ntohs(sender_addr.sin_port),
                     ntohs(rtp_hdr->seq_num), ntohl(rtp_hdr->timestamp), payload_size);
-                
-                // 只對前3個包顯示詳細頭部信息
-                if (received_packet_count <= 3) {
-                    log_with_timestamp("RTP頭: version=%d, PT=%d, SSRC=%u\n", 
-                        (rtp_hdr->version_p_x_cc >> 6) & 0x03, rtp_hdr->m_pt & 0x7F, 
-                        ntohl(rtp_hdr->ssrc));
-                    
-                    // 展示前幾個字節的數據
-                    log_with_timestamp("數據樣本（前16字節或全部）: ");
-                    int bytes_to_show = payload_size > 16 ? 16 : payload_size;
-                    for (int i = 0; i < bytes_to_show; i++) {
-                        printf("%02X ", (unsigned char)payload[i]);
-                    }
-                    printf("\n");
-                }
             }
             
             // 調用回調函數（如果設置了）
-            if (global_rtp_callback) {
-                global_rtp_callback((unsigned char*)buffer, n);
+            if (rx->callback) {
+                rx->callback(rx->user_data, (unsigned char*)buffer, n);
+            }
+            
+            // 錄音以 μ-law 儲存：PCMA 轉換後寫入，telephone-event 與舒適噪音等非音頻負載不寫入
+            int payload_type = rtp_hdr->m_pt & 0x7F;
+            if (payload_type == 8) {
+                rtp_alaw_to_ulaw((unsigned char *)payload, payload_size);
             }
             
             // 如果有輸出文件，寫入音頻數據
-            if (output_file && payload_size > 0) {
+            if (rx->output_file && payload_size > 0 && (payload_type == 0 || payload_type == 8)) {
                 // 保存原始數據到調試文件
-                if (raw_data_file) {
-                    fwrite(payload, 1, payload_size, raw_data_file);
-                    fflush(raw_data_file);
+                if (rx->raw_data_file) {
+                    fwrite(payload, 1, payload_size, rx->raw_data_file);
+                    fflush(rx->raw_data_file);
                 }
                 
                 // 寫入WAV文件數據部分
-                size_t written = fwrite(payload, 1, payload_size, output_file);
-                if (written != payload_size && received_packet_count <= 5) {
+                size_t written = fwrite(payload, 1, payload_size, rx->output_file);
+                if (written != payload_size && rx->received_packet_count <= 5) {
                     log_with_timestamp("警告: 寫入文件數據不完整: %zu/%d\n", written, payload_size);
                 }
-                fflush(output_file);
+                fflush(rx->output_file);
                 
-                if (received_packet_count <= 5) {
+                if (rx->received_packet_count <= 5) {
                     log_with_timestamp("成功寫入%zu字節到WAV文件\n", written);
                 }
             }
-        } else if (n == 0) {
-            // 連接關閉
-            log_with_timestamp("連接關閉\n");
-        } else if (n < 0) {
+        } else if (n >= 0) {
+            // 空封包或不完整的RTP頭，忽略
+            continue;
+        } else {
             // 錯誤處理
             if (errno == EAGAIN || errno == EWOULDBLOCK) {
                 // 超時，這是正常的，繼續循環檢查running標誌
@@ -359,7 +520,7 @@ void* receive_rtp_thread(void *arg) {
                 time_t current_time = time(NULL);
                 if (current_time - last_packet_time > 30) {
                     log_with_timestamp("警告: 已有%ld秒未收到RTP包，總計接收%d個包\n", 
-                                     current_time - last_packet_time, received_packet_count);
+                                     current_time - last_packet_time, rx->received_packet_count);
                     last_packet_time = current_time;  // 避免重複日誌
                 }
                 
@@ -376,47 +537,66 @@ void* receive_rtp_thread(void *arg) {
         }
     }
     
-    // 確保原始數據文件被正確關閉
-    if (raw_data_file) {
-        fclose(raw_data_file);
-        raw_data_file = NULL;
-        log_with_timestamp("原始數據文件已關閉\n");
-    }
-    
     log_with_timestamp("RTP接收線程正常停止，共接收 %d 個包，總計 %u 字節\n", 
-                       received_packet_count, total_bytes_received);
+                       rx->received_packet_count, rx->total_bytes_received);
     return NULL;
 }
 
-// 啟動RTP接收器
-int start_rtp_receiver(int port, const char *output_filename) {
+// 更新WAV頭部中的長度欄位 (58字節G.711 μ-law頭部)
+static void update_wav_header(FILE *file) {
+    long file_size = ftell(file);
+    long data_size = file_size - 58;
+    long riff_size = file_size - 8;
+    long sample_count = data_size;  // 對於G.711，每個採樣是1字節
+    
+    // 寫入RIFF塊大小
+    fseek(file, 4, SEEK_SET);
+    fwrite(&riff_size, 4, 1, file);
+    
+    // 寫入採樣數（fact塊）- 正確的偏移位置是 46
+    fseek(file, 46, SEEK_SET);
+    fwrite(&sample_count, 4, 1, file);
+    
+    // 寫入數據塊大小
+    fseek(file, 54, SEEK_SET);
+    fwrite(&data_size, 4, 1, file);
+}
+
+// 創建RTP接收器：綁定端口、打開輸出文件並啟動接收線程
+rtp_receiver_t* rtp_receiver_create(int port, const char *output_filename,
+                                    rtp_stream_callback_t callback, void *user_data) {
     struct sockaddr_in local_addr;
     
-    // 如果已經運行，先停止
-    if (running) {
-        log_with_timestamp("RTP接收器已在運行，先停止它\n");
-        stop_rtp_receiver();
+    rtp_receiver_t *rx = calloc(1, sizeof(rtp_receiver_t));
+    if (!rx) {
+        log_with_timestamp("錯誤: 無法分配RTP接收器\n");
+        return NULL;
+    }
+    rx->port = port;
+    rx->callback = callback;
+    rx->user_data = user_data;
+    rx->latch_packets = sip_config()->rtp_latch_packets;
+    rx->expected_pt = -1;
+
+    rx->latch = calloc(1, sizeof(rtp_latch_t));
+    if (!rx->latch) {
+        log_with_timestamp("錯誤: 無法分配RTP鎖定狀態: %s\n", strerror(errno));
+        free(rx);
+        return NULL;
     }
-    
-    // 確保全局狀態是初始化的
-    rtp_sockfd = -1;
-    output_file = NULL;
-    raw_data_file = NULL;
-    running = 0;
-    received_packet_count = 0;
-    total_bytes_received = 0;
-    real_audio_data_received = 0;
     
     // 創建UDP socket
-    rtp_sockfd = socket(AF_INET, SOCK_DGRAM, 0);
-    if (rtp_sockfd < 0) {
+    rx->sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (rx->sockfd < 0) {
         log_with_timestamp("錯誤: 無法創建RTP接收socket: %s\n", strerror(errno));
-        return -1;
+        free(rx->latch);
+        free(rx);
+        return NULL;
     }
     
     // 設置socket選項 - 允許重用地址，避免"address already in use"錯誤
     int opt = 1;
-    if (setsockopt(rtp_sockfd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0) {
+    if (setsockopt(rx->sockfd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0) {
         log_with_timestamp("警告: 無法設置SO_REUSEADDR: %s\n", strerror(errno));
     }
     
@@ -426,23 +606,25 @@ int start_rtp_receiver(int port, const char *output_filename) {
     local_addr.sin_addr.s_addr = htonl(INADDR_ANY);
     local_addr.sin_port = htons(port);
     
-    if (bind(rtp_sockfd, (struct sockaddr *)&local_addr, sizeof(local_addr)) < 0) {
+    if (bind(rx->sockfd, (struct sockaddr *)&local_addr, sizeof(local_addr)) < 0) {
         log_with_timestamp("錯誤: 無法綁定RTP接收socket到端口 %d: %s\n", 
                         port, strerror(errno));
-        close(rtp_sockfd);
-        rtp_sockfd = -1;
-        return -1;
+        close(rx->sockfd);
+        free(rx->latch);
+        free(rx);
+        return NULL;
     }
     
     // 如果指定了輸出文件，打開它
     if (output_filename) {
-        output_file = fopen(output_filename, "wb");
-        if (!output_file) {
+        rx->output_file = fopen(output_filename, "wb");
+        if (!rx->output_file) {
             log_with_timestamp("錯誤: 無法打開輸出文件 %s: %s\n", 
                            output_filename, strerror(errno));
-            close(rtp_sockfd);
-            rtp_sockfd = -1;
-            return -1;
+            close(rx->sockfd);
+            free(rx->latch);
+            free(rx);
+            return NULL;
         }
         
         // 寫入一個正確的WAV頭部 (使用G.711 μ-law格式，格式代碼為7)
@@ -465,160 +647,190 @@ int start_rtp_receiver(int port, const char *output_filename) {
             'd', 'a', 't', 'a',             // data塊標識
             0xFF, 0xFF, 0xFF, 0xFF          // 數據塊大小 (暫時設為最大)
         };
-        fwrite(wav_header, 1, sizeof(wav_header), output_file);
-        fflush(output_file);
+        fwrite(wav_header, 1, sizeof(wav_header), rx->output_file);
+        fflush(rx->output_file);
         
         log_with_timestamp("已創建WAV文件，格式為G.711 μ-law (PCMU)\n");
     }
     
     // 啟動接收線程前設置標誌
-    running = 1;
+    rx->running = 1;
     
     // 啟動接收線程
-    if (pthread_create(&rtp_thread, NULL, receive_rtp_thread, &rtp_sockfd) != 0) {
+    if (pthread_create(&rx->thread, NULL, receive_rtp_thread, rx) != 0) {
         log_with_timestamp("錯誤: 無法創建RTP接收線程: %s\n", strerror(errno));
-        if (output_file) fclose(output_file);
-        close(rtp_sockfd);
-        rtp_sockfd = -1;
-        running = 0;
-        return -1;
+        if (rx->output_file) fclose(rx->output_file);
+        close(rx->sockfd);
+        free(rx->latch);
+        free(rx);
+        return NULL;
     }
     
     log_with_timestamp("RTP接收器已啟動在端口 %d，保存到 %s\n", 
                     port, output_filename ? output_filename : "無");
-    return 0;
+    return rx;
 }
 
-// 停止RTP接收器
-void stop_rtp_receiver() {
-    log_with_timestamp("開始停止RTP接收器...\n");
+// 停止並釋放RTP接收器
+void rtp_receiver_destroy(rtp_receiver_t *rx) {
+    if (!rx) return;
     
-    if (!running) {
-        log_with_timestamp("RTP接收器未運行\n");
-        return;
-    }
+    log_with_timestamp("開始停止RTP接收器 (端口 %d)...\n", rx->port);
     
-    // 設置運行標誌為停止
-    running = 0;
-    log_with_timestamp("設置RTP接收停止標誌\n");
-    
-    // 關閉socket以確保recvfrom立即返回（這是關鍵修改）
-    if (rtp_sockfd >= 0) {
-        log_with_timestamp("關閉RTP socket以中斷接收線程...\n");
-        // 複製socket文件描述符，避免線程同時使用時發生問題
-        int sockfd_copy = rtp_sockfd;
-        rtp_sockfd = -1;
-        
-        // 立即關閉socket，強制中斷recvfrom
-        close(sockfd_copy);
-        log_with_timestamp("RTP socket已關閉\n");
-    }
+    // 設置運行標誌為停止，並 shutdown socket 讓 recvfrom 立即返回；
+    // socket 在線程結束後才關閉，避免文件描述符被其他通話重用
+    rx->running = 0;
+    shutdown(rx->sockfd, SHUT_RDWR);
     
     // 等待線程結束
     log_with_timestamp("等待RTP接收線程終止...\n");
-    if (pthread_join(rtp_thread, NULL) != 0) {
+    if (pthread_join(rx->thread, NULL) != 0) {
         log_with_timestamp("警告: 無法等待RTP線程結束: %s\n", strerror(errno));
     } else {
         log_with_timestamp("RTP接收線程已成功終止\n");
     }
+    close(rx->sockfd);
     
     // 關閉原始數據文件
-    if (raw_data_file) {
-        fclose(raw_data_file);
-        raw_data_file = NULL;
+    if (rx->raw_data_file) {
+        fclose(rx->raw_data_file);
         log_with_timestamp("原始數據文件已關閉\n");
     }
     
     // 處理輸出文件
-    if (output_file) {
+    if (rx->output_file) {
         log_with_timestamp("關閉輸出文件並修復WAV頭...\n");
         
         // 修復WAV文件長度
-        long file_size = ftell(output_file);
+        long file_size = ftell(rx->output_file);
         log_with_timestamp("WAV檔案總大小: %ld 字節\n", file_size);
         
-        if (file_size > 58) {  // 新的WAV頭部大小為58字節
-            // 計算數據大小和RIFF大小
-            long data_size = file_size - 58;
-            long riff_size = file_size - 8;
-            long sample_count = data_size;  // 對於G.711，每個採樣是1字節
-            
-            log_with_timestamp("數據大小: %ld 字節，採樣數: %ld\n", data_size, sample_count);
-            
-            // 寫入RIFF塊大小
-            fseek(output_file, 4, SEEK_SET);
-            fwrite(&riff_size, 4, 1, output_file);
-            
-            // 寫入採樣數（fact塊）- 正確的偏移位置是 46
-            fseek(output_file, 46, SEEK_SET);
-            fwrite(&sample_count, 4, 1, output_file);
-            
-            // 寫入數據塊大小
-            fseek(output_file, 54, SEEK_SET);
-            fwrite(&data_size, 4, 1, output_file);
+        if (file_size > 58 && rx->real_audio_data_received) {  // 新的WAV頭部大小為58字節
+            update_wav_header(rx->output_file);
             
             // 計算音頻時長
-            float duration = (float)sample_count / 8000.0f;
+            float duration = (float)(file_size - 58) / 8000.0f;
             log_with_timestamp("音頻時長: %.2f 秒\n", duration);
-            
-            if (!real_audio_data_received) {
-                // 如果沒有收到實際的RTP數據，生成一個簡短的測試音調
-                log_with_timestamp("未接收到實際RTP音頻數據，生成測試音調...\n");
-                fseek(output_file, 58, SEEK_SET);
-                generate_test_audio(output_file, 1000);  // 1秒測試音調
-                
-                // 重新計算並更新文件大小
-                file_size = ftell(output_file);
-                data_size = file_size - 58;
-                riff_size = file_size - 8;
-                sample_count = data_size;
-                
-                // 更新WAV頭部
-                fseek(output_file, 4, SEEK_SET);
-                fwrite(&riff_size, 4, 1, output_file);
-                fseek(output_file, 46, SEEK_SET);
-                fwrite(&sample_count, 4, 1, output_file);
-                fseek(output_file, 54, SEEK_SET);
-                fwrite(&data_size, 4, 1, output_file);
-                
-                log_with_timestamp("已添加測試音調 (1秒)，總文件大小: %ld 字節\n", file_size);
-            }
         } else {
-            log_with_timestamp("警告: WAV文件太小或格式不正確，添加測試音調...\n");
-            // 確保文件指針在數據區開始位置
-            fseek(output_file, 58, SEEK_SET);
-            generate_test_audio(output_file, 1000);  // 1秒測試音調
-            
-            // 重新計算並更新文件大小
-            file_size = ftell(output_file);
-            long data_size = file_size - 58;
-            long riff_size = file_size - 8;
-            long sample_count = data_size;
+            // 如果沒有收到實際的RTP數據，生成一個簡短的測試音調
+            log_with_timestamp("未接收到實際RTP音頻數據，生成測試音調...\n");
+            fseek(rx->output_file, 58, SEEK_SET);
+            generate_test_audio(rx->output_file, 1000);  // 1秒測試音調
+            update_wav_header(rx->output_file);
             
-            // 更新WAV頭部
-            fseek(output_file, 4, SEEK_SET);
-            fwrite(&riff_size, 4, 1, output_file);
-            fseek(output_file, 46, SEEK_SET);
-            fwrite(&sample_count, 4, 1, output_file);
-            fseek(output_file, 54, SEEK_SET);
-            fwrite(&data_size, 4, 1, output_file);
-            
-            log_with_timestamp("已添加測試音調作為備用，文件大小: %ld 字節\n", file_size);
+            log_with_timestamp("已添加測試音調 (1秒)\n");
         }
         
-        fclose(output_file);
-        output_file = NULL;
+        fclose(rx->output_file);
         
         log_with_timestamp("統計信息：共接收 %d 個RTP數據包，總數據量 %u 字節\n", 
-                         received_packet_count, total_bytes_received);
+                         rx->received_packet_count, rx->total_bytes_received);
         
         log_with_timestamp("輸出文件已關閉\n");
     }
     
+    free(rx->latch);
+    free(rx);
     log_with_timestamp("RTP接收器已完全停止\n");
 }
 
+// 獲取接收器的RTP socket (同一socket也用於發送，以保持對稱RTP)
+int rtp_receiver_get_sockfd(rtp_receiver_t *rx) {
+    return rx ? rx->sockfd : -1;
+}
+
+// 獲取已接收的RTP封包數
+int rtp_receiver_packet_count(rtp_receiver_t *rx) {
+    return rx ? rx->received_packet_count : 0;
+}
+
+// 設定 SDP 協商的對方媒體地址與負載類型 (可從任意線程調用；收到 183/200 或 re-INVITE 後更新)
+void rtp_receiver_set_remote(rtp_receiver_t *rx, const sip_media_t *media) {
+    struct sockaddr_in addr;
+
+    if (!rx || !media) return;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_addr = media->remote_addr;
+    addr.sin_port = htons(media->remote_port);
+    uint64_t expected = rtp_peer_pack(&addr);
+    uint64_t old_expected = __atomic_exchange_n(&rx->expected, expected, __ATOMIC_RELAXED);
+    int old_pt = __atomic_exchange_n(&rx->expected_pt, media->payload_type, __ATOMIC_RELAXED);
+
+    // SDP 地址或負載類型改變時解除鎖定：發送立即改回新的 SDP 地址，接收線程在下一個封包重置累計狀態
+    if (old_expected != expected || old_pt != media->payload_type) {
+        __atomic_store_n(&rx->latch->peer, 0, __ATOMIC_RELEASE);
+        __atomic_add_fetch(&rx->remote_changes, 1, __ATOMIC_RELEASE);
+    }
+}
+
+// 鎖定狀態 (在接收器銷毀前有效)
+const rtp_latch_t* rtp_receiver_latch(rtp_receiver_t *rx) {
+    return rx ? rx->latch : NULL;
+}
+
+// 已鎖定時以實際來源覆寫 dest 並返回 1，否則不修改 dest 並返回 0
+int rtp_latch_apply(const rtp_latch_t *latch, struct sockaddr_in *dest) {
+    if (!latch) return 0;
+    uint64_t peer = __atomic_load_n(&latch->peer, __ATOMIC_ACQUIRE);
+    if (!peer) return 0;
+    rtp_peer_unpack(peer, dest);
+    return 1;
+}
+
+void rtp_latch_get_stats(rtp_latch_stats_t *out) {
+    out->latched = __atomic_load_n(&latch_stats.latched, __ATOMIC_RELAXED);
+    out->moved = __atomic_load_n(&latch_stats.moved, __ATOMIC_RELAXED);
+    out->relatched = __atomic_load_n(&latch_stats.relatched, __ATOMIC_RELAXED);
+    out->rejected = __atomic_load_n(&latch_stats.rejected, __ATOMIC_RELAXED);
+}
+
+int rtp_latch_format(char *buf, size_t size) {
+    rtp_latch_stats_t s;
+
+    rtp_latch_get_stats(&s);
+    int len = snprintf(buf, size, "rtp_latch packets=%d latched=%lu moved=%lu relatched=%lu rejected=%lu\n",
+                       sip_config()->rtp_latch_packets, s.latched, s.moved, s.relatched, s.rejected);
+    if (len < 0) return 0;
+    return (size_t)len < size ? len : (int)size - 1;
+}
+
+// 啟動RTP接收器 (舊式全局接收器)
+int start_rtp_receiver(int port, const char *output_filename) {
+    // 如果已經運行，先停止
+    if (default_receiver) {
+        log_with_timestamp("RTP接收器已在運行，先停止它\n");
+        stop_rtp_receiver();
+    }
+    
+    default_receiver = rtp_receiver_create(port, output_filename, default_receiver_callback, NULL);
+    if (!default_receiver) {
+        return -1;
+    }
+    
+    // 創建一個原始數據文件，用於調試
+    if (output_filename) {
+        default_receiver->raw_data_file = fopen("rtp_raw_data.bin", "wb");
+        if (default_receiver->raw_data_file) {
+            log_with_timestamp("創建原始RTP數據文件用於調試\n");
+        } else {
+            log_with_timestamp("警告: 無法創建原始數據文件: %s\n", strerror(errno));
+        }
+    }
+    return 0;
+}
+
+// 停止RTP接收器 (舊式全局接收器)
+void stop_rtp_receiver() {
+    if (!default_receiver) {
+        log_with_timestamp("RTP接收器未運行\n");
+        return;
+    }
+    
+    rtp_receiver_destroy(default_receiver);
+    default_receiver = NULL;
+}
+
 // 獲取當前RTP socket文件描述符（用於發送）
 int get_rtp_sockfd() {
-    return rtp_sockfd;
-} 
\ No newline at end of file
+    return rtp_receiver_get_sockfd(default_receiver);
+}
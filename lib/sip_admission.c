@@ -0,0 +1,263 @@
+// sip_admission.c - 實現呼叫准入控制 (所有狀態只在事件循環線程中存取)
+#include "sip_admission.h"
+#include "sip_client.h"
+#include "sip_config.h"
+#include "sip_gateway.h"
+
+// 等待中的請求 (環形佇列，依到達順序准入)
+typedef struct {
+    sip_admission_callback_t callback;
+    void *user_data;
+    uint64_t enqueued_ms;
+    uint64_t deadline_ms;
+} admission_waiter_t;
+
+typedef struct {
+    sip_admission_callback_t callback;
+    void *user_data;
+} admission_request_t;
+
+static admission_waiter_t waiters[SIP_ADMISSION_QUEUE_MAX];
+static int wait_head = 0;
+static int wait_count = 0;
+
+// 令牌桶：每秒補充 max_cps 個令牌，最多累積 cps_burst 個；每通呼叫消耗一個
+static double tokens = 0;
+static uint64_t refill_us = 0;
+static int bucket_ready = 0;
+
+static int active = 0;
+static sip_timer_t wake_timer;
+static int wake_timer_ready = 0;
+static sip_admission_stats_t stats;
+
+static const char *reason_codes[SIP_ADMIT_RESULT_COUNT] = {
+    [SIP_ADMIT_OK] = "OK",
+    [SIP_ADMIT_REJECT_RATE] = "RATE_LIMIT",
+    [SIP_ADMIT_REJECT_CAPACITY] = "CALL_LIMIT",
+    [SIP_ADMIT_REJECT_QUEUE_FULL] = "QUEUE_FULL",
+    [SIP_ADMIT_REJECT_TIMEOUT] = "QUEUE_TIMEOUT",
+    [SIP_ADMIT_CANCELLED] = "CANCELLED",
+};
+
+static void admission_drain(void *arg);
+
+// 同時通話數上限：max_calls 與所有中繼容量總和中較小者
+static int admission_limit(const sip_config_t *cfg) {
+    int limit = cfg->max_calls;
+    if (cfg->trunk_max_calls > 0) {
+        int capacity = cfg->trunk_max_calls * sip_gateway_count();
+        if (capacity < limit) limit = capacity;
+    }
+    return limit;
+}
+
+static void bucket_refill(const sip_config_t *cfg, uint64_t now_us) {
+    double size = cfg->cps_burst > 0 ? cfg->cps_burst : cfg->max_cps;
+
+    if (!bucket_ready) {
+        // 啟用限速 (或重新啟用) 時以滿桶開始
+        tokens = size;
+        bucket_ready = 1;
+    } else {
+        tokens += (double)(now_us - refill_us) * cfg->max_cps / 1000000.0;
+    }
+    if (tokens > size) tokens = size;
+    refill_us = now_us;
+}
+
+// 嘗試取得名額與令牌；不足時返回受限的原因，不消耗任何資源
+static sip_admit_result_t admission_try(void) {
+    const sip_config_t *cfg = sip_config();
+
+    if (active >= admission_limit(cfg)) return SIP_ADMIT_REJECT_CAPACITY;
+    if (cfg->max_cps > 0) {
+        bucket_refill(cfg, sip_now_us());
+        if (tokens < 1.0) return SIP_ADMIT_REJECT_RATE;
+        tokens -= 1.0;
+    } else {
+        bucket_ready = 0;
+    }
+    active++;
+    stats.admitted++;
+    return SIP_ADMIT_OK;
+}
+
+static void admission_reject(sip_admission_callback_t callback, void *user_data, sip_admit_result_t result) {
+    stats.rejected[result]++;
+    callback(result, user_data);
+}
+
+static admission_waiter_t admission_pop(void) {
+    admission_waiter_t waiter = waiters[wait_head];
+    wait_head = (wait_head + 1) % SIP_ADMISSION_QUEUE_MAX;
+    wait_count--;
+    return waiter;
+}
+
+// 安排下一次檢查：佇列頭的期限，或受 CPS 限制時下一個令牌補滿的時間
+// (受同時通話數限制時由 sip_admission_release 喚醒)
+static void admission_schedule(void) {
+    if (!wake_timer_ready) {
+        sip_timer_init(&wake_timer, admission_drain, NULL);
+        wake_timer_ready = 1;
+    }
+    if (wait_count == 0) {
+        sip_timer_stop(&wake_timer);
+        return;
+    }
+
+    const sip_config_t *cfg = sip_config();
+    uint64_t now = sip_now_ms();
+    const admission_waiter_t *head = &waiters[wait_head];
+    int delay = head->deadline_ms > now ? (int)(head->deadline_ms - now) : 0;
+
+    if (cfg->max_cps > 0 && active < admission_limit(cfg)) {
+        bucket_refill(cfg, sip_now_us());
+        if (tokens < 1.0) {
+            int token_delay = (int)((1.0 - tokens) * 1000.0 / cfg->max_cps) + 1;
+            if (token_delay < delay) delay = token_delay;
+        } else {
+            delay = 0;
+        }
+    }
+    sip_timer_start(&wake_timer, delay);
+}
+
+// 依到達順序准入等待中的請求，並拒絕已超過期限的請求
+static void admission_drain(void *arg) {
+    (void)arg;
+
+    while (wait_count > 0) {
+        uint64_t now = sip_now_ms();
+        admission_waiter_t *head = &waiters[wait_head];
+
+        if (now >= head->deadline_ms) {
+            admission_waiter_t waiter = admission_pop();
+            admission_reject(waiter.callback, waiter.user_data, SIP_ADMIT_REJECT_TIMEOUT);
+            continue;
+        }
+        if (admission_try() != SIP_ADMIT_OK) break;
+
+        admission_waiter_t waiter = admission_pop();
+        unsigned long waited = (unsigned long)(now - waiter.enqueued_ms);
+        if (waited > stats.max_wait_ms) stats.max_wait_ms = waited;
+        waiter.callback(SIP_ADMIT_OK, waiter.user_data);
+    }
+    admission_schedule();
+}
+
+static void admission_submit_task(void *arg) {
+    admission_request_t *req = (admission_request_t *)arg;
+    sip_admission_callback_t callback = req->callback;
+    void *user_data = req->user_data;
+    const sip_config_t *cfg = sip_config();
+    sip_admit_result_t result;
+
+    free(req);
+    stats.requests++;
+
+    // 已有請求在排隊時新請求排在其後，不可插隊
+    if (wait_count == 0) {
+        result = admission_try();
+        if (result == SIP_ADMIT_OK) {
+            callback(SIP_ADMIT_OK, user_data);
+            return;
+        }
+    } else {
+        result = SIP_ADMIT_REJECT_QUEUE_FULL;
+    }
+
+    if (cfg->admission_queue == 0 || cfg->admission_wait_ms == 0) {
+        admission_reject(callback, user_data, result);
+        return;
+    }
+    if (wait_count >= cfg->admission_queue) {
+        log_with_timestamp("准入等待佇列已滿 (%d 個)，拒絕新的呼叫請求\n", wait_count);
+        admission_reject(callback, user_data, SIP_ADMIT_REJECT_QUEUE_FULL);
+        return;
+    }
+
+    uint64_t now = sip_now_ms();
+    admission_waiter_t *waiter = &waiters[(wait_head + wait_count) % SIP_ADMISSION_QUEUE_MAX];
+    waiter->callback = callback;
+    waiter->user_data = user_data;
+    waiter->enqueued_ms = now;
+    waiter->deadline_ms = now + cfg->admission_wait_ms;
+    wait_count++;
+    stats.queued++;
+    admission_schedule();
+}
+
+int sip_admission_submit(sip_admission_callback_t callback, void *user_data) {
+    if (!callback) return -1;
+
+    admission_request_t *req = malloc(sizeof(admission_request_t));
+    if (!req) return -1;
+    req->callback = callback;
+    req->user_data = user_data;
+    if (sip_reactor_post(admission_submit_task, req) != 0) {
+        free(req);
+        return -1;
+    }
+    return 0;
+}
+
+static void admission_release_task(void *arg) {
+    (void)arg;
+    if (active > 0) active--;
+    admission_drain(NULL);
+}
+
+void sip_admission_release(void) {
+    sip_reactor_post(admission_release_task, NULL);
+}
+
+static void admission_flush_task(void *arg) {
+    (void)arg;
+    while (wait_count > 0) {
+        admission_waiter_t waiter = admission_pop();
+        admission_reject(waiter.callback, waiter.user_data, SIP_ADMIT_CANCELLED);
+    }
+    admission_schedule();
+}
+
+void sip_admission_flush(void) {
+    sip_reactor_run_sync(admission_flush_task, NULL);
+}
+
+const char* sip_admission_reason(sip_admit_result_t result) {
+    if ((int)result < 0 || result >= SIP_ADMIT_RESULT_COUNT) return "UNKNOWN";
+    return reason_codes[result];
+}
+
+static void admission_stats_task(void *arg) {
+    sip_admission_stats_t *out = (sip_admission_stats_t *)arg;
+    *out = stats;
+    out->active = active;
+    out->waiting = wait_count;
+    out->limit = admission_limit(sip_config());
+}
+
+void sip_admission_get_stats(sip_admission_stats_t *out) {
+    memset(out, 0, sizeof(*out));
+    sip_reactor_run_sync(admission_stats_task, out);
+}
+
+int sip_admission_format(char *buf, size_t size) {
+    sip_admission_stats_t s;
+    int len;
+
+    sip_admission_get_stats(&s);
+    len = snprintf(buf, size,
+                   "admission requests=%lu admitted=%lu queued=%lu active=%d/%d waiting=%d max_wait_ms=%lu",
+                   s.requests, s.admitted, s.queued, s.active, s.limit, s.waiting, s.max_wait_ms);
+    for (int r = SIP_ADMIT_REJECT_RATE; r < SIP_ADMIT_RESULT_COUNT && len >= 0 && (size_t)len < size; r++) {
+        len += snprintf(buf + len, size - len, " %s=%lu", reason_codes[r], s.rejected[r]);
+    }
+    if (len >= 0 && (size_t)len < size) {
+        len += snprintf(buf + len, size - len, "\n");
+    }
+    if (len < 0) return 0;
+    return (size_t)len < size ? len : (int)size - 1;
+}
@@ -0,0 +1,51 @@
+// sip_admission.h - 呼叫准入控制：以令牌桶限制每秒新呼叫數 (CPS)，並限制同時通話數與各中繼的通話數，
+// 超出限制的請求進入有界等待佇列，逾時或佇列已滿時立即拒絕
+#ifndef SIP_ADMISSION_H
+#define SIP_ADMISSION_H
+
+#include <stddef.h>
+
+#define SIP_ADMISSION_QUEUE_MAX 1024     // 等待佇列容量上限 (設定 admission_queue 不可超過)
+
+// 准入結果
+typedef enum {
+    SIP_ADMIT_OK = 0,             // 可發起呼叫；結束後須調用 sip_admission_release
+    SIP_ADMIT_REJECT_RATE,        // 每秒呼叫數已達上限，且不排隊
+    SIP_ADMIT_REJECT_CAPACITY,    // 同時通話數 (或所有中繼的通話數) 已達上限，且不排隊
+    SIP_ADMIT_REJECT_QUEUE_FULL,  // 等待佇列已滿
+    SIP_ADMIT_REJECT_TIMEOUT,     // 排隊超過 admission_wait_ms
+    SIP_ADMIT_CANCELLED,          // 等待中被 sip_admission_flush 取消
+    SIP_ADMIT_RESULT_COUNT
+} sip_admit_result_t;
+
+// 准入結果通知 (在事件循環線程中調用)
+typedef void (*sip_admission_callback_t)(sip_admit_result_t result, void *user_data);
+
+// 統計 (自啟動起累計；active、waiting 與 limit 為目前值)
+typedef struct {
+    unsigned long requests;
+    unsigned long admitted;                 // 含排隊後准入的請求
+    unsigned long queued;                   // 曾進入等待佇列的請求
+    unsigned long rejected[SIP_ADMIT_RESULT_COUNT];
+    int active;                             // 已准入尚未釋放的呼叫
+    int waiting;                            // 目前在佇列中的請求
+    int limit;                              // 目前的同時通話數上限
+    unsigned long max_wait_ms;              // 排隊後准入的最長等待時間
+} sip_admission_stats_t;
+
+// 申請發起一通呼叫 (可從任意線程調用)：結果經由 callback 在事件循環線程中回報，
+// 可立即准入時在下一輪事件循環回報；返回 -1 表示無法投遞 (callback 不會被調用)
+int sip_admission_submit(sip_admission_callback_t callback, void *user_data);
+// 已准入的呼叫結束 (可從任意線程調用)：釋放名額並喚醒等待中的請求
+void sip_admission_release(void);
+// 取消所有等待中的請求 (SIP_ADMIT_CANCELLED)，之後的請求仍照常處理 (可從任意線程調用)
+void sip_admission_flush(void);
+
+// 結果的原因碼 (例如 "RATE_LIMIT")，用於回報給客戶端
+const char* sip_admission_reason(sip_admit_result_t result);
+
+void sip_admission_get_stats(sip_admission_stats_t *out);
+// 以文字格式輸出統計，返回寫入的長度
+int sip_admission_format(char *buf, size_t size);
+
+#endif // SIP_ADMISSION_H
@@ -0,0 +1,202 @@
+// sip_auth.c - 實現摘要認證憑證快取 (RFC 2617 / RFC 3261 22.4)
+#include "sip_client.h"
+#include "sip_auth.h"
+#include "sip_id.h"
+
+typedef struct {
+    int in_use;
+    struct in_addr addr;             // 發出挑戰的伺服器
+    uint16_t port;
+    int proxy;                       // 407：以 Proxy-Authorization 回應
+    int qop_auth;                    // 伺服器接受 qop=auth
+    char realm[128];
+    char nonce[256];                 // 空字串表示需要重新挑戰
+    char opaque[128];
+    char ha1[33];                    // MD5(username:realm:password)，同一領域只計算一次
+    unsigned int nc;                 // 目前 nonce 已使用的次數
+    uint64_t last_used;
+} sip_auth_entry_t;
+
+static sip_auth_entry_t auth_cache[SIP_AUTH_CACHE_SIZE];
+static pthread_mutex_t auth_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int same_server(const sip_auth_entry_t *e, const struct sockaddr_in *server) {
+    return e->addr.s_addr == server->sin_addr.s_addr && e->port == server->sin_port;
+}
+
+// 伺服器最近使用的領域 (需持有 auth_lock)
+static sip_auth_entry_t* find_server_locked(const struct sockaddr_in *server) {
+    sip_auth_entry_t *best = NULL;
+    for (int i = 0; i < SIP_AUTH_CACHE_SIZE; i++) {
+        sip_auth_entry_t *e = &auth_cache[i];
+        if (e->in_use && same_server(e, server) && (!best || e->last_used > best->last_used)) {
+            best = e;
+        }
+    }
+    return best;
+}
+
+// 找到或分配領域的快取項目，已滿時淘汰最久未使用的項目 (需持有 auth_lock)
+static sip_auth_entry_t* find_realm_locked(const struct sockaddr_in *server, const char *realm, int *created) {
+    sip_auth_entry_t *victim = NULL;
+
+    *created = 0;
+    for (int i = 0; i < SIP_AUTH_CACHE_SIZE; i++) {
+        sip_auth_entry_t *e = &auth_cache[i];
+        if (e->in_use && same_server(e, server) && strcmp(e->realm, realm) == 0) return e;
+        if (!victim || (victim->in_use && (!e->in_use || e->last_used < victim->last_used))) {
+            victim = e;
+        }
+    }
+
+    memset(victim, 0, sizeof(*victim));
+    victim->in_use = 1;
+    victim->addr = server->sin_addr;
+    victim->port = server->sin_port;
+    snprintf(victim->realm, sizeof(victim->realm), "%s", realm);
+    *created = 1;
+    return victim;
+}
+
+// qop 參數是以逗號分隔的清單，檢查其中是否有 auth
+static int qop_offers_auth(const char *qop) {
+    const char *p = qop;
+    while (*p) {
+        while (*p == ' ' || *p == ',') p++;
+        const char *start = p;
+        while (*p && *p != ',' && *p != ' ') p++;
+        if (p - start == 4 && strncasecmp(start, "auth", 4) == 0) return 1;
+    }
+    return 0;
+}
+
+int sip_auth_handle_challenge(const struct sockaddr_in *server, int status_code, const sip_msg_t *msg) {
+    char realm[128] = "", nonce[256] = "", opaque[128] = "", qop[64] = "", stale[16] = "", algorithm[32] = "";
+    sip_header_id_t id = status_code == 407 ? SIP_HDR_PROXY_AUTHENTICATE : SIP_HDR_WWW_AUTHENTICATE;
+
+    if (!msg || sip_msg_header_param(msg, id, "realm", realm, sizeof(realm)) != 0 ||
+        sip_msg_header_param(msg, id, "nonce", nonce, sizeof(nonce)) != 0 ||
+        realm[0] == '\0' || nonce[0] == '\0') {
+        log_with_timestamp("認證資訊解析失敗\n");
+        return -1;
+    }
+    sip_msg_header_param(msg, id, "opaque", opaque, sizeof(opaque));
+    sip_msg_header_param(msg, id, "qop", qop, sizeof(qop));
+    sip_msg_header_param(msg, id, "stale", stale, sizeof(stale));
+    sip_msg_header_param(msg, id, "algorithm", algorithm, sizeof(algorithm));
+    if (algorithm[0] && strcasecmp(algorithm, "MD5") != 0) {
+        log_with_timestamp("不支援的摘要演算法: %s\n", algorithm);
+        return -1;
+    }
+
+    pthread_mutex_lock(&auth_lock);
+    int created;
+    sip_auth_entry_t *e = find_realm_locked(server, realm, &created);
+    if (created) {
+        // 帳號、realm 與密碼的最大長度 (各含結尾，恰好容納兩個冒號與結尾)，不會截斷成錯誤的 HA1
+        char a1[sizeof(sip_config()->username) + sizeof(realm) + sizeof(sip_config()->password)];
+        snprintf(a1, sizeof(a1), "%s:%s:%s", USERNAME, realm, PASSWORD);
+        md5(a1, e->ha1);
+    }
+    e->proxy = status_code == 407;
+    e->qop_auth = qop_offers_auth(qop);
+    snprintf(e->nonce, sizeof(e->nonce), "%s", nonce);
+    snprintf(e->opaque, sizeof(e->opaque), "%s", opaque);
+    e->nc = 0;
+    e->last_used = sip_now_ms();
+    pthread_mutex_unlock(&auth_lock);
+
+    log_with_timestamp("認證挑戰: realm %s，nonce %s%s%s\n", realm, nonce,
+                     e->qop_auth ? "，qop=auth" : "",
+                     strcasecmp(stale, "true") == 0 ? " (nonce 已過期)" : created ? "" : " (沿用快取的 HA1)");
+    return 0;
+}
+
+int sip_auth_build_header(const struct sockaddr_in *server, const char *method, const char *uri,
+                          int preemptive, char *buf, size_t buf_size) {
+    char ha1[33], ha2[33], response[33];
+    char nonce[256], opaque[128], realm[128];
+    char a2[320], kd[768];
+    char cnonce[17] = "";
+    unsigned int nc = 0;
+    int proxy, qop_auth;
+
+    pthread_mutex_lock(&auth_lock);
+    sip_auth_entry_t *e = find_server_locked(server);
+    if (!e || e->nonce[0] == '\0' || (preemptive && !e->qop_auth)) {
+        pthread_mutex_unlock(&auth_lock);
+        return 0;
+    }
+    nc = ++e->nc;
+    e->last_used = sip_now_ms();
+    memcpy(ha1, e->ha1, sizeof(ha1));
+    memcpy(nonce, e->nonce, sizeof(nonce));
+    memcpy(opaque, e->opaque, sizeof(opaque));
+    memcpy(realm, e->realm, sizeof(realm));
+    proxy = e->proxy;
+    qop_auth = e->qop_auth;
+    pthread_mutex_unlock(&auth_lock);
+
+    if ((size_t)snprintf(a2, sizeof(a2), "%s:%s", method, uri) >= sizeof(a2)) {
+        log_with_timestamp("認證失敗: Request-URI 過長 (%zu 字節)\n", strlen(uri));
+        return -1;
+    }
+    md5(a2, ha2);
+    if (qop_auth) {
+        sip_id_tag(cnonce, sizeof(cnonce));
+        snprintf(kd, sizeof(kd), "%s:%s:%08x:%s:auth:%s", ha1, nonce, nc, cnonce, ha2);
+    } else {
+        snprintf(kd, sizeof(kd), "%s:%s:%s", ha1, nonce, ha2);
+    }
+    md5(kd, response);
+
+    int len = snprintf(buf, buf_size,
+        "%s: Digest username=\"%s\", realm=\"%s\", nonce=\"%s\", uri=\"%s\", response=\"%s\", algorithm=MD5",
+        proxy ? "Proxy-Authorization" : "Authorization",
+        USERNAME, realm, nonce, uri, response);
+    if (len > 0 && (size_t)len < buf_size && opaque[0]) {
+        len += snprintf(buf + len, buf_size - len, ", opaque=\"%s\"", opaque);
+    }
+    if (len > 0 && (size_t)len < buf_size && qop_auth) {
+        len += snprintf(buf + len, buf_size - len, ", qop=auth, nc=%08x, cnonce=\"%s\"", nc, cnonce);
+    }
+    if (len > 0 && (size_t)len < buf_size) {
+        len += snprintf(buf + len, buf_size - len, "\r\n");
+    }
+    return (len > 0 && (size_t)len < buf_size) ? len : -1;
+}
+
+void sip_auth_update_from_response(const struct sockaddr_in *server, const sip_msg_t *msg) {
+    char nextnonce[256];
+    const sip_header_t *info = sip_msg_header_by_name(msg, "Authentication-Info");
+    sip_slice_t value;
+
+    if (!info || sip_header_param(msg, info, "nextnonce", &value) != 0 ||
+        sip_slice_copy(msg, value, nextnonce, sizeof(nextnonce)) != 0 || nextnonce[0] == '\0') {
+        return;
+    }
+
+    pthread_mutex_lock(&auth_lock);
+    sip_auth_entry_t *e = find_server_locked(server);
+    if (e) {
+        snprintf(e->nonce, sizeof(e->nonce), "%s", nextnonce);
+        e->nc = 0;
+    }
+    pthread_mutex_unlock(&auth_lock);
+}
+
+void sip_auth_invalidate(const struct sockaddr_in *server) {
+    pthread_mutex_lock(&auth_lock);
+    for (int i = 0; i < SIP_AUTH_CACHE_SIZE; i++) {
+        if (auth_cache[i].in_use && same_server(&auth_cache[i], server)) {
+            auth_cache[i].nonce[0] = '\0';
+        }
+    }
+    pthread_mutex_unlock(&auth_lock);
+}
+
+void sip_auth_cache_clear(void) {
+    pthread_mutex_lock(&auth_lock);
+    memset(auth_cache, 0, sizeof(auth_cache));
+    pthread_mutex_unlock(&auth_lock);
+}
@@ -0,0 +1,26 @@
+// sip_auth.h - 摘要認證憑證快取：每個領域保存 HA1 與最近的 nonce，支援 qop=auth 預先認證
+#ifndef SIP_AUTH_H
+#define SIP_AUTH_H
+
+#include <stddef.h>
+#include <netinet/in.h>
+#include "sip_parser.h"
+
+#define SIP_AUTH_CACHE_SIZE 8        // 快取的領域數上限
+
+// 以 401/407 挑戰更新快取 (計算或沿用 HA1、記錄 nonce 並重置 nonce 計數)
+int sip_auth_handle_challenge(const struct sockaddr_in *server, int status_code, const sip_msg_t *msg);
+
+// 產生整行認證標頭 (含 \r\n)，每次調用遞增 nonce 計數；返回長度，沒有可用的快取時返回 0。
+// preemptive 為 1 時只在伺服器提供 qop=auth 時使用 (舊 nonce 配合新的 nc 才能安全重用)
+int sip_auth_build_header(const struct sockaddr_in *server, const char *method, const char *uri,
+                          int preemptive, char *buf, size_t buf_size);
+
+// 2xx 的 Authentication-Info 帶有 nextnonce 時更新快取
+void sip_auth_update_from_response(const struct sockaddr_in *server, const sip_msg_t *msg);
+
+// 預先認證遭拒時清除該伺服器的 nonce，下次呼叫重新等待挑戰
+void sip_auth_invalidate(const struct sockaddr_in *server);
+void sip_auth_cache_clear(void);
+
+#endif // SIP_AUTH_H
@@ -0,0 +1,135 @@
+// sip_batch.c - 實現 SIP UDP 批量收發 (recvmmsg / sendmmsg)
+#define _GNU_SOURCE  // recvmmsg / sendmmsg
+#include "sip_batch.h"
+#include "sip_client.h"
+#include <sys/socket.h>
+
+// 接收：每個數據報一個 BUF_SIZE 緩衝區，保留一個字節放 NUL
+static char recv_bufs[SIP_BATCH_SIZE][BUF_SIZE];
+static struct mmsghdr recv_msgs[SIP_BATCH_SIZE];
+static struct iovec recv_iovs[SIP_BATCH_SIZE];
+static struct sockaddr_in recv_addrs[SIP_BATCH_SIZE];
+
+// 待發送佇列
+typedef struct {
+    int sockfd;
+    struct sockaddr_in dest;
+    int len;
+    char data[BUF_SIZE];
+} batch_entry_t;
+
+static batch_entry_t send_queue[SIP_BATCH_QUEUE];
+static int send_count = 0;
+static struct mmsghdr send_msgs[SIP_BATCH_QUEUE];
+static struct iovec send_iovs[SIP_BATCH_QUEUE];
+
+static sip_batch_stats_t stats;
+
+int sip_batch_recv(int sockfd, sip_batch_handler_t handler) {
+    int total = 0;
+
+    for (;;) {
+        for (int i = 0; i < SIP_BATCH_SIZE; i++) {
+            recv_iovs[i].iov_base = recv_bufs[i];
+            recv_iovs[i].iov_len = BUF_SIZE - 1;
+            memset(&recv_msgs[i].msg_hdr, 0, sizeof(recv_msgs[i].msg_hdr));
+            recv_msgs[i].msg_hdr.msg_iov = &recv_iovs[i];
+            recv_msgs[i].msg_hdr.msg_iovlen = 1;
+            recv_msgs[i].msg_hdr.msg_name = &recv_addrs[i];
+            recv_msgs[i].msg_hdr.msg_namelen = sizeof(recv_addrs[i]);
+        }
+
+        int n = recvmmsg(sockfd, recv_msgs, SIP_BATCH_SIZE, MSG_DONTWAIT, NULL);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                log_with_timestamp("接收 SIP 訊息錯誤: %s\n", strerror(errno));
+            }
+            break;
+        }
+        stats.recv_calls++;
+        stats.recv_datagrams += n;
+
+        for (int i = 0; i < n; i++) {
+            int len = (int)recv_msgs[i].msg_len;
+            if (len == 0) continue;
+            recv_bufs[i][len] = '\0';
+            handler(sockfd, recv_bufs[i], len, &recv_addrs[i]);
+        }
+        total += n;
+        // 未填滿批次表示已讀空
+        if (n < SIP_BATCH_SIZE) break;
+    }
+    return total;
+}
+
+ssize_t sip_batch_send(int sockfd, const struct sockaddr_in *dest, const struct iovec *iov, int iovcnt) {
+    if (send_count == SIP_BATCH_QUEUE) {
+        sip_batch_flush();
+    }
+
+    batch_entry_t *entry = &send_queue[send_count];
+    int len = sip_iov_flatten(iov, iovcnt, entry->data, sizeof(entry->data));
+    if (len < 0) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+    entry->sockfd = sockfd;
+    entry->dest = *dest;
+    entry->len = len;
+    send_count++;
+    return len;
+}
+
+// 送出佇列中 [start, start + count) 的數據報 (相同 socket)
+static void flush_run(int start, int count) {
+    int sockfd = send_queue[start].sockfd;
+    int sent = 0;
+
+    for (int i = 0; i < count; i++) {
+        batch_entry_t *entry = &send_queue[start + i];
+        send_iovs[i].iov_base = entry->data;
+        send_iovs[i].iov_len = entry->len;
+        memset(&send_msgs[i].msg_hdr, 0, sizeof(send_msgs[i].msg_hdr));
+        send_msgs[i].msg_hdr.msg_iov = &send_iovs[i];
+        send_msgs[i].msg_hdr.msg_iovlen = 1;
+        send_msgs[i].msg_hdr.msg_name = &entry->dest;
+        send_msgs[i].msg_hdr.msg_namelen = sizeof(entry->dest);
+    }
+
+    while (sent < count) {
+        int n = sendmmsg(sockfd, send_msgs + sent, count - sent, 0);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            // 第一個數據報發送失敗 (例如目的地不可達)：記錄後跳過，繼續發送其餘的
+            const batch_entry_t *entry = &send_queue[start + sent];
+            log_with_timestamp("錯誤: 發送 SIP 訊息到 %s:%d 失敗: %s\n",
+                             inet_ntoa(entry->dest.sin_addr), ntohs(entry->dest.sin_port), strerror(errno));
+            sent++;
+            continue;
+        }
+        stats.send_calls++;
+        stats.send_datagrams += n;
+        sent += n;
+    }
+}
+
+void sip_batch_flush(void) {
+    int start = 0;
+
+    while (start < send_count) {
+        int end = start + 1;
+        while (end < send_count && send_queue[end].sockfd == send_queue[start].sockfd) end++;
+        flush_run(start, end - start);
+        start = end;
+    }
+    send_count = 0;
+}
+
+int sip_batch_pending(void) {
+    return send_count;
+}
+
+void sip_batch_get_stats(sip_batch_stats_t *out) {
+    *out = stats;
+}
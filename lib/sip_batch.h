@@ -0,0 +1,36 @@
+// sip_batch.h - SIP UDP 批量收發：以 recvmmsg 一次讀取多個數據報，發送先進佇列，每輪事件循環結束時以 sendmmsg 送出
+#ifndef SIP_BATCH_H
+#define SIP_BATCH_H
+
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+
+#define SIP_BATCH_SIZE 32            // 每次 recvmmsg / sendmmsg 處理的數據報數
+#define SIP_BATCH_QUEUE 64           // 待發送佇列容量 (滿時立即送出)
+
+// 收到一個數據報 (data 以 NUL 結尾)
+typedef void (*sip_batch_handler_t)(int sockfd, const char *data, int len, const struct sockaddr_in *from);
+
+// 以下函數使用預先分配的靜態緩衝區，只可在同一個線程 (事件循環線程) 中調用
+
+// 讀取 sockfd 上所有待處理的數據報並逐一交給 handler；返回讀取的數據報數
+int sip_batch_recv(int sockfd, sip_batch_handler_t handler);
+
+// 將數據報複製到待發送佇列，返回長度 (發送錯誤在送出時記錄)
+ssize_t sip_batch_send(int sockfd, const struct sockaddr_in *dest, const struct iovec *iov, int iovcnt);
+// 以 sendmmsg 送出佇列中的所有數據報 (相同 socket 的連續數據報合併為一次系統調用)
+void sip_batch_flush(void);
+int sip_batch_pending(void);
+
+// 統計：系統調用次數與數據報數
+typedef struct {
+    unsigned long recv_calls;
+    unsigned long recv_datagrams;
+    unsigned long send_calls;
+    unsigned long send_datagrams;
+} sip_batch_stats_t;
+
+void sip_batch_get_stats(sip_batch_stats_t *stats);
+
+#endif // SIP_BATCH_H
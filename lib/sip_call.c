@@ -1,254 +1,588 @@
-// sip_call.c - 實現SIP呼叫控制功能
+// sip_call.c - 實現SIP呼叫控制功能 (建立在事件循環與事務層之上)
 #include "sip_client.h"
+#include "sip_transaction.h"
+#include "sip_auth.h"
+#include "sip_transport.h"
+#include "sip_gateway.h"
+#include "sip_metrics.h"
 
-// 發起SIP呼叫
-int make_sip_call(sip_session_t *session, const char *callee) {
-    if (!session || session->sockfd < 0) return -1;
-    
-    char buffer[BUF_SIZE], recvbuf[BUF_SIZE];
-    char nonce[256] = "", realm[256] = "";
-    char response[33];
-    char auth_header[1024] = "";
-    char sdp[BUF_SIZE];
-    int received_100 = 0, received_183 = 0, received_200 = 0;
-    struct sockaddr_in recv_addr;
-    
-    log_with_timestamp("準備發起SIP呼叫到 %s\n", callee);
-    
-    // 構建SDP內容 - 使用動態RTP接收端口，與網關端口範圍匹配
+// 構建SDP offer - 使用動態RTP接收端口，與網關端口範圍匹配
+static int build_sdp(const sip_session_t *session, char *sdp, size_t sdp_size) {
     // 網關通常使用32000-32011範圍，我們也應該在此範圍內協商
-    int suggested_rtp_port = LOCAL_RTP_PORT;  // 起始建議端口
-    snprintf(sdp, BUF_SIZE,
-        "v=0\r\n"
-        "o=- 0 0 IN IP4 " LOCAL_IP "\r\n"
-        "s=Custom SIP Client\r\n"
-        "c=IN IP4 " LOCAL_IP "\r\n"
-        "t=0 0\r\n"
-        "m=audio %d RTP/AVP 0 8 101\r\n"
-        "a=rtpmap:0 PCMU/8000\r\n"
-        "a=rtpmap:8 PCMA/8000\r\n"
-        "a=rtpmap:101 telephone-event/8000\r\n"
-        "a=fmtp:101 0-16\r\n"
-        "a=ptime:20\r\n"
-        "a=sendrecv\r\n",
-        suggested_rtp_port  // 建議端口，最終以對方回應為準
-    );
-    log_with_timestamp("SDP中建議的RTP端口: %d（最終端口以對方回應為準）\n", suggested_rtp_port);
-    int sdp_len = strlen(sdp);
-    
-    // 構建初始 INVITE 請求
-    snprintf(buffer, BUF_SIZE,
+    int suggested_rtp_port = session->local_rtp_port > 0 ? session->local_rtp_port : LOCAL_RTP_PORT;
+    return sip_sdp_build_offer(sdp, sdp_size, LOCAL_IP, suggested_rtp_port,
+                               RTP_PACKET_SIZE / 8, session->sdp_version);  // 8000Hz 下每毫秒 8 個樣本
+}
+
+// 編譯 INVITE 模板：SDP 與對話內不變的標頭預先格式化，branch、CSeq 與認證標頭在發送時填入
+static int compile_invite_template(sip_session_t *session) {
+    char sdp[BUF_SIZE];
+    sip_template_t *tpl = &session->invite_tpl;
+    const char *host = sip_session_host(session);
+    int sdp_len = build_sdp(session, sdp, sizeof(sdp));
+
+    sip_template_reset(tpl);
+    sip_template_append(tpl,
         "INVITE sip:%s@%s SIP/2.0\r\n"
-        "Via: SIP/2.0/UDP %s:%d;branch=%s\r\n"
+        "Via: SIP/2.0/%s %s:%d;branch=",
+        session->callee, host,
+        sip_transport_via(), LOCAL_IP, LOCAL_PORT);
+    sip_template_field(tpl, SIP_TPL_BRANCH);
+    sip_template_append(tpl,
+        "\r\n"
         "Max-Forwards: 70\r\n"
         "From: \"%s\" <sip:%s@%s>;tag=%s\r\n"
         "To: <sip:%s@%s>\r\n"
-        "Contact: <sip:%s@%s:%d>\r\n"
+        "Contact: <sip:%s@%s:%d%s>\r\n"
         "Call-ID: %s\r\n"
-        "CSeq: %s INVITE\r\n"
-        "User-Agent: Custom SIP Client\r\n"
+        "CSeq: ",
+        CALLER, CALLER, SIP_SERVER, session->tag,
+        session->callee, host,
+        CALLER, LOCAL_IP, LOCAL_PORT, sip_transport_uri_param(),
+        session->callid);
+    sip_template_field(tpl, SIP_TPL_CSEQ);
+    sip_template_append(tpl,
+        " INVITE\r\n"
+        "User-Agent: Custom SIP Client\r\n");
+    sip_template_field(tpl, SIP_TPL_AUTH);
+    sip_template_append(tpl,
         "Content-Type: application/sdp\r\n"
         "Content-Length: %d\r\n"
         "\r\n"
         "%s",
-        callee, SIP_SERVER,
-        LOCAL_IP, LOCAL_PORT, session->branch,
-        CALLER, CALLER, SIP_SERVER, session->tag,
-        callee, SIP_SERVER,
-        CALLER, LOCAL_IP, LOCAL_PORT,
-        session->callid,
-        session->cseq,
         sdp_len,
-        sdp
-    );
-    
-    log_with_timestamp("發送初始 INVITE 請求 (%lu 字節):\n%s\n", strlen(buffer), buffer);
-    
-    // 清空接收緩衝區
-    flush_socket(session->sockfd);
-    
-    ssize_t sent_bytes = sendto(session->sockfd, buffer, strlen(buffer), 0, 
-                            (struct sockaddr *)&session->servaddr, sizeof(session->servaddr));
-    
-    if (sent_bytes < 0) {
-        log_with_timestamp("錯誤: 發送 INVITE 失敗: %s\n", strerror(errno));
+        sdp);
+
+    if (!sip_template_ready(tpl)) {
+        log_with_timestamp("錯誤: INVITE 模板超出容量\n");
+        return -1;
+    }
+    return 0;
+}
+
+static void on_invite_event(sip_transaction_t *txn, int status_code, const sip_msg_t *msg, void *user_data);
+
+// 以會話當前的 branch/CSeq 發送 INVITE 並建立事務 (auth_header 可為空字串)
+static int send_invite(sip_session_t *session, const char *auth_header) {
+    struct iovec iov[SIP_TPL_MAX_SEGMENTS];
+    const char *values[SIP_TPL_FIELD_COUNT] = { 0 };
+
+    values[SIP_TPL_BRANCH] = session->branch;
+    values[SIP_TPL_CSEQ] = session->cseq;
+    values[SIP_TPL_AUTH] = auth_header;
+    int iovcnt = sip_template_iov(&session->invite_tpl, values, iov, SIP_TPL_MAX_SEGMENTS, NULL);
+    if (iovcnt < 0) {
+        log_with_timestamp("錯誤: 無法以模板產生 INVITE 請求\n");
+        return -1;
+    }
+
+    session->invite_txn = sip_txn_client_start_iov(session->sockfd, &session->servaddr, "INVITE",
+                                                   session->branch, iov, iovcnt,
+                                                   on_invite_event, session);
+    if (!session->invite_txn) return -1;
+    log_with_timestamp("發送 INVITE 請求 (%d 字節，CSeq %s)\n", session->invite_txn->request_len, session->cseq);
+
+    // 還有未嘗試的網關時，限時等待第一個回應
+    session->invite_sent_us = sip_now_us();
+    session->invite_responded = 0;
+    session->phases_seen = 0;
+    if (session->gateway_attempts < SIP_MAX_GATEWAY_ATTEMPTS &&
+        session->gateway_attempts < sip_gateway_count()) {
+        sip_timer_start(&session->failover_timer, sip_config()->gateway_failover_ms);
+    }
+    return 0;
+}
+
+// 不再經由目前的網關進行呼叫：釋放其同時通話數
+static void release_gateway(sip_session_t *session) {
+    if (!session->gateway_held) return;
+    sip_gateway_call_end(&session->servaddr);
+    session->gateway_held = 0;
+}
+
+// 呼叫流程結束，回報結果
+static void finish_call(sip_session_t *session, int status_code) {
+    sip_call_callback_t callback = session->on_call_result;
+    void *user_data = session->call_user_data;
+
+    sip_timer_stop(&session->answer_timer);
+    sip_timer_stop(&session->failover_timer);
+    // 接通的通話在結束 (BYE、放棄或關閉會話) 前持續佔用網關的名額
+    if (status_code < 200 || status_code >= 300) {
+        release_gateway(session);
+    }
+    session->invite_txn = NULL;
+    session->on_call_result = NULL;
+    session->on_call_progress = NULL;
+    session->call_user_data = NULL;
+
+    log_with_timestamp("SIP 呼叫結果: 狀態碼 %d，通話建立: %s\n",
+                     status_code, session->call_established ? "是" : "否");
+    if (callback) {
+        callback(session, status_code, user_data);
+    }
+}
+
+static void send_cancel(sip_session_t *session) {
+    char buffer[BUF_SIZE];
+    int len = sip_txn_build_cancel(session->invite_txn, buffer, sizeof(buffer));
+    if (len < 0) {
+        log_with_timestamp("錯誤: 無法產生 CANCEL 請求\n");
+        return;
+    }
+
+    log_with_timestamp("發送 CANCEL 請求 (%d 字節)\n", len);
+    sip_txn_client_start(session->sockfd, &session->servaddr, buffer, len, NULL, NULL);
+    session->cancel_state = 2;
+    // 等待 487 的時間上限，超過則放棄 INVITE 事務
+    sip_timer_start(&session->answer_timer, 64 * SIP_T1_MS);
+}
+
+// INVITE 的 Request-URI，也是摘要認證的 digest-uri (uri_size 須能容納最長的被叫與主機，不可截斷)
+static void invite_uri(const sip_session_t *session, char *uri, size_t uri_size) {
+    snprintf(uri, uri_size, "sip:%s@%s", session->callee, sip_session_host(session));
+}
+
+// 處理帶認證的重新 INVITE：以挑戰更新憑證快取後重新發送
+static int send_auth_invite(sip_session_t *session, int status_code, const sip_msg_t *msg) {
+    char auth_header[1024];
+    char uri[sizeof(session->callee) + sizeof(session->route_host) + 8];   // "sip:被叫@主機"
+
+    if (sip_auth_handle_challenge(&session->servaddr, status_code, msg) != 0) {
+        return -1;
+    }
+    invite_uri(session, uri, sizeof(uri));
+    if (sip_auth_build_header(&session->servaddr, "INVITE", uri, 0, auth_header, sizeof(auth_header)) <= 0) {
+        log_with_timestamp("錯誤: 無法產生認證標頭\n");
         return -1;
     }
-    
-    log_with_timestamp("成功發送 %zd 字節\n", sent_bytes);
-    log_with_timestamp("等待 SIP 回應...\n");
-    
-    // 用於接收的循環
-    int timeout_count = 0;
-    
-    // 直接嘗試接收回應
-    while (timeout_count < 30) {  // 增加到30次嘗試
-        memset(recvbuf, 0, BUF_SIZE);
-        socklen_t recv_len = sizeof(recv_addr);
-        
-        // 使用較短的超時(500ms)多次檢查
-        int n = recv_with_timeout(session->sockfd, recvbuf, BUF_SIZE-1, 
-                               (struct sockaddr *)&recv_addr, &recv_len, 500);
-        
-        if (n > 0) {
-            // 成功接收
-            recvbuf[n] = 0;
-            char recv_ip[INET_ADDRSTRLEN];
-            inet_ntop(AF_INET, &(recv_addr.sin_addr), recv_ip, INET_ADDRSTRLEN);
-            
-            log_with_timestamp("收到資料 (%d 字節) 來自 %s:%d:\n%s\n", 
-                            n, recv_ip, ntohs(recv_addr.sin_port), recvbuf);
-            
-            // 解析回應狀態碼
-            int status_code = parse_sip_status_code(recvbuf);
-            log_with_timestamp("SIP 回應狀態碼: %d\n", status_code);
-            
-            // 解析 SIP 訊息頭
-            parse_sip_headers(recvbuf);
-            
-            // 根據狀態碼處理回應
-            if (status_code == 100) {
-                log_with_timestamp("收到 100 Trying\n");
-                received_100 = 1;
-            } else if (status_code == 183) {
-                log_with_timestamp("收到 183 Session Progress\n");
-                received_183 = 1;
-                
-                // 提取 To tag 以備後用
-                if (extract_to_tag(recvbuf, session->to_tag, sizeof(session->to_tag))) {
-                    log_with_timestamp("提取到 To tag: %s\n", session->to_tag);
-                }
-            } else if (status_code == 200) {
-                log_with_timestamp("收到 200 OK\n");
-                received_200 = 1;
-                
-                // 提取 To tag (如果尚未提取)
-                if (session->to_tag[0] == '\0' && extract_to_tag(recvbuf, session->to_tag, sizeof(session->to_tag))) {
-                    log_with_timestamp("提取到 To tag: %s\n", session->to_tag);
-                }
-                
-                // 解析 SDP 訊息
-                const char *sdp_start = strstr(recvbuf, "\r\n\r\n");
-                if (sdp_start) {
-                    sdp_start += 4;  // 跳過 \r\n\r\n
-                    log_with_timestamp("SDP 內容:\n%s\n", sdp_start);
-                    
-                    // 解析媒體端口
-                    const char *m_line = strstr(sdp_start, "m=audio ");
-                    if (m_line) {
-                        sscanf(m_line, "m=audio %d", &session->remote_rtp_port);
-                        log_with_timestamp("解析到 RTP 端口: %d\n", session->remote_rtp_port);
-                    } else {
-                        log_with_timestamp("找不到音頻媒體行\n");
-                    }
-                }
-                
-                // 發送 ACK
-                char new_branch[64];
-                snprintf(new_branch, sizeof(new_branch), "z9hG4bK%08x", (unsigned int)time(NULL) + 2);
-                send_ack(session->sockfd, &session->servaddr, session->callid, session->tag, 
-                        new_branch, session->to_tag, session->cseq);
-                
-                session->call_established = 1;
-                
-                // 收到 200 OK 並發送 ACK 後，可以退出接收循環
-                break;
-                
-            } else if (status_code == 401 || status_code == 407) {
-                log_with_timestamp("收到認證請求: %d\n", status_code);
-                parse_nonce_realm(recvbuf, nonce, realm);
-                
-                if (strlen(nonce) == 0 || strlen(realm) == 0) {
-                    log_with_timestamp("認證資訊解析失敗\n");
-                    return -1;
-                }
-                
-                char uri[128];
-                snprintf(uri, sizeof(uri), "sip:%s@%s", callee, SIP_SERVER);
-                log_with_timestamp("準備帶認證的 INVITE 請求\n");
-                
-                make_digest_response(USERNAME, realm, PASSWORD, "INVITE", uri, nonce, response);
-                
-                snprintf(auth_header, sizeof(auth_header),
-                    "Authorization: Digest username=\"%s\", realm=\"%s\", nonce=\"%s\", uri=\"%s\", response=\"%s\"\r\n",
-                    USERNAME, realm, nonce, uri, response);
-                
-                log_with_timestamp("認證標頭: %s", auth_header);
-                
-                // 生成新的分支參數
-                snprintf(session->branch, sizeof(session->branch), "z9hG4bK%08x", (unsigned int)time(NULL)+1);
-                log_with_timestamp("新分支參數: %s\n", session->branch);
-                
-                // 構建帶認證的 INVITE 請求
-                snprintf(buffer, BUF_SIZE,
-                    "INVITE sip:%s@%s SIP/2.0\r\n"
-                    "Via: SIP/2.0/UDP %s:%d;branch=%s\r\n"
-                    "Max-Forwards: 70\r\n"
-                    "From: <sip:%s@%s>;tag=%s\r\n"
-                    "To: <sip:%s@%s>\r\n"
-                    "Contact: <sip:%s@%s:%d>\r\n"
-                    "Call-ID: %s\r\n"
-                    "CSeq: %s INVITE\r\n"
-                    "User-Agent: Custom SIP Client\r\n"
-                    "%s"
-                    "Content-Type: application/sdp\r\n"
-                    "Content-Length: %d\r\n"
-                    "\r\n"
-                    "%s",
-                    callee, SIP_SERVER,
-                    LOCAL_IP, LOCAL_PORT, session->branch,
-                    CALLER, SIP_SERVER, session->tag,
-                    callee, SIP_SERVER,
-                    CALLER, LOCAL_IP, LOCAL_PORT,
-                    session->callid,
-                    session->cseq,
-                    auth_header,
-                    sdp_len,
-                    sdp
-                );
-                
-                log_with_timestamp("發送帶認證的 INVITE 請求 (%lu 字節):\n%s\n", strlen(buffer), buffer);
-                
-                // 清空接收緩衝區
-                flush_socket(session->sockfd);
-                
-                sent_bytes = sendto(session->sockfd, buffer, strlen(buffer), 0, 
-                                 (struct sockaddr *)&session->servaddr, sizeof(session->servaddr));
-                
-                if (sent_bytes < 0) {
-                    log_with_timestamp("錯誤: 發送認證 INVITE 失敗\n");
-                    return -1;
-                }
-                
-                log_with_timestamp("成功發送認證 INVITE: %zd 字節\n", sent_bytes);
-                
-            } else if (status_code == 403) {
-                log_with_timestamp("權限被拒絕: 403 Forbidden\n");
-                return -1;
-            } else {
-                log_with_timestamp("收到其他狀態碼: %d\n", status_code);
+    log_with_timestamp("認證標頭: %s", auth_header);
+
+    // 新的事務：新的 branch 與遞增的 CSeq
+    get_branch(session->branch, sizeof(session->branch));
+    snprintf(session->cseq, sizeof(session->cseq), "%d", atoi(session->cseq) + 1);
+    session->auth_attempted = 1;
+    if (send_invite(session, auth_header) != 0) {
+        return -1;
+    }
+    sip_metrics_record_since(SIP_PHASE_REINVITE, session->challenge_us);
+    return 0;
+}
+
+// 以回應的 SDP answer 協商媒體：返回 0 表示成功，-1 表示沒有音頻 SDP，-2 表示無法接受 (沒有共同編碼或媒體被拒絕)
+static int apply_remote_sdp(sip_session_t *session, const sip_msg_t *msg) {
+    sip_sdp_t answer;
+
+    if (msg->body.len == 0 || sip_sdp_parse(msg->buf + msg->body.off, msg->body.len, &answer) != 0) {
+        return -1;
+    }
+    // 沒有 c= 行時媒體與信令走同一地址
+    if (sip_sdp_negotiate(&answer, &session->servaddr.sin_addr, RTP_PACKET_SIZE / 8, &session->media) != 0) {
+        return -2;
+    }
+    return 0;
+}
+
+// 處理 2xx：提取對話資訊並發送 ACK；對話無法進行時返回結束通話的狀態碼 (ACK 已發送，由調用者以 BYE 結束)：
+// 路由集合超出容量為 500，SDP answer 無法接受為 488
+static int handle_invite_success(sip_session_t *session, const sip_msg_t *msg) {
+    uint64_t answered_us = sip_now_us();
+
+    sip_auth_update_from_response(&session->servaddr, msg);
+
+    // 2xx 的 To tag 即為對話的遠端 tag
+    if (sip_msg_header_param(msg, SIP_HDR_TO, "tag", session->to_tag, sizeof(session->to_tag)) == 0) {
+        log_with_timestamp("提取到 To tag: %s\n", session->to_tag);
+    }
+    // 對話內的 ACK/BYE 發往對方的 Contact，並帶上 Record-Route 建立的路由
+    int route_ok = sip_session_set_route(session, msg) == 0;
+
+    // 2xx 的 SDP 為最終的媒體描述；沒有 SDP 時沿用早期媒體協商的結果
+    int sdp_result = apply_remote_sdp(session, msg);
+    if (sdp_result == -1 && !session->early_media) {
+        log_with_timestamp("找不到音頻媒體行，使用默認媒體描述\n");
+        session->media.remote_addr = session->servaddr.sin_addr;
+    }
+
+    // 2xx 的 ACK 是獨立的事務，使用新的 branch (即使 SDP 無法接受也必須 ACK，之後以 BYE 結束)
+    char ack_branch[64];
+    get_branch(ack_branch, sizeof(ack_branch));
+    sip_session_send_ack(session, ack_branch);
+    sip_metrics_record_since(SIP_PHASE_ACK, answered_us);
+    if (!route_ok) {
+        log_with_timestamp("無法建立對話的路由，發送 BYE\n");
+        return 500;
+    }
+    if (sdp_result == -2) {
+        // RFC 3264 6.1：answer 沒有可用的媒體，通話無法進行
+        log_with_timestamp("對方的 SDP answer 無法接受，發送 BYE\n");
+        return 488;
+    }
+    sip_metrics_expect_rtp(session->local_rtp_port, sip_now_us());
+    return 0;
+}
+
+// 選擇本次嘗試的網關，作為 INVITE 與後續對話內請求的目的地
+static int select_gateway(sip_session_t *session) {
+    struct sockaddr_in addr;
+    char host[64];
+
+    if (session->gateway_attempts >= SIP_MAX_GATEWAY_ATTEMPTS ||
+        sip_gateway_select(session->tried_gateways, session->gateway_attempts,
+                           &addr, host, sizeof(host)) != 0) {
+        return -1;
+    }
+    release_gateway(session);
+    session->servaddr = addr;
+    snprintf(session->route_host, sizeof(session->route_host), "%s", host);
+    session->tried_gateways[session->gateway_attempts++] = addr;
+    sip_gateway_call_begin(&addr);
+    session->gateway_held = 1;
+    return 0;
+}
+
+// 經由目前選定的網關發送 INVITE：模板依網關主機重新編譯
+static int start_attempt(sip_session_t *session) {
+    char auth_header[1024];
+    char uri[sizeof(session->callee) + sizeof(session->route_host) + 8];   // "sip:被叫@主機"
+
+    // 快取中有支援 qop=auth 的 nonce 時直接帶上認證，省去一次 401/407 往返
+    invite_uri(session, uri, sizeof(uri));
+    if (sip_auth_build_header(&session->servaddr, "INVITE", uri, 1, auth_header, sizeof(auth_header)) > 0) {
+        log_with_timestamp("以快取的憑證預先認證 INVITE\n");
+    } else {
+        auth_header[0] = '\0';
+    }
+
+    if (compile_invite_template(session) != 0 || sip_session_compile_templates(session) != 0) {
+        return -1;
+    }
+    return send_invite(session, auth_header);
+}
+
+// 5xx 與逾時表示網關故障，改用其他網關；其他最終回應 (含 4xx/6xx) 代表被叫端的結果
+static int is_gateway_failure(int status_code) {
+    return status_code == 408 || (status_code >= 500 && status_code < 600);
+}
+
+// 經由下一個網關重新發送 INVITE (新的事務：新的 branch 與遞增的 CSeq)
+static int failover_invite(sip_session_t *session) {
+    char failed[sizeof(session->route_host) + 8];   // 主機 + ":" + 端口
+
+    if (session->cancel_state != 0) return -1;
+    snprintf(failed, sizeof(failed), "%s:%d", session->route_host, ntohs(session->servaddr.sin_port));
+    if (select_gateway(session) != 0) {
+        log_with_timestamp("沒有其他可嘗試的網關\n");
+        return -1;
+    }
+    log_with_timestamp("網關 %s 故障，改經由 %s:%d 重新發送 INVITE (第 %d 次嘗試)\n",
+                     failed, session->route_host, ntohs(session->servaddr.sin_port), session->gateway_attempts);
+
+    get_branch(session->branch, sizeof(session->branch));
+    snprintf(session->cseq, sizeof(session->cseq), "%d", atoi(session->cseq) + 1);
+    session->auth_attempted = 0;
+    session->early_media = 0;
+    session->to_tag[0] = '\0';
+    return start_attempt(session);
+}
+
+// 已放棄的 INVITE 事務：網關稍後才回應臨時回應時以 CANCEL 結束，避免被叫端在兩個網關同時振鈴
+static void on_abandoned_invite(sip_transaction_t *txn, int status_code, const sip_msg_t *msg, void *user_data) {
+    char buffer[BUF_SIZE];
+    (void)msg;
+    (void)user_data;
+
+    if (status_code >= 200) {
+        if (status_code < 300) {
+            log_with_timestamp("警告: 已放棄的網關 %s:%d 接聽了呼叫，對方將因缺少 ACK 而結束通話\n",
+                             inet_ntoa(txn->dest.sin_addr), ntohs(txn->dest.sin_port));
+        }
+        return;
+    }
+    int len = sip_txn_build_cancel(txn, buffer, sizeof(buffer));
+    if (len > 0) {
+        log_with_timestamp("已放棄的網關 %s:%d 回應 %d，發送 CANCEL\n",
+                         inet_ntoa(txn->dest.sin_addr), ntohs(txn->dest.sin_port), status_code);
+        sip_txn_client_start(txn->sockfd, &txn->dest, buffer, len, NULL, NULL);
+    }
+    sip_txn_detach(txn);
+}
+
+// 記錄目前 INVITE 的一個階段 (同一個 INVITE 的重複回應只記錄第一次)
+static void record_phase(sip_session_t *session, sip_phase_t phase, uint64_t since_us) {
+    if (session->phases_seen & (1u << phase)) return;
+    session->phases_seen |= 1u << phase;
+    sip_metrics_record_since(phase, since_us);
+}
+
+// INVITE 事務事件
+static void on_invite_event(sip_transaction_t *txn, int status_code, const sip_msg_t *msg, void *user_data) {
+    sip_session_t *session = (sip_session_t *)user_data;
+    (void)txn;
+
+    // 第一個回應的延遲即網關處理 INVITE 的延遲；之後只回報故障
+    if (!session->invite_responded) {
+        session->invite_responded = 1;
+        sip_timer_stop(&session->failover_timer);
+        sip_gateway_report(&session->servaddr, status_code,
+                           msg ? (int)((sip_now_us() - session->invite_sent_us) / 1000) : -1);
+    } else if (is_gateway_failure(status_code)) {
+        sip_gateway_report(&session->servaddr, status_code, -1);
+    }
+
+    // 逾時與傳送失敗沒有對應的回應，不計入階段延遲
+    if (msg) {
+        if (status_code == 100) {
+            record_phase(session, SIP_PHASE_TRYING, session->invite_sent_us);
+        } else if (status_code == 183) {
+            record_phase(session, SIP_PHASE_PROGRESS, session->invite_sent_us);
+        } else if (status_code == 401 || status_code == 407) {
+            record_phase(session, SIP_PHASE_CHALLENGE, session->invite_sent_us);
+            session->challenge_us = sip_now_us();
+        } else if (status_code >= 200 && status_code < 300) {
+            record_phase(session, SIP_PHASE_ANSWER, session->invite_sent_us);
+            sip_metrics_record_since(SIP_PHASE_SETUP, session->setup_start_us);
+        }
+    }
+
+    if (status_code < 200) {
+        log_with_timestamp("收到臨時回應: %d\n", status_code);
+        if (status_code == 183 &&
+            sip_msg_header_param(msg, SIP_HDR_TO, "tag", session->to_tag, sizeof(session->to_tag)) == 0) {
+            log_with_timestamp("提取到 To tag: %s\n", session->to_tag);
+        }
+        if (session->cancel_state == 1) {
+            send_cancel(session);
+        }
+        // 帶 SDP 的 18x：對方開始送回鈴音或提示音，RTP 接收器已在 INVITE 前啟動，通知應用層立即處理
+        if (msg && status_code > 100 && session->cancel_state == 0 && apply_remote_sdp(session, msg) == 0) {
+            if (!session->early_media) {
+                log_with_timestamp("收到 %d 早期媒體，對方 RTP %s:%d\n", status_code,
+                                 inet_ntoa(session->media.remote_addr), session->media.remote_port);
+            }
+            session->early_media = 1;
+            // 回調中可能銷毀對話，之後不可再存取 session
+            if (session->on_call_progress) {
+                session->on_call_progress(session, status_code, session->call_user_data);
             }
-            
-            // 重置超時計數
-            timeout_count = 0;
-            
-        } else if (n == 0) {
-            // 超時，無數據可讀
-            timeout_count++;
-            log_with_timestamp("接收超時 (%d/30)\n", timeout_count);
+        }
+        return;
+    }
+
+    // 最終回應後事務即將釋放
+    session->invite_txn = NULL;
+
+    if (status_code < 300) {
+        log_with_timestamp("收到 %d OK\n", status_code);
+        int failure = handle_invite_success(session, msg);
+        if (session->cancel_state != 0) {
+            // CANCEL 與 200 OK 交錯：通話已建立，立即以 BYE 結束
+            log_with_timestamp("呼叫已取消但對方已接聽，發送 BYE\n");
+            sip_session_bye_async(session, NULL, NULL);
+            finish_call(session, 487);
+            return;
+        }
+        if (failure) {
+            sip_session_bye_async(session, NULL, NULL);
+            finish_call(session, failure);
+            return;
+        }
+        session->call_established = 1;
+        finish_call(session, status_code);
+    } else if ((status_code == 401 || status_code == 407) && !session->auth_attempted && msg) {
+        log_with_timestamp("收到認證請求: %d\n", status_code);
+        if (send_auth_invite(session, status_code, msg) != 0) {
+            finish_call(session, status_code);
+        }
+    } else if (is_gateway_failure(status_code) && failover_invite(session) == 0) {
+        return;
+    } else {
+        if (status_code == 401 || status_code == 407) {
+            // 以新挑戰計算的憑證仍被拒絕：不再預先使用快取
+            log_with_timestamp("認證失敗: %d\n", status_code);
+            sip_auth_invalidate(&session->servaddr);
+        } else if (status_code == 403) {
+            log_with_timestamp("權限被拒絕: 403 Forbidden\n");
         } else {
-            // 接收錯誤
-            log_with_timestamp("接收錯誤: %s\n", strerror(errno));
-            break;
+            log_with_timestamp("呼叫失敗，狀態碼: %d\n", status_code);
         }
+        finish_call(session, status_code);
+    }
+}
+
+// 無應答逾時；CANCEL 後仍無 487 時放棄 INVITE 事務
+static void on_answer_timeout(void *arg) {
+    sip_session_t *session = (sip_session_t *)arg;
+
+    if (!session->invite_txn) return;
+    if (session->cancel_state == 2) {
+        log_with_timestamp("CANCEL 後未收到最終回應，放棄呼叫\n");
+        sip_txn_detach(session->invite_txn);
+        finish_call(session, 408);
+        return;
+    }
+    log_with_timestamp("呼叫 %s 無應答 (%d ms)，取消呼叫\n", session->callee, SIP_NO_ANSWER_TIMEOUT_MS);
+    sip_call_cancel(session);
+}
+
+// 網關在限定時間內沒有任何回應：放棄該事務並改用下一個網關
+static void on_failover_timeout(void *arg) {
+    sip_session_t *session = (sip_session_t *)arg;
+
+    if (!session->invite_txn || session->invite_responded || session->cancel_state != 0) return;
+    log_with_timestamp("網關 %s:%d 在 %d ms 內沒有回應\n", session->route_host,
+                     ntohs(session->servaddr.sin_port), sip_config()->gateway_failover_ms);
+    sip_gateway_report(&session->servaddr, 408, -1);
+
+    sip_transaction_t *txn = session->invite_txn;
+    txn->callback = on_abandoned_invite;
+    txn->user_data = NULL;
+    session->invite_txn = NULL;
+    if (failover_invite(session) != 0) {
+        finish_call(session, 408);
+    }
+}
+
+// 非阻塞發起SIP呼叫 (須在事件循環線程中調用)；結果經由 callback 回報
+// 調用前設置 session->on_call_progress 可在收到帶 SDP 的臨時回應時得到通知
+int sip_call_start(sip_session_t *session, const char *callee, sip_call_callback_t callback, void *user_data) {
+    if (!session || session->sockfd < 0 || session->invite_txn) return -1;
+
+    log_with_timestamp("準備發起SIP呼叫到 %s\n", callee);
+
+    snprintf(session->callee, sizeof(session->callee), "%s", callee);
+    session->auth_attempted = 0;
+    session->cancel_state = 0;
+    session->call_established = 0;
+    session->early_media = 0;
+    session->sdp_version = 0;
+    session->remote_cseq = 0;
+    session->remote_bye = 0;
+    session->offer_pending = 0;
+    session->to_tag[0] = '\0';
+    session->remote_target[0] = '\0';
+    session->route_set[0] = '\0';
+    session->on_call_result = callback;
+    session->call_user_data = user_data;
+    // 沒有進行中的呼叫時計時器必定未啟動，可安全重新初始化
+    sip_timer_init(&session->answer_timer, on_answer_timeout, session);
+    sip_timer_init(&session->failover_timer, on_failover_timeout, session);
+
+    session->setup_start_us = sip_now_us();
+    sip_metrics_expect_rtp(session->local_rtp_port, 0);
+
+    session->gateway_attempts = 0;
+    release_gateway(session);
+    if (select_gateway(session) != 0) {
+        log_with_timestamp("錯誤: 沒有可用的網關\n");
+        session->on_call_result = NULL;
+        return -1;
+    }
+
+    if (start_attempt(session) != 0) {
+        release_gateway(session);
+        session->on_call_result = NULL;
+        return -1;
+    }
+    sip_timer_start(&session->answer_timer, SIP_NO_ANSWER_TIMEOUT_MS);
+    return 0;
+}
+
+// 取消進行中的呼叫 (須在事件循環線程中調用)
+void sip_call_cancel(sip_session_t *session) {
+    if (!session || !session->invite_txn || session->cancel_state != 0) return;
+
+    if (session->invite_txn->state == TXN_PROCEEDING) {
+        send_cancel(session);
+    } else {
+        // RFC 3261 9.1：收到臨時回應前不可發送 CANCEL
+        session->cancel_state = 1;
+    }
+}
+
+// 放棄呼叫與 BYE 流程，不再回報結果 (須在事件循環線程中調用)
+void sip_call_abandon(sip_session_t *session) {
+    if (!session) return;
+    sip_timer_stop(&session->answer_timer);
+    sip_timer_stop(&session->failover_timer);
+    if (session->invite_txn) {
+        sip_txn_detach(session->invite_txn);
+        session->invite_txn = NULL;
+    }
+    if (session->bye_txn) {
+        sip_txn_detach(session->bye_txn);
+        session->bye_txn = NULL;
+    }
+    session->on_call_result = NULL;
+    session->on_call_progress = NULL;
+    session->call_user_data = NULL;
+    session->on_bye_done = NULL;
+    session->bye_user_data = NULL;
+    release_gateway(session);
+}
+
+static void release_gateway_task(void *arg) {
+    release_gateway((sip_session_t *)arg);
+}
+
+// 通話結束：釋放網關的同時通話數 (可從任意線程調用)
+void sip_call_release_gateway(sip_session_t *session) {
+    if (!session || !session->gateway_held) return;
+    sip_reactor_run_sync(release_gateway_task, session);
+}
+
+// ---- 阻塞式介面 ----
+
+typedef struct {
+    sip_session_t *session;
+    const char *callee;
+    int status_code;
+    int done;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} blocking_call_t;
+
+static void blocking_call_done(sip_session_t *session, int status_code, void *user_data) {
+    blocking_call_t *call = (blocking_call_t *)user_data;
+    (void)session;
+
+    pthread_mutex_lock(&call->lock);
+    call->status_code = status_code;
+    call->done = 1;
+    pthread_cond_signal(&call->cond);
+    pthread_mutex_unlock(&call->lock);
+}
+
+static void blocking_call_start(void *arg) {
+    blocking_call_t *call = (blocking_call_t *)arg;
+    if (sip_call_start(call->session, call->callee, blocking_call_done, call) != 0) {
+        blocking_call_done(call->session, 503, call);
+    }
+}
+
+// 發起SIP呼叫並等待結果 (不可在事件循環線程中調用)
+int make_sip_call(sip_session_t *session, const char *callee) {
+    if (!session || session->sockfd < 0) return -1;
+
+    if (sip_reactor_in_thread()) {
+        log_with_timestamp("錯誤: make_sip_call 不可在事件循環線程中調用，請使用 sip_call_start\n");
+        return -1;
     }
-    
-    // 總結會話狀態
-    log_with_timestamp("SIP 呼叫結果:\n");
-    log_with_timestamp("  - 接收到 100 Trying: %s\n", received_100 ? "是" : "否");
-    log_with_timestamp("  - 接收到 183 Session Progress: %s\n", received_183 ? "是" : "否");
-    log_with_timestamp("  - 接收到 200 OK: %s\n", received_200 ? "是" : "否");
-    log_with_timestamp("  - 通話建立: %s\n", session->call_established ? "是" : "否");
-    
+    if (sip_txn_attach_socket(session->sockfd) != 0) {
+        return -1;
+    }
+
+    blocking_call_t call = { session, callee, 0, 0, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
+    if (sip_reactor_post(blocking_call_start, &call) != 0) {
+        log_with_timestamp("錯誤: 無法投遞呼叫任務到事件循環\n");
+        return -1;
+    }
+
+    pthread_mutex_lock(&call.lock);
+    while (!call.done) {
+        pthread_cond_wait(&call.cond, &call.lock);
+    }
+    pthread_mutex_unlock(&call.lock);
+
     return session->call_established ? 0 : -1;
-} 
\ No newline at end of file
+}
@@ -1,5 +1,7 @@
 // sip_client.c - 實現SIP客戶端核心功能
 #include "sip_client.h"
+#include "sip_parser.h"
+#include "sip_id.h"
 
 // 日誌函數
 void log_with_timestamp(const char *format, ...) {
@@ -22,10 +24,18 @@ void log_with_timestamp(const char *format, ...) {
 
 // MD5 摘要函數
 void md5(const char *str, char *output) {
-    unsigned char digest[MD5_DIGEST_LENGTH];
-    MD5((unsigned char*)str, strlen(str), digest);
-    for (int i = 0; i < MD5_DIGEST_LENGTH; i++)
-        sprintf(&output[i*2], "%02x", (unsigned int)digest[i]);
+    static const char hex[] = "0123456789abcdef";
+    unsigned char digest[EVP_MAX_MD_SIZE];
+    unsigned int digest_len = 0;
+
+    if (EVP_Digest(str, strlen(str), digest, &digest_len, EVP_md5(), NULL) != 1 || digest_len != 16) {
+        output[0] = 0;
+        return;
+    }
+    for (unsigned int i = 0; i < digest_len; i++) {
+        output[i*2] = hex[digest[i] >> 4];
+        output[i*2 + 1] = hex[digest[i] & 0x0f];
+    }
     output[32] = 0;
 }
 
@@ -56,70 +66,68 @@ void make_digest_response(
     log_with_timestamp("  - 摘要結果: %s\n", res);
 }
 
-// 解析nonce和realm值
+// 解析nonce和realm值 (nonce/realm 緩衝區至少 256 字節)
 void parse_nonce_realm(const char *msg, char *nonce, char *realm) {
-    char *p, *q;
-    p = strstr(msg, "nonce=\"");
-    if (p) {
-        p += 7;
-        q = strchr(p, '"');
-        if (q) {
-            strncpy(nonce, p, q-p);
-            nonce[q-p] = 0;
-            log_with_timestamp("解析到 nonce: %s\n", nonce);
-        } else {
-            log_with_timestamp("解析 nonce 失敗: 找不到結束引號\n");
-        }
+    sip_msg_t parsed;
+    const sip_header_t *auth = NULL;
+    sip_slice_t value;
+    
+    if (sip_parse_message(msg, strlen(msg), &parsed) == 0) {
+        auth = sip_msg_header(&parsed, SIP_HDR_WWW_AUTHENTICATE);
+        if (!auth) auth = sip_msg_header(&parsed, SIP_HDR_PROXY_AUTHENTICATE);
+    }
+    if (!auth) {
+        log_with_timestamp("解析認證資訊失敗: 找不到 WWW-Authenticate/Proxy-Authenticate 標頭\n");
+        return;
+    }
+    
+    if (sip_header_param(&parsed, auth, "nonce", &value) == 0 && sip_slice_copy(&parsed, value, nonce, 256) == 0) {
+        log_with_timestamp("解析到 nonce: %s\n", nonce);
     } else {
         log_with_timestamp("解析 nonce 失敗: 找不到 nonce 欄位\n");
     }
     
-    p = strstr(msg, "realm=\"");
-    if (p) {
-        p += 7;
-        q = strchr(p, '"');
-        if (q) {
-            strncpy(realm, p, q-p);
-            realm[q-p] = 0;
-            log_with_timestamp("解析到 realm: %s\n", realm);
-        } else {
-            log_with_timestamp("解析 realm 失敗: 找不到結束引號\n");
-        }
+    if (sip_header_param(&parsed, auth, "realm", &value) == 0 && sip_slice_copy(&parsed, value, realm, 256) == 0) {
+        log_with_timestamp("解析到 realm: %s\n", realm);
     } else {
         log_with_timestamp("解析 realm 失敗: 找不到 realm 欄位\n");
     }
 }
 
-// 生成tag
+// 生成tag (64 位元隨機數)
 void get_tag(char *tag, size_t len) {
-    snprintf(tag, len, "%08x", (unsigned int)time(NULL));
+    sip_id_tag(tag, len);
 }
 
-// 生成call-id
+// 生成call-id (96 位元隨機數，同一秒內發起的呼叫也不會重複)
 void get_callid(char *callid, size_t len) {
-    snprintf(callid, len, "%08x@%s", (unsigned int)time(NULL), SIP_SERVER);
+    sip_id_callid(callid, len, SIP_SERVER);
+}
+
+// 產生 branch 參數：事務以 branch 識別，magic cookie 之後為 96 位元隨機數
+void get_branch(char *branch, size_t len) {
+    sip_id_branch(branch, len);
 }
 
 // 解析SIP消息頭
 void parse_sip_headers(const char *msg) {
-    char header[256];
-    const char *headers[] = {"Via:", "From:", "To:", "Call-ID:", "CSeq:", "Contact:", "User-Agent:", "Content-Type:", "Content-Length:"};
-    int header_count = sizeof(headers) / sizeof(headers[0]);
+    static const sip_header_id_t logged[] = {
+        SIP_HDR_VIA, SIP_HDR_FROM, SIP_HDR_TO, SIP_HDR_CALL_ID, SIP_HDR_CSEQ,
+        SIP_HDR_CONTACT, SIP_HDR_USER_AGENT, SIP_HDR_CONTENT_TYPE, SIP_HDR_CONTENT_LENGTH
+    };
+    sip_msg_t parsed;
+    
+    if (sip_parse_message(msg, strlen(msg), &parsed) != 0) {
+        log_with_timestamp("SIP 訊息格式錯誤，無法解析訊息頭\n");
+        return;
+    }
     
     log_with_timestamp("解析 SIP 訊息頭:\n");
-    
-    for (int i = 0; i < header_count; i++) {
-        const char *p = strstr(msg, headers[i]);
-        if (p) {
-            const char *eol = strstr(p, "\r\n");
-            if (eol) {
-                int len = eol - p;
-                if (len < sizeof(header) - 1) {
-                    strncpy(header, p, len);
-                    header[len] = '\0';
-                    log_with_timestamp("  %s\n", header);
-                }
-            }
+    for (size_t i = 0; i < sizeof(logged) / sizeof(logged[0]); i++) {
+        const sip_header_t *hdr = sip_msg_header(&parsed, logged[i]);
+        if (hdr) {
+            log_with_timestamp("  %.*s: %.*s\n", hdr->name.len, msg + hdr->name.off,
+                             hdr->value.len, msg + hdr->value.off);
         }
     }
 }
@@ -135,23 +143,10 @@ int parse_sip_status_code(const char *msg) {
 
 // 提取To標籤
 char* extract_to_tag(const char *msg, char *tag_buf, size_t buf_size) {
-    char *to_header = strstr(msg, "To:");
-    if (to_header) {
-        char *tag_start = strstr(to_header, "tag=");
-        if (tag_start) {
-            tag_start += 4;  // 跳過 "tag="
-            char *tag_end = strpbrk(tag_start, "\r\n;>");
-            if (tag_end) {
-                size_t tag_len = tag_end - tag_start;
-                if (tag_len < buf_size - 1) {
-                    strncpy(tag_buf, tag_start, tag_len);
-                    tag_buf[tag_len] = '\0';
-                    return tag_buf;
-                }
-            }
-        }
-    }
-    return NULL;
+    sip_msg_t parsed;
+    if (sip_parse_message(msg, strlen(msg), &parsed) != 0) return NULL;
+    if (sip_msg_header_param(&parsed, SIP_HDR_TO, "tag", tag_buf, buf_size) != 0) return NULL;
+    return tag_buf[0] ? tag_buf : NULL;
 }
 
 // 帶超時的接收函數
@@ -197,20 +192,49 @@ void flush_socket(int sockfd) {
 
 // 函數：解析SIP訊息中的RTP端口
 int parse_rtp_port(const char *msg) {
-    char *sdp_start = strstr(msg, "\r\n\r\n");
-    if (!sdp_start) return 0;
-    
-    sdp_start += 4; // 跳過分隔符
-    
-    // 尋找媒體描述行 (m=audio)
-    char *m_audio = strstr(sdp_start, "m=audio ");
-    if (!m_audio) return 0;
-    
-    // 解析端口號
-    int port = 0;
-    if (sscanf(m_audio, "m=audio %d", &port) != 1) {
-        return 0;
-    }
-    
-    return port;
-} 
\ No newline at end of file
+    sip_msg_t parsed;
+    if (sip_parse_message(msg, strlen(msg), &parsed) != 0) return 0;
+    return sip_msg_sdp_audio_port(&parsed);
+}
+
+// 提取標頭的完整值 (去除前後空白；compact 為緊湊形式名稱，可為 NULL)
+char* extract_header_value(const char *msg, const char *name, const char *compact, char *buf, size_t buf_size) {
+    sip_msg_t parsed;
+    if (sip_parse_message(msg, strlen(msg), &parsed) != 0) return NULL;
+    
+    const sip_header_t *hdr = sip_msg_header_by_name(&parsed, name);
+    if (!hdr && compact) hdr = sip_msg_header_by_name(&parsed, compact);
+    if (!hdr || sip_slice_copy(&parsed, hdr->value, buf, buf_size) != 0) return NULL;
+    return buf;
+}
+
+// 提取Call-ID
+char* extract_callid(const char *msg, char *callid_buf, size_t buf_size) {
+    if (!extract_header_value(msg, "Call-ID", "i", callid_buf, buf_size)) return NULL;
+    return callid_buf[0] ? callid_buf : NULL;
+}
+
+// 提取最上層 Via 的 branch 參數
+char* extract_via_branch(const char *msg, char *branch_buf, size_t buf_size) {
+    sip_msg_t parsed;
+    if (sip_parse_message(msg, strlen(msg), &parsed) != 0) return NULL;
+    if (sip_msg_header_param(&parsed, SIP_HDR_VIA, "branch", branch_buf, buf_size) != 0) return NULL;
+    return branch_buf[0] ? branch_buf : NULL;
+}
+
+// 解析 CSeq 標頭的序號與方法
+int parse_cseq(const char *msg, int *cseq_num, char *method, size_t method_size) {
+    sip_msg_t parsed;
+    if (sip_parse_message(msg, strlen(msg), &parsed) != 0) return -1;
+    if (!sip_msg_header(&parsed, SIP_HDR_CSEQ) || parsed.cseq_method.len == 0) return -1;
+    *cseq_num = parsed.cseq_num;
+    return sip_slice_copy(&parsed, parsed.cseq_method, method, method_size);
+}
+
+// 提取From標籤
+char* extract_from_tag(const char *msg, char *tag_buf, size_t buf_size) {
+    sip_msg_t parsed;
+    if (sip_parse_message(msg, strlen(msg), &parsed) != 0) return NULL;
+    if (sip_msg_header_param(&parsed, SIP_HDR_FROM, "tag", tag_buf, buf_size) != 0) return NULL;
+    return tag_buf[0] ? tag_buf : NULL;
+}
@@ -7,7 +7,7 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <arpa/inet.h>
-#include <openssl/md5.h>
+#include <openssl/evp.h>
 #include <time.h>
 #include <sys/select.h>
 #include <stdarg.h>
@@ -15,24 +15,31 @@
 #include <fcntl.h>
 #include <sys/stat.h>
 #include <pthread.h>
+#include "sip_reactor.h"
+#include "sip_template.h"
+#include "sip_parser.h"
+#include "sip_config.h"
+#include "sip_sdp.h"
 
-// 常量定義
-#define SIP_SERVER "192.168.1.170"
-#define SIP_PORT 5060
-#define LOCAL_IP "192.168.157.126"
-#define LOCAL_PORT 5062
-#define LOCAL_RTP_PORT 32000
-#define LOCAL_RTP_SEND_PORT 32001  // 發送RTP用的端口，保持在網關範圍內
+// 常量定義 (除緩衝區大小外，均由執行期設定提供，見 sip_config.h)
+#define SIP_SERVER (sip_config()->sip_server)
+#define SIP_PORT (sip_config()->sip_port)
+#define LOCAL_IP (sip_config()->local_ip)
+#define LOCAL_PORT (sip_config()->local_port)
+#define LOCAL_RTP_PORT (sip_config()->local_rtp_port)
+#define LOCAL_RTP_SEND_PORT (sip_config()->local_rtp_send_port)  // 發送RTP用的端口，保持在網關範圍內
 #define BUF_SIZE 4096
+#define SIP_NO_ANSWER_TIMEOUT_MS (sip_config()->no_answer_timeout_ms)  // INVITE 無最終回應時取消呼叫的時間
+#define SIP_MAX_GATEWAY_ATTEMPTS 3   // 每通呼叫最多嘗試的網關數 (見 sip_gateway.h)
 
 // RTP和音頻相關常數
-#define RTP_PACKET_SIZE 160  // G.711 ulaw 20ms@8kHz = 160 bytes
+#define RTP_PACKET_SIZE (sip_config()->rtp_packet_size)  // G.711 ulaw 20ms@8kHz = 160 bytes (上限 RTP_PACKET_MAX)
 #define WAV_HEADER_SIZE 64   // μ-law WAV 頭部大小
 
-#define USERNAME "voip"
-#define PASSWORD "qwER12#$"
-#define CALLER "0921367101"
-#define CALLEE "0938220136"
+#define USERNAME (sip_config()->username)
+#define PASSWORD (sip_config()->password)
+#define CALLER (sip_config()->caller)
+#define CALLEE (sip_config()->callee)
 
 // RTP包頭結構
 typedef struct {
@@ -43,17 +50,70 @@ typedef struct {
     unsigned int ssrc;
 } rtp_header_t;
 
+struct sip_dialog;
+struct sip_transaction;
+struct sip_session;
+
+// 非阻塞呼叫/BYE 結果回調：2xx 表示成功，其他為失敗狀態碼 (逾時為 408)
+typedef void (*sip_call_callback_t)(struct sip_session *session, int status_code, void *user_data);
+
 // SIP會話狀態
-typedef struct {
+typedef struct sip_session {
     int sockfd;
     char tag[32];
     char callid[64];
     char branch[64];
     char cseq[16];
     char to_tag[128];
-    int remote_rtp_port;
+    sip_media_t media;           // 協商的媒體描述：對方媒體地址/端口、編碼、ptime、方向 (見 sip_sdp.h)
     struct sockaddr_in servaddr;
     int call_established;
+    int local_rtp_port;          // 本地RTP接收端口 (SDP中宣告)
+    struct sip_dialog *dialog;   // 所屬對話；NULL 表示獨立 socket 的舊式會話
+    unsigned int sdp_version;    // 我方最後發出的 SDP 的 o= 版本
+    int remote_cseq;             // 對方在對話中最後一個請求的 CSeq (0 表示尚未收到)
+    int remote_bye;              // 對方已以 BYE 結束通話 (不需再發送 BYE)
+    int offer_pending;           // 我方在沒有 SDP 的 re-INVITE 的 2xx 中提出了 offer，answer 在 ACK 中
+    char remote_target[128];     // 對方 Contact 的 URI，對話內請求的 Request-URI (空字串表示 sip:被叫@主機)
+    char route_set[512];         // 2xx 的 Record-Route 反序，以 ", " 分隔 (空字串表示沒有 Route 標頭)
+    struct sockaddr_in next_hop; // 對話內請求的目的地 (由路由集合或遠端目標決定；sin_family 為 0 時使用 servaddr)
+
+    // 非阻塞呼叫流程 (只在事件循環線程中存取)
+    char callee[64];
+    int auth_attempted;
+    int cancel_state;                     // 0: 未取消 1: 等待 1xx 後發送 CANCEL 2: 已發送 CANCEL
+    struct sip_transaction *invite_txn;   // 進行中的 INVITE 事務
+    sip_timer_t answer_timer;             // 無應答逾時
+    sip_call_callback_t on_call_result;
+    void *call_user_data;
+    sip_call_callback_t on_call_progress; // 帶 SDP 的臨時回應 (早期媒體)，與 on_call_result 共用 call_user_data
+    int early_media;                      // 已從臨時回應的 SDP 取得對方媒體地址
+    struct sip_transaction *bye_txn;      // 進行中的 BYE 事務
+    sip_call_callback_t on_bye_done;
+    void *bye_user_data;
+
+    // 網關選擇與故障轉移 (只在事件循環線程中存取)
+    char route_host[64];                  // Request-URI 的主機部分 (空字串表示 SIP_SERVER)
+    int gateway_attempts;                 // 本次呼叫已嘗試的網關數
+    struct sockaddr_in tried_gateways[SIP_MAX_GATEWAY_ATTEMPTS];
+    int gateway_held;                     // 已計入 servaddr 網關的同時通話數
+    int invite_responded;                 // 目前的 INVITE 已收到任何回應
+    sip_timer_t failover_timer;           // 網關沒有任何回應時改用下一個
+
+    // 呼叫建立各階段的時間點 (CLOCK_MONOTONIC 微秒，見 sip_metrics.h)
+    uint64_t setup_start_us;              // 第一個 INVITE 發出
+    uint64_t invite_sent_us;              // 目前的 INVITE 發出
+    uint64_t challenge_us;                // 收到 401/407
+    unsigned int phases_seen;             // 目前的 INVITE 已記錄的階段 (位元遮罩)
+
+    // 預先編譯的請求模板：Via、From、Contact、SDP 等靜態段每個對話只格式化一次
+    sip_template_t invite_tpl;
+    sip_template_t ack_tpl;
+    sip_template_t bye_tpl;
+
+    // 共用傳輸的 Call-ID 登記 (見 sip_transport.h)
+    int transport_registered;
+    struct sip_session *transport_next;
 } sip_session_t;
 
 // 日誌函數
@@ -67,18 +127,35 @@ void make_digest_response(const char *username, const char *realm, const char *p
 void parse_nonce_realm(const char *msg, char *nonce, char *realm);
 void get_tag(char *tag, size_t len);
 void get_callid(char *callid, size_t len);
+void get_branch(char *branch, size_t len);
 void parse_sip_headers(const char *msg);
 int parse_sip_status_code(const char *msg);
 char* extract_to_tag(const char *msg, char *tag_buf, size_t buf_size);
 int recv_with_timeout(int sockfd, char *buf, int maxlen, struct sockaddr *src_addr, socklen_t *addrlen, int timeout_ms);
 void flush_socket(int sockfd);
 int parse_rtp_port(const char *msg);
+char* extract_callid(const char *msg, char *callid_buf, size_t buf_size);
+char* extract_from_tag(const char *msg, char *tag_buf, size_t buf_size);
+char* extract_header_value(const char *msg, const char *name, const char *compact, char *buf, size_t buf_size);
+char* extract_via_branch(const char *msg, char *branch_buf, size_t buf_size);
+int parse_cseq(const char *msg, int *cseq_num, char *method, size_t method_size);
 
 // SIP消息發送函數
 void send_ack(int sockfd, struct sockaddr_in *servaddr, const char *callid, const char *tag, 
              const char *branch, const char *to_tag, const char *cseq);
 void send_bye(int sockfd, struct sockaddr_in *servaddr, const char *callid, 
              const char *tag, const char *to_tag, const char *cseq);
+void sip_session_bye(sip_session_t *session);
+const char* sip_session_host(const sip_session_t *session);
+int sip_session_compile_templates(sip_session_t *session);
+// 以 2xx 的 Contact 與 Record-Route 建立對話的遠端目標與路由集合，並重新編譯 ACK/BYE 模板；
+// Contact 或路由集合超出容量時返回 -1 (不使用截斷的路由)
+int sip_session_set_route(sip_session_t *session, const sip_msg_t *msg);
+int sip_session_send_ack(sip_session_t *session, const char *branch);
+void sip_session_on_unmatched(sip_session_t *session, const sip_msg_t *msg, const struct sockaddr_in *from);
+int sip_session_bye_async(sip_session_t *session, sip_call_callback_t on_done, void *user_data);
+// 發送BYE後立即返回 (任意線程)：事務在背景完成重傳並記錄結果，會話與媒體資源可立即釋放
+int sip_session_bye_detached(sip_session_t *session);
 
 // RTP相關函數
 void init_rtp_header(rtp_header_t *hdr, int payload_type, unsigned short seq_num, 
@@ -87,6 +164,13 @@ void send_rtp_audio(int sockfd, struct sockaddr_in *dest_addr, const char *wav_f
                   const char *callid, const char *tag, const char *to_tag, const char *cseq,
                   struct sockaddr_in *servaddr);
 
+// G.711 轉碼 (原地轉換)
+void rtp_ulaw_to_alaw(unsigned char *data, size_t len);
+void rtp_alaw_to_ulaw(unsigned char *data, size_t len);
+
+// 寫入 1kHz 的 G.711 μ-law 測試音 (8000Hz，每毫秒 8 個樣本)
+void generate_test_audio(FILE *file, int duration_ms);
+
 // RTP接收函數
 void* receive_rtp_thread(void *arg);
 int start_rtp_receiver(int port, const char *output_filename);
@@ -95,6 +179,10 @@ void stop_rtp_receiver(void);
 // SIP會話管理
 int init_sip_session(sip_session_t *session);
 int make_sip_call(sip_session_t *session, const char *callee);
+int sip_call_start(sip_session_t *session, const char *callee, sip_call_callback_t callback, void *user_data);
+void sip_call_cancel(sip_session_t *session);
+void sip_call_abandon(sip_session_t *session);
+void sip_call_release_gateway(sip_session_t *session);
 void close_sip_session(sip_session_t *session);
 
 // RTP處理函數
@@ -112,4 +200,28 @@ void set_rtp_callback(rtp_data_callback_t callback);
 void clear_rtp_callback(void);
 int get_rtp_sockfd(void);  // 獲取當前RTP socket文件描述符
 
+// 多實例RTP接收器 (每個通話一個)
+typedef void (*rtp_stream_callback_t)(void *user_data, const unsigned char *rtp_data, size_t data_size);
+typedef struct rtp_receiver rtp_receiver_t;
+rtp_receiver_t* rtp_receiver_create(int port, const char *output_filename,
+                                    rtp_stream_callback_t callback, void *user_data);
+void rtp_receiver_destroy(rtp_receiver_t *rx);
+int rtp_receiver_get_sockfd(rtp_receiver_t *rx);
+int rtp_receiver_packet_count(rtp_receiver_t *rx);
+
+// 對稱 RTP 鎖定 (rtp_latch_packets > 0 時啟用)：NAT 或媒體中繼後方的實際 RTP 來源常與 SDP 的地址不同，
+// 接收器收到同一來源、同一 SSRC 的連續有效封包後記下該來源，發送端改送到這個地址
+typedef struct rtp_latch rtp_latch_t;
+typedef struct {
+    unsigned long latched;       // 鎖定次數 (含重新鎖定)
+    unsigned long moved;         // 鎖定的地址與 SDP 不同
+    unsigned long relatched;     // 同一 SSRC 換了來源後重新鎖定
+    unsigned long rejected;      // 不計入鎖定的封包
+} rtp_latch_stats_t;
+void rtp_receiver_set_remote(rtp_receiver_t *rx, const sip_media_t *media);
+const rtp_latch_t* rtp_receiver_latch(rtp_receiver_t *rx);
+int rtp_latch_apply(const rtp_latch_t *latch, struct sockaddr_in *dest);
+void rtp_latch_get_stats(rtp_latch_stats_t *out);
+int rtp_latch_format(char *buf, size_t size);
+
 #endif // SIP_CLIENT_H
\ No newline at end of file
@@ -0,0 +1,387 @@
+// sip_config.c - 實現設定檔解析、環境變數覆寫與 SIGHUP 熱更新
+#include <ctype.h>
+#include <signal.h>
+#include <stddef.h>
+#include "sip_config.h"
+#include "sip_dialog.h"
+#include "sip_admission.h"
+
+// 預設值 (未提供設定檔時與原先的編譯期常量相同)
+static const sip_config_t config_defaults = {
+    .sip_server = "192.168.1.170",
+    .sip_port = 5060,
+    .local_ip = "192.168.157.126",
+    .local_port = 5062,
+    .local_rtp_port = 32000,
+    .local_rtp_send_port = 32001,   // 發送RTP用的端口，保持在網關範圍內
+    .username = "voip",
+    .password = "qwER12#$",
+    .caller = "0921367101",
+    .callee = "0938220136",
+    .rtp_packet_size = 160,         // G.711 ulaw 20ms@8kHz = 160 bytes
+    .ws_port = 8080,
+    .transport = "udp",
+    .tls_verify = 1,
+    .tls_ca_file = "",
+    .tls_server_name = "",
+    .snapshot_file = "sip_calls.snap",
+    .trace_file = "/tmp/sip_trace.%d",
+    .no_answer_timeout_ms = 60000,
+    .rtp_listen_timeout = 300,
+    .max_calls = SIP_MAX_DIALOGS,
+    .gateway_probe_interval_ms = 10000,
+    .gateway_failover_ms = 2000,
+    .max_cps = 0,
+    .cps_burst = 0,
+    .trunk_max_calls = 0,
+    .admission_queue = 64,
+    .admission_wait_ms = 5000,
+    .rtp_latch_packets = 0,
+    .pacer_threads = 0,
+    .media_cache_mb = 64,
+    .trunk_count = 0,
+    .generation = 0,
+};
+
+// 設定快照：讀取端無鎖，更新時寫入下一個槽位後原子切換
+// (保留多個槽位，讓剛取得舊指標的讀取端在之後數次重新載入期間仍可安全使用)
+static sip_config_t config_slots[SIP_CONFIG_SLOTS];
+static const sip_config_t *current_config = &config_defaults;
+static int current_slot = -1;
+static char config_path[256] = "";
+static pthread_mutex_t config_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int sighup_pipe[2] = { -1, -1 };
+
+// 設定項描述
+typedef enum { CFG_STRING, CFG_INT } config_type_t;
+
+typedef struct {
+    const char *key;
+    config_type_t type;
+    size_t offset;
+    size_t size;
+    int min;
+    int max;
+    int hot;              // 1: 可在重新載入時套用
+} config_field_t;
+
+#define CFG_STR(name, hot) { #name, CFG_STRING, offsetof(sip_config_t, name), \
+                             sizeof(((sip_config_t *)0)->name), 0, 0, hot }
+#define CFG_NUM(name, lo, hi, hot) { #name, CFG_INT, offsetof(sip_config_t, name), \
+                                     sizeof(int), lo, hi, hot }
+
+static const config_field_t config_fields[] = {
+    CFG_STR(sip_server, 0),
+    CFG_NUM(sip_port, 1, 65535, 0),
+    CFG_STR(local_ip, 0),
+    CFG_NUM(local_port, 1, 65535, 0),
+    CFG_NUM(local_rtp_port, 1, 65535, 0),
+    CFG_NUM(local_rtp_send_port, 1, 65535, 0),
+    CFG_STR(username, 0),
+    CFG_STR(password, 0),
+    CFG_STR(caller, 0),
+    CFG_STR(callee, 0),
+    CFG_NUM(rtp_packet_size, 80, RTP_PACKET_MAX, 0),
+    CFG_NUM(ws_port, 1, 65535, 0),
+    CFG_STR(transport, 0),
+    CFG_NUM(tls_verify, 0, 1, 0),
+    CFG_STR(tls_ca_file, 0),
+    CFG_STR(tls_server_name, 0),
+    CFG_STR(snapshot_file, 0),
+    CFG_STR(trace_file, 0),
+    CFG_NUM(no_answer_timeout_ms, 1000, 600000, 1),
+    CFG_NUM(rtp_listen_timeout, 1, 86400, 1),
+    CFG_NUM(max_calls, 1, 1000000, 1),
+    CFG_NUM(gateway_probe_interval_ms, 1000, 600000, 1),
+    CFG_NUM(gateway_failover_ms, 100, 60000, 1),
+    CFG_NUM(max_cps, 0, 100000, 1),
+    CFG_NUM(cps_burst, 0, 100000, 1),
+    CFG_NUM(trunk_max_calls, 0, 1000000, 1),
+    CFG_NUM(admission_queue, 0, SIP_ADMISSION_QUEUE_MAX, 1),
+    CFG_NUM(admission_wait_ms, 0, 600000, 1),
+    CFG_NUM(rtp_latch_packets, 0, 1000, 1),
+    CFG_NUM(pacer_threads, 0, 16, 0),
+    CFG_NUM(media_cache_mb, 0, 4096, 1),
+};
+
+#define CONFIG_FIELD_COUNT ((int)(sizeof(config_fields) / sizeof(config_fields[0])))
+
+const sip_config_t* sip_config(void) {
+    return __atomic_load_n(&current_config, __ATOMIC_ACQUIRE);
+}
+
+static char* trim(char *s) {
+    while (isspace((unsigned char)*s)) s++;
+    char *end = s + strlen(s);
+    while (end > s && isspace((unsigned char)end[-1])) *--end = '\0';
+    return s;
+}
+
+// 設定單一欄位；值不合法時保留原值並返回 -1
+static int config_set_field(sip_config_t *cfg, const config_field_t *field, const char *value,
+                            const char *source) {
+    char *dst = (char *)cfg + field->offset;
+
+    if (field->type == CFG_STRING) {
+        if (strlen(value) >= field->size) {
+            log_with_timestamp("警告: 設定 %s (%s) 過長，已忽略\n", field->key, source);
+            return -1;
+        }
+        memcpy(dst, value, strlen(value) + 1);
+        return 0;
+    }
+
+    char *end;
+    long n = strtol(value, &end, 10);
+    if (end == value || *end != '\0' || n < field->min || n > field->max) {
+        log_with_timestamp("警告: 設定 %s = '%s' (%s) 不合法 (範圍 %d-%d)，已忽略\n",
+                         field->key, value, source, field->min, field->max);
+        return -1;
+    }
+    *(int *)dst = (int)n;
+    return 0;
+}
+
+// trunk = <名稱> <主機>[:<端口>]
+static int config_add_trunk(sip_config_t *cfg, const char *value, const char *source) {
+    if (cfg->trunk_count >= SIP_MAX_TRUNKS) {
+        log_with_timestamp("警告: 中繼數量超過上限 %d (%s)，已忽略: %s\n", SIP_MAX_TRUNKS, source, value);
+        return -1;
+    }
+
+    sip_trunk_t *trunk = &cfg->trunks[cfg->trunk_count];
+    char host[64];
+    if (sscanf(value, "%31s %63s", trunk->name, host) != 2) {
+        log_with_timestamp("警告: 中繼設定格式錯誤 (%s): %s\n", source, value);
+        return -1;
+    }
+
+    trunk->port = 5060;
+    char *colon = strchr(host, ':');
+    if (colon) {
+        *colon = '\0';
+        trunk->port = atoi(colon + 1);
+        if (trunk->port <= 0 || trunk->port > 65535) {
+            log_with_timestamp("警告: 中繼 %s 的端口不合法 (%s)\n", trunk->name, source);
+            return -1;
+        }
+    }
+    snprintf(trunk->host, sizeof(trunk->host), "%s", host);
+    cfg->trunk_count++;
+    return 0;
+}
+
+// 解析 key = value 格式的設定檔 (# 開頭為註解)；檔案不存在時返回 1
+static int config_parse_file(sip_config_t *cfg, const char *path) {
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+        if (errno == ENOENT) return 1;
+        log_with_timestamp("錯誤: 無法打開設定檔 %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    char line[512], source[300];
+    int lineno = 0, trunks_seen = 0;
+    while (fgets(line, sizeof(line), fp)) {
+        lineno++;
+        char *s = trim(line);
+        if (*s == '\0' || *s == '#') continue;
+
+        snprintf(source, sizeof(source), "%s:%d", path, lineno);
+        char *eq = strchr(s, '=');
+        if (!eq) {
+            log_with_timestamp("警告: 設定檔格式錯誤 (%s)，缺少 '='\n", source);
+            continue;
+        }
+        *eq = '\0';
+        char *key = trim(s);
+        char *value = trim(eq + 1);
+
+        // 設定檔中的中繼清單取代預設清單
+        if (strcmp(key, "trunk") == 0) {
+            if (!trunks_seen) {
+                cfg->trunk_count = 0;
+                trunks_seen = 1;
+            }
+            config_add_trunk(cfg, value, source);
+            continue;
+        }
+
+        int i;
+        for (i = 0; i < CONFIG_FIELD_COUNT; i++) {
+            if (strcmp(key, config_fields[i].key) == 0) {
+                config_set_field(cfg, &config_fields[i], value, source);
+                break;
+            }
+        }
+        if (i == CONFIG_FIELD_COUNT) {
+            log_with_timestamp("警告: 未知的設定項 '%s' (%s)\n", key, source);
+        }
+    }
+
+    fclose(fp);
+    return 0;
+}
+
+// 環境變數覆寫：SIP_CFG_<大寫鍵名>，例如 SIP_CFG_LOCAL_IP
+static void config_apply_env(sip_config_t *cfg) {
+    char name[64];
+    for (int i = 0; i < CONFIG_FIELD_COUNT; i++) {
+        const char *key = config_fields[i].key;
+        size_t prefix = strlen(SIP_CONFIG_ENV_PREFIX);
+        memcpy(name, SIP_CONFIG_ENV_PREFIX, prefix);
+        for (size_t j = 0; key[j] && prefix + j < sizeof(name) - 1; j++) {
+            name[prefix + j] = (char)toupper((unsigned char)key[j]);
+            name[prefix + j + 1] = '\0';
+        }
+
+        const char *value = getenv(name);
+        if (value) {
+            config_set_field(cfg, &config_fields[i], value, name);
+        }
+    }
+}
+
+// 從預設值、設定檔與環境變數組合出完整設定
+static int config_build(sip_config_t *cfg, const char *path) {
+    *cfg = config_defaults;
+    int rc = config_parse_file(cfg, path);
+    if (rc < 0) return -1;
+    if (rc > 0) {
+        log_with_timestamp("設定檔 %s 不存在，使用預設值\n", path);
+    }
+    config_apply_env(cfg);
+    for (char *p = cfg->transport; *p; p++) *p = (char)tolower((unsigned char)*p);
+    if (strcmp(cfg->transport, "udp") != 0 && strcmp(cfg->transport, "tcp") != 0 &&
+        strcmp(cfg->transport, "tls") != 0) {
+        log_with_timestamp("警告: 不支援的傳輸 '%s'，使用 udp\n", cfg->transport);
+        snprintf(cfg->transport, sizeof(cfg->transport), "udp");
+    }
+    if (cfg->max_calls > SIP_MAX_DIALOGS) {
+        cfg->max_calls = SIP_MAX_DIALOGS;
+    }
+    return 0;
+}
+
+// 寫入下一個槽位並發佈 (需持有 config_lock)
+static void config_publish_locked(const sip_config_t *cfg) {
+    int slot = (current_slot + 1) % SIP_CONFIG_SLOTS;
+    unsigned int generation = current_config->generation + 1;
+    config_slots[slot] = *cfg;
+    config_slots[slot].generation = generation;
+    current_slot = slot;
+    __atomic_store_n(&current_config, &config_slots[slot], __ATOMIC_RELEASE);
+}
+
+int sip_config_load(const char *path) {
+    if (!path || !*path) path = getenv("SIP_CONFIG");
+    if (!path || !*path) path = SIP_CONFIG_DEFAULT_PATH;
+
+    pthread_mutex_lock(&config_lock);
+    snprintf(config_path, sizeof(config_path), "%s", path);
+
+    sip_config_t cfg;
+    if (config_build(&cfg, config_path) != 0) {
+        pthread_mutex_unlock(&config_lock);
+        return -1;
+    }
+    config_publish_locked(&cfg);
+    pthread_mutex_unlock(&config_lock);
+
+    const sip_config_t *c = sip_config();
+    log_with_timestamp("設定已載入: SIP 伺服器 %s:%d (%s)，本地 %s:%d，RTP 端口 %d，中繼 %d 個\n",
+                     c->sip_server, c->sip_port, c->transport, c->local_ip, c->local_port,
+                     c->local_rtp_port, c->trunk_count);
+    return 0;
+}
+
+int sip_config_reload(void) {
+    pthread_mutex_lock(&config_lock);
+    if (config_path[0] == '\0') {
+        snprintf(config_path, sizeof(config_path), "%s", SIP_CONFIG_DEFAULT_PATH);
+    }
+
+    sip_config_t loaded;
+    if (config_build(&loaded, config_path) != 0) {
+        pthread_mutex_unlock(&config_lock);
+        log_with_timestamp("重新載入設定失敗，保留目前設定\n");
+        return -1;
+    }
+
+    // 從目前設定出發，只套用可熱更新的項目
+    sip_config_t next = *current_config;
+    for (int i = 0; i < CONFIG_FIELD_COUNT; i++) {
+        const config_field_t *field = &config_fields[i];
+        const char *src = (const char *)&loaded + field->offset;
+        char *dst = (char *)&next + field->offset;
+        if (memcmp(src, dst, field->size) == 0) continue;
+
+        if (field->hot) {
+            memcpy(dst, src, field->size);
+        } else {
+            log_with_timestamp("警告: 設定 %s 已變更，需重新啟動才會生效\n", field->key);
+        }
+    }
+    memcpy(next.trunks, loaded.trunks, sizeof(next.trunks));
+    next.trunk_count = loaded.trunk_count;
+
+    config_publish_locked(&next);
+    pthread_mutex_unlock(&config_lock);
+
+    const sip_config_t *c = sip_config();
+    log_with_timestamp("設定已重新載入 (第 %u 版): 無應答逾時 %d ms，通話上限 %d 秒，同時通話 %d 個，中繼 %d 個\n",
+                     c->generation, c->no_answer_timeout_ms, c->rtp_listen_timeout,
+                     c->max_calls, c->trunk_count);
+    return 0;
+}
+
+// ---- SIGHUP：信號處理函數只寫入管道，重新載入在事件循環線程中執行 ----
+
+static void config_sighup_handler(int sig) {
+    (void)sig;
+    int saved_errno = errno;
+    char c = 1;
+    if (write(sighup_pipe[1], &c, 1) < 0) {
+        // 管道已滿表示已有待處理的重新載入
+    }
+    errno = saved_errno;
+}
+
+static void config_on_sighup(int fd, void *arg) {
+    (void)arg;
+    char buf[64];
+    while (read(fd, buf, sizeof(buf)) > 0) {
+    }
+    log_with_timestamp("收到 SIGHUP，重新載入設定檔 %s\n", config_path);
+    sip_config_reload();
+}
+
+int sip_config_watch_sighup(void) {
+    if (sighup_pipe[0] >= 0) return 0;
+
+    if (pipe(sighup_pipe) != 0) {
+        log_with_timestamp("錯誤: 無法創建 SIGHUP 管道: %s\n", strerror(errno));
+        return -1;
+    }
+    for (int i = 0; i < 2; i++) {
+        fcntl(sighup_pipe[i], F_SETFL, fcntl(sighup_pipe[i], F_GETFL) | O_NONBLOCK);
+        fcntl(sighup_pipe[i], F_SETFD, FD_CLOEXEC);
+    }
+
+    if (sip_reactor_start() != 0 ||
+        sip_reactor_add_fd(sighup_pipe[0], config_on_sighup, NULL) != 0) {
+        close(sighup_pipe[0]);
+        close(sighup_pipe[1]);
+        sighup_pipe[0] = sighup_pipe[1] = -1;
+        return -1;
+    }
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = config_sighup_handler;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_RESTART;
+    sigaction(SIGHUP, &sa, NULL);
+    return 0;
+}
@@ -0,0 +1,71 @@
+// sip_config.h - 執行期設定：啟動時從設定檔與環境變數載入，SIGHUP 時重新載入可熱更新的項目
+#ifndef SIP_CONFIG_H
+#define SIP_CONFIG_H
+
+#define SIP_CONFIG_DEFAULT_PATH "sip_client.conf"  // 未設定 SIP_CONFIG 環境變數時使用
+#define SIP_CONFIG_ENV_PREFIX "SIP_CFG_"           // 環境變數覆寫：SIP_CFG_<大寫鍵名>
+#define SIP_CONFIG_SLOTS 4                         // 設定快照輪替數
+#define SIP_MAX_TRUNKS 8                           // 中繼 (網關) 清單上限
+#define RTP_PACKET_MAX 1280                        // rtp_packet_size 的上限 (決定緩衝區大小)
+
+// 中繼：trunk = <名稱> <主機>[:<端口>]
+typedef struct {
+    char name[32];
+    char host[64];
+    int port;
+} sip_trunk_t;
+
+typedef struct {
+    // 結構性設定：只在啟動時生效，重新載入時變更會被忽略並記錄
+    char sip_server[64];
+    int sip_port;
+    char local_ip[64];
+    int local_port;
+    int local_rtp_port;
+    int local_rtp_send_port;
+    char username[64];
+    char password[128];
+    char caller[64];
+    char callee[64];
+    int rtp_packet_size;          // 每個 RTP 封包的 G.711 樣本數 (8000Hz 下 160 = 20ms)
+    int ws_port;
+    char transport[8];            // SIP 傳輸：udp、tcp 或 tls
+    int tls_verify;               // 1: 驗證伺服器憑證
+    char tls_ca_file[256];        // 空字串表示使用系統預設 CA
+    char tls_server_name[128];    // SNI 與憑證主機名 (空字串表示使用 sip_server)
+    char snapshot_file[256];      // 通話狀態快照檔案 (見 sip_snapshot.h)，空字串表示停用
+    char trace_file[256];         // 事件追蹤檔案 (見 sip_trace.h)，%d 替換為進程 ID；空字串表示只在記憶體中追蹤
+
+    // 可熱更新的設定：SIGHUP 後立即套用到新的通話，不影響進行中的通話
+    int no_answer_timeout_ms;     // INVITE 無最終回應時取消呼叫的時間
+    int rtp_listen_timeout;       // 通話最長持續時間 (秒)
+    int max_calls;                // 同時進行的通話數上限 (不超過 SIP_MAX_DIALOGS)
+    int gateway_probe_interval_ms;  // 有設定中繼時，對每個網關發送 OPTIONS 的間隔
+    int gateway_failover_ms;      // INVITE 在此時間內沒有任何回應時改用下一個網關
+    int max_cps;                  // 每秒新呼叫數上限 (0: 不限制，見 sip_admission.h)
+    int cps_burst;                // 令牌桶容量：允許的瞬間突發呼叫數 (0: 等於 max_cps)
+    int trunk_max_calls;          // 每個中繼的同時通話數上限 (0: 不限制)
+    int admission_queue;          // 超出限制的呼叫請求最多排隊數 (0: 立即拒絕)
+    int admission_wait_ms;        // 排隊等待的時間上限，逾時拒絕
+    int rtp_latch_packets;        // 對稱 RTP 鎖定需要的連續封包數 (0: 停用，一律送到 SDP 的地址)
+    int pacer_threads;            // RTP 發送節拍線程數 (0: 每個 CPU 一個並綁定，見 sip_pacer.h)
+    int media_cache_mb;           // 提示音快取的記憶體預算 (MB，0: 不快取，見 sip_media_cache.h)
+    sip_trunk_t trunks[SIP_MAX_TRUNKS];
+    int trunk_count;
+
+    unsigned int generation;      // 每次載入遞增
+} sip_config_t;
+
+// 目前的設定快照 (任意線程可讀；不可跨越重新載入長期保存指標)
+const sip_config_t* sip_config(void);
+
+// 啟動時載入 (path 為 NULL 時使用 SIP_CONFIG 環境變數或預設路徑；檔案不存在時使用預設值)
+int sip_config_load(const char *path);
+
+// 重新載入設定檔：只套用可熱更新的項目
+int sip_config_reload(void);
+
+// 收到 SIGHUP 時在事件循環線程中重新載入
+int sip_config_watch_sighup(void);
+
+#endif // SIP_CONFIG_H
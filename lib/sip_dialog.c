@@ -0,0 +1,396 @@
+// sip_dialog.c - 實現多對話呼叫表 (SIP訊息由事件循環與事務層分派)
+#include "sip_dialog.h"
+#include "sip_transaction.h"
+#include "sip_transport.h"
+#include "sip_snapshot.h"
+#include "sip_trace.h"
+
+// 呼叫表
+static sip_dialog_t dialogs[SIP_MAX_DIALOGS];
+static pthread_mutex_t table_lock = PTHREAD_MUTEX_INITIALIZER;
+static int table_initialized = 0;
+static int next_slot = 0;             // 輪流分配槽位，避免剛釋放的槽位立即重用
+static int dialogs_in_use = 0;        // 使用中的槽位數 (受 max_calls 設定限制)
+
+static void dialog_duration_expired(void *arg);
+
+// 初始化呼叫表：取得共用SIP傳輸，收到的訊息由傳輸依 Call-ID 與 tag 分派給各對話
+int sip_dialog_table_init(void) {
+    if (table_initialized) return 0;
+
+    for (int i = 0; i < SIP_MAX_DIALOGS; i++) {
+        memset(&dialogs[i], 0, sizeof(sip_dialog_t));
+        dialogs[i].index = i;
+        dialogs[i].state = DIALOG_FREE;
+    }
+
+    if (sip_transport_acquire() != 0) {
+        return -1;
+    }
+
+    table_initialized = 1;
+    sip_snapshot_open(sip_config()->snapshot_file);
+    log_with_timestamp("呼叫表初始化完成: 共享 SIP socket %s:%d，容量 %d 個對話\n",
+                     LOCAL_IP, LOCAL_PORT, SIP_MAX_DIALOGS);
+    return 0;
+}
+
+// 關閉呼叫表
+void sip_dialog_table_shutdown(void) {
+    if (!table_initialized) return;
+
+    for (int i = 0; i < SIP_MAX_DIALOGS; i++) {
+        if (dialogs[i].state != DIALOG_FREE) {
+            sip_dialog_destroy(&dialogs[i]);
+        }
+    }
+
+    sip_snapshot_close();
+    sip_transport_release();
+    table_initialized = 0;
+    log_with_timestamp("呼叫表已關閉\n");
+}
+
+// 獲取共享SIP socket
+int sip_dialog_table_sockfd(void) {
+    return table_initialized ? sip_transport_sockfd() : -1;
+}
+
+// 初始化槽位中的對話並產生唯一的 Call-ID、tag 與 branch (調用者持有 table_lock)
+static void dialog_init_slot(sip_dialog_t *d, const char *callee) {
+    sip_session_t *session = &d->session;
+
+    memset(session, 0, sizeof(sip_session_t));
+    session->sockfd = sip_transport_sockfd();
+    session->dialog = d;
+    session->servaddr.sin_family = AF_INET;
+    session->servaddr.sin_port = htons(SIP_PORT);
+    inet_pton(AF_INET, SIP_SERVER, &session->servaddr.sin_addr);
+
+    get_tag(session->tag, sizeof(session->tag));
+    get_callid(session->callid, sizeof(session->callid));
+    get_branch(session->branch, sizeof(session->branch));
+    snprintf(session->cseq, sizeof(session->cseq), "102");
+    sip_media_init(&session->media, &session->servaddr.sin_addr, LOCAL_RTP_PORT);
+    session->local_rtp_port = LOCAL_RTP_PORT + 2 * d->index;  // 每個對話使用獨立的偶數RTP端口
+    sip_timer_init(&session->answer_timer, NULL, NULL);
+    sip_timer_init(&session->failover_timer, NULL, NULL);
+
+    snprintf(d->callee, sizeof(d->callee), "%s", callee);
+    d->hangup_requested = 0;
+    d->rtp = NULL;
+    d->user_data = NULL;
+    d->last_status = 0;
+    d->on_state_change = NULL;
+    d->on_media_change = NULL;
+    d->max_duration_ms = 0;
+    sip_timer_init(&d->duration_timer, dialog_duration_expired, d);
+    d->state = DIALOG_CALLING;
+    dialogs_in_use++;
+}
+
+// 分配新對話
+sip_dialog_t* sip_dialog_create(const char *callee) {
+    if (!table_initialized) {
+        log_with_timestamp("錯誤: 呼叫表尚未初始化\n");
+        return NULL;
+    }
+
+    pthread_mutex_lock(&table_lock);
+
+    int max_calls = sip_config()->max_calls;
+    if (dialogs_in_use >= max_calls) {
+        pthread_mutex_unlock(&table_lock);
+        log_with_timestamp("錯誤: 同時通話數已達上限 (%d 個)\n", max_calls);
+        return NULL;
+    }
+
+    sip_dialog_t *d = NULL;
+    for (int i = 0; i < SIP_MAX_DIALOGS; i++) {
+        int slot = (next_slot + i) % SIP_MAX_DIALOGS;
+        if (dialogs[slot].state == DIALOG_FREE) {
+            d = &dialogs[slot];
+            next_slot = (slot + 1) % SIP_MAX_DIALOGS;
+            break;
+        }
+    }
+
+    if (!d) {
+        pthread_mutex_unlock(&table_lock);
+        log_with_timestamp("錯誤: 呼叫表已滿 (%d 個對話)\n", SIP_MAX_DIALOGS);
+        return NULL;
+    }
+
+    dialog_init_slot(d, callee);
+
+    pthread_mutex_unlock(&table_lock);
+
+    sip_transport_register(&d->session);
+
+    log_with_timestamp("建立對話 #%d: Call-ID %s，本地RTP端口 %d\n",
+                     d->index, d->session.callid, d->session.local_rtp_port);
+    return d;
+}
+
+// 以快照記錄在原槽位重建已接通的對話 (Call-ID、tags、CSeq、網關與媒體沿用記錄)
+sip_dialog_t* sip_dialog_restore(const sip_snapshot_record_t *rec) {
+    if (!table_initialized || !rec || rec->index < 0 || rec->index >= SIP_MAX_DIALOGS) return NULL;
+
+    pthread_mutex_lock(&table_lock);
+    sip_dialog_t *d = &dialogs[rec->index];
+    if (d->state != DIALOG_FREE) {
+        pthread_mutex_unlock(&table_lock);
+        return NULL;
+    }
+    dialog_init_slot(d, rec->callee);
+
+    sip_session_t *session = &d->session;
+    snprintf(session->callee, sizeof(session->callee), "%s", rec->callee);
+    snprintf(session->callid, sizeof(session->callid), "%s", rec->callid);
+    snprintf(session->tag, sizeof(session->tag), "%s", rec->tag);
+    snprintf(session->to_tag, sizeof(session->to_tag), "%s", rec->to_tag);
+    snprintf(session->cseq, sizeof(session->cseq), "%s", rec->cseq);
+    snprintf(session->route_host, sizeof(session->route_host), "%s", rec->route_host);
+    snprintf(session->remote_target, sizeof(session->remote_target), "%s", rec->remote_target);
+    snprintf(session->route_set, sizeof(session->route_set), "%s", rec->route_set);
+    session->servaddr = rec->servaddr;
+    session->media = rec->media;
+    session->sdp_version = rec->sdp_version;
+    session->local_rtp_port = rec->local_rtp_port;
+    session->call_established = 1;
+    d->last_status = rec->last_status;
+    d->state = DIALOG_CONFIRMED;
+    pthread_mutex_unlock(&table_lock);
+
+    sip_transport_register(session);
+    sip_snapshot_save(d);
+
+    log_with_timestamp("恢復對話 #%d: Call-ID %s，網關 %s:%d\n",
+                     d->index, session->callid, inet_ntoa(session->servaddr.sin_addr),
+                     ntohs(session->servaddr.sin_port));
+    return d;
+}
+
+// ---- 非阻塞介面 (以下 static 函數都在事件循環線程中執行) ----
+
+static void dialog_set_state(sip_dialog_t *d, sip_dialog_state_t state) {
+    d->state = state;
+    sip_snapshot_save(d);
+    sip_trace_dialog(d->index, state, d->session.callid);
+    if (state == DIALOG_CONFIRMED && d->max_duration_ms > 0) {
+        sip_timer_start(&d->duration_timer, d->max_duration_ms);
+    } else if (state == DIALOG_TERMINATED) {
+        sip_timer_stop(&d->duration_timer);
+    }
+    // 回調中可能銷毀對話，之後不可再存取 d
+    if (d->on_state_change) {
+        d->on_state_change(d);
+    }
+}
+
+static void dialog_send_bye(sip_dialog_t *d) {
+    if (d->session.remote_bye) {
+        // 對方的 BYE 已結束通話，狀態變化的任務尚未執行
+        dialog_set_state(d, DIALOG_TERMINATED);
+        return;
+    }
+    // BYE 在背景完成 (200 或逾時只記錄)，對話立即結束，槽位可以馬上重用
+    dialog_set_state(d, DIALOG_TERMINATING);
+    sip_session_bye_detached(&d->session);
+    dialog_set_state(d, DIALOG_TERMINATED);
+}
+
+static void dialog_call_result(sip_session_t *session, int status_code, void *user_data) {
+    sip_dialog_t *d = (sip_dialog_t *)user_data;
+    (void)session;
+
+    d->last_status = status_code;
+    if (status_code >= 200 && status_code < 300) {
+        dialog_set_state(d, DIALOG_CONFIRMED);
+        if (d->state == DIALOG_CONFIRMED && d->hangup_requested) {
+            dialog_send_bye(d);
+        }
+    } else {
+        dialog_set_state(d, DIALOG_TERMINATED);
+    }
+}
+
+// 帶 SDP 的臨時回應：第一次進入早期媒體狀態時通知應用層
+static void dialog_call_progress(sip_session_t *session, int status_code, void *user_data) {
+    sip_dialog_t *d = (sip_dialog_t *)user_data;
+    (void)session;
+
+    if (d->state != DIALOG_CALLING) return;
+    d->last_status = status_code;
+    dialog_set_state(d, DIALOG_EARLY);
+}
+
+static void dialog_start_call_task(void *arg) {
+    sip_dialog_t *d = (sip_dialog_t *)arg;
+    if (d->state != DIALOG_CALLING) return;
+
+    d->session.on_call_progress = dialog_call_progress;
+    if (d->hangup_requested ||
+        sip_call_start(&d->session, d->callee, dialog_call_result, d) != 0) {
+        d->last_status = d->hangup_requested ? 487 : 503;
+        dialog_set_state(d, DIALOG_TERMINATED);
+        return;
+    }
+    // CALLING 在分配槽位時設定，Call-ID 到這裡才產生
+    sip_trace_dialog(d->index, DIALOG_CALLING, d->session.callid);
+}
+
+static void dialog_hangup_task(void *arg) {
+    sip_dialog_t *d = (sip_dialog_t *)arg;
+
+    d->hangup_requested = 1;
+    if (d->state == DIALOG_CALLING || d->state == DIALOG_EARLY) {
+        sip_call_cancel(&d->session);
+    } else if (d->state == DIALOG_CONFIRMED) {
+        dialog_send_bye(d);
+    }
+}
+
+static void dialog_duration_expired(void *arg) {
+    sip_dialog_t *d = (sip_dialog_t *)arg;
+    log_with_timestamp("對話 #%d 達到通話時長上限 (%d 秒)，自動掛斷\n", d->index, d->max_duration_ms / 1000);
+    dialog_hangup_task(d);
+}
+
+typedef struct {
+    sip_dialog_t *dialog;
+    char callid[64];
+} dialog_remote_bye_t;
+
+// 槽位可能在任務執行前已釋放並重用，以 Call-ID 確認仍是同一通話
+static void dialog_remote_bye_task(void *arg) {
+    dialog_remote_bye_t *bye = (dialog_remote_bye_t *)arg;
+    sip_dialog_t *d = bye->dialog;
+
+    if (d->state == DIALOG_CONFIRMED && strcmp(d->session.callid, bye->callid) == 0) {
+        log_with_timestamp("對話 #%d 已由對方掛斷\n", d->index);
+        dialog_set_state(d, DIALOG_TERMINATED);
+    }
+    free(bye);
+}
+
+// 在傳輸分派中調用 (持有登記鎖，不可在此銷毀對話)，狀態變化延後到事件循環的下一個任務
+int sip_dialog_remote_bye(sip_dialog_t *dialog, const char *callid) {
+    dialog_remote_bye_t *bye = malloc(sizeof(*bye));
+    if (!bye) return -1;
+    bye->dialog = dialog;
+    snprintf(bye->callid, sizeof(bye->callid), "%s", callid);
+    if (sip_reactor_post(dialog_remote_bye_task, bye) != 0) {
+        free(bye);
+        return -1;
+    }
+    return 0;
+}
+
+void sip_dialog_media_changed(sip_dialog_t *dialog) {
+    sip_snapshot_save(dialog);
+    if (dialog->state == DIALOG_CONFIRMED && dialog->on_media_change) {
+        dialog->on_media_change(dialog);
+    }
+}
+
+// 非阻塞發起呼叫：結果經由 on_state_change 通知 (CONFIRMED 或 TERMINATED)
+int sip_dialog_start_call(sip_dialog_t *dialog) {
+    if (!dialog || dialog->state != DIALOG_CALLING) return -1;
+    return sip_reactor_post(dialog_start_call_task, dialog);
+}
+
+// 非阻塞掛斷：呼叫中發送 CANCEL，已接通發送 BYE
+int sip_dialog_hangup(sip_dialog_t *dialog) {
+    if (!dialog || dialog->state == DIALOG_FREE) return -1;
+    dialog->hangup_requested = 1;
+    return sip_reactor_post(dialog_hangup_task, dialog);
+}
+
+// 設定通話時長上限 (秒)，0 表示不限制；接通後開始計時
+void sip_dialog_set_max_duration(sip_dialog_t *dialog, int seconds) {
+    if (!dialog) return;
+    dialog->max_duration_ms = seconds > 0 ? seconds * 1000 : 0;
+    if (dialog->state == DIALOG_CONFIRMED && dialog->max_duration_ms > 0) {
+        sip_timer_start(&dialog->duration_timer, dialog->max_duration_ms);
+    }
+}
+
+// ---- 阻塞式介面 ----
+
+// 在對話上發起呼叫 (阻塞直到收到最終回應或超時)
+int sip_dialog_call(sip_dialog_t *dialog) {
+    if (!dialog) return -1;
+
+    dialog->state = DIALOG_CALLING;
+    if (make_sip_call(&dialog->session, dialog->callee) != 0) {
+        dialog->state = DIALOG_TERMINATED;
+        return -1;
+    }
+
+    dialog->state = DIALOG_CONFIRMED;
+    return 0;
+}
+
+// 結束已建立的對話
+void sip_dialog_bye(sip_dialog_t *dialog) {
+    if (!dialog || dialog->state != DIALOG_CONFIRMED) return;
+
+    dialog->state = DIALOG_TERMINATING;
+    sip_session_bye(&dialog->session);
+    dialog->state = DIALOG_TERMINATED;
+}
+
+// 在事件循環線程中釋放對話：與進行中的事務脫鉤並停止計時器
+static void dialog_release_task(void *arg) {
+    sip_dialog_t *dialog = (sip_dialog_t *)arg;
+
+    sip_call_abandon(&dialog->session);
+    sip_timer_stop(&dialog->duration_timer);
+
+    sip_transport_unregister(&dialog->session);
+
+    pthread_mutex_lock(&table_lock);
+    if (dialog->state != DIALOG_FREE) {
+        dialog->session.call_established = 0;
+        dialog->on_state_change = NULL;
+        dialog->on_media_change = NULL;
+        dialog->state = DIALOG_FREE;
+        dialogs_in_use--;
+    }
+    pthread_mutex_unlock(&table_lock);
+    sip_snapshot_clear(dialog->index);
+}
+
+// 釋放對話槽位
+void sip_dialog_destroy(sip_dialog_t *dialog) {
+    if (!dialog || dialog->state == DIALOG_FREE) return;
+
+    if (sip_reactor_run_sync(dialog_release_task, dialog) != 0) {
+        dialog_release_task(dialog);
+    }
+    log_with_timestamp("對話 #%d 已釋放\n", dialog->index);
+}
+
+// 依槽位獲取對話
+sip_dialog_t* sip_dialog_get(int index) {
+    if (index < 0 || index >= SIP_MAX_DIALOGS) return NULL;
+    return dialogs[index].state == DIALOG_FREE ? NULL : &dialogs[index];
+}
+
+// 依 Call-ID (及可選的本地 tag) 查找對話
+sip_dialog_t* sip_dialog_find(const char *callid, const char *local_tag) {
+    sip_session_t *session = sip_transport_find(callid, local_tag);
+    return session ? session->dialog : NULL;
+}
+
+// 統計使用中的對話數
+int sip_dialog_active_count(void) {
+    int count = 0;
+    pthread_mutex_lock(&table_lock);
+    for (int i = 0; i < SIP_MAX_DIALOGS; i++) {
+        if (dialogs[i].state != DIALOG_FREE) count++;
+    }
+    pthread_mutex_unlock(&table_lock);
+    return count;
+}
@@ -0,0 +1,70 @@
+// sip_dialog.h - 多對話呼叫表：多個SIP對話共享同一個SIP socket
+#ifndef SIP_DIALOG_H
+#define SIP_DIALOG_H
+
+#include "sip_client.h"
+
+#define SIP_MAX_DIALOGS 512          // 呼叫表容量 (同時進行的對話數上限)
+
+// 對話狀態
+typedef enum {
+    DIALOG_FREE = 0,       // 槽位未使用
+    DIALOG_CALLING,        // 已發送 INVITE，等待最終回應
+    DIALOG_EARLY,          // 收到帶 SDP 的臨時回應，早期媒體 (回鈴音、提示音) 已開始
+    DIALOG_CONFIRMED,      // 已收到 200 OK 並送出 ACK
+    DIALOG_TERMINATING,    // 正在發送 BYE (BYE 在背景完成，隨即進入 TERMINATED)
+    DIALOG_TERMINATED      // 通話結束，等待釋放槽位
+} sip_dialog_state_t;
+
+// 單一SIP對話
+typedef struct sip_dialog {
+    int index;                           // 在呼叫表中的槽位
+    volatile sip_dialog_state_t state;
+    sip_session_t session;               // Call-ID、tags、CSeq 等對話狀態
+    char callee[64];
+    volatile int hangup_requested;       // 由應用層設置，要求掛斷
+    rtp_receiver_t *rtp;                 // 此通話的RTP接收器
+    void *user_data;
+    int last_status;                     // INVITE 的最終回應狀態碼 (早期媒體期間為該臨時回應的狀態碼)
+
+    // 狀態變化通知 (在事件循環線程中調用；可在回調中銷毀對話)
+    void (*on_state_change)(struct sip_dialog *dialog);
+    // 對方在通話中改變媒體 (re-INVITE/UPDATE 的 offer，或我方 offer 後 ACK 中的 answer)，session.media 已更新；
+    // 在傳輸分派中調用 (持有登記鎖)，不可在回調中銷毀對話
+    void (*on_media_change)(struct sip_dialog *dialog);
+    sip_timer_t duration_timer;          // 通話時長上限，到期自動掛斷
+    int max_duration_ms;
+} sip_dialog_t;
+
+// 呼叫表管理
+int sip_dialog_table_init(void);
+void sip_dialog_table_shutdown(void);
+int sip_dialog_table_sockfd(void);
+
+// 對話生命週期
+sip_dialog_t* sip_dialog_create(const char *callee);
+void sip_dialog_destroy(sip_dialog_t *dialog);
+// 以快照記錄在原槽位重建已接通的對話 (見 sip_snapshot.h)；槽位被佔用時返回 NULL
+struct sip_snapshot_record;
+sip_dialog_t* sip_dialog_restore(const struct sip_snapshot_record *rec);
+
+// 非阻塞介面 (可從任意線程調用；結果經由 on_state_change 通知)
+// RTP 接收器應在 sip_dialog_start_call 之前於 session.local_rtp_port 上建立，才能收到早期媒體
+int sip_dialog_start_call(sip_dialog_t *dialog);
+int sip_dialog_hangup(sip_dialog_t *dialog);
+void sip_dialog_set_max_duration(sip_dialog_t *dialog, int seconds);
+// 對方以 BYE 結束通話 (BYE 已回應 200)：對話轉為 TERMINATED，由 on_state_change 立即拆除媒體
+int sip_dialog_remote_bye(sip_dialog_t *dialog, const char *callid);
+// 對方在通話中改變了媒體：更新快照並通知 on_media_change
+void sip_dialog_media_changed(sip_dialog_t *dialog);
+
+// 阻塞式介面 (不可在事件循環線程中調用)
+int sip_dialog_call(sip_dialog_t *dialog);
+void sip_dialog_bye(sip_dialog_t *dialog);
+
+// 查詢
+sip_dialog_t* sip_dialog_get(int index);
+sip_dialog_t* sip_dialog_find(const char *callid, const char *local_tag);
+int sip_dialog_active_count(void);
+
+#endif // SIP_DIALOG_H
@@ -0,0 +1,462 @@
+// sip_gateway.c - 實現網關清單、OPTIONS 健康探測與加權選擇
+#include "sip_gateway.h"
+#include "sip_transaction.h"
+#include "sip_transport.h"
+#include "sip_id.h"
+#include <netdb.h>
+
+// 網關清單與探測狀態 (只在事件循環線程中存取)
+static sip_gateway_t gateways[SIP_MAX_GATEWAYS];
+static int gateway_count = 0;
+static int gateway_built = 0;             // 0: 下次使用時依設定重建
+static unsigned int gateway_generation = 0;
+
+// 主機名的解析結果：事件循環線程只查詢快取，getaddrinfo 在 sip_gateway_prepare 或輔助線程中執行
+#define GATEWAY_HOST_CACHE (SIP_MAX_GATEWAYS * 2)
+typedef struct {
+    char host[64];
+    struct in_addr addr;
+} gateway_host_t;
+
+static gateway_host_t resolved_hosts[GATEWAY_HOST_CACHE];
+static int resolved_next = 0;
+static unsigned int resolved_generation = 0;     // 已開始解析的設定版本
+static int resolved_valid = 0;                    // resolved_generation 有效
+static pthread_mutex_t resolve_lock = PTHREAD_MUTEX_INITIALIZER;
+
+typedef struct {
+    int count;
+    char hosts[SIP_MAX_GATEWAYS + 1][64];
+} gateway_resolve_job_t;
+
+static void gateway_probe_tick(void *arg);
+static void gateway_rebuild(void);
+
+static int same_addr(const struct sockaddr_in *a, const struct sockaddr_in *b) {
+    return a->sin_addr.s_addr == b->sin_addr.s_addr && a->sin_port == b->sin_port;
+}
+
+// 阻塞解析主機名 (不可在事件循環線程中調用)
+static int host_lookup(const char *host, struct in_addr *addr) {
+    struct addrinfo hints, *res;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_DGRAM;
+    if (getaddrinfo(host, NULL, &hints, &res) != 0) return -1;
+    *addr = ((struct sockaddr_in *)res->ai_addr)->sin_addr;
+    freeaddrinfo(res);
+    return 0;
+}
+
+static gateway_host_t* host_cache_find(const char *host) {
+    for (int i = 0; i < GATEWAY_HOST_CACHE; i++) {
+        if (resolved_hosts[i].host[0] && strcmp(resolved_hosts[i].host, host) == 0) return &resolved_hosts[i];
+    }
+    return NULL;
+}
+
+// 記錄解析結果，返回地址是否改變 (調用者持有 resolve_lock)
+static int host_cache_store(const char *host, const struct in_addr *addr) {
+    gateway_host_t *entry = host_cache_find(host);
+    if (entry) {
+        int changed = entry->addr.s_addr != addr->s_addr;
+        entry->addr = *addr;
+        return changed;
+    }
+    entry = &resolved_hosts[resolved_next];
+    resolved_next = (resolved_next + 1) % GATEWAY_HOST_CACHE;
+    snprintf(entry->host, sizeof(entry->host), "%s", host);
+    entry->addr = *addr;
+    return 1;
+}
+
+// 設定中需要解析的主機名 (IP 字面值不需要)
+static void collect_hosts(gateway_resolve_job_t *job) {
+    const sip_config_t *cfg = sip_config();
+    struct in_addr literal;
+
+    job->count = 0;
+    if (inet_pton(AF_INET, cfg->sip_server, &literal) != 1) {
+        snprintf(job->hosts[job->count++], sizeof(job->hosts[0]), "%s", cfg->sip_server);
+    }
+    for (int i = 0; i < cfg->trunk_count; i++) {
+        if (inet_pton(AF_INET, cfg->trunks[i].host, &literal) != 1) {
+            snprintf(job->hosts[job->count++], sizeof(job->hosts[0]), "%s", cfg->trunks[i].host);
+        }
+    }
+}
+
+// 解析完成 (在事件循環線程中執行)：地址有改變時以新的地址重建清單並重新開始探測
+static void gateway_resolved_task(void *arg) {
+    if (arg && gateway_built) {
+        gateway_rebuild();
+    }
+}
+
+static void* gateway_resolve_thread(void *arg) {
+    gateway_resolve_job_t *job = (gateway_resolve_job_t *)arg;
+    struct in_addr addr;
+    intptr_t changed = 0;
+
+    for (int i = 0; i < job->count; i++) {
+        if (host_lookup(job->hosts[i], &addr) != 0) {
+            log_with_timestamp("警告: 無法解析網關地址 %s\n", job->hosts[i]);
+            continue;
+        }
+        pthread_mutex_lock(&resolve_lock);
+        changed |= host_cache_store(job->hosts[i], &addr);
+        pthread_mutex_unlock(&resolve_lock);
+    }
+    free(job);
+    sip_reactor_post(gateway_resolved_task, (void *)changed);
+    return NULL;
+}
+
+// 設定重新載入後在輔助線程中重新解析所有主機名 (DNS 可能已改變)，清單先沿用快取中的地址
+static void gateway_resolve_async(void) {
+    unsigned int generation = sip_config()->generation;
+    pthread_t tid;
+
+    pthread_mutex_lock(&resolve_lock);
+    int started = resolved_valid && resolved_generation == generation;
+    resolved_generation = generation;
+    resolved_valid = 1;
+    pthread_mutex_unlock(&resolve_lock);
+    if (started) return;
+
+    gateway_resolve_job_t *job = malloc(sizeof(gateway_resolve_job_t));
+    if (!job) return;
+    collect_hosts(job);
+    if (job->count == 0 || pthread_create(&tid, NULL, gateway_resolve_thread, job) != 0) {
+        free(job);
+        return;
+    }
+    pthread_detach(tid);
+}
+
+void sip_gateway_prepare(void) {
+    gateway_resolve_job_t job;
+    struct in_addr addr;
+
+    collect_hosts(&job);
+    for (int i = 0; i < job.count; i++) {
+        if (host_lookup(job.hosts[i], &addr) != 0) continue;
+        pthread_mutex_lock(&resolve_lock);
+        host_cache_store(job.hosts[i], &addr);
+        pthread_mutex_unlock(&resolve_lock);
+    }
+    pthread_mutex_lock(&resolve_lock);
+    resolved_generation = sip_config()->generation;
+    resolved_valid = 1;
+    pthread_mutex_unlock(&resolve_lock);
+}
+
+// 網關地址：IP 字面值直接轉換，主機名只查詢解析快取 (不阻塞事件循環)
+int sip_gateway_resolve(const char *host, int port, struct sockaddr_in *addr) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sin_family = AF_INET;
+    addr->sin_port = htons(port);
+    if (inet_pton(AF_INET, host, &addr->sin_addr) == 1) return 0;
+
+    pthread_mutex_lock(&resolve_lock);
+    gateway_host_t *entry = host_cache_find(host);
+    if (entry) addr->sin_addr = entry->addr;
+    pthread_mutex_unlock(&resolve_lock);
+    return entry ? 0 : -1;
+}
+
+static sip_gateway_t* gateway_find(const struct sockaddr_in *addr) {
+    for (int i = 0; i < gateway_count; i++) {
+        if (same_addr(&gateways[i].addr, addr)) return &gateways[i];
+    }
+    return NULL;
+}
+
+// 有效延遲：失敗率越高，估計的建立呼叫時間越長
+static double gateway_effective_rtt(const sip_gateway_t *gw) {
+    return gw->srtt_ms * (1.0 + SIP_GATEWAY_FAIL_PENALTY * gw->failure_rate);
+}
+
+static void gateway_probe_stop(sip_gateway_t *gw) {
+    sip_timer_stop(&gw->probe_timer);
+    if (gw->probe_txn) {
+        sip_txn_detach(gw->probe_txn);
+        gw->probe_txn = NULL;
+    }
+}
+
+static void gateway_add(const char *name, const char *host, int port, const sip_gateway_t *old, int old_count) {
+    sip_gateway_t *gw = &gateways[gateway_count];
+    struct sockaddr_in addr;
+
+    if (sip_gateway_resolve(host, port, &addr) != 0) {
+        log_with_timestamp("警告: 網關 %s 的地址 %s 尚未解析，解析完成前略過\n", name, host);
+        return;
+    }
+
+    // 地址不變的網關沿用統計與探測的 Call-ID
+    const sip_gateway_t *prev = NULL;
+    for (int i = 0; i < old_count; i++) {
+        if (same_addr(&old[i].addr, &addr)) {
+            prev = &old[i];
+            break;
+        }
+    }
+    if (prev) {
+        *gw = *prev;
+    } else {
+        memset(gw, 0, sizeof(*gw));
+        gw->up = 1;
+        gw->srtt_ms = SIP_GATEWAY_INITIAL_RTT_MS;
+        sip_id_callid(gw->probe_callid, sizeof(gw->probe_callid), LOCAL_IP);
+        get_tag(gw->probe_tag, sizeof(gw->probe_tag));
+        gw->probe_cseq = 1;
+    }
+    snprintf(gw->name, sizeof(gw->name), "%s", name);
+    snprintf(gw->host, sizeof(gw->host), "%s", host);
+    gw->addr = addr;
+    gw->probe_txn = NULL;
+    sip_timer_init(&gw->probe_timer, gateway_probe_tick, gw);
+    gateway_count++;
+}
+
+// 依目前設定重建網關清單；未設定中繼時只有 sip_server 一個網關，且不探測
+static void gateway_rebuild(void) {
+    const sip_config_t *cfg = sip_config();
+    sip_gateway_t old[SIP_MAX_GATEWAYS];
+    int old_count = gateway_count;
+
+    for (int i = 0; i < gateway_count; i++) {
+        gateway_probe_stop(&gateways[i]);
+    }
+    memcpy(old, gateways, sizeof(old));
+    gateway_count = 0;
+    gateway_resolve_async();
+
+    if (cfg->trunk_count == 0) {
+        gateway_add("default", cfg->sip_server, cfg->sip_port, old, old_count);
+    } else {
+        for (int i = 0; i < cfg->trunk_count; i++) {
+            const sip_trunk_t *trunk = &cfg->trunks[i];
+            gateway_add(trunk->name, trunk->host, trunk->port, old, old_count);
+        }
+    }
+    gateway_generation = cfg->generation;
+    gateway_built = 1;
+
+    if (cfg->trunk_count == 0) return;
+    log_with_timestamp("網關清單: %d 個，OPTIONS 探測間隔 %d ms\n", gateway_count, cfg->gateway_probe_interval_ms);
+    for (int i = 0; i < gateway_count; i++) {
+        log_with_timestamp("  - %s: %s:%d\n", gateways[i].name, gateways[i].host, ntohs(gateways[i].addr.sin_port));
+        // 錯開第一次探測，避免同時發出
+        sip_timer_start(&gateways[i].probe_timer, i * 100);
+    }
+}
+
+static void gateway_ensure(void) {
+    if (!gateway_built || gateway_generation != sip_config()->generation) {
+        gateway_rebuild();
+    }
+}
+
+// 更新統計；連續失敗達到門檻時標記為不可用，之後第一次成功即恢復
+static void gateway_record(sip_gateway_t *gw, int status_code, int latency_ms) {
+    int failed = status_code == 408 || (status_code >= 500 && status_code < 600);
+
+    gw->requests++;
+    gw->failure_rate += SIP_GATEWAY_FAIL_ALPHA * ((failed ? 1.0 : 0.0) - gw->failure_rate);
+    if (failed) {
+        gw->failures++;
+        if (++gw->consecutive_failures >= SIP_GATEWAY_DOWN_THRESHOLD && gw->up) {
+            gw->up = 0;
+            log_with_timestamp("網關 %s (%s:%d) 連續 %d 次失敗 (%d)，標記為不可用\n",
+                             gw->name, gw->host, ntohs(gw->addr.sin_port), gw->consecutive_failures, status_code);
+        }
+        return;
+    }
+
+    gw->consecutive_failures = 0;
+    if (latency_ms >= 0) {
+        if (gw->samples++ == 0) {
+            gw->srtt_ms = latency_ms;
+        } else {
+            gw->srtt_ms += SIP_GATEWAY_RTT_ALPHA * (latency_ms - gw->srtt_ms);
+        }
+    }
+    if (!gw->up) {
+        gw->up = 1;
+        log_with_timestamp("網關 %s (%s:%d) 已恢復，延遲 %.1f ms\n",
+                         gw->name, gw->host, ntohs(gw->addr.sin_port), gw->srtt_ms);
+    }
+}
+
+// ---- OPTIONS 探測 ----
+
+static void on_probe_response(sip_transaction_t *txn, int status_code, const sip_msg_t *msg, void *user_data) {
+    sip_gateway_t *gw = (sip_gateway_t *)user_data;
+    (void)txn;
+
+    if (status_code < 200) return;
+    gw->probe_txn = NULL;
+    // 任何來自網關的最終回應 (含 404/405) 都表示網關在線
+    gateway_record(gw, status_code, msg ? (int)(sip_now_ms() - gw->probe_sent_ms) : -1);
+}
+
+static void gateway_send_probe(sip_gateway_t *gw) {
+    char request[BUF_SIZE];
+    char branch[64];
+    int sockfd = sip_transport_sockfd();
+
+    if (sockfd < 0) return;
+    get_branch(branch, sizeof(branch));
+    int len = snprintf(request, sizeof(request),
+        "OPTIONS sip:%s:%d SIP/2.0\r\n"
+        "Via: SIP/2.0/%s %s:%d;branch=%s\r\n"
+        "Max-Forwards: 70\r\n"
+        "From: <sip:%s@%s>;tag=%s\r\n"
+        "To: <sip:%s:%d>\r\n"
+        "Call-ID: %s\r\n"
+        "CSeq: %u OPTIONS\r\n"
+        "Contact: <sip:%s@%s:%d%s>\r\n"
+        "Accept: application/sdp\r\n"
+        "User-Agent: Custom SIP Client\r\n"
+        "Content-Length: 0\r\n"
+        "\r\n",
+        gw->host, ntohs(gw->addr.sin_port),
+        sip_transport_via(), LOCAL_IP, LOCAL_PORT, branch,
+        USERNAME, SIP_SERVER, gw->probe_tag,
+        gw->host, ntohs(gw->addr.sin_port),
+        gw->probe_callid,
+        gw->probe_cseq++,
+        USERNAME, LOCAL_IP, LOCAL_PORT, sip_transport_uri_param());
+    if (len < 0 || len >= (int)sizeof(request)) return;
+
+    gw->probe_sent_ms = sip_now_ms();
+    gw->probe_txn = sip_txn_client_start(sockfd, &gw->addr, request, len, on_probe_response, gw);
+}
+
+static void gateway_probe_tick(void *arg) {
+    sip_gateway_t *gw = (sip_gateway_t *)arg;
+    const sip_config_t *cfg = sip_config();
+
+    // 設定已重新載入：重建清單並重新排程所有探測
+    if (gateway_generation != cfg->generation) {
+        gateway_rebuild();
+        return;
+    }
+
+    if (gw->probe_txn) {
+        // 上一次探測在一個探測間隔內沒有最終回應
+        sip_txn_detach(gw->probe_txn);
+        gw->probe_txn = NULL;
+        gateway_record(gw, 408, -1);
+    }
+    gateway_send_probe(gw);
+
+    int interval = cfg->gateway_probe_interval_ms;
+    if (!gw->up) interval /= SIP_GATEWAY_DOWN_PROBE_DIVISOR;
+    sip_timer_start(&gw->probe_timer, interval);
+}
+
+// ---- 選擇與回報 ----
+
+int sip_gateway_select(const struct sockaddr_in *exclude, int exclude_count,
+                       struct sockaddr_in *addr, char *host, size_t host_size) {
+    double weights[SIP_MAX_GATEWAYS];
+    double total = 0;
+    int fallback = -1;
+    int max_calls = sip_config()->trunk_max_calls;
+
+    gateway_ensure();
+
+    // 可用網關的權重與有效延遲的平方成反比：延遲加倍，分到的呼叫約為四分之一
+    for (int i = 0; i < gateway_count; i++) {
+        const sip_gateway_t *gw = &gateways[i];
+        int excluded = 0;
+
+        weights[i] = 0;
+        for (int j = 0; j < exclude_count; j++) {
+            if (same_addr(&exclude[j], &gw->addr)) {
+                excluded = 1;
+                break;
+            }
+        }
+        if (excluded) continue;
+        // 已滿的中繼即使是唯一的網關也不選擇
+        if (max_calls > 0 && gw->active_calls >= max_calls) continue;
+
+        double rtt = gateway_effective_rtt(gw) + 1.0;
+        if (gw->up) {
+            weights[i] = 1.0 / (rtt * rtt);
+            total += weights[i];
+        } else if (fallback < 0 || rtt < gateway_effective_rtt(&gateways[fallback]) + 1.0) {
+            fallback = i;
+        }
+    }
+
+    // 沒有可用網關時選擇有效延遲最低的不可用網關
+    int chosen = fallback;
+    if (total > 0) {
+        double r = (double)sip_id_u32() / 4294967296.0 * total;
+        for (int i = 0; i < gateway_count; i++) {
+            if (weights[i] <= 0) continue;
+            chosen = i;
+            r -= weights[i];
+            if (r < 0) break;
+        }
+    }
+    if (chosen < 0) return -1;
+
+    const sip_gateway_t *gw = &gateways[chosen];
+    *addr = gw->addr;
+    snprintf(host, host_size, "%s", gw->host);
+    if (gateway_count > 1) {
+        log_with_timestamp("選擇網關 %s (%s:%d)%s，延遲 %.1f ms，失敗率 %.0f%%\n",
+                         gw->name, gw->host, ntohs(gw->addr.sin_port), gw->up ? "" : " [不可用]",
+                         gw->srtt_ms, gw->failure_rate * 100);
+    }
+    return 0;
+}
+
+void sip_gateway_report(const struct sockaddr_in *addr, int status_code, int latency_ms) {
+    sip_gateway_t *gw = gateway_find(addr);
+    if (gw) {
+        gateway_record(gw, status_code, latency_ms);
+    }
+}
+
+int sip_gateway_count(void) {
+    gateway_ensure();
+    return gateway_count;
+}
+
+void sip_gateway_call_begin(const struct sockaddr_in *addr) {
+    sip_gateway_t *gw = gateway_find(addr);
+    if (gw) {
+        gw->active_calls++;
+    }
+}
+
+void sip_gateway_call_end(const struct sockaddr_in *addr) {
+    sip_gateway_t *gw = gateway_find(addr);
+    if (gw && gw->active_calls > 0) {
+        gw->active_calls--;
+    }
+}
+
+static void gateway_stop_task(void *arg) {
+    (void)arg;
+    for (int i = 0; i < gateway_count; i++) {
+        gateway_probe_stop(&gateways[i]);
+    }
+    // 保留統計；下次選擇網關時重建清單並重新開始探測
+    gateway_built = 0;
+}
+
+void sip_gateway_stop(void) {
+    if (sip_reactor_in_thread()) {
+        gateway_stop_task(NULL);
+    } else {
+        sip_reactor_run_sync(gateway_stop_task, NULL);
+    }
+}
@@ -0,0 +1,58 @@
+// sip_gateway.h - 多網關出局路由：以 OPTIONS 探測各網關的延遲與失敗率，每通呼叫依加權最低延遲選擇網關
+#ifndef SIP_GATEWAY_H
+#define SIP_GATEWAY_H
+
+#include "sip_client.h"
+
+#define SIP_MAX_GATEWAYS SIP_MAX_TRUNKS       // 網關清單來自設定的中繼清單
+#define SIP_GATEWAY_INITIAL_RTT_MS 100        // 尚無延遲樣本時的估計值
+#define SIP_GATEWAY_RTT_ALPHA 0.125           // 延遲 EWMA 權重 (同 TCP SRTT)
+#define SIP_GATEWAY_FAIL_ALPHA 0.2            // 失敗率 EWMA 權重
+#define SIP_GATEWAY_FAIL_PENALTY 4.0          // 有效延遲 = 延遲 × (1 + 懲罰係數 × 失敗率)
+#define SIP_GATEWAY_DOWN_THRESHOLD 3          // 連續失敗次數達到時標記為不可用
+#define SIP_GATEWAY_DOWN_PROBE_DIVISOR 2      // 不可用的網關以較短間隔探測
+
+typedef struct sip_gateway {
+    char name[32];
+    char host[64];                       // Request-URI 的主機部分 (設定中的原始字串)
+    struct sockaddr_in addr;
+    int up;                              // 0: 連續失敗，只在沒有可用網關時選擇
+    double srtt_ms;                      // 回應延遲的 EWMA (OPTIONS 與 INVITE 第一個回應)
+    double failure_rate;                 // 失敗率的 EWMA (0-1)
+    int samples;
+    int consecutive_failures;
+    unsigned long requests;
+    unsigned long failures;
+    int active_calls;                    // 經由此網關進行中的呼叫 (見 sip_gateway_call_begin)
+
+    // OPTIONS 探測 (只在事件循環線程中存取)
+    char probe_callid[64];
+    char probe_tag[32];
+    unsigned int probe_cseq;
+    uint64_t probe_sent_ms;
+    struct sip_transaction *probe_txn;
+    sip_timer_t probe_timer;
+} sip_gateway_t;
+
+// 以下函數須在事件循環線程中調用
+// 選擇網關：略過 exclude 中已嘗試過的地址與通話數已達 trunk_max_calls 的網關；沒有可選網關時返回 -1
+int sip_gateway_select(const struct sockaddr_in *exclude, int exclude_count,
+                       struct sockaddr_in *addr, char *host, size_t host_size);
+// 回報一次請求結果：5xx 與 408 計為失敗，其他回應計為成功 (latency_ms < 0 表示沒有延遲樣本)
+void sip_gateway_report(const struct sockaddr_in *addr, int status_code, int latency_ms);
+// 清單中的網關數 (未設定中繼時為 1：sip_server)
+int sip_gateway_count(void);
+// 呼叫開始經由 / 不再經由某網關時調用，用於每個中繼的同時通話數上限
+void sip_gateway_call_begin(const struct sockaddr_in *addr);
+void sip_gateway_call_end(const struct sockaddr_in *addr);
+
+// 阻塞解析設定中的網關主機名並放入快取 (開啟共用傳輸時在事件循環線程外調用)；
+// 之後設定重新載入時在輔助線程中重新解析，事件循環線程不調用 getaddrinfo
+void sip_gateway_prepare(void);
+// 設定中的主機地址：IP 字面值直接轉換，主機名查詢上述快取；未解析時返回 -1 (可從任意線程調用)
+int sip_gateway_resolve(const char *host, int port, struct sockaddr_in *addr);
+
+// 停止探測 (共用SIP傳輸關閉前調用；可從任意線程調用)
+void sip_gateway_stop(void);
+
+#endif // SIP_GATEWAY_H
@@ -0,0 +1,198 @@
+// sip_id.c - 實現以 ChaCha20 為核心的識別碼產生器
+#include "sip_id.h"
+#include "sip_client.h"
+#include <sys/random.h>
+
+// 每個線程的產生器狀態：input 為 ChaCha20 的常數、金鑰、64 位元區塊計數器與 nonce
+typedef struct {
+    uint32_t input[16];
+    uint8_t block[64];
+    unsigned int used;              // block 中已輸出的位元組數
+    unsigned int blocks;            // 自上次播種以來產生的區塊數
+    unsigned int generation;        // 播種時的 fork 世代
+    int seeded;
+} id_state_t;
+
+static __thread id_state_t id_state;
+static unsigned int id_fork_generation = 0;
+static pthread_once_t id_once = PTHREAD_ONCE_INIT;
+
+// fork 後子進程與父進程持有相同的狀態，必須重新播種以免產生相同的識別碼
+static void id_on_fork_child(void) {
+    __atomic_add_fetch(&id_fork_generation, 1, __ATOMIC_RELAXED);
+}
+
+static void id_register_atfork(void) {
+    pthread_atfork(NULL, NULL, id_on_fork_child);
+}
+
+#define ROTL32(v, n) (((v) << (n)) | ((v) >> (32 - (n))))
+#define QUARTER_ROUND(a, b, c, d) do {              \
+    a += b; d ^= a; d = ROTL32(d, 16);              \
+    c += d; b ^= c; b = ROTL32(b, 12);              \
+    a += b; d ^= a; d = ROTL32(d, 8);               \
+    c += d; b ^= c; b = ROTL32(b, 7);               \
+} while (0)
+
+static uint32_t load_le32(const uint8_t *p) {
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+// ChaCha20 區塊函數 (RFC 8439 2.3)
+static void chacha20_block(const uint32_t in[16], uint8_t out[64]) {
+    uint32_t x[16];
+
+    memcpy(x, in, sizeof(x));
+    for (int i = 0; i < 10; i++) {
+        QUARTER_ROUND(x[0], x[4], x[8], x[12]);
+        QUARTER_ROUND(x[1], x[5], x[9], x[13]);
+        QUARTER_ROUND(x[2], x[6], x[10], x[14]);
+        QUARTER_ROUND(x[3], x[7], x[11], x[15]);
+        QUARTER_ROUND(x[0], x[5], x[10], x[15]);
+        QUARTER_ROUND(x[1], x[6], x[11], x[12]);
+        QUARTER_ROUND(x[2], x[7], x[8], x[13]);
+        QUARTER_ROUND(x[3], x[4], x[9], x[14]);
+    }
+    for (int i = 0; i < 16; i++) {
+        uint32_t v = x[i] + in[i];
+        out[i * 4] = (uint8_t)v;
+        out[i * 4 + 1] = (uint8_t)(v >> 8);
+        out[i * 4 + 2] = (uint8_t)(v >> 16);
+        out[i * 4 + 3] = (uint8_t)(v >> 24);
+    }
+}
+
+// 讀取核心熵源：優先使用 getrandom，不可用時退回 /dev/urandom
+static int id_read_entropy(uint8_t *buf, size_t len) {
+    size_t got = 0;
+
+    while (got < len) {
+        ssize_t n = getrandom(buf + got, len - got, 0);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        got += n;
+    }
+    if (got == len) return 0;
+
+    int fd = open("/dev/urandom", O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+    while (got < len) {
+        ssize_t n = read(fd, buf + got, len - got);
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR) continue;
+            break;
+        }
+        got += n;
+    }
+    close(fd);
+    return got == len ? 0 : -1;
+}
+
+static void id_seed(id_state_t *st) {
+    uint8_t seed[40];   // 32 字節金鑰 + 8 字節 nonce
+
+    if (id_read_entropy(seed, sizeof(seed)) != 0) {
+        // 最後手段：不足以抵抗預測，但仍保證不同線程與進程的序列不同
+        log_with_timestamp("警告: 無法讀取系統隨機數，識別碼改以時間與進程資訊播種\n");
+        uint64_t mix[5] = { sip_now_us(), (uint64_t)getpid(), (uint64_t)(uintptr_t)st,
+                            (uint64_t)time(NULL), (uint64_t)pthread_self() };
+        memcpy(seed, mix, sizeof(seed));
+    }
+
+    st->input[0] = 0x61707865;   // "expand 32-byte k"
+    st->input[1] = 0x3320646e;
+    st->input[2] = 0x79622d32;
+    st->input[3] = 0x6b206574;
+    for (int i = 0; i < 8; i++) {
+        st->input[4 + i] = load_le32(seed + i * 4);
+    }
+    st->input[12] = 0;
+    st->input[13] = 0;
+    st->input[14] = load_le32(seed + 32);
+    st->input[15] = load_le32(seed + 36);
+    memset(seed, 0, sizeof(seed));
+
+    st->used = sizeof(st->block);
+    st->blocks = 0;
+    st->generation = __atomic_load_n(&id_fork_generation, __ATOMIC_RELAXED);
+    st->seeded = 1;
+}
+
+static id_state_t* id_get_state(void) {
+    id_state_t *st = &id_state;
+
+    if (!st->seeded || st->blocks >= SIP_ID_RESEED_BLOCKS ||
+        st->generation != __atomic_load_n(&id_fork_generation, __ATOMIC_RELAXED)) {
+        pthread_once(&id_once, id_register_atfork);
+        id_seed(st);
+    }
+    return st;
+}
+
+void sip_id_random(void *buf, size_t len) {
+    id_state_t *st = id_get_state();
+    uint8_t *out = (uint8_t *)buf;
+
+    while (len > 0) {
+        if (st->used == sizeof(st->block)) {
+            chacha20_block(st->input, st->block);
+            if (++st->input[12] == 0) st->input[13]++;
+            st->blocks++;
+            st->used = 0;
+        }
+        size_t n = sizeof(st->block) - st->used;
+        if (n > len) n = len;
+        memcpy(out, st->block + st->used, n);
+        st->used += n;
+        out += n;
+        len -= n;
+    }
+}
+
+uint32_t sip_id_u32(void) {
+    uint32_t v;
+    sip_id_random(&v, sizeof(v));
+    return v;
+}
+
+// RFC 3550 8.1：SSRC 隨機選擇，不同進程與通話之間不可重複
+uint32_t sip_id_ssrc(void) {
+    return sip_id_u32();
+}
+
+// nbytes 個隨機位元組的十六進位字串寫入 out (需有 2 * nbytes + 1 字節)
+static void id_hex(char *out, size_t nbytes) {
+    static const char hex[] = "0123456789abcdef";
+    uint8_t bytes[32];
+
+    sip_id_random(bytes, nbytes);
+    for (size_t i = 0; i < nbytes; i++) {
+        out[i * 2] = hex[bytes[i] >> 4];
+        out[i * 2 + 1] = hex[bytes[i] & 0x0f];
+    }
+    out[nbytes * 2] = '\0';
+}
+
+void sip_id_tag(char *buf, size_t len) {
+    char hex[SIP_ID_TAG_BYTES * 2 + 1];
+    id_hex(hex, SIP_ID_TAG_BYTES);
+    snprintf(buf, len, "%s", hex);
+}
+
+void sip_id_callid(char *buf, size_t len, const char *host) {
+    char hex[SIP_ID_CALLID_BYTES * 2 + 1];
+    id_hex(hex, SIP_ID_CALLID_BYTES);
+    if (host && *host) {
+        snprintf(buf, len, "%s@%s", hex, host);
+    } else {
+        snprintf(buf, len, "%s", hex);
+    }
+}
+
+void sip_id_branch(char *buf, size_t len) {
+    char hex[SIP_ID_BRANCH_BYTES * 2 + 1];
+    id_hex(hex, SIP_ID_BRANCH_BYTES);
+    snprintf(buf, len, SIP_ID_BRANCH_COOKIE "%s", hex);
+}
@@ -0,0 +1,24 @@
+// sip_id.h - 識別碼產生器：每個線程一份 ChaCha20 狀態 (以 getrandom 播種)，產生 Call-ID、tag、branch 與 SSRC
+#ifndef SIP_ID_H
+#define SIP_ID_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SIP_ID_BRANCH_COOKIE "z9hG4bK"       // RFC 3261 8.1.1.7 magic cookie
+#define SIP_ID_TAG_BYTES 8                   // tag 的隨機位元組數 (RFC 3261 19.3 要求至少 32 位元)
+#define SIP_ID_CALLID_BYTES 12
+#define SIP_ID_BRANCH_BYTES 12
+#define SIP_ID_RESEED_BLOCKS (1u << 20)      // 每個線程產生 64MB 後重新播種
+
+// 以下函數可從任意線程調用，無鎖；fork 後子進程自動重新播種
+void sip_id_random(void *buf, size_t len);
+uint32_t sip_id_u32(void);
+uint32_t sip_id_ssrc(void);
+
+// 以十六進位字串輸出 (buf 太小時截斷，仍以 NUL 結尾)
+void sip_id_tag(char *buf, size_t len);
+void sip_id_callid(char *buf, size_t len, const char *host);
+void sip_id_branch(char *buf, size_t len);
+
+#endif // SIP_ID_H
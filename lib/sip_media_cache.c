@@ -0,0 +1,344 @@
+// sip_media_cache.c - 實現提示音快取 (雜湊表與 LRU 串列以一個互斥鎖保護，項目內容建立後不再修改)
+#include "sip_media_cache.h"
+#include "sip_client.h"
+#include "sip_config.h"
+
+struct sip_prompt {
+    char path[512];
+    const unsigned char *payload[2];     // [0] PCMU、[1] PCMA，都指向 data
+    size_t length;
+    size_t bytes;                        // 計入快取大小的字節數
+
+    // 載入時檔案的修改時間與大小 (之後不同表示檔案在快取外被修改)
+    struct timespec mtime;
+    off_t file_size;
+
+    // 以下由 cache_lock 保護
+    int refs;
+    int cached;                          // 仍在雜湊表與 LRU 串列中
+    struct sip_prompt *hash_next;
+    struct sip_prompt *lru_prev;         // 較近使用
+    struct sip_prompt *lru_next;         // 較久未使用
+    unsigned char data[];
+};
+
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static sip_prompt_t *cache_hash[SIP_MEDIA_CACHE_HASH_SIZE];
+static sip_prompt_t *lru_head = NULL;    // 最近使用
+static sip_prompt_t *lru_tail = NULL;    // 最久未使用
+static size_t cache_bytes = 0;
+static sip_media_cache_stats_t stats;
+
+static unsigned int cache_hash_key(const char *path) {
+    unsigned int h = 2166136261u;
+    while (*path) {
+        h ^= (unsigned char)*path++;
+        h *= 16777619u;
+    }
+    return h & (SIP_MEDIA_CACHE_HASH_SIZE - 1);
+}
+
+static uint16_t read_le16(const unsigned char *p) {
+    return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+static uint32_t read_le32(const unsigned char *p) {
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+// 找出音頻數據的位置與編碼：RIFF 檔案依 fmt 與 data 區塊解析 (頭部長度因產生工具而異)，
+// 其他內容沿用舊格式，視為 WAV_HEADER_SIZE 字節頭部之後的 μ-law
+static int media_parse_wav(const char *path, const unsigned char *wav, size_t size,
+                           size_t *offset, size_t *length, int *alaw) {
+    if (size < 12 || memcmp(wav, "RIFF", 4) != 0 || memcmp(wav + 8, "WAVE", 4) != 0) {
+        if (size <= WAV_HEADER_SIZE) {
+            log_with_timestamp("WAV 文件沒有可播放的音頻: %s\n", path);
+            return -1;
+        }
+        *offset = WAV_HEADER_SIZE;
+        *length = size - WAV_HEADER_SIZE;
+        *alaw = 0;
+        return 0;
+    }
+
+    int format = -1, channels = 0;
+    uint32_t rate = 0;
+    size_t pos = 12;
+    *length = 0;
+    while (pos + 8 <= size) {
+        uint32_t chunk = read_le32(wav + pos + 4);
+        size_t body = pos + 8;
+        if (memcmp(wav + pos, "fmt ", 4) == 0 && chunk >= 16 && body + 16 <= size) {
+            format = read_le16(wav + body);
+            channels = read_le16(wav + body + 2);
+            rate = read_le32(wav + body + 4);
+        } else if (memcmp(wav + pos, "data", 4) == 0) {
+            *offset = body;
+            *length = chunk < size - body ? chunk : size - body;
+            break;
+        }
+        if (chunk > size - body) break;
+        pos = body + chunk + (chunk & 1);
+    }
+
+    // 6 = A-law、7 = μ-law
+    if ((format != 6 && format != 7) || channels != 1 || rate != 8000) {
+        log_with_timestamp("不支援的 WAV 格式: %s (格式 %d，%d 聲道，%u Hz；需要 8000Hz 單聲道 G.711)\n",
+                          path, format, channels, rate);
+        return -1;
+    }
+    if (*length == 0) {
+        log_with_timestamp("WAV 文件沒有可播放的音頻: %s\n", path);
+        return -1;
+    }
+    *alaw = format == 6;
+    return 0;
+}
+
+// 建立項目：兩種編碼各一份，之後播放不再轉碼
+static sip_prompt_t* media_build(const char *path, const unsigned char *wav, size_t size, const struct stat *st) {
+    size_t offset, length;
+    int alaw;
+
+    if (media_parse_wav(path, wav, size, &offset, &length, &alaw) != 0) return NULL;
+
+    sip_prompt_t *prompt = malloc(sizeof(sip_prompt_t) + 2 * length);
+    if (!prompt) {
+        log_with_timestamp("錯誤: 無法分配提示音快取 (%zu 字節): %s\n", 2 * length, path);
+        return NULL;
+    }
+    memset(prompt, 0, sizeof(*prompt));
+    snprintf(prompt->path, sizeof(prompt->path), "%s", path);
+    prompt->length = length;
+    prompt->bytes = sizeof(sip_prompt_t) + 2 * length;
+    prompt->mtime = st->st_mtim;
+    prompt->file_size = st->st_size;
+
+    unsigned char *ulaw = prompt->data;
+    unsigned char *alaw_data = prompt->data + length;
+    memcpy(ulaw, wav + offset, length);
+    memcpy(alaw_data, wav + offset, length);
+    if (alaw) {
+        rtp_alaw_to_ulaw(ulaw, length);
+    } else {
+        rtp_ulaw_to_alaw(alaw_data, length);
+    }
+    prompt->payload[0] = ulaw;
+    prompt->payload[1] = alaw_data;
+    return prompt;
+}
+
+static sip_prompt_t* media_load(const char *path) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+
+    if (fd < 0) {
+        log_with_timestamp("錯誤: 無法打開WAV文件 %s: %s\n", path, strerror(errno));
+        return NULL;
+    }
+    if (fstat(fd, &st) < 0 || st.st_size <= 0) {
+        log_with_timestamp("錯誤: 無法讀取WAV文件 %s\n", path);
+        close(fd);
+        return NULL;
+    }
+
+    size_t size = (size_t)st.st_size;
+    unsigned char *wav = malloc(size);
+    size_t done = 0;
+    while (wav && done < size) {
+        ssize_t n = read(fd, wav + done, size - done);
+        if (n <= 0) break;
+        done += (size_t)n;
+    }
+    close(fd);
+
+    sip_prompt_t *prompt = wav ? media_build(path, wav, done, &st) : NULL;
+    free(wav);
+    return prompt;
+}
+
+static int media_unchanged(const sip_prompt_t *prompt, const struct stat *st) {
+    return prompt->file_size == st->st_size &&
+           prompt->mtime.tv_sec == st->st_mtim.tv_sec && prompt->mtime.tv_nsec == st->st_mtim.tv_nsec;
+}
+
+static sip_prompt_t* cache_lookup(const char *path) {
+    for (sip_prompt_t *p = cache_hash[cache_hash_key(path)]; p; p = p->hash_next) {
+        if (strcmp(p->path, path) == 0) return p;
+    }
+    return NULL;
+}
+
+static void lru_remove(sip_prompt_t *prompt) {
+    if (prompt->lru_prev) prompt->lru_prev->lru_next = prompt->lru_next;
+    else lru_head = prompt->lru_next;
+    if (prompt->lru_next) prompt->lru_next->lru_prev = prompt->lru_prev;
+    else lru_tail = prompt->lru_prev;
+    prompt->lru_prev = prompt->lru_next = NULL;
+}
+
+static void lru_push_front(sip_prompt_t *prompt) {
+    prompt->lru_prev = NULL;
+    prompt->lru_next = lru_head;
+    if (lru_head) lru_head->lru_prev = prompt;
+    lru_head = prompt;
+    if (!lru_tail) lru_tail = prompt;
+}
+
+// 移出快取 (持有 cache_lock)；沒有引用時立即釋放，否則在最後一個引用釋放時回收
+static void cache_unlink(sip_prompt_t *prompt) {
+    sip_prompt_t **link = &cache_hash[cache_hash_key(prompt->path)];
+    while (*link && *link != prompt) link = &(*link)->hash_next;
+    if (*link) *link = prompt->hash_next;
+    prompt->hash_next = NULL;
+    lru_remove(prompt);
+    prompt->cached = 0;
+    cache_bytes -= prompt->bytes;
+    stats.entries--;
+    if (prompt->refs == 0) free(prompt);
+}
+
+static size_t cache_budget(void) {
+    return (size_t)sip_config()->media_cache_mb * 1024 * 1024;
+}
+
+// 從最久未使用的一端淘汰沒有引用的項目，直到總大小不超過預算 (持有 cache_lock)
+static void cache_evict(void) {
+    size_t budget = cache_budget();
+    sip_prompt_t *p = lru_tail;
+
+    while (cache_bytes > budget && p) {
+        sip_prompt_t *prev = p->lru_prev;
+        if (p->refs == 0) {
+            cache_unlink(p);
+            stats.evictions++;
+        }
+        p = prev;
+    }
+}
+
+// 加入快取並取代同一路徑的舊項目 (持有 cache_lock)，返回是否已加入；預算為 0 或單一項目超過預算時不快取。
+// 新項目本身不會被這次淘汰 (其他項目都在播放時暫時超出預算，之後釋放引用時再淘汰)
+static int cache_insert(sip_prompt_t *prompt) {
+    sip_prompt_t *old = cache_lookup(prompt->path);
+    if (old) cache_unlink(old);
+
+    if (prompt->bytes > cache_budget()) return 0;
+    unsigned int key = cache_hash_key(prompt->path);
+    prompt->hash_next = cache_hash[key];
+    cache_hash[key] = prompt;
+    lru_push_front(prompt);
+    prompt->cached = 1;
+    cache_bytes += prompt->bytes;
+    stats.entries++;
+    prompt->refs++;
+    cache_evict();
+    prompt->refs--;
+    return 1;
+}
+
+int sip_media_cache_store(const char *path, const unsigned char *wav, size_t size) {
+    struct stat st;
+
+    if (stat(path, &st) != 0) {
+        memset(&st, 0, sizeof(st));
+    }
+    sip_prompt_t *prompt = media_build(path, wav, size, &st);
+    if (!prompt) {
+        pthread_mutex_lock(&cache_lock);
+        stats.load_errors++;
+        pthread_mutex_unlock(&cache_lock);
+        return -1;
+    }
+
+    double seconds = (double)prompt->length / 8000;
+    pthread_mutex_lock(&cache_lock);
+    stats.stores++;
+    int cached = cache_insert(prompt);
+    if (!cached) free(prompt);
+    pthread_mutex_unlock(&cache_lock);
+
+    if (cached) {
+        log_with_timestamp("提示音已快取: %s (%.1f 秒)\n", path, seconds);
+    }
+    return 0;
+}
+
+sip_prompt_t* sip_media_cache_acquire(const char *path) {
+    struct stat st;
+    int have_stat = stat(path, &st) == 0;
+
+    pthread_mutex_lock(&cache_lock);
+    sip_prompt_t *prompt = cache_lookup(path);
+    if (prompt && (!have_stat || media_unchanged(prompt, &st))) {
+        prompt->refs++;
+        lru_remove(prompt);
+        lru_push_front(prompt);
+        stats.hits++;
+        pthread_mutex_unlock(&cache_lock);
+        return prompt;
+    }
+    stats.misses++;
+    pthread_mutex_unlock(&cache_lock);
+
+    // 在鎖外讀取檔案與轉碼，其他通話的播放不受影響
+    prompt = media_load(path);
+
+    pthread_mutex_lock(&cache_lock);
+    if (prompt) {
+        prompt->refs = 1;
+        cache_insert(prompt);
+    } else {
+        stats.load_errors++;
+    }
+    pthread_mutex_unlock(&cache_lock);
+    return prompt;
+}
+
+void sip_media_cache_release(sip_prompt_t *prompt) {
+    if (!prompt) return;
+
+    pthread_mutex_lock(&cache_lock);
+    if (--prompt->refs == 0) {
+        if (!prompt->cached) {
+            free(prompt);
+        } else {
+            cache_evict();       // 播放期間可能超出預算
+        }
+    }
+    pthread_mutex_unlock(&cache_lock);
+}
+
+const unsigned char* sip_prompt_payload(const sip_prompt_t *prompt, int payload_type) {
+    if (!prompt) return NULL;
+    if (payload_type == 0) return prompt->payload[0];
+    if (payload_type == 8) return prompt->payload[1];
+    return NULL;
+}
+
+size_t sip_prompt_length(const sip_prompt_t *prompt) {
+    return prompt ? prompt->length : 0;
+}
+
+void sip_media_cache_get_stats(sip_media_cache_stats_t *out) {
+    pthread_mutex_lock(&cache_lock);
+    *out = stats;
+    out->playing = 0;
+    for (sip_prompt_t *p = lru_head; p; p = p->lru_next) {
+        if (p->refs > 0) out->playing++;
+    }
+    out->bytes = cache_bytes;
+    out->budget = cache_budget();
+    pthread_mutex_unlock(&cache_lock);
+}
+
+int sip_media_cache_format(char *buf, size_t size) {
+    sip_media_cache_stats_t s;
+
+    sip_media_cache_get_stats(&s);
+    int len = snprintf(buf, size,
+                       "media_cache entries=%d playing=%d bytes=%zu budget=%zu hits=%lu misses=%lu stores=%lu evictions=%lu errors=%lu\n",
+                       s.entries, s.playing, s.bytes, s.budget, s.hits, s.misses, s.stores, s.evictions, s.load_errors);
+    if (len < 0) return 0;
+    return (size_t)len < size ? len : (int)size - 1;
+}
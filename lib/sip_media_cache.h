@@ -0,0 +1,43 @@
+// sip_media_cache.h - 提示音快取：上傳 (或第一次播放) 時解析 WAV 一次，把音頻存成 PCMU 與 PCMA 兩份連續的
+// RTP 負載 (第 n 個封包即 payload + n × 封包字節數)，所有通話以引用計數唯讀共用；
+// 總大小超過 media_cache_mb 時淘汰最久未使用且沒有通話在播放的項目
+#ifndef SIP_MEDIA_CACHE_H
+#define SIP_MEDIA_CACHE_H
+
+#include <stddef.h>
+
+#define SIP_MEDIA_CACHE_HASH_SIZE 256    // 以檔案路徑雜湊的桶數 (2 的冪)
+
+typedef struct sip_prompt sip_prompt_t;
+
+// 統計 (自啟動起累計；entries、bytes 與 budget 為目前值)
+typedef struct {
+    unsigned long hits;
+    unsigned long misses;                // 需從檔案載入 (含檔案已在快取外被修改)
+    unsigned long stores;                // 上傳時建立
+    unsigned long evictions;
+    unsigned long load_errors;
+    int entries;
+    int playing;                         // 有通話在播放的快取項目數
+    size_t bytes;
+    size_t budget;
+} sip_media_cache_stats_t;
+
+// 以上傳的 WAV 內容建立 (或取代) path 的項目；檔案須已寫入 path (記錄修改時間以偵測之後的變更)。
+// 正在播放舊內容的通話不受影響，舊項目在最後一個引用釋放時回收；格式不支援時返回 -1
+int sip_media_cache_store(const char *path, const unsigned char *wav, size_t size);
+// 取得 path 的音頻 (可從任意線程調用)：快取中沒有或檔案已變更時從檔案載入；
+// 返回的項目在 sip_media_cache_release 前保持有效且不變，失敗返回 NULL
+sip_prompt_t* sip_media_cache_acquire(const char *path);
+void sip_media_cache_release(sip_prompt_t *prompt);
+
+// 協商編碼的負載 (payload_type 0 = PCMU、8 = PCMA)，不支援的編碼返回 NULL
+const unsigned char* sip_prompt_payload(const sip_prompt_t *prompt, int payload_type);
+// 每種編碼的字節數 (G.711 每個樣本 1 字節，8000Hz)
+size_t sip_prompt_length(const sip_prompt_t *prompt);
+
+void sip_media_cache_get_stats(sip_media_cache_stats_t *out);
+// 以文字格式輸出統計，返回寫入的長度
+int sip_media_cache_format(char *buf, size_t size);
+
+#endif // SIP_MEDIA_CACHE_H
@@ -1,5 +1,12 @@
 // sip_message.c - 實現SIP消息發送相關功能
 #include "sip_client.h"
+#include "sip_transaction.h"
+#include "sip_transport.h"
+#include "sip_dialog.h"
+#include "sip_snapshot.h"
+#include "sip_trace.h"
+
+#define SIP_MAX_ROUTES 16    // 對話路由集合的項目數上限
 
 // 發送ACK請求
 void send_ack(int sockfd, struct sockaddr_in *servaddr, const char *callid, const char *tag, 
@@ -11,29 +18,27 @@ void send_ack(int sockfd, struct sockaddr_in *servaddr, const char *callid, cons
     
     snprintf(buffer, BUF_SIZE,
         "ACK sip:%s@%s SIP/2.0\r\n"
-        "Via: SIP/2.0/UDP %s:%d;branch=%s\r\n"
+        "Via: SIP/2.0/%s %s:%d;branch=%s\r\n"
         "Max-Forwards: 70\r\n"
         "From: \"%s\" <sip:%s@%s>;tag=%s\r\n"
         "To: <sip:%s@%s>;tag=%s\r\n"
         "Call-ID: %s\r\n"
         "CSeq: %d ACK\r\n"
-        "Contact: <sip:%s@%s:%d>\r\n"
+        "Contact: <sip:%s@%s:%d%s>\r\n"
         "User-Agent: Custom SIP Client\r\n"
         "Content-Length: 0\r\n"
         "\r\n",
         CALLEE, SIP_SERVER,
-        LOCAL_IP, LOCAL_PORT, branch,
+        sip_transport_via(), LOCAL_IP, LOCAL_PORT, branch,
         CALLER, USERNAME, SIP_SERVER, tag,
         CALLEE, SIP_SERVER, to_tag,
         callid,
         cseq_num,
-        USERNAME, LOCAL_IP, LOCAL_PORT
+        USERNAME, LOCAL_IP, LOCAL_PORT, sip_transport_uri_param()
     );
     
-    log_with_timestamp("ACK 內容:\n%s\n", buffer);
-    
-    ssize_t sent_bytes = sendto(sockfd, buffer, strlen(buffer), 0, 
-                           (struct sockaddr *)servaddr, sizeof(*servaddr));
+    struct iovec iov = { buffer, strlen(buffer) };
+    ssize_t sent_bytes = sip_transport_send(sockfd, servaddr, &iov, 1);
                            
     if (sent_bytes < 0) {
         log_with_timestamp("錯誤: 發送 ACK 失敗: %s\n", strerror(errno));
@@ -42,123 +47,667 @@ void send_ack(int sockfd, struct sockaddr_in *servaddr, const char *callid, cons
     }
 }
 
-// 發送BYE請求
-void send_bye(int sockfd, struct sockaddr_in *servaddr, const char *callid, 
-              const char *tag, const char *to_tag, const char *cseq) {
-    char buffer[BUF_SIZE];
-    char branch[64];
-    int cseq_num = atoi(cseq);
-    
-    // 生成新的分支參數
-    snprintf(branch, sizeof(branch), "z9hG4bK%08x", (unsigned int)time(NULL) + 3);
-    
-    log_with_timestamp("發送 BYE 請求給伺服器\n");
-    
-    snprintf(buffer, BUF_SIZE,
-        "BYE sip:%s@%s SIP/2.0\r\n"
-        "Via: SIP/2.0/UDP %s:%d;branch=%s\r\n"
+// 對話的被叫號碼 (舊式會話未記錄時使用預設值)
+static const char* session_callee(const sip_session_t *session) {
+    return session->callee[0] ? session->callee : CALLEE;
+}
+
+// 對話的 Request-URI 主機 (經由選定網關發出的呼叫為網關主機)
+const char* sip_session_host(const sip_session_t *session) {
+    return session->route_host[0] ? session->route_host : SIP_SERVER;
+}
+
+// 路由集合中一個項目的結尾 (下一個不在角括號或引號內的逗號，或字串結尾)
+static const char* route_entry_end(const char *entry) {
+    int in_angle = 0, in_quote = 0;
+    for (; *entry; entry++) {
+        if (*entry == '"') in_quote = !in_quote;
+        else if (!in_quote && *entry == '<') in_angle = 1;
+        else if (!in_quote && *entry == '>') in_angle = 0;
+        else if (!in_quote && !in_angle && *entry == ',') break;
+    }
+    return entry;
+}
+
+// 取出 name-addr 或 addr-spec 中的 URI (去除顯示名稱、角括號與標頭參數)
+static int addr_uri(const char *value, size_t len, char *buf, size_t buf_size) {
+    const char *end = value + len;
+    const char *start = value;
+    const char *stop;
+
+    if (start < end && *start == '"') {
+        const char *quote = memchr(start + 1, '"', end - start - 1);
+        if (!quote) return -1;
+        start = quote + 1;
+    }
+    const char *lt = memchr(start, '<', end - start);
+    if (lt) {
+        start = lt + 1;
+        stop = memchr(start, '>', end - start);
+        if (!stop) return -1;
+    } else {
+        while (start < end && *start == ' ') start++;
+        for (stop = start; stop < end && *stop != ';' && *stop != ',' && *stop != ' '; stop++);
+    }
+    if (stop == start || (size_t)(stop - start) >= buf_size) return -1;
+    memcpy(buf, start, stop - start);
+    buf[stop - start] = '\0';
+    return 0;
+}
+
+// 對話內請求的 Request-URI 與 Route 標頭 (RFC 3261 12.2.1.1)：第一個路由帶 lr 時 (鬆散路由)
+// Request-URI 為遠端目標、Route 為完整的路由集合；否則 (嚴格路由) Request-URI 為第一個路由，
+// Route 為其餘路由再加上遠端目標
+static int session_request_target(const sip_session_t *session, char *uri, size_t uri_size,
+                                  char *route, size_t route_size) {
+    char target[sizeof(session->remote_target) + 8];
+    char first[sizeof(session->route_set)];
+
+    if (session->remote_target[0]) {
+        snprintf(target, sizeof(target), "%s", session->remote_target);
+    } else {
+        snprintf(target, sizeof(target), "sip:%s@%s", session_callee(session), sip_session_host(session));
+    }
+    route[0] = '\0';
+    if (!session->route_set[0]) {
+        return snprintf(uri, uri_size, "%s", target) < (int)uri_size ? 0 : -1;
+    }
+
+    const char *end = route_entry_end(session->route_set);
+    if (addr_uri(session->route_set, end - session->route_set, first, sizeof(first)) != 0) return -1;
+    const char *lr = strstr(first, ";lr");
+    if (lr && (lr[3] == '\0' || lr[3] == ';' || lr[3] == '=')) {
+        snprintf(route, route_size, "Route: %s\r\n", session->route_set);
+        return snprintf(uri, uri_size, "%s", target) < (int)uri_size ? 0 : -1;
+    }
+    if (*end) {
+        snprintf(route, route_size, "Route: %s, <%s>\r\n", end + 2, target);
+    } else {
+        snprintf(route, route_size, "Route: <%s>\r\n", target);
+    }
+    return snprintf(uri, uri_size, "%s", first) < (int)uri_size ? 0 : -1;
+}
+
+// SIP URI 的主機與端口 (未指定端口為 5060)；只接受 IPv4 字面地址，對話內請求不在反應器線程上查詢 DNS
+static int uri_addr(const char *uri, struct sockaddr_in *addr) {
+    char host[64];
+    const char *p = uri;
+
+    if (strncasecmp(p, "sip:", 4) == 0) p += 4;
+    else if (strncasecmp(p, "sips:", 5) == 0) p += 5;
+    else return -1;
+    const char *at = strchr(p, '@');
+    const char *params = strpbrk(p, ";?");
+    if (at && (!params || at < params)) p = at + 1;
+
+    size_t len = strcspn(p, ":;?>");
+    if (len == 0 || len >= sizeof(host)) return -1;
+    memcpy(host, p, len);
+    host[len] = '\0';
+
+    memset(addr, 0, sizeof(*addr));
+    addr->sin_family = AF_INET;
+    addr->sin_port = htons(p[len] == ':' ? atoi(p + len + 1) : 5060);
+    if (inet_pton(AF_INET, host, &addr->sin_addr) != 1 || addr->sin_port == 0) return -1;
+    return 0;
+}
+
+// 對話內請求的下一跳 (RFC 3261 12.2.1.1 與 8.1.2)：有路由集合時為第一個路由，否則為遠端目標；
+// 兩者都沒有或不是 IP 地址時 next_hop 的 sin_family 為 0，經由選定的網關 (servaddr) 發送
+static void session_resolve_next_hop(sip_session_t *session) {
+    char hop[sizeof(session->route_set)];
+
+    memset(&session->next_hop, 0, sizeof(session->next_hop));
+    if (session->route_set[0]) {
+        const char *end = route_entry_end(session->route_set);
+        if (addr_uri(session->route_set, end - session->route_set, hop, sizeof(hop)) != 0) return;
+    } else if (session->remote_target[0]) {
+        snprintf(hop, sizeof(hop), "%s", session->remote_target);
+    } else {
+        return;
+    }
+    if (uri_addr(hop, &session->next_hop) != 0) {
+        memset(&session->next_hop, 0, sizeof(session->next_hop));
+        log_with_timestamp("會話 %s 的下一跳 %s 不是 IP 地址，經由網關 %s:%d 發送\n", session->callid, hop,
+                         inet_ntoa(session->servaddr.sin_addr), ntohs(session->servaddr.sin_port));
+    }
+}
+
+// 對話內請求 (2xx 的 ACK、BYE) 的目的地
+static const struct sockaddr_in* session_dest(const sip_session_t *session) {
+    return session->next_hop.sin_family == AF_INET ? &session->next_hop : &session->servaddr;
+}
+
+// 2xx 建立對話：Contact 為遠端目標，Record-Route 反序即路由集合 (RFC 3261 12.1.2)；
+// 兩者都只在此設定，之後對方的 re-INVITE/UPDATE 只更新遠端目標
+int sip_session_set_route(sip_session_t *session, const sip_msg_t *msg) {
+    const sip_header_t *contact = sip_msg_header(msg, SIP_HDR_CONTACT);
+    const char *entries[SIP_MAX_ROUTES];
+    int lens[SIP_MAX_ROUTES];
+    int count = 0;
+
+    session->remote_target[0] = '\0';
+    session->route_set[0] = '\0';
+    if (contact && addr_uri(msg->buf + contact->value.off, contact->value.len,
+                            session->remote_target, sizeof(session->remote_target)) != 0) {
+        log_with_timestamp("錯誤: 無法使用對方的 Contact (無效或超過 %zu 字節)\n", sizeof(session->remote_target) - 1);
+        return -1;
+    }
+
+    // 每個 Record-Route 標頭可含多個以逗號分隔的項目；截斷的路由集合會把請求送錯地方，因此超出容量時失敗
+    for (int i = 0; i < msg->header_count; i++) {
+        const sip_header_t *hdr = &msg->headers[i];
+        if (hdr->id != SIP_HDR_RECORD_ROUTE) continue;
+        char value[sizeof(session->route_set)];
+        if (sip_slice_copy(msg, hdr->value, value, sizeof(value)) != 0) {
+            log_with_timestamp("錯誤: Record-Route 超過 %zu 字節\n", sizeof(value) - 1);
+            return -1;
+        }
+        const char *p = msg->buf + hdr->value.off;
+        const char *entry = value;
+        while (*entry) {
+            const char *end = route_entry_end(entry);
+            const char *start = entry;
+            while (start < end && *start == ' ') start++;
+            int len = (int)(end - start);
+            while (len > 0 && start[len - 1] == ' ') len--;
+            if (len > 0) {
+                if (count == SIP_MAX_ROUTES) {
+                    log_with_timestamp("錯誤: Record-Route 超過 %d 個項目\n", SIP_MAX_ROUTES);
+                    return -1;
+                }
+                entries[count] = p + (start - value);
+                lens[count++] = len;
+            }
+            entry = *end ? end + 1 : end;
+        }
+    }
+
+    int used = 0;
+    for (int i = count - 1; i >= 0; i--) {
+        int n = snprintf(session->route_set + used, sizeof(session->route_set) - used, "%s%.*s",
+                         used > 0 ? ", " : "", lens[i], entries[i]);
+        if (n < 0 || (size_t)n >= sizeof(session->route_set) - used) {
+            log_with_timestamp("錯誤: 路由集合超過 %zu 字節\n", sizeof(session->route_set) - 1);
+            session->route_set[0] = '\0';
+            return -1;
+        }
+        used += n;
+    }
+
+    if (session->remote_target[0] || session->route_set[0]) {
+        log_with_timestamp("對話遠端目標 %s%s%s\n", session->remote_target[0] ? session->remote_target : "(無 Contact)",
+                         session->route_set[0] ? "，路由 " : "", session->route_set);
+    }
+    return sip_session_compile_templates(session);
+}
+
+// 對方在對話中的 re-INVITE/UPDATE 帶 Contact 時更新遠端目標 (RFC 3261 12.2.2 target refresh)
+static void session_refresh_target(sip_session_t *session, const sip_msg_t *msg) {
+    const sip_header_t *contact = sip_msg_header(msg, SIP_HDR_CONTACT);
+    char target[sizeof(session->remote_target)];
+
+    if (!contact || addr_uri(msg->buf + contact->value.off, contact->value.len, target, sizeof(target)) != 0 ||
+        strcmp(target, session->remote_target) == 0) {
+        return;
+    }
+    log_with_timestamp("會話 %s 遠端目標更新為 %s\n", session->callid, target);
+    snprintf(session->remote_target, sizeof(session->remote_target), "%s", target);
+    sip_session_compile_templates(session);
+    if (session->dialog) {
+        sip_snapshot_save(session->dialog);
+    }
+}
+
+// 編譯對話內的 ACK/BYE 模板：只有 branch、CSeq 與遠端 tag 在發送時填入
+int sip_session_compile_templates(sip_session_t *session) {
+    const char *callee = session_callee(session);
+    const char *host = sip_session_host(session);
+    sip_template_t *tpl = &session->ack_tpl;
+    char uri[sizeof(session->route_set)];
+    char route[sizeof(session->route_set) + sizeof(session->remote_target) + 16];
+
+    if (session_request_target(session, uri, sizeof(uri), route, sizeof(route)) != 0) {
+        log_with_timestamp("錯誤: 無法解析路由集合 %s\n", session->route_set);
+        return -1;
+    }
+    session_resolve_next_hop(session);
+
+    sip_template_reset(tpl);
+    sip_template_append(tpl,
+        "ACK %s SIP/2.0\r\n"
+        "Via: SIP/2.0/%s %s:%d;branch=",
+        uri, sip_transport_via(), LOCAL_IP, LOCAL_PORT);
+    sip_template_field(tpl, SIP_TPL_BRANCH);
+    sip_template_append(tpl,
+        "\r\n"
         "Max-Forwards: 70\r\n"
+        "%s"
         "From: \"%s\" <sip:%s@%s>;tag=%s\r\n"
-        "To: <sip:%s@%s>;tag=%s\r\n"
+        "To: <sip:%s@%s>;tag=",
+        route,
+        CALLER, USERNAME, SIP_SERVER, session->tag,
+        callee, host);
+    sip_template_field(tpl, SIP_TPL_TO_TAG);
+    sip_template_append(tpl,
+        "\r\n"
         "Call-ID: %s\r\n"
-        "CSeq: %d BYE\r\n"
+        "CSeq: ",
+        session->callid);
+    sip_template_field(tpl, SIP_TPL_CSEQ);
+    sip_template_append(tpl,
+        " ACK\r\n"
+        "Contact: <sip:%s@%s:%d%s>\r\n"
         "User-Agent: Custom SIP Client\r\n"
         "Content-Length: 0\r\n"
         "\r\n",
-        CALLEE, SIP_SERVER,
-        LOCAL_IP, LOCAL_PORT, branch,
-        CALLER, USERNAME, SIP_SERVER, tag,
-        CALLEE, SIP_SERVER, to_tag,
-        callid,
-        cseq_num + 1
-    );
-    
-    log_with_timestamp("BYE 內容:\n%s\n", buffer);
-    
-    ssize_t sent_bytes = sendto(sockfd, buffer, strlen(buffer), 0, 
-                           (struct sockaddr *)servaddr, sizeof(*servaddr));
-                           
-    if (sent_bytes < 0) {
-        log_with_timestamp("錯誤: 發送 BYE 失敗: %s\n", strerror(errno));
+        USERNAME, LOCAL_IP, LOCAL_PORT, sip_transport_uri_param());
+
+    tpl = &session->bye_tpl;
+    sip_template_reset(tpl);
+    sip_template_append(tpl,
+        "BYE %s SIP/2.0\r\n"
+        "Via: SIP/2.0/%s %s:%d;branch=",
+        uri, sip_transport_via(), LOCAL_IP, LOCAL_PORT);
+    sip_template_field(tpl, SIP_TPL_BRANCH);
+    sip_template_append(tpl,
+        "\r\n"
+        "Max-Forwards: 70\r\n"
+        "%s"
+        "From: \"%s\" <sip:%s@%s>;tag=%s\r\n"
+        "To: <sip:%s@%s>;tag=",
+        route,
+        CALLER, USERNAME, SIP_SERVER, session->tag,
+        callee, host);
+    sip_template_field(tpl, SIP_TPL_TO_TAG);
+    sip_template_append(tpl,
+        "\r\n"
+        "Call-ID: %s\r\n"
+        "CSeq: ",
+        session->callid);
+    sip_template_field(tpl, SIP_TPL_CSEQ);
+    sip_template_append(tpl,
+        " BYE\r\n"
+        "User-Agent: Custom SIP Client\r\n"
+        "Content-Length: 0\r\n"
+        "\r\n");
+
+    if (!sip_template_ready(&session->ack_tpl) || !sip_template_ready(&session->bye_tpl)) {
+        log_with_timestamp("錯誤: ACK/BYE 模板超出容量\n");
+        return -1;
+    }
+    return 0;
+}
+
+// 以模板發送 2xx 的 ACK (不經事務，直接以 sendmsg 發送)
+int sip_session_send_ack(sip_session_t *session, const char *branch) {
+    struct iovec iov[SIP_TPL_MAX_SEGMENTS];
+    size_t len = 0;
+
+    if (!sip_template_ready(&session->ack_tpl) && sip_session_compile_templates(session) != 0) {
+        return -1;
+    }
+
+    const char *values[SIP_TPL_FIELD_COUNT] = { 0 };
+    values[SIP_TPL_BRANCH] = branch;
+    values[SIP_TPL_CSEQ] = session->cseq;
+    values[SIP_TPL_TO_TAG] = session->to_tag;
+    int iovcnt = sip_template_iov(&session->ack_tpl, values, iov, SIP_TPL_MAX_SEGMENTS, &len);
+    if (iovcnt < 0) return -1;
+
+    // 每通呼叫的 ACK 只記錄在事件追蹤中 (sip_transport_send)，不寫日誌
+    if (sip_transport_send(session->sockfd, session_dest(session), iov, iovcnt) < 0) {
+        log_with_timestamp("錯誤: 發送 ACK 失敗: %s\n", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+// BYE 事務事件
+static void on_bye_event(sip_transaction_t *txn, int status_code, const sip_msg_t *msg, void *user_data) {
+    sip_session_t *session = (sip_session_t *)user_data;
+    (void)txn;
+    (void)msg;
+
+    if (status_code < 200) return;
+
+    sip_call_callback_t on_done = session->on_bye_done;
+    void *done_user_data = session->bye_user_data;
+    session->bye_txn = NULL;
+    session->on_bye_done = NULL;
+    session->bye_user_data = NULL;
+
+    if (status_code == 200) {
+        log_with_timestamp("BYE請求成功，通話已結束\n");
     } else {
-        log_with_timestamp("成功發送 BYE: %zd 字節\n", sent_bytes);
+        log_with_timestamp("BYE請求結束，狀態碼: %d\n", status_code);
     }
-    
-    // 等待BYE的回應 (200 OK)
-    char recvbuf[BUF_SIZE];
-    struct sockaddr_in recv_addr;
-    socklen_t recv_len = sizeof(recv_addr);
-    int n;
-    int timeout_count = 0;
-    
-    while (timeout_count < 5) {  // 最多等待5次
-        memset(recvbuf, 0, BUF_SIZE);
-        
-        n = recv_with_timeout(sockfd, recvbuf, BUF_SIZE-1, 
-                           (struct sockaddr *)&recv_addr, &recv_len, 500);
-        
-        if (n > 0) {
-            recvbuf[n] = 0;
-            char recv_ip[INET_ADDRSTRLEN];
-            inet_ntop(AF_INET, &(recv_addr.sin_addr), recv_ip, INET_ADDRSTRLEN);
-            
-            log_with_timestamp("收到BYE回應 (%d 字節) 來自 %s:%d:\n%s\n", 
-                            n, recv_ip, ntohs(recv_addr.sin_port), recvbuf);
-            
-            int status_code = parse_sip_status_code(recvbuf);
-            if (status_code == 200) {
-                log_with_timestamp("BYE請求成功，通話已結束\n");
-                break;
-            }
-        } else if (n == 0) {
-            timeout_count++;
-            log_with_timestamp("等待BYE回應超時 (%d/5)\n", timeout_count);
-        } else {
-            log_with_timestamp("接收BYE回應錯誤: %s\n", strerror(errno));
-            break;
+    session->call_established = 0;
+    if (on_done) {
+        on_done(session, status_code, done_user_data);
+    }
+}
+
+// 以會話的 BYE 模板建立 BYE 事務 (須在事件循環線程中調用)
+static sip_transaction_t* session_start_bye(sip_session_t *session, sip_txn_callback_t callback, void *user_data) {
+    struct iovec iov[SIP_TPL_MAX_SEGMENTS];
+    char branch[64];
+    char cseq[16];
+
+    if (!sip_template_ready(&session->bye_tpl) && sip_session_compile_templates(session) != 0) {
+        return NULL;
+    }
+
+    get_branch(branch, sizeof(branch));
+    snprintf(cseq, sizeof(cseq), "%d", atoi(session->cseq) + 1);
+
+    const char *values[SIP_TPL_FIELD_COUNT] = { 0 };
+    values[SIP_TPL_BRANCH] = branch;
+    values[SIP_TPL_CSEQ] = cseq;
+    values[SIP_TPL_TO_TAG] = session->to_tag;
+    int iovcnt = sip_template_iov(&session->bye_tpl, values, iov, SIP_TPL_MAX_SEGMENTS, NULL);
+    if (iovcnt < 0) return NULL;
+
+    sip_transaction_t *txn = sip_txn_client_start_iov(session->sockfd, session_dest(session), "BYE", branch,
+                                                      iov, iovcnt, callback, user_data);
+    if (!txn) return NULL;
+    log_with_timestamp("發送 BYE 請求給伺服器 (Call-ID %s，CSeq %s)\n", session->callid, cseq);
+    return txn;
+}
+
+// 非阻塞發送BYE (須在事件循環線程中調用)；on_done 為 NULL 時不追蹤結果
+int sip_session_bye_async(sip_session_t *session, sip_call_callback_t on_done, void *user_data) {
+    if (!session || session->sockfd < 0 || session->bye_txn) return -1;
+
+    sip_transaction_t *txn = session_start_bye(session, on_done ? on_bye_event : NULL, on_done ? session : NULL);
+    if (!txn) return -1;
+
+    if (on_done) {
+        session->bye_txn = txn;
+        session->on_bye_done = on_done;
+        session->bye_user_data = user_data;
+    }
+    return 0;
+}
+
+// 背景BYE：事務只保存 Call-ID 以記錄結果，並持有一個傳輸引用直到事務結束，
+// 因此會話、媒體資源與呼叫槽位都可以在發送後立即釋放
+typedef struct {
+    char callid[128];
+    int holds_transport;
+} detached_bye_t;
+
+typedef struct {
+    sip_session_t *session;
+    detached_bye_t *bye;
+    int started;
+} detached_bye_start_t;
+
+static void detached_bye_release(void *arg) {
+    (void)arg;
+    sip_transport_release();
+}
+
+static void detached_bye_event(sip_transaction_t *txn, int status_code, const sip_msg_t *msg, void *user_data) {
+    detached_bye_t *bye = (detached_bye_t *)user_data;
+    (void)txn;
+    (void)msg;
+
+    if (status_code < 200) return;
+    if (status_code == 200) {
+        log_with_timestamp("BYE 請求成功 (Call-ID %s)\n", bye->callid);
+    } else {
+        log_with_timestamp("BYE 請求結束 (Call-ID %s)，狀態碼: %d\n", bye->callid, status_code);
+    }
+    // 事務回調返回後才釋放傳輸 (可能關閉 socket)
+    if (bye->holds_transport && sip_reactor_post(detached_bye_release, NULL) != 0) {
+        sip_transport_release();
+    }
+    free(bye);
+}
+
+static void detached_bye_start(void *arg) {
+    detached_bye_start_t *start = (detached_bye_start_t *)arg;
+    start->started = session_start_bye(start->session, detached_bye_event, start->bye) != NULL;
+}
+
+int sip_session_bye_detached(sip_session_t *session) {
+    if (!session || session->sockfd < 0) return -1;
+    session->call_established = 0;
+    if (session->remote_bye) return 0;
+    if (sip_txn_attach_socket(session->sockfd) != 0) return -1;
+
+    detached_bye_t *bye = calloc(1, sizeof(*bye));
+    if (!bye) return -1;
+    snprintf(bye->callid, sizeof(bye->callid), "%s", session->callid);
+    bye->holds_transport = session->sockfd == sip_transport_sockfd() && sip_transport_acquire() == 0;
+
+    // 事務建立時已複製請求，之後不再存取會話；bye 由事務回調釋放
+    detached_bye_start_t start = { session, bye, 0 };
+    if (sip_reactor_run_sync(detached_bye_start, &start) != 0) {
+        detached_bye_start(&start);
+    }
+    if (!start.started) {
+        if (bye->holds_transport) sip_transport_release();
+        free(bye);
+        return -1;
+    }
+    return 0;
+}
+
+// 發送BYE請求 (不等待回應)
+void send_bye(int sockfd, struct sockaddr_in *servaddr, const char *callid, 
+              const char *tag, const char *to_tag, const char *cseq) {
+    sip_session_t session;
+
+    memset(&session, 0, sizeof(session));
+    session.sockfd = sockfd;
+    session.servaddr = *servaddr;
+    snprintf(session.callid, sizeof(session.callid), "%s", callid);
+    snprintf(session.tag, sizeof(session.tag), "%s", tag);
+    snprintf(session.to_tag, sizeof(session.to_tag), "%s", to_tag);
+    snprintf(session.cseq, sizeof(session.cseq), "%s", cseq);
+    sip_timer_init(&session.answer_timer, NULL, NULL);
+    sip_timer_init(&session.failover_timer, NULL, NULL);
+
+    sip_session_bye_detached(&session);
+}
+
+// 以會話狀態發送BYE請求 (不等待回應)
+void sip_session_bye(sip_session_t *session) {
+    sip_session_bye_detached(session);
+}
+
+// 對方在對話中帶 SDP 的 re-INVITE / UPDATE：重新協商媒體並以 answer 回應；
+// 沒有 SDP 的 re-INVITE 要求我方在 2xx 中提出 offer (對方的 answer 在 ACK 中，見 session_on_ack)；
+// 媒體改變後通知所屬對話，由應用程式更新 RTP 的鎖定與發送目的地
+static void session_on_offer(sip_session_t *session, const sip_msg_t *msg, const struct sockaddr_in *from,
+                             int is_invite, const char *extra_headers) {
+    char headers[512];
+    char sdp_body[BUF_SIZE / 2];
+    sip_sdp_t offer;
+    sip_media_t media = session->media;
+
+    snprintf(headers, sizeof(headers),
+             "Contact: <sip:%s@%s:%d%s>\r\n%s",
+             USERNAME, LOCAL_IP, LOCAL_PORT, sip_transport_uri_param(), extra_headers);
+
+    if (msg->body.len == 0) {
+        if (!is_invite) {
+            session_refresh_target(session, msg);
+            sip_txn_respond(session->sockfd, from, msg, 200, "OK", NULL, headers, NULL);
+            return;
+        }
+        sip_sdp_build_offer(sdp_body, sizeof(sdp_body), LOCAL_IP, session->local_rtp_port,
+                            session->media.ptime, ++session->sdp_version);
+        session->offer_pending = 1;
+    } else if (sip_sdp_parse(msg->buf + msg->body.off, msg->body.len, &offer) != 0 ||
+               sip_sdp_negotiate(&offer, &session->media.remote_addr, session->media.ptime, &media) != 0) {
+        log_with_timestamp("會話 %s 無法接受對方的 SDP offer，回應 488\n", session->callid);
+        sip_txn_respond(session->sockfd, from, msg, 488, "Not Acceptable Here", NULL, NULL, NULL);
+        return;
+    } else {
+        session->media = media;
+        session->offer_pending = 0;
+        sip_sdp_build_answer(sdp_body, sizeof(sdp_body), LOCAL_IP, session->local_rtp_port,
+                             &session->media, ++session->sdp_version);
+    }
+
+    session_refresh_target(session, msg);
+    size_t len = strlen(headers);
+    snprintf(headers + len, sizeof(headers) - len, "Content-Type: application/sdp\r\n");
+    sip_txn_respond(session->sockfd, from, msg, 200, "OK", NULL, headers, sdp_body);
+    if (msg->body.len > 0 && session->dialog) {
+        sip_dialog_media_changed(session->dialog);
+    }
+}
+
+// re-INVITE 2xx 的 ACK：我方在 2xx 中提出 offer 時，對方的 answer 在 ACK 中 (RFC 3264 4 節)
+static void session_on_ack(sip_session_t *session, const sip_msg_t *msg) {
+    sip_sdp_t answer;
+    sip_media_t media = session->media;
+
+    if (!session->offer_pending) {
+        return;
+    }
+    session->offer_pending = 0;
+    if (msg->body.len == 0) {
+        return;
+    }
+    if (sip_sdp_parse(msg->buf + msg->body.off, msg->body.len, &answer) != 0 ||
+        sip_sdp_negotiate(&answer, &session->media.remote_addr, session->media.ptime, &media) != 0) {
+        // ACK 無法回應錯誤，沿用目前的媒體
+        log_with_timestamp("會話 %s 無法接受 ACK 中的 SDP answer，沿用目前的媒體\n", session->callid);
+        return;
+    }
+    session->media = media;
+    if (session->dialog) {
+        sip_dialog_media_changed(session->dialog);
+    }
+}
+
+// 請求的 Supported 標頭 (可有多個，緊湊形式 k) 是否列出 option
+static int msg_supports(const sip_msg_t *msg, const char *option) {
+    size_t option_len = strlen(option);
+
+    for (int i = 0; i < msg->header_count; i++) {
+        const sip_header_t *hdr = &msg->headers[i];
+        const char *name = msg->buf + hdr->name.off;
+        if (!(hdr->name.len == 9 && strncasecmp(name, "Supported", 9) == 0) &&
+            !(hdr->name.len == 1 && (*name == 'k' || *name == 'K'))) continue;
+        const char *p = msg->buf + hdr->value.off;
+        const char *end = p + hdr->value.len;
+        while (p < end) {
+            while (p < end && (*p == ' ' || *p == ',')) p++;
+            const char *start = p;
+            while (p < end && *p != ',' && *p != ' ') p++;
+            if ((size_t)(p - start) == option_len && strncasecmp(start, option, option_len) == 0) return 1;
+        }
+    }
+    return 0;
+}
+
+// 對方在對話中的請求 (RFC 3261 12.2.2)
+static void session_on_request(sip_session_t *session, const sip_msg_t *msg, const struct sockaddr_in *from) {
+    char method[16] = "";
+    char session_expires[64];
+    char timer_headers[128] = "";
+
+    sip_slice_copy(msg, msg->method, method, sizeof(method));
+    if (strcmp(method, "ACK") == 0) {
+        session_on_ack(session, msg);
+        return;
+    }
+
+    // CSeq 必須遞增；較舊的請求以 500 回應
+    if (session->remote_cseq > 0 && msg->cseq_num < session->remote_cseq) {
+        log_with_timestamp("會話 %s 收到過期的 %s (CSeq %d < %d)\n", session->callid, method,
+                         msg->cseq_num, session->remote_cseq);
+        sip_txn_respond(session->sockfd, from, msg, 500, "Server Internal Error", NULL, NULL, NULL);
+        return;
+    }
+    if (strcmp(method, "CANCEL") != 0) {
+        session->remote_cseq = msg->cseq_num;
+    }
+
+    if (strcmp(method, "BYE") == 0) {
+        if (!session->call_established) {
+            sip_txn_respond(session->sockfd, from, msg, 481, "Call/Transaction Does Not Exist", NULL, NULL, NULL);
+            return;
+        }
+        log_with_timestamp("會話 %s 對方已掛斷 (收到 BYE)\n", session->callid);
+        sip_txn_respond(session->sockfd, from, msg, 200, "OK", NULL, NULL, NULL);
+        session->call_established = 0;
+        session->remote_bye = 1;
+        if (session->dialog) {
+            sip_dialog_remote_bye(session->dialog, session->callid);
+        }
+    } else if (strcmp(method, "OPTIONS") == 0) {
+        sip_txn_respond(session->sockfd, from, msg, 200, "OK", NULL,
+                        SIP_ALLOW_HEADER "Accept: application/sdp\r\n", NULL);
+    } else if (strcmp(method, "INVITE") == 0 || strcmp(method, "UPDATE") == 0) {
+        if (!session->call_established && strcmp(method, "INVITE") == 0) {
+            sip_txn_respond(session->sockfd, from, msg, 481, "Call/Transaction Does Not Exist", NULL, NULL, NULL);
+            return;
         }
+        // 會話計時器 (RFC 4028)：接受對方的間隔，未指定刷新方時由對方 (UAC) 負責；
+        // 對方沒有 Supported: timer 時 (Session-Expires 可能由代理加入) 無法由對方刷新，不啟用計時器 (9 節)
+        const sip_header_t *se = sip_msg_header_by_name(msg, "Session-Expires");
+        if (!se) se = sip_msg_header_by_name(msg, "x");   // 緊湊形式
+        if (se && msg_supports(msg, "timer") &&
+            sip_slice_copy(msg, se->value, session_expires, sizeof(session_expires)) == 0) {
+            snprintf(timer_headers, sizeof(timer_headers), "Session-Expires: %s%s\r\nRequire: timer\r\n",
+                     session_expires, strstr(session_expires, "refresher=") ? "" : ";refresher=uac");
+        }
+        log_with_timestamp("會話 %s 收到 %s (會話刷新%s)\n", session->callid, method,
+                         msg->body.len > 0 ? "，帶 SDP offer" : "");
+        session_on_offer(session, msg, from, strcmp(method, "INVITE") == 0, timer_headers);
+    } else if (strcmp(method, "CANCEL") == 0) {
+        // 沒有等待最終回應的伺服器端 INVITE：re-INVITE 都已立即回應
+        sip_txn_respond(session->sockfd, from, msg, 481, "Call/Transaction Does Not Exist", NULL, NULL, NULL);
+    } else {
+        log_with_timestamp("會話 %s 收到不支援的 %s 請求，回應 501\n", session->callid, method);
+        sip_txn_respond(session->sockfd, from, msg, 501, "Not Implemented", NULL, SIP_ALLOW_HEADER, NULL);
+    }
+}
+
+// 不屬於任何事務的訊息 (由共用傳輸依 Call-ID 與 tag 分派，分派期間持有傳輸的登記鎖)：
+// INVITE 的 2xx 重傳表示 ACK 遺失，重新發送 ACK (RFC 3261 13.2.2.4)；對方的請求在對話中回應
+void sip_session_on_unmatched(sip_session_t *session, const sip_msg_t *msg, const struct sockaddr_in *from) {
+    char to_tag[128];
+
+    if (!msg->is_response) {
+        session_on_request(session, msg, from);
+        return;
     }
+
+    if (msg->status_code >= 200 && msg->status_code < 300 &&
+        sip_slice_equals(msg, msg->cseq_method, "INVITE") && session->to_tag[0] &&
+        sip_msg_header_param(msg, SIP_HDR_TO, "tag", to_tag, sizeof(to_tag)) == 0 &&
+        strcmp(to_tag, session->to_tag) == 0) {
+        char ack_branch[64];
+        get_branch(ack_branch, sizeof(ack_branch));
+        sip_trace_retransmit(SIP_TRACE_SIP_RESEND, session->dialog ? session->dialog->index : -1,
+                             "ACK", ack_branch, (uint32_t)msg->status_code);
+        sip_session_send_ack(session, ack_branch);
+        return;
+    }
+
+    log_with_timestamp("會話 %s 收到無對應事務的 %d 回應，已丟棄\n", session->callid, msg->status_code);
 }
 
-// 初始化SIP會話
+// 初始化SIP會話：使用進程共用的SIP傳輸，不再為每個會話建立與綁定socket
 int init_sip_session(sip_session_t *session) {
     if (!session) return -1;
     
     memset(session, 0, sizeof(sip_session_t));
+    session->sockfd = -1;
     
-    // 創建 socket
-    session->sockfd = socket(AF_INET, SOCK_DGRAM, 0);
-    if (session->sockfd < 0) {
-        log_with_timestamp("錯誤: 無法創建 socket: %s\n", strerror(errno));
+    if (sip_transport_acquire() != 0) {
+        log_with_timestamp("錯誤: 無法開啟 SIP 傳輸\n");
         return -1;
     }
-    
-    log_with_timestamp("Socket 創建成功: %d\n", session->sockfd);
-    
-    // 增加套接字接收緩衝區大小
-    int rcvbuf_size = 65536;  // 64KB
-    if (setsockopt(session->sockfd, SOL_SOCKET, SO_RCVBUF, &rcvbuf_size, sizeof(rcvbuf_size)) < 0) {
-        log_with_timestamp("警告: 無法設置接收緩衝區大小: %s\n", strerror(errno));
-    }
-    
-    // 綁定本地地址
-    struct sockaddr_in localaddr;
-    memset(&localaddr, 0, sizeof(localaddr));
-    localaddr.sin_family = AF_INET;
-    localaddr.sin_addr.s_addr = inet_addr(LOCAL_IP);
-    localaddr.sin_port = htons(LOCAL_PORT);
-    
-    if (bind(session->sockfd, (struct sockaddr *)&localaddr, sizeof(localaddr)) < 0) {
-        log_with_timestamp("錯誤: 無法綁定到本地地址 %s:%d: %s\n", 
-                         LOCAL_IP, LOCAL_PORT, strerror(errno));
-        close(session->sockfd);
-        return -1;
-    }
-    
-    log_with_timestamp("Socket 綁定成功: %s:%d\n", LOCAL_IP, LOCAL_PORT);
-    
-    // 排空可能存在的舊封包
-    flush_socket(session->sockfd);
+    session->sockfd = sip_transport_sockfd();
     
     // 設置伺服器地址
     memset(&session->servaddr, 0, sizeof(session->servaddr));
@@ -169,10 +718,16 @@ int init_sip_session(sip_session_t *session) {
     // 生成SIP標識符
     get_tag(session->tag, sizeof(session->tag));
     get_callid(session->callid, sizeof(session->callid));
-    snprintf(session->branch, sizeof(session->branch), "z9hG4bK%08x", (unsigned int)time(NULL));
+    get_branch(session->branch, sizeof(session->branch));
     snprintf(session->cseq, sizeof(session->cseq), "102");
-    session->remote_rtp_port = LOCAL_RTP_PORT;  // 默認RTP端口
+    sip_media_init(&session->media, &session->servaddr.sin_addr, LOCAL_RTP_PORT);  // 協商前的默認媒體
+    session->local_rtp_port = LOCAL_RTP_PORT;
     session->call_established = 0;
+    session->dialog = NULL;
+    session->route_host[0] = '\0';
+    sip_timer_init(&session->answer_timer, NULL, NULL);
+    sip_timer_init(&session->failover_timer, NULL, NULL);
+    sip_transport_register(session);
     
     log_with_timestamp("SIP 會話初始化完成:\n");
     log_with_timestamp("  - Tag: %s\n", session->tag);
@@ -187,11 +742,14 @@ int init_sip_session(sip_session_t *session) {
 void close_sip_session(sip_session_t *session) {
     if (!session) return;
     
-    if (session->sockfd >= 0) {
-        close(session->sockfd);
-        session->sockfd = -1;
+    sip_call_release_gateway(session);
+    // 對話模式下由呼叫表管理登記與傳輸引用
+    if (session->sockfd >= 0 && !session->dialog) {
+        sip_transport_unregister(session);
+        sip_transport_release();
     }
+    session->sockfd = -1;
     
     session->call_established = 0;
     log_with_timestamp("SIP 會話已關閉\n");
-} 
\ No newline at end of file
+}
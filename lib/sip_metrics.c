@@ -0,0 +1,177 @@
+// sip_metrics.c - 實現呼叫建立各階段的延遲直方圖
+#include "sip_metrics.h"
+#include "sip_client.h"
+
+#define HIST_SUB_COUNT (1 << SIP_HIST_SUB_BITS)
+#define HIST_HALF_COUNT (HIST_SUB_COUNT / 2)
+#define HIST_MAX_VALUE ((1ULL << SIP_HIST_MAX_BITS) - 1)
+
+// 對數-線性直方圖：小於 HIST_SUB_COUNT 的值各佔一格，之後每個 2 的冪次區間分為 HIST_HALF_COUNT 格
+typedef struct {
+    uint64_t count;
+    uint64_t sum_us;
+    uint64_t max_us;
+    uint32_t buckets[SIP_HIST_BUCKETS];
+} sip_histogram_t;
+
+static sip_histogram_t histograms[SIP_PHASE_COUNT];
+
+// 等待第一個 RTP 封包的端口 (以端口取模索引；對話的RTP端口連續分配，不會互相覆蓋)
+typedef struct {
+    int port;
+    uint64_t since_us;
+} rtp_mark_t;
+
+static rtp_mark_t rtp_marks[SIP_METRICS_RTP_SLOTS];
+
+static pthread_once_t atexit_once = PTHREAD_ONCE_INIT;
+
+static const char *const phase_names[SIP_PHASE_COUNT] = {
+    "INVITE->100", "INVITE->401/407", "401->re-INVITE", "INVITE->183",
+    "INVITE->200", "200->ACK", "ACK->RTP", "setup-total",
+    "RTP-pacing"
+};
+
+const char* sip_metrics_phase_name(sip_phase_t phase) {
+    return phase >= 0 && phase < SIP_PHASE_COUNT ? phase_names[phase] : "未知";
+}
+
+static int hist_index(uint64_t v) {
+    if (v > HIST_MAX_VALUE) v = HIST_MAX_VALUE;
+    if (v < HIST_SUB_COUNT) return (int)v;
+
+    int msb = 63 - __builtin_clzll(v);
+    int shift = msb - SIP_HIST_SUB_BITS + 1;
+    int mantissa = (int)(v >> shift);        // [HIST_HALF_COUNT, HIST_SUB_COUNT)
+    return HIST_SUB_COUNT + (shift - 1) * HIST_HALF_COUNT + (mantissa - HIST_HALF_COUNT);
+}
+
+// 格內的最大值 (回報百分位時採保守估計)
+static uint64_t hist_upper(int index) {
+    if (index < HIST_SUB_COUNT) return (uint64_t)index;
+
+    int k = index - HIST_SUB_COUNT;
+    int shift = k / HIST_HALF_COUNT + 1;
+    uint64_t mantissa = (uint64_t)(k % HIST_HALF_COUNT + HIST_HALF_COUNT);
+    return ((mantissa + 1) << shift) - 1;
+}
+
+static void metrics_dump_at_exit(void) {
+    sip_metrics_dump();
+}
+
+static void metrics_register_atexit(void) {
+    atexit(metrics_dump_at_exit);
+}
+
+void sip_metrics_record(sip_phase_t phase, uint64_t latency_us) {
+    if (phase < 0 || phase >= SIP_PHASE_COUNT) return;
+    pthread_once(&atexit_once, metrics_register_atexit);
+
+    sip_histogram_t *h = &histograms[phase];
+    __atomic_fetch_add(&h->buckets[hist_index(latency_us)], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->sum_us, latency_us, __ATOMIC_RELAXED);
+    uint64_t max = __atomic_load_n(&h->max_us, __ATOMIC_RELAXED);
+    while (latency_us > max &&
+           !__atomic_compare_exchange_n(&h->max_us, &max, latency_us, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+    // count 最後更新：讀取端依 count 計算百分位時，對應的格必定已計入
+    __atomic_fetch_add(&h->count, 1, __ATOMIC_RELEASE);
+}
+
+void sip_metrics_record_since(sip_phase_t phase, uint64_t since_us) {
+    uint64_t now = sip_now_us();
+    sip_metrics_record(phase, now > since_us ? now - since_us : 0);
+}
+
+int sip_metrics_get(sip_phase_t phase, sip_phase_stats_t *stats) {
+    if (phase < 0 || phase >= SIP_PHASE_COUNT || !stats) return -1;
+
+    const sip_histogram_t *h = &histograms[phase];
+    memset(stats, 0, sizeof(*stats));
+    stats->count = __atomic_load_n(&h->count, __ATOMIC_ACQUIRE);
+    if (stats->count == 0) return 0;
+    stats->max_us = __atomic_load_n(&h->max_us, __ATOMIC_RELAXED);
+    stats->mean_us = __atomic_load_n(&h->sum_us, __ATOMIC_RELAXED) / stats->count;
+
+    // 各百分位的目標名次 (至少為 1)
+    const double quantiles[3] = { 0.50, 0.99, 0.999 };
+    uint64_t *outputs[3] = { &stats->p50_us, &stats->p99_us, &stats->p999_us };
+    uint64_t ranks[3];
+    for (int q = 0; q < 3; q++) {
+        ranks[q] = (uint64_t)(quantiles[q] * stats->count + 0.999999);
+        if (ranks[q] < 1) ranks[q] = 1;
+    }
+
+    uint64_t seen = 0;
+    int q = 0;
+    for (int i = 0; i < SIP_HIST_BUCKETS && q < 3; i++) {
+        seen += __atomic_load_n(&h->buckets[i], __ATOMIC_RELAXED);
+        while (q < 3 && seen >= ranks[q]) {
+            uint64_t upper = hist_upper(i);
+            *outputs[q++] = upper < stats->max_us ? upper : stats->max_us;
+        }
+    }
+    // 與記錄同時讀取時格數可能少於 count
+    while (q < 3) *outputs[q++] = stats->max_us;
+    return 0;
+}
+
+int sip_metrics_format(char *buf, size_t buf_size) {
+    int len = snprintf(buf, buf_size, "%-16s %8s %9s %9s %9s %9s %9s\n",
+                       "phase", "count", "mean", "p50", "p99", "p999", "max");
+    for (int i = 0; i < SIP_PHASE_COUNT && len >= 0 && (size_t)len < buf_size; i++) {
+        sip_phase_stats_t s;
+        sip_metrics_get((sip_phase_t)i, &s);
+        len += snprintf(buf + len, buf_size - len, "%-16s %8llu %9.2f %9.2f %9.2f %9.2f %9.2f\n",
+                        phase_names[i], (unsigned long long)s.count,
+                        s.mean_us / 1000.0, s.p50_us / 1000.0, s.p99_us / 1000.0,
+                        s.p999_us / 1000.0, s.max_us / 1000.0);
+    }
+    return len;
+}
+
+void sip_metrics_dump(void) {
+    char buf[2048];
+    uint64_t total = 0;
+
+    for (int i = 0; i < SIP_PHASE_COUNT; i++) {
+        total += __atomic_load_n(&histograms[i].count, __ATOMIC_ACQUIRE);
+    }
+    if (total == 0) return;
+
+    sip_metrics_format(buf, sizeof(buf));
+    log_with_timestamp("呼叫建立與RTP發送延遲統計 (毫秒):\n%s", buf);
+}
+
+void sip_metrics_reset(void) {
+    for (int i = 0; i < SIP_PHASE_COUNT; i++) {
+        sip_histogram_t *h = &histograms[i];
+        __atomic_store_n(&h->count, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&h->sum_us, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&h->max_us, 0, __ATOMIC_RELAXED);
+        for (int j = 0; j < SIP_HIST_BUCKETS; j++) {
+            __atomic_store_n(&h->buckets[j], 0, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+void sip_metrics_expect_rtp(int port, uint64_t since_us) {
+    if (port <= 0) return;
+    rtp_mark_t *mark = &rtp_marks[port % SIP_METRICS_RTP_SLOTS];
+    __atomic_store_n(&mark->port, port, __ATOMIC_RELAXED);
+    __atomic_store_n(&mark->since_us, since_us, __ATOMIC_RELEASE);
+}
+
+// 每個RTP封包都會調用：未登記時只有一次讀取
+void sip_metrics_rtp_received(int port) {
+    if (port <= 0) return;
+    rtp_mark_t *mark = &rtp_marks[port % SIP_METRICS_RTP_SLOTS];
+    uint64_t since = __atomic_load_n(&mark->since_us, __ATOMIC_ACQUIRE);
+    if (since == 0 || __atomic_load_n(&mark->port, __ATOMIC_RELAXED) != port) return;
+
+    // 只有取得登記的線程記錄
+    if (__atomic_compare_exchange_n(&mark->since_us, &since, 0, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+        sip_metrics_record_since(SIP_PHASE_FIRST_RTP, since);
+    }
+}
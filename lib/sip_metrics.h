@@ -0,0 +1,53 @@
+// sip_metrics.h - 呼叫建立延遲統計：各階段以 CLOCK_MONOTONIC 計時，記錄到對數-線性直方圖 (p50/p99/p999)
+#ifndef SIP_METRICS_H
+#define SIP_METRICS_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define SIP_HIST_SUB_BITS 6                          // 每個 2 的冪次區間分為 32 格 (相對誤差約 3%)
+#define SIP_HIST_MAX_BITS 36                         // 上限 2^36 微秒 (約 19 小時)
+#define SIP_HIST_BUCKETS ((1 << SIP_HIST_SUB_BITS) + \
+                          (SIP_HIST_MAX_BITS - SIP_HIST_SUB_BITS) * (1 << (SIP_HIST_SUB_BITS - 1)))
+#define SIP_METRICS_RTP_SLOTS 1024                   // 等待第一個 RTP 封包的本地端口數
+
+// 呼叫建立階段 (INVITE 的回應以發出該 INVITE 的時間為起點)
+typedef enum {
+    SIP_PHASE_TRYING = 0,    // INVITE -> 100 Trying
+    SIP_PHASE_CHALLENGE,     // INVITE -> 401/407
+    SIP_PHASE_REINVITE,      // 401/407 -> 帶認證的 INVITE 發出
+    SIP_PHASE_PROGRESS,      // INVITE -> 183 Session Progress
+    SIP_PHASE_ANSWER,        // INVITE -> 200 OK
+    SIP_PHASE_ACK,           // 200 OK -> ACK 發出
+    SIP_PHASE_FIRST_RTP,     // ACK -> 收到第一個 RTP 封包
+    SIP_PHASE_SETUP,         // 第一個 INVITE -> 200 OK (含認證與網關故障轉移)
+    SIP_PHASE_RTP_PACING,    // RTP 封包的預定發送時間 -> 實際發送 (見 sip_pacer.h)
+    SIP_PHASE_COUNT
+} sip_phase_t;
+
+typedef struct {
+    uint64_t count;
+    uint64_t mean_us;
+    uint64_t p50_us;
+    uint64_t p99_us;
+    uint64_t p999_us;
+    uint64_t max_us;
+} sip_phase_stats_t;
+
+// 記錄一個樣本 (可從任意線程調用，無鎖)
+void sip_metrics_record(sip_phase_t phase, uint64_t latency_us);
+// 記錄 since_us 至今的時間
+void sip_metrics_record_since(sip_phase_t phase, uint64_t since_us);
+
+// 查詢 (任意線程；與記錄同時進行時結果為近似值)
+int sip_metrics_get(sip_phase_t phase, sip_phase_stats_t *stats);
+const char* sip_metrics_phase_name(sip_phase_t phase);
+int sip_metrics_format(char *buf, size_t buf_size);   // 所有階段的摘要表 (毫秒)
+void sip_metrics_dump(void);                          // 以日誌輸出摘要表 (進程結束時自動調用)
+void sip_metrics_reset(void);
+
+// 第一個 RTP 封包：ACK 發出時登記本地RTP端口，接收器收到封包時回報 (since_us 為 0 表示取消登記)
+void sip_metrics_expect_rtp(int port, uint64_t since_us);
+void sip_metrics_rtp_received(int port);
+
+#endif // SIP_METRICS_H
@@ -0,0 +1,415 @@
+// sip_pacer.c - 實現 RTP 發送節拍器 (每個節拍線程一份串流清單，以線程的互斥鎖保護)
+#define _GNU_SOURCE  // pthread_setaffinity_np
+#include "sip_pacer.h"
+#include "sip_config.h"
+#include "sip_metrics.h"
+#include "sip_trace.h"
+#include "sip_reactor.h"
+#include "sip_id.h"
+#include <sched.h>
+#include <sys/socket.h>
+
+typedef struct {
+    // 參數
+    sip_pacer_stream_params_t params;
+    uint64_t interval_us;
+    int local_port;                      // 追蹤記錄用
+
+    // 狀態 (加入節拍線程後只在該線程的鎖內修改)
+    size_t offset;
+    uint16_t seq;
+    uint32_t timestamp;
+    uint64_t deadline_us;                // 下一個封包的絕對期限 (CLOCK_MONOTONIC 微秒)
+    unsigned long packets;
+    int thread;
+
+    // 槽位管理 (table_lock)
+    int in_use;
+    unsigned int generation;
+} pacer_stream_t;
+
+typedef struct {
+    pthread_t tid;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;                 // 沒有串流時等待新串流
+    int streams[SIP_PACER_MAX_STREAMS];  // 串流槽位
+    int count;
+    uint64_t next_wake_us;               // 本輪發送後預定醒來的時間 (新串流對齊到這個時間)
+    int exiting;                         // sip_pacer_shutdown 要求結束
+} pacer_thread_t;
+
+// 結束的串流 (在鎖外通知並釋放槽位)
+typedef struct {
+    int slot;
+    sip_pacer_result_t result;
+} pacer_finished_t;
+
+static pacer_stream_t streams[SIP_PACER_MAX_STREAMS];
+static int free_slots[SIP_PACER_MAX_STREAMS];
+static int free_count = 0;
+static pthread_mutex_t table_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static pacer_thread_t threads[SIP_PACER_MAX_THREADS];
+static int thread_count = 0;
+static pthread_once_t pacer_once = PTHREAD_ONCE_INIT;
+
+static struct {
+    unsigned long started;
+    unsigned long completed;
+    unsigned long stopped;
+    unsigned long send_errors;
+    unsigned long packets;
+    unsigned long resyncs;
+    int active;
+} stats;
+
+// 串流編號：低 16 位元為槽位，其上為槽位的世代 (槽位重複使用後舊編號失效)
+static int stream_id(int slot) {
+    return (int)((streams[slot].generation & 0x7FFF) << 16) | slot;
+}
+
+static int stream_slot(int id) {
+    if (id < 0) return -1;
+    int slot = id & 0xFFFF;
+    if (slot >= SIP_PACER_MAX_STREAMS || !streams[slot].in_use ||
+        (int)(streams[slot].generation & 0x7FFF) != (id >> 16)) {
+        return -1;
+    }
+    return slot;
+}
+
+static void release_slot(int slot) {
+    pthread_mutex_lock(&table_lock);
+    streams[slot].in_use = 0;
+    free_slots[free_count++] = slot;
+    pthread_mutex_unlock(&table_lock);
+}
+
+static void finish_stream(int slot, sip_pacer_result_t result) {
+    pacer_stream_t *s = &streams[slot];
+    unsigned long *counter = result == SIP_PACER_DONE ? &stats.completed :
+                             result == SIP_PACER_STOPPED ? &stats.stopped : &stats.send_errors;
+
+    __atomic_fetch_add(counter, 1, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&stats.active, 1, __ATOMIC_RELAXED);
+    if (s->params.done) {
+        s->params.done(stream_id(slot), result, s->packets, s->params.user_data);
+    }
+    release_slot(slot);
+}
+
+// 發送串流的下一個封包：RTP 頭在堆疊上，負載直接指向 payload (不複製)
+static int send_packet(pacer_stream_t *s) {
+    rtp_header_t hdr;
+    struct sockaddr_in dest = s->params.dest;
+    size_t len = s->params.length - s->offset;
+    if (len > s->params.packet_bytes) len = s->params.packet_bytes;
+
+    init_rtp_header(&hdr, s->params.payload_type, s->seq, s->timestamp, s->params.ssrc);
+    rtp_latch_apply(s->params.latch, &dest);
+
+    struct iovec iov[2] = {
+        { &hdr, sizeof(hdr) },
+        { (void *)(s->params.payload + s->offset), len }
+    };
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name = &dest;
+    msg.msg_namelen = sizeof(dest);
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+    if (sendmsg(s->params.sockfd, &msg, MSG_DONTWAIT) < 0 && errno != EAGAIN && errno != ENOBUFS) {
+        return -1;
+    }
+    sip_trace_rtp(SIP_TRACE_RTP_TX, s->local_port, (const unsigned char *)&hdr, sizeof(hdr) + len, &dest);
+
+    s->offset += len;
+    s->seq++;
+    s->timestamp += (uint32_t)len;     // G.711 每個樣本 1 字節
+    s->packets++;
+    __atomic_fetch_add(&stats.packets, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+static void remove_at(pacer_thread_t *t, int i) {
+    t->streams[i] = t->streams[--t->count];
+}
+
+// 發出所有到期的封包，返回最早的下一個期限；結束的串流移出清單並記錄到 finished
+static uint64_t pacer_tick(pacer_thread_t *t, pacer_finished_t *finished, int *finished_count) {
+    uint64_t now = sip_now_us();
+    uint64_t next = UINT64_MAX;
+
+    for (int i = 0; i < t->count; ) {
+        int slot = t->streams[i];
+        pacer_stream_t *s = &streams[slot];
+        int burst = 0;
+        int result = -1;
+
+        while (s->deadline_us <= now && burst < SIP_PACER_MAX_BURST) {
+            sip_metrics_record_since(SIP_PHASE_RTP_PACING, s->deadline_us);
+            if (send_packet(s) != 0) {
+                result = SIP_PACER_SEND_ERROR;
+                break;
+            }
+            s->deadline_us += s->interval_us;
+            burst++;
+            if (s->offset >= s->params.length) {
+                result = SIP_PACER_DONE;
+                break;
+            }
+        }
+        if (result >= 0) {
+            finished[(*finished_count)++] = (pacer_finished_t){ slot, (sip_pacer_result_t)result };
+            remove_at(t, i);
+            continue;
+        }
+        // 落後太多 (例如線程被長時間搶佔)：不再補發，從現在重新開始計時
+        if (s->deadline_us <= now) {
+            s->deadline_us = now + s->interval_us;
+            __atomic_fetch_add(&stats.resyncs, 1, __ATOMIC_RELAXED);
+        }
+        if (s->deadline_us < next) next = s->deadline_us;
+        i++;
+    }
+    return next;
+}
+
+static void* pacer_thread_main(void *arg) {
+    pacer_thread_t *t = (pacer_thread_t *)arg;
+    pacer_finished_t finished[SIP_PACER_MAX_STREAMS];
+
+    for (;;) {
+        int finished_count = 0;
+
+        pthread_mutex_lock(&t->lock);
+        while (t->count == 0 && !t->exiting) {
+            t->next_wake_us = 0;
+            pthread_cond_wait(&t->cond, &t->lock);
+        }
+        if (t->exiting) {
+            pthread_mutex_unlock(&t->lock);
+            break;
+        }
+        uint64_t next = pacer_tick(t, finished, &finished_count);
+        t->next_wake_us = t->count > 0 ? next : 0;
+        pthread_mutex_unlock(&t->lock);
+
+        for (int i = 0; i < finished_count; i++) {
+            finish_stream(finished[i].slot, finished[i].result);
+        }
+
+        if (next != UINT64_MAX) {
+            struct timespec ts = { (time_t)(next / 1000000), (long)(next % 1000000) * 1000 };
+            while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {
+            }
+        }
+    }
+    return NULL;
+}
+
+// 啟動節拍線程：pacer_threads 為 0 時進程可用的每個 CPU 一個並綁定到該 CPU
+// (依 sched_getaffinity 選擇 CPU，在 cpuset 或 taskset 限制下不會綁定到不允許的 CPU)
+static void pacer_init(void) {
+    int configured = sip_config()->pacer_threads;
+    int cpus[SIP_PACER_MAX_THREADS];
+    int cpu_count = 0;
+    cpu_set_t allowed;
+
+    if (configured == 0 && sched_getaffinity(0, sizeof(allowed), &allowed) == 0) {
+        for (int cpu = 0; cpu < CPU_SETSIZE && cpu_count < SIP_PACER_MAX_THREADS; cpu++) {
+            if (CPU_ISSET(cpu, &allowed)) cpus[cpu_count++] = cpu;
+        }
+    }
+    long online = sysconf(_SC_NPROCESSORS_ONLN);
+    int count = configured > 0 ? configured : cpu_count > 0 ? cpu_count : (int)(online > 0 ? online : 1);
+    if (count > SIP_PACER_MAX_THREADS) count = SIP_PACER_MAX_THREADS;
+
+    for (int i = 0; i < SIP_PACER_MAX_STREAMS; i++) {
+        free_slots[free_count++] = SIP_PACER_MAX_STREAMS - 1 - i;
+    }
+    for (int i = 0; i < count; i++) {
+        pacer_thread_t *t = &threads[i];
+        pthread_mutex_init(&t->lock, NULL);
+        pthread_cond_init(&t->cond, NULL);
+        if (pthread_create(&t->tid, NULL, pacer_thread_main, t) != 0) {
+            log_with_timestamp("錯誤: 無法建立RTP節拍線程: %s\n", strerror(errno));
+            break;
+        }
+        if (i < cpu_count) {
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(cpus[i], &set);
+            int err = pthread_setaffinity_np(t->tid, sizeof(set), &set);
+            if (err != 0) {
+                log_with_timestamp("警告: 無法將RTP節拍線程綁定到 CPU %d: %s\n", cpus[i], strerror(err));
+            }
+        }
+        thread_count++;
+    }
+    log_with_timestamp("RTP節拍器: %d 個發送線程%s\n", thread_count, cpu_count > 0 ? " (每個可用的 CPU 一個)" : "");
+}
+
+int sip_pacer_start(const sip_pacer_stream_params_t *params) {
+    if (!params || !params->payload || params->length == 0 || params->packet_bytes == 0 ||
+        params->packet_bytes > RTP_PACKET_MAX || params->ptime <= 0) {
+        return -1;
+    }
+    pthread_once(&pacer_once, pacer_init);
+    if (thread_count == 0) return -1;
+
+    struct sockaddr_in local;
+    socklen_t local_len = sizeof(local);
+    int local_port = getsockname(params->sockfd, (struct sockaddr *)&local, &local_len) == 0 ? ntohs(local.sin_port) : 0;
+    // 序號與時間戳的初始值隨機 (RFC 3550 5.1)
+    uint16_t seq = (uint16_t)sip_id_u32();
+    uint32_t timestamp = sip_id_u32();
+
+    pthread_mutex_lock(&table_lock);
+    if (free_count == 0) {
+        pthread_mutex_unlock(&table_lock);
+        log_with_timestamp("RTP節拍器: 同時發送的串流已達上限 %d\n", SIP_PACER_MAX_STREAMS);
+        return -1;
+    }
+    int slot = free_slots[--free_count];
+    pacer_stream_t *s = &streams[slot];
+    s->in_use = 1;
+    // 世代不為 0：串流編號一定大於 0，調用者可以用 0 表示沒有串流
+    if ((++s->generation & 0x7FFF) == 0) s->generation++;
+    int id = stream_id(slot);
+
+    // 分配給串流最少的線程
+    int best = 0;
+    for (int i = 1; i < thread_count; i++) {
+        if (__atomic_load_n(&threads[i].count, __ATOMIC_RELAXED) < __atomic_load_n(&threads[best].count, __ATOMIC_RELAXED)) {
+            best = i;
+        }
+    }
+    s->params = *params;
+    s->interval_us = (uint64_t)params->ptime * 1000;
+    s->local_port = local_port;
+    s->offset = 0;
+    s->seq = seq;
+    s->timestamp = timestamp;
+    s->packets = 0;
+    s->thread = best;
+    pthread_mutex_unlock(&table_lock);
+
+    __atomic_fetch_add(&stats.started, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&stats.active, 1, __ATOMIC_RELAXED);
+
+    // 線程已在發送其他串流時，第一個封包對齊到它下一次醒來的時間 (同一線程的串流一起發出)
+    pacer_thread_t *t = &threads[best];
+    pthread_mutex_lock(&t->lock);
+    uint64_t now = sip_now_us();
+    s->deadline_us = t->next_wake_us > now ? t->next_wake_us : now;
+    t->streams[t->count++] = slot;
+    if (t->count == 1) {
+        pthread_cond_signal(&t->cond);
+    }
+    pthread_mutex_unlock(&t->lock);
+    return id;
+}
+
+int sip_pacer_stop(int stream) {
+    pthread_mutex_lock(&table_lock);
+    int slot = stream_slot(stream);
+    if (slot < 0) {
+        pthread_mutex_unlock(&table_lock);
+        return -1;
+    }
+    pacer_thread_t *t = &threads[streams[slot].thread];
+
+    // 持有線程的鎖時節拍線程不會發送，移出清單後就不再有封包
+    int found = 0;
+    pthread_mutex_lock(&t->lock);
+    for (int i = 0; i < t->count; i++) {
+        if (t->streams[i] == slot) {
+            remove_at(t, i);
+            found = 1;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&t->lock);
+    pthread_mutex_unlock(&table_lock);
+
+    // 不在清單中：節拍線程剛結束這個串流，由它通知
+    if (!found) return -1;
+    finish_stream(slot, SIP_PACER_STOPPED);
+    return 0;
+}
+
+int sip_pacer_redirect(int stream, const struct sockaddr_in *dest, int payload_type, const unsigned char *payload) {
+    pthread_mutex_lock(&table_lock);
+    int slot = stream_slot(stream);
+    if (slot < 0) {
+        pthread_mutex_unlock(&table_lock);
+        return -1;
+    }
+    pacer_stream_t *s = &streams[slot];
+    pacer_thread_t *t = &threads[s->thread];
+
+    // 持有線程的鎖時節拍線程不會發送，下一個封包即使用新的參數
+    pthread_mutex_lock(&t->lock);
+    s->params.dest = *dest;
+    s->params.payload_type = payload_type;
+    if (payload) {
+        s->params.payload = payload;
+    }
+    pthread_mutex_unlock(&t->lock);
+    pthread_mutex_unlock(&table_lock);
+    return 0;
+}
+
+void sip_pacer_shutdown(void) {
+    int ids[SIP_PACER_MAX_STREAMS];
+    int id_count = 0;
+
+    pthread_mutex_lock(&table_lock);
+    for (int slot = 0; slot < SIP_PACER_MAX_STREAMS; slot++) {
+        if (streams[slot].in_use) ids[id_count++] = stream_id(slot);
+    }
+    pthread_mutex_unlock(&table_lock);
+    for (int i = 0; i < id_count; i++) {
+        sip_pacer_stop(ids[i]);
+    }
+
+    // 線程在目前的封包間隔結束後醒來並退出
+    int count = thread_count;
+    for (int i = 0; i < count; i++) {
+        pacer_thread_t *t = &threads[i];
+        pthread_mutex_lock(&t->lock);
+        t->exiting = 1;
+        pthread_cond_signal(&t->cond);
+        pthread_mutex_unlock(&t->lock);
+    }
+    for (int i = 0; i < count; i++) {
+        pthread_join(threads[i].tid, NULL);
+    }
+    if (count > 0) {
+        log_with_timestamp("RTP節拍器已停止 (%d 個發送線程)\n", count);
+    }
+    thread_count = 0;
+}
+
+void sip_pacer_get_stats(sip_pacer_stats_t *out) {
+    out->started = __atomic_load_n(&stats.started, __ATOMIC_RELAXED);
+    out->completed = __atomic_load_n(&stats.completed, __ATOMIC_RELAXED);
+    out->stopped = __atomic_load_n(&stats.stopped, __ATOMIC_RELAXED);
+    out->send_errors = __atomic_load_n(&stats.send_errors, __ATOMIC_RELAXED);
+    out->packets = __atomic_load_n(&stats.packets, __ATOMIC_RELAXED);
+    out->resyncs = __atomic_load_n(&stats.resyncs, __ATOMIC_RELAXED);
+    out->active = __atomic_load_n(&stats.active, __ATOMIC_RELAXED);
+    out->threads = thread_count;
+}
+
+int sip_pacer_format(char *buf, size_t size) {
+    sip_pacer_stats_t s;
+
+    sip_pacer_get_stats(&s);
+    int len = snprintf(buf, size,
+                       "pacer threads=%d active=%d started=%lu completed=%lu stopped=%lu send_errors=%lu packets=%lu resyncs=%lu\n",
+                       s.threads, s.active, s.started, s.completed, s.stopped, s.send_errors, s.packets, s.resyncs);
+    if (len < 0) return 0;
+    return (size_t)len < size ? len : (int)size - 1;
+}
@@ -0,0 +1,69 @@
+// sip_pacer.h - RTP 發送節拍器：所有通話的發送串流由少數節拍線程 (預設每個 CPU 一個) 共同發送，
+// 每個串流依絕對時間排定下一個封包 (起點 + n × ptime)，線程以 clock_nanosleep(TIMER_ABSTIME)
+// 睡到最早的期限，醒來後發出所有到期的封包；發送時間不隨系統調用耗時累積漂移
+#ifndef SIP_PACER_H
+#define SIP_PACER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <netinet/in.h>
+#include "sip_client.h"
+
+#define SIP_PACER_MAX_THREADS 16         // 節拍線程數上限
+#define SIP_PACER_MAX_STREAMS 1024       // 同時發送的串流數上限
+#define SIP_PACER_MAX_BURST 3            // 落後時每個串流一次最多補發的封包數，仍落後則重新對齊時間
+
+// 串流結束的原因
+typedef enum {
+    SIP_PACER_DONE = 0,          // 所有封包已發出
+    SIP_PACER_STOPPED,           // 被 sip_pacer_stop 停止
+    SIP_PACER_SEND_ERROR         // 發送失敗 (例如 socket 已關閉)
+} sip_pacer_result_t;
+
+// 串流結束通知：DONE 與 SEND_ERROR 在節拍線程中調用，STOPPED 在調用 sip_pacer_stop 的線程中調用；
+// 之後串流不再存取 payload，可在此釋放
+typedef void (*sip_pacer_done_fn)(int stream, sip_pacer_result_t result, unsigned long packets, void *user_data);
+
+// 串流參數 (payload 為已編碼為協商格式的 G.711 樣本，串流進行中必須保持有效)
+typedef struct {
+    int sockfd;                          // 發送用的 socket (通常為接收器的 socket，保持對稱 RTP)
+    struct sockaddr_in dest;             // SDP 中的對方媒體地址
+    const rtp_latch_t *latch;            // 對稱 RTP 鎖定 (NULL 表示一律送到 dest)
+    const unsigned char *payload;
+    size_t length;
+    size_t packet_bytes;                 // 每個封包的負載字節數 (clock_rate / 1000 × ptime)
+    int ptime;                           // 封包間隔 (毫秒)
+    int payload_type;
+    uint32_t ssrc;
+    sip_pacer_done_fn done;
+    void *user_data;
+} sip_pacer_stream_params_t;
+
+// 統計 (自啟動起累計；active 為目前值)
+typedef struct {
+    unsigned long started;
+    unsigned long completed;
+    unsigned long stopped;
+    unsigned long send_errors;
+    unsigned long packets;
+    unsigned long resyncs;               // 落後超過 SIP_PACER_MAX_BURST 個封包而重新對齊的次數
+    int active;
+    int threads;
+} sip_pacer_stats_t;
+
+// 開始發送串流 (可從任意線程調用；第一次調用時啟動節拍線程)：
+// 返回串流編號 (> 0)，失敗返回 -1 (done 不會被調用)
+int sip_pacer_start(const sip_pacer_stream_params_t *params);
+// 停止串流：返回後不再發送任何封包 (之後即可關閉 socket)；串流已結束或編號無效時返回 -1
+int sip_pacer_stop(int stream);
+// 對方在通話中改變媒體 (re-INVITE/UPDATE) 時改送到新的地址與負載類型，序號與時間戳連續；
+// payload 不為 NULL 時改用另一份相同長度的負載 (例如改以新協商的編碼發送)；串流已結束時返回 -1
+int sip_pacer_redirect(int stream, const struct sockaddr_in *dest, int payload_type, const unsigned char *payload);
+// 停止所有串流 (done 以 STOPPED 調用) 並等待節拍線程結束；進程結束前調用，之後不可再開始串流
+void sip_pacer_shutdown(void);
+
+void sip_pacer_get_stats(sip_pacer_stats_t *out);
+// 以文字格式輸出統計 (發送時間誤差的百分位數見 sip_metrics 的 RTP-pacing)，返回寫入的長度
+int sip_pacer_format(char *buf, size_t size);
+
+#endif // SIP_PACER_H
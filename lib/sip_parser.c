@@ -0,0 +1,339 @@
+// sip_parser.c - 實現單次掃描的SIP訊息解析
+#include "sip_parser.h"
+#include <string.h>
+#include <strings.h>
+#include <stdlib.h>
+
+// 已知標頭名稱 (依 sip_header_id_t 順序)
+static const char *const header_names[SIP_HDR_COUNT] = {
+    NULL, "Via", "From", "To", "Call-ID", "CSeq", "Contact", "Content-Type", "Content-Length",
+    "Max-Forwards", "User-Agent", "WWW-Authenticate", "Proxy-Authenticate", "Record-Route",
+    "Route", "Expires"
+};
+
+// ASCII 不分大小寫比較 (標頭名稱只含 token 字元，不需要 locale)
+static inline int ascii_casecmp_n(const char *a, const char *b, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        if ((a[i] | 0x20) != (b[i] | 0x20)) return 1;
+    }
+    return 0;
+}
+
+// 依長度與首字母選出唯一候選，再做一次不分大小寫比對
+static sip_header_id_t classify_header(const char *name, size_t len) {
+    sip_header_id_t candidate = SIP_HDR_OTHER;
+    char first = name[0] | 0x20;
+
+    switch (len) {
+    case 1:  // 緊湊形式 (RFC 3261 7.3.3)
+        switch (first) {
+        case 'v': return SIP_HDR_VIA;
+        case 'f': return SIP_HDR_FROM;
+        case 't': return SIP_HDR_TO;
+        case 'i': return SIP_HDR_CALL_ID;
+        case 'm': return SIP_HDR_CONTACT;
+        case 'c': return SIP_HDR_CONTENT_TYPE;
+        case 'l': return SIP_HDR_CONTENT_LENGTH;
+        default: return SIP_HDR_OTHER;
+        }
+    case 2:  candidate = SIP_HDR_TO; break;
+    case 3:  candidate = SIP_HDR_VIA; break;
+    case 4:  candidate = first == 'f' ? SIP_HDR_FROM : SIP_HDR_CSEQ; break;
+    case 5:  candidate = SIP_HDR_ROUTE; break;
+    case 7:
+        if (first == 'e') candidate = SIP_HDR_EXPIRES;
+        else if ((name[1] | 0x20) == 'a') candidate = SIP_HDR_CALL_ID;
+        else candidate = SIP_HDR_CONTACT;
+        break;
+    case 10: candidate = SIP_HDR_USER_AGENT; break;
+    case 12:
+        if (first == 'c') candidate = SIP_HDR_CONTENT_TYPE;
+        else if (first == 'm') candidate = SIP_HDR_MAX_FORWARDS;
+        else candidate = SIP_HDR_RECORD_ROUTE;
+        break;
+    case 14: candidate = SIP_HDR_CONTENT_LENGTH; break;
+    case 16: candidate = SIP_HDR_WWW_AUTHENTICATE; break;
+    case 18: candidate = SIP_HDR_PROXY_AUTHENTICATE; break;
+    default: return SIP_HDR_OTHER;
+    }
+    return ascii_casecmp_n(header_names[candidate], name, len) == 0 ? candidate : SIP_HDR_OTHER;
+}
+
+static inline int is_lws(char c) {
+    return c == ' ' || c == '\t';
+}
+
+static inline sip_slice_t make_slice(const char *base, const char *start, const char *end) {
+    sip_slice_t s;
+    s.off = (uint16_t)(start - base);
+    s.len = (uint16_t)(end - start);
+    return s;
+}
+
+// 解析起始行 (請求行或狀態行)
+static int parse_start_line(sip_msg_t *msg, const char *line, const char *end) {
+    const char *buf = msg->buf;
+
+    if (end - line >= 11 && memcmp(line, "SIP/2.0 ", 8) == 0) {
+        const char *p = line + 8;
+        int code = 0;
+        for (int i = 0; i < 3; i++, p++) {
+            if (*p < '0' || *p > '9') return -1;
+            code = code * 10 + (*p - '0');
+        }
+        msg->is_response = 1;
+        msg->status_code = code;
+        while (p < end && is_lws(*p)) p++;
+        msg->reason = make_slice(buf, p, end);
+        return 0;
+    }
+
+    const char *sp1 = memchr(line, ' ', end - line);
+    if (!sp1 || sp1 == line) return -1;
+    const char *uri = sp1 + 1;
+    const char *sp2 = memchr(uri, ' ', end - uri);
+    if (!sp2 || sp2 == uri || end - (sp2 + 1) != 7 || memcmp(sp2 + 1, "SIP/2.0", 7) != 0) return -1;
+
+    msg->is_response = 0;
+    msg->method = make_slice(buf, line, sp1);
+    msg->request_uri = make_slice(buf, uri, sp2);
+    return 0;
+}
+
+// 解析 CSeq 的序號與方法
+static void parse_cseq_header(sip_msg_t *msg, const sip_header_t *hdr) {
+    const char *p = msg->buf + hdr->value.off;
+    const char *end = p + hdr->value.len;
+    int num = 0;
+
+    while (p < end && *p >= '0' && *p <= '9') {
+        num = num * 10 + (*p - '0');
+        p++;
+    }
+    while (p < end && is_lws(*p)) p++;
+    msg->cseq_num = num;
+    msg->cseq_method = make_slice(msg->buf, p, end);
+}
+
+int sip_parse_message(const char *buf, int len, sip_msg_t *msg) {
+    msg->buf = buf;
+    msg->len = len;
+    msg->is_response = 0;
+    msg->status_code = 0;
+    msg->header_count = 0;
+    msg->cseq_num = 0;
+    msg->method.off = msg->method.len = 0;
+    msg->request_uri = msg->reason = msg->cseq_method = msg->body = msg->method;
+    memset(msg->first, -1, sizeof(msg->first));
+
+    if (!buf || len <= 0 || len > 65535) return -1;
+
+    const char *p = buf;
+    const char *end = buf + len;
+
+    // 起始行
+    const char *eol = memchr(p, '\n', end - p);
+    if (!eol) return -1;
+    const char *line_end = (eol > p && eol[-1] == '\r') ? eol - 1 : eol;
+    if (parse_start_line(msg, p, line_end) != 0) return -1;
+    p = eol + 1;
+
+    // 標頭：每行一次 memchr，不回頭掃描
+    sip_header_t *last = NULL;   // 上一個已索引的標頭 (超過上限而略過時為 NULL)
+    int seen_header = 0;
+    while (p < end) {
+        // 標頭名稱很短，逐字元找冒號比 memchr 快；值較長，以 memchr 找行尾
+        const char *colon = p;
+        while (colon < end && *colon != ':' && *colon != '\n') colon++;
+        if (colon < end && *colon == '\n') {
+            eol = colon;
+        } else {
+            eol = colon < end ? memchr(colon, '\n', end - colon) : NULL;
+            if (!eol) eol = end;
+        }
+        line_end = (eol > p && eol[-1] == '\r') ? eol - 1 : eol;
+
+        if (line_end == p) {  // 空行：標頭結束
+            p = eol < end ? eol + 1 : end;
+            break;
+        }
+
+        if (is_lws(*p)) {
+            // 折行 (RFC 3261 7.3.1)：併入上一個標頭的值
+            if (!seen_header) return -1;
+            const char *value_end = line_end;
+            while (value_end > p && is_lws(value_end[-1])) value_end--;
+            if (last && value_end > p) {
+                last->value.len = (uint16_t)(value_end - (buf + last->value.off));
+            }
+            p = eol + 1;
+            continue;
+        }
+
+        if (colon >= line_end) return -1;
+
+        const char *name_end = colon;
+        while (name_end > p && is_lws(name_end[-1])) name_end--;
+        const char *value = colon + 1;
+        while (value < line_end && is_lws(*value)) value++;
+        const char *value_end = line_end;
+        while (value_end > value && is_lws(value_end[-1])) value_end--;
+
+        seen_header = 1;
+        last = NULL;
+        if (msg->header_count < SIP_MAX_HEADERS) {
+            sip_header_t *hdr = &msg->headers[msg->header_count];
+            last = hdr;
+            hdr->id = classify_header(p, name_end - p);
+            hdr->name = make_slice(buf, p, name_end);
+            hdr->value = make_slice(buf, value, value_end);
+            if (hdr->id != SIP_HDR_OTHER && msg->first[hdr->id] < 0) {
+                msg->first[hdr->id] = (int8_t)msg->header_count;
+            }
+            msg->header_count++;
+        }
+        p = eol < end ? eol + 1 : end;
+    }
+
+    // 訊息體：以 Content-Length 為上限
+    const char *body_end = end;
+    const sip_header_t *cl = sip_msg_header(msg, SIP_HDR_CONTENT_LENGTH);
+    if (cl) {
+        long content_length = strtol(buf + cl->value.off, NULL, 10);
+        if (content_length >= 0 && content_length < end - p) body_end = p + content_length;
+    }
+    msg->body = make_slice(buf, p, body_end);
+
+    const sip_header_t *cseq = sip_msg_header(msg, SIP_HDR_CSEQ);
+    if (cseq) parse_cseq_header(msg, cseq);
+    return 0;
+}
+
+const sip_header_t* sip_msg_header(const sip_msg_t *msg, sip_header_id_t id) {
+    if (id <= SIP_HDR_OTHER || id >= SIP_HDR_COUNT || msg->first[id] < 0) return NULL;
+    return &msg->headers[(int)msg->first[id]];
+}
+
+// 依名稱查找標頭：已知標頭 (含緊湊形式) 直接查索引，其他標頭逐一比對
+const sip_header_t* sip_msg_header_by_name(const sip_msg_t *msg, const char *name) {
+    size_t len = strlen(name);
+    sip_header_id_t id = classify_header(name, len);
+    if (id != SIP_HDR_OTHER) return sip_msg_header(msg, id);
+
+    for (int i = 0; i < msg->header_count; i++) {
+        const sip_header_t *hdr = &msg->headers[i];
+        if (hdr->name.len == len && strncasecmp(msg->buf + hdr->name.off, name, len) == 0) {
+            return hdr;
+        }
+    }
+    return NULL;
+}
+
+static inline int is_param_separator(char c) {
+    return c == ';' || c == ',' || c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+// 取出標頭參數；name-addr 形式 (<...>) 只搜尋尖括號之後的標頭參數
+int sip_header_param(const sip_msg_t *msg, const sip_header_t *hdr, const char *name, sip_slice_t *out) {
+    const char *value = msg->buf + hdr->value.off;
+    const char *end = value + hdr->value.len;
+    const char *p = value;
+    size_t name_len = strlen(name);
+    int in_quote = 0;
+
+    for (const char *q = value; q < end; q++) {
+        if (*q == '"') {
+            in_quote = !in_quote;
+        } else if (!in_quote && *q == '<') {
+            const char *gt = memchr(q, '>', end - q);
+            if (gt) p = gt + 1;
+            break;
+        } else if (!in_quote && (*q == ';' || *q == ',')) {
+            break;
+        }
+    }
+
+    while (p < end) {
+        while (p < end && is_param_separator(*p)) p++;
+        if (p >= end) break;
+
+        const char *token = p;
+        while (p < end && *p != '=' && !is_param_separator(*p)) p++;
+        size_t token_len = p - token;
+        int matched = token_len == name_len && strncasecmp(token, name, name_len) == 0;
+
+        if (p < end && *p == '=') {
+            const char *val_start, *val_end;
+            p++;
+            if (p < end && *p == '"') {
+                val_start = ++p;
+                while (p < end && *p != '"') {
+                    if (*p == '\\' && p + 1 < end) p++;
+                    p++;
+                }
+                val_end = p;
+                if (p < end) p++;
+            } else {
+                val_start = p;
+                while (p < end && !is_param_separator(*p)) p++;
+                val_end = p;
+            }
+            if (matched) {
+                *out = make_slice(msg->buf, val_start, val_end);
+                return 0;
+            }
+        } else if (matched) {
+            // 無值參數 (如 ;lr、;rport)
+            *out = make_slice(msg->buf, p, p);
+            return 0;
+        } else if (token_len == 0) {
+            p++;
+        }
+    }
+    return -1;
+}
+
+int sip_slice_copy(const sip_msg_t *msg, sip_slice_t slice, char *buf, size_t buf_size) {
+    if ((size_t)slice.len >= buf_size) return -1;
+    memcpy(buf, msg->buf + slice.off, slice.len);
+    buf[slice.len] = '\0';
+    return 0;
+}
+
+int sip_slice_equals(const sip_msg_t *msg, sip_slice_t slice, const char *str) {
+    size_t len = strlen(str);
+    return slice.len == len && memcmp(msg->buf + slice.off, str, len) == 0;
+}
+
+int sip_msg_header_value(const sip_msg_t *msg, sip_header_id_t id, char *buf, size_t buf_size) {
+    const sip_header_t *hdr = sip_msg_header(msg, id);
+    if (!hdr) return -1;
+    return sip_slice_copy(msg, hdr->value, buf, buf_size);
+}
+
+int sip_msg_header_param(const sip_msg_t *msg, sip_header_id_t id, const char *name, char *buf, size_t buf_size) {
+    sip_slice_t value;
+    const sip_header_t *hdr = sip_msg_header(msg, id);
+    if (!hdr || sip_header_param(msg, hdr, name, &value) != 0) return -1;
+    return sip_slice_copy(msg, value, buf, buf_size);
+}
+
+// 從 SDP 訊息體取出第一個音頻媒體行的端口，找不到返回 0
+int sip_msg_sdp_audio_port(const sip_msg_t *msg) {
+    const char *p = msg->buf + msg->body.off;
+    const char *end = p + msg->body.len;
+
+    while (p < end) {
+        const char *eol = memchr(p, '\n', end - p);
+        if (!eol) eol = end;
+        if (eol - p > 8 && memcmp(p, "m=audio ", 8) == 0) {
+            int port = 0;
+            for (p += 8; p < eol && *p >= '0' && *p <= '9'; p++) {
+                port = port * 10 + (*p - '0');
+            }
+            return port;
+        }
+        p = eol + 1;
+    }
+    return 0;
+}
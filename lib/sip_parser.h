@@ -0,0 +1,79 @@
+// sip_parser.h - 單次掃描的SIP訊息解析器：以 (偏移, 長度) 片段索引起始行、標頭與訊息體
+#ifndef SIP_PARSER_H
+#define SIP_PARSER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SIP_MAX_HEADERS 48     // 單一訊息可索引的標頭數上限
+
+// 訊息緩衝區中的一段 (不複製資料)
+typedef struct {
+    uint16_t off;
+    uint16_t len;
+} sip_slice_t;
+
+// 已知標頭 (名稱不分大小寫，含緊湊形式)
+typedef enum {
+    SIP_HDR_OTHER = 0,
+    SIP_HDR_VIA,                 // v
+    SIP_HDR_FROM,                // f
+    SIP_HDR_TO,                  // t
+    SIP_HDR_CALL_ID,             // i
+    SIP_HDR_CSEQ,
+    SIP_HDR_CONTACT,             // m
+    SIP_HDR_CONTENT_TYPE,        // c
+    SIP_HDR_CONTENT_LENGTH,      // l
+    SIP_HDR_MAX_FORWARDS,
+    SIP_HDR_USER_AGENT,
+    SIP_HDR_WWW_AUTHENTICATE,
+    SIP_HDR_PROXY_AUTHENTICATE,
+    SIP_HDR_RECORD_ROUTE,
+    SIP_HDR_ROUTE,
+    SIP_HDR_EXPIRES,
+    SIP_HDR_COUNT
+} sip_header_id_t;
+
+typedef struct {
+    sip_header_id_t id;
+    sip_slice_t name;
+    sip_slice_t value;           // 已去除前後空白；折行會併入同一個值
+} sip_header_t;
+
+// 解析結果：所有片段都指向 buf，buf 在使用期間必須保持有效
+typedef struct {
+    const char *buf;
+    int len;
+    int is_response;
+    int status_code;             // 回應的狀態碼
+    sip_slice_t method;          // 請求的方法
+    sip_slice_t request_uri;     // 請求的 Request-URI
+    sip_slice_t reason;          // 回應的原因短語
+    sip_header_t headers[SIP_MAX_HEADERS];
+    int header_count;
+    int8_t first[SIP_HDR_COUNT]; // 每種已知標頭第一次出現的索引，-1 表示不存在
+    int cseq_num;
+    sip_slice_t cseq_method;
+    sip_slice_t body;
+} sip_msg_t;
+
+// 解析訊息 (成功返回 0)
+int sip_parse_message(const char *buf, int len, sip_msg_t *msg);
+
+// 標頭查詢
+const sip_header_t* sip_msg_header(const sip_msg_t *msg, sip_header_id_t id);
+const sip_header_t* sip_msg_header_by_name(const sip_msg_t *msg, const char *name);
+
+// 取出標頭參數 (;tag=、;branch= 或認證標頭的 realm="..." 等)，引號會被去除
+int sip_header_param(const sip_msg_t *msg, const sip_header_t *hdr, const char *name, sip_slice_t *out);
+
+// 片段工具
+int sip_slice_copy(const sip_msg_t *msg, sip_slice_t slice, char *buf, size_t buf_size);
+int sip_slice_equals(const sip_msg_t *msg, sip_slice_t slice, const char *str);
+
+// 常用欄位
+int sip_msg_header_value(const sip_msg_t *msg, sip_header_id_t id, char *buf, size_t buf_size);
+int sip_msg_header_param(const sip_msg_t *msg, sip_header_id_t id, const char *name, char *buf, size_t buf_size);
+int sip_msg_sdp_audio_port(const sip_msg_t *msg);
+
+#endif // SIP_PARSER_H
@@ -0,0 +1,482 @@
+// sip_reactor.c - 實現 epoll 事件循環、計時器最小堆與跨線程任務投遞
+#include "sip_client.h"
+#include "sip_reactor.h"
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+// 已註冊的文件描述符
+typedef struct fd_registration {
+    int fd;
+    int removed;             // 已移除，延遲到事件循環線程釋放
+    sip_fd_handler_t handler;
+    void *arg;
+    struct fd_registration *next;
+} fd_registration_t;
+
+// 投遞的任務
+typedef struct posted_task {
+    sip_task_fn_t fn;
+    void *arg;
+    struct posted_task *next;
+} posted_task_t;
+
+static int epoll_fd = -1;
+static int wakeup_fd = -1;
+static pthread_t reactor_thread;
+static volatile int reactor_running = 0;
+static __thread int in_reactor_thread = 0;
+static pthread_mutex_t start_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// 文件描述符註冊表 (只在持有 fd_lock 時修改)
+static fd_registration_t *registrations = NULL;
+static pthread_mutex_t fd_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// 計時器最小堆
+static sip_timer_t **timer_heap = NULL;
+static int timer_count = 0;
+static int timer_capacity = 0;
+static pthread_mutex_t timer_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// 投遞任務佇列
+static posted_task_t *task_head = NULL;
+static posted_task_t *task_tail = NULL;
+static pthread_mutex_t task_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// 每輪結束時調用的函數
+static struct {
+    sip_task_fn_t fn;
+    void *arg;
+} tick_hooks[SIP_REACTOR_MAX_TICK_HOOKS];
+static int tick_hook_count = 0;
+
+// 獲取單調時鐘毫秒數
+uint64_t sip_now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+uint64_t sip_now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// 喚醒 epoll_wait
+static void reactor_wakeup(void) {
+    uint64_t one = 1;
+    if (wakeup_fd >= 0 && write(wakeup_fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+        log_with_timestamp("警告: 無法喚醒事件循環: %s\n", strerror(errno));
+    }
+}
+
+// ---- 計時器最小堆 (需持有 timer_lock) ----
+
+static void heap_swap(int a, int b) {
+    sip_timer_t *t = timer_heap[a];
+    timer_heap[a] = timer_heap[b];
+    timer_heap[b] = t;
+    timer_heap[a]->heap_index = a;
+    timer_heap[b]->heap_index = b;
+}
+
+static void heap_sift_up(int i) {
+    while (i > 0) {
+        int parent = (i - 1) / 2;
+        if (timer_heap[parent]->expires_ms <= timer_heap[i]->expires_ms) break;
+        heap_swap(i, parent);
+        i = parent;
+    }
+}
+
+static void heap_sift_down(int i) {
+    for (;;) {
+        int left = 2 * i + 1, right = left + 1, smallest = i;
+        if (left < timer_count && timer_heap[left]->expires_ms < timer_heap[smallest]->expires_ms) smallest = left;
+        if (right < timer_count && timer_heap[right]->expires_ms < timer_heap[smallest]->expires_ms) smallest = right;
+        if (smallest == i) break;
+        heap_swap(i, smallest);
+        i = smallest;
+    }
+}
+
+static void heap_remove(sip_timer_t *timer) {
+    int i = timer->heap_index;
+    timer->heap_index = -1;
+    timer_count--;
+    if (i == timer_count) return;
+
+    timer_heap[i] = timer_heap[timer_count];
+    timer_heap[i]->heap_index = i;
+    heap_sift_down(i);
+    heap_sift_up(i);
+}
+
+void sip_timer_init(sip_timer_t *timer, sip_task_fn_t callback, void *arg) {
+    timer->expires_ms = 0;
+    timer->heap_index = -1;
+    timer->callback = callback;
+    timer->arg = arg;
+}
+
+// 啟動 (或重新啟動) 計時器
+void sip_timer_start(sip_timer_t *timer, int delay_ms) {
+    int is_earliest;
+
+    pthread_mutex_lock(&timer_lock);
+    if (timer->heap_index >= 0) {
+        heap_remove(timer);
+    }
+    if (timer_count == timer_capacity) {
+        int new_capacity = timer_capacity ? timer_capacity * 2 : 256;
+        sip_timer_t **new_heap = realloc(timer_heap, new_capacity * sizeof(sip_timer_t *));
+        if (!new_heap) {
+            pthread_mutex_unlock(&timer_lock);
+            log_with_timestamp("錯誤: 無法擴展計時器堆\n");
+            return;
+        }
+        timer_heap = new_heap;
+        timer_capacity = new_capacity;
+    }
+    timer->expires_ms = sip_now_ms() + (delay_ms > 0 ? delay_ms : 0);
+    timer->heap_index = timer_count;
+    timer_heap[timer_count++] = timer;
+    heap_sift_up(timer->heap_index);
+    is_earliest = (timer->heap_index == 0);
+    pthread_mutex_unlock(&timer_lock);
+
+    // 新的最早到期計時器需要縮短 epoll_wait 的等待時間
+    if (is_earliest && !sip_reactor_in_thread()) {
+        reactor_wakeup();
+    }
+}
+
+void sip_timer_stop(sip_timer_t *timer) {
+    pthread_mutex_lock(&timer_lock);
+    if (timer->heap_index >= 0) {
+        heap_remove(timer);
+    }
+    pthread_mutex_unlock(&timer_lock);
+}
+
+int sip_timer_active(const sip_timer_t *timer) {
+    return timer->heap_index >= 0;
+}
+
+// 計算距下一個計時器到期的毫秒數
+static int next_timeout_ms(void) {
+    int timeout = 1000;
+    pthread_mutex_lock(&timer_lock);
+    if (timer_count > 0) {
+        uint64_t now = sip_now_ms();
+        uint64_t expires = timer_heap[0]->expires_ms;
+        timeout = expires <= now ? 0 : (int)(expires - now < 1000 ? expires - now : 1000);
+    }
+    pthread_mutex_unlock(&timer_lock);
+    return timeout;
+}
+
+// 執行所有已到期的計時器 (回調時不持有鎖，回調中可重新啟動計時器)
+static void run_expired_timers(void) {
+    uint64_t now = sip_now_ms();
+    for (;;) {
+        pthread_mutex_lock(&timer_lock);
+        if (timer_count == 0 || timer_heap[0]->expires_ms > now) {
+            pthread_mutex_unlock(&timer_lock);
+            break;
+        }
+        sip_timer_t *timer = timer_heap[0];
+        heap_remove(timer);
+        pthread_mutex_unlock(&timer_lock);
+
+        timer->callback(timer->arg);
+    }
+}
+
+// ---- 投遞任務 ----
+
+int sip_reactor_post(sip_task_fn_t fn, void *arg) {
+    if (!reactor_running) return -1;
+
+    posted_task_t *task = malloc(sizeof(posted_task_t));
+    if (!task) return -1;
+    task->fn = fn;
+    task->arg = arg;
+    task->next = NULL;
+
+    pthread_mutex_lock(&task_lock);
+    if (task_tail) {
+        task_tail->next = task;
+    } else {
+        task_head = task;
+    }
+    task_tail = task;
+    pthread_mutex_unlock(&task_lock);
+
+    reactor_wakeup();
+    return 0;
+}
+
+static void run_posted_tasks(void) {
+    pthread_mutex_lock(&task_lock);
+    posted_task_t *task = task_head;
+    task_head = task_tail = NULL;
+    pthread_mutex_unlock(&task_lock);
+
+    while (task) {
+        posted_task_t *next = task->next;
+        task->fn(task->arg);
+        free(task);
+        task = next;
+    }
+}
+
+// 同步任務：投遞後在條件變量上等待完成
+typedef struct {
+    sip_task_fn_t fn;
+    void *arg;
+    int done;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} sync_task_t;
+
+static void run_sync_task(void *arg) {
+    sync_task_t *sync = (sync_task_t *)arg;
+    sync->fn(sync->arg);
+    pthread_mutex_lock(&sync->lock);
+    sync->done = 1;
+    pthread_cond_signal(&sync->cond);
+    pthread_mutex_unlock(&sync->lock);
+}
+
+int sip_reactor_run_sync(sip_task_fn_t fn, void *arg) {
+    if (sip_reactor_in_thread()) {
+        fn(arg);
+        return 0;
+    }
+
+    sync_task_t sync = { fn, arg, 0, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
+    if (sip_reactor_post(run_sync_task, &sync) != 0) return -1;
+
+    pthread_mutex_lock(&sync.lock);
+    while (!sync.done) {
+        pthread_cond_wait(&sync.cond, &sync.lock);
+    }
+    pthread_mutex_unlock(&sync.lock);
+    return 0;
+}
+
+// ---- 文件描述符 ----
+
+int sip_reactor_add_fd(int fd, sip_fd_handler_t handler, void *arg) {
+    fd_registration_t *reg = calloc(1, sizeof(fd_registration_t));
+    if (!reg) return -1;
+    reg->fd = fd;
+    reg->handler = handler;
+    reg->arg = arg;
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = reg;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        log_with_timestamp("錯誤: 無法將 fd %d 加入事件循環: %s\n", fd, strerror(errno));
+        free(reg);
+        return -1;
+    }
+
+    pthread_mutex_lock(&fd_lock);
+    reg->next = registrations;
+    registrations = reg;
+    pthread_mutex_unlock(&fd_lock);
+    return 0;
+}
+
+// 釋放已標記移除的註冊 (在事件循環線程中執行，此時不會再有指向它們的事件)
+static void free_removed_registrations(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&fd_lock);
+    fd_registration_t **link = &registrations;
+    while (*link) {
+        fd_registration_t *reg = *link;
+        if (reg->removed) {
+            *link = reg->next;
+            free(reg);
+        } else {
+            link = &reg->next;
+        }
+    }
+    pthread_mutex_unlock(&fd_lock);
+}
+
+void sip_reactor_remove_fd(int fd) {
+    int found = 0;
+
+    pthread_mutex_lock(&fd_lock);
+    for (fd_registration_t *reg = registrations; reg; reg = reg->next) {
+        if (reg->fd == fd && !reg->removed) {
+            reg->removed = 1;
+            found = 1;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&fd_lock);
+
+    if (!found) return;
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+    sip_reactor_post(free_removed_registrations, NULL);
+}
+
+int sip_reactor_watch_write(int fd, int enable) {
+    fd_registration_t *found = NULL;
+
+    pthread_mutex_lock(&fd_lock);
+    for (fd_registration_t *reg = registrations; reg; reg = reg->next) {
+        if (reg->fd == fd && !reg->removed) {
+            found = reg;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&fd_lock);
+    if (!found) return -1;
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN | (enable ? EPOLLOUT : 0);
+    ev.data.ptr = found;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &ev) < 0) {
+        log_with_timestamp("錯誤: 無法修改 fd %d 的事件: %s\n", fd, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+int sip_reactor_add_tick_hook(sip_task_fn_t fn, void *arg) {
+    pthread_mutex_lock(&start_lock);
+    for (int i = 0; i < tick_hook_count; i++) {
+        if (tick_hooks[i].fn == fn && tick_hooks[i].arg == arg) {
+            pthread_mutex_unlock(&start_lock);
+            return 0;
+        }
+    }
+    if (tick_hook_count == SIP_REACTOR_MAX_TICK_HOOKS) {
+        pthread_mutex_unlock(&start_lock);
+        return -1;
+    }
+    tick_hooks[tick_hook_count].fn = fn;
+    tick_hooks[tick_hook_count].arg = arg;
+    // 事件循環線程不持鎖讀取：先寫入項目再發布計數
+    __atomic_store_n(&tick_hook_count, tick_hook_count + 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&start_lock);
+    return 0;
+}
+
+// ---- 事件循環 ----
+
+static void* reactor_thread_main(void *arg) {
+    struct epoll_event events[SIP_REACTOR_MAX_EVENTS];
+    (void)arg;
+
+    in_reactor_thread = 1;
+    log_with_timestamp("SIP 事件循環線程啟動\n");
+
+    while (reactor_running) {
+        int n = epoll_wait(epoll_fd, events, SIP_REACTOR_MAX_EVENTS, next_timeout_ms());
+        if (n < 0 && errno != EINTR) {
+            log_with_timestamp("epoll_wait 錯誤: %s\n", strerror(errno));
+            break;
+        }
+
+        for (int i = 0; i < n; i++) {
+            fd_registration_t *reg = (fd_registration_t *)events[i].data.ptr;
+            if (reg == NULL) {
+                uint64_t value;
+                while (read(wakeup_fd, &value, sizeof(value)) > 0) {
+                }
+                continue;
+            }
+            if (!reg->removed) {
+                reg->handler(reg->fd, reg->arg);
+            }
+        }
+
+        run_expired_timers();
+        run_posted_tasks();
+        int hooks = __atomic_load_n(&tick_hook_count, __ATOMIC_ACQUIRE);
+        for (int i = 0; i < hooks; i++) {
+            tick_hooks[i].fn(tick_hooks[i].arg);
+        }
+    }
+
+    log_with_timestamp("SIP 事件循環線程結束\n");
+    return NULL;
+}
+
+// 啟動事件循環 (重複調用無副作用)
+int sip_reactor_start(void) {
+    pthread_mutex_lock(&start_lock);
+    if (reactor_running) {
+        pthread_mutex_unlock(&start_lock);
+        return 0;
+    }
+
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd < 0) {
+        log_with_timestamp("錯誤: 無法創建 epoll: %s\n", strerror(errno));
+        pthread_mutex_unlock(&start_lock);
+        return -1;
+    }
+
+    wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (wakeup_fd < 0) {
+        log_with_timestamp("錯誤: 無法創建 eventfd: %s\n", strerror(errno));
+        close(epoll_fd);
+        epoll_fd = -1;
+        pthread_mutex_unlock(&start_lock);
+        return -1;
+    }
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;  // NULL 代表喚醒用的 eventfd
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wakeup_fd, &ev);
+
+    reactor_running = 1;
+    if (pthread_create(&reactor_thread, NULL, reactor_thread_main, NULL) != 0) {
+        log_with_timestamp("錯誤: 無法創建事件循環線程\n");
+        reactor_running = 0;
+        close(wakeup_fd);
+        close(epoll_fd);
+        wakeup_fd = epoll_fd = -1;
+        pthread_mutex_unlock(&start_lock);
+        return -1;
+    }
+
+    pthread_mutex_unlock(&start_lock);
+    return 0;
+}
+
+// 停止事件循環並等待線程結束
+void sip_reactor_stop(void) {
+    pthread_mutex_lock(&start_lock);
+    if (!reactor_running) {
+        pthread_mutex_unlock(&start_lock);
+        return;
+    }
+    reactor_running = 0;
+    reactor_wakeup();
+    pthread_join(reactor_thread, NULL);
+
+    run_posted_tasks();
+    free_removed_registrations(NULL);
+    close(wakeup_fd);
+    close(epoll_fd);
+    wakeup_fd = epoll_fd = -1;
+    pthread_mutex_unlock(&start_lock);
+}
+
+// 判斷當前是否在事件循環線程中
+int sip_reactor_in_thread(void) {
+    return in_reactor_thread;
+}
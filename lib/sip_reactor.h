@@ -0,0 +1,49 @@
+// sip_reactor.h - 單線程 epoll 事件循環與計時器
+#ifndef SIP_REACTOR_H
+#define SIP_REACTOR_H
+
+#include <stdint.h>
+
+#define SIP_REACTOR_MAX_EVENTS 64    // 每次 epoll_wait 取回的事件數
+#define SIP_REACTOR_MAX_TICK_HOOKS 4 // 每輪結束時調用的函數數上限
+
+// 文件描述符可讀時的處理函數 (在事件循環線程中調用)
+typedef void (*sip_fd_handler_t)(int fd, void *arg);
+// 計時器到期與投遞任務的回調函數 (在事件循環線程中調用)
+typedef void (*sip_task_fn_t)(void *arg);
+
+// 計時器：嵌入在使用者的結構中，由事件循環的最小堆管理
+typedef struct sip_timer {
+    uint64_t expires_ms;     // 到期時間 (CLOCK_MONOTONIC 毫秒)
+    int heap_index;          // 在最小堆中的位置，-1 表示未啟動
+    sip_task_fn_t callback;
+    void *arg;
+} sip_timer_t;
+
+// 事件循環管理
+int sip_reactor_start(void);
+void sip_reactor_stop(void);
+int sip_reactor_in_thread(void);
+uint64_t sip_now_ms(void);
+uint64_t sip_now_us(void);
+
+// 文件描述符註冊
+int sip_reactor_add_fd(int fd, sip_fd_handler_t handler, void *arg);
+void sip_reactor_remove_fd(int fd);
+// 同時等待可寫事件 (非阻塞 connect 與待發送數據)；處理函數對兩種事件都會被調用
+int sip_reactor_watch_write(int fd, int enable);
+
+// 將任務投遞到事件循環線程執行 (可從任意線程調用)
+int sip_reactor_post(sip_task_fn_t fn, void *arg);
+// 投遞任務並等待其執行完成 (不可在事件循環線程中調用)
+int sip_reactor_run_sync(sip_task_fn_t fn, void *arg);
+// 每輪事件處理 (文件描述符、計時器、任務) 結束、再次等待之前調用，用於合併發送 (重複註冊無副作用)
+int sip_reactor_add_tick_hook(sip_task_fn_t fn, void *arg);
+
+// 計時器 (可從任意線程調用；回調在事件循環線程中執行)
+void sip_timer_init(sip_timer_t *timer, sip_task_fn_t callback, void *arg);
+void sip_timer_start(sip_timer_t *timer, int delay_ms);
+void sip_timer_stop(sip_timer_t *timer);
+int sip_timer_active(const sip_timer_t *timer);
+
+#endif // SIP_REACTOR_H
@@ -0,0 +1,373 @@
+// sip_register.c - 實現 REGISTER 客戶端與背景更新排程 (RFC 3261 10)
+#include "sip_register.h"
+#include "sip_transport.h"
+#include "sip_transaction.h"
+#include "sip_auth.h"
+#include "sip_gateway.h"
+#include "sip_id.h"
+
+static sip_registration_t registrations[SIP_MAX_REGISTRATIONS];
+static pthread_mutex_t reg_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void reg_send(sip_registration_t *reg);
+static void reg_refresh_expired(void *arg);
+
+const char* sip_register_state_name(sip_reg_state_t state) {
+    switch (state) {
+        case REG_UNREGISTERED:  return "未註冊";
+        case REG_REGISTERING:   return "註冊中";
+        case REG_REGISTERED:    return "已註冊";
+        case REG_FAILED:        return "註冊失敗";
+        case REG_UNREGISTERING: return "註銷中";
+    }
+    return "未知";
+}
+
+// 編譯 REGISTER 模板：branch、CSeq、Expires 與認證標頭在發送時填入
+static int reg_compile_template(sip_registration_t *reg) {
+    sip_template_t *tpl = &reg->tpl;
+
+    sip_template_reset(tpl);
+    sip_template_append(tpl,
+        "REGISTER sip:%s SIP/2.0\r\n"
+        "Via: SIP/2.0/%s %s:%d;branch=",
+        reg->host, sip_transport_via(), LOCAL_IP, LOCAL_PORT);
+    sip_template_field(tpl, SIP_TPL_BRANCH);
+    sip_template_append(tpl,
+        "\r\n"
+        "Max-Forwards: 70\r\n"
+        "From: <sip:%s@%s>;tag=%s\r\n"
+        "To: <sip:%s@%s>\r\n"
+        "Call-ID: %s\r\n"
+        "CSeq: ",
+        reg->user, reg->host, reg->tag,
+        reg->user, reg->host,
+        reg->callid);
+    sip_template_field(tpl, SIP_TPL_CSEQ);
+    sip_template_append(tpl,
+        " REGISTER\r\n"
+        "Contact: <sip:%s@%s:%d%s>\r\n"
+        "Expires: ",
+        reg->user, LOCAL_IP, LOCAL_PORT, sip_transport_uri_param());
+    sip_template_field(tpl, SIP_TPL_EXPIRES);
+    sip_template_append(tpl,
+        "\r\n"
+        "User-Agent: Custom SIP Client\r\n");
+    sip_template_field(tpl, SIP_TPL_AUTH);
+    sip_template_append(tpl,
+        "Content-Length: 0\r\n"
+        "\r\n");
+
+    return sip_template_ready(tpl) ? 0 : -1;
+}
+
+// 建立註冊槽位 (不發送)
+sip_registration_t* sip_register_create(const char *user, int expires, const char *host, int port) {
+    struct sockaddr_in servaddr;
+
+    if (!host) {
+        host = SIP_SERVER;
+        port = SIP_PORT;
+    }
+    // 開啟共用傳輸時已在本線程解析設定中的主機名，這裡只查詢快取
+    if (sip_transport_acquire() != 0) {
+        log_with_timestamp("錯誤: 無法開啟 SIP 傳輸，無法建立註冊\n");
+        return NULL;
+    }
+    if (sip_gateway_resolve(host, port, &servaddr) != 0) {
+        sip_transport_release();
+        log_with_timestamp("錯誤: 無法解析註冊伺服器 %s\n", host);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&reg_lock);
+    sip_registration_t *reg = NULL;
+    for (int i = 0; i < SIP_MAX_REGISTRATIONS; i++) {
+        if (!registrations[i].in_use) {
+            reg = &registrations[i];
+            break;
+        }
+    }
+    if (!reg) {
+        pthread_mutex_unlock(&reg_lock);
+        sip_transport_release();
+        log_with_timestamp("錯誤: 註冊表已滿 (%d)\n", SIP_MAX_REGISTRATIONS);
+        return NULL;
+    }
+
+    memset(reg, 0, sizeof(*reg));
+    reg->index = reg - registrations;
+    reg->in_use = 1;
+    reg->state = REG_UNREGISTERED;
+    snprintf(reg->user, sizeof(reg->user), "%s", user);
+    snprintf(reg->host, sizeof(reg->host), "%s", host);
+    reg->sockfd = sip_transport_sockfd();
+    reg->servaddr = servaddr;
+    reg->expires = expires > 0 ? expires : SIP_REGISTER_EXPIRES;
+    sip_id_callid(reg->callid, sizeof(reg->callid), LOCAL_IP);
+    get_tag(reg->tag, sizeof(reg->tag));
+    reg->cseq = 1;
+    reg->retry_delay_ms = SIP_REGISTER_RETRY_MIN_MS;
+    sip_timer_init(&reg->refresh_timer, reg_refresh_expired, reg);
+
+    if (reg_compile_template(reg) != 0) {
+        reg->in_use = 0;
+        pthread_mutex_unlock(&reg_lock);
+        sip_transport_release();
+        log_with_timestamp("錯誤: REGISTER 模板超出容量\n");
+        return NULL;
+    }
+    pthread_mutex_unlock(&reg_lock);
+
+    log_with_timestamp("建立註冊 #%d: sip:%s@%s:%d，有效期 %d 秒\n", reg->index, user, host, port, reg->expires);
+    return reg;
+}
+
+// ---- 事件循環線程中的狀態機 ----
+
+// 狀態改變時記錄並通知 (認證重試等同狀態的重新發送不通知)
+static void reg_set_state(sip_registration_t *reg, sip_reg_state_t state) {
+    if (reg->state == state) return;
+    log_with_timestamp("註冊 #%d (%s): %s -> %s\n", reg->index, reg->user,
+                     sip_register_state_name(reg->state), sip_register_state_name(state));
+    reg->state = state;
+    if (reg->on_state_change) {
+        reg->on_state_change(reg);
+    }
+}
+
+// 更新時間：有效期較長時提前 32 秒 (Timer F)，較短時在一半時更新
+static int reg_refresh_interval_ms(int granted) {
+    int seconds = granted > 64 ? granted - 32 : granted / 2;
+    return (seconds > 0 ? seconds : 1) * 1000;
+}
+
+// 伺服器允許的有效期：優先取 Contact 的 expires 參數，其次為 Expires 標頭
+static int reg_granted_expires(const sip_registration_t *reg, const sip_msg_t *msg) {
+    char value[16];
+    if (msg && sip_msg_header_param(msg, SIP_HDR_CONTACT, "expires", value, sizeof(value)) == 0 && value[0]) {
+        return atoi(value);
+    }
+    if (msg && sip_msg_header_value(msg, SIP_HDR_EXPIRES, value, sizeof(value)) == 0 && value[0]) {
+        return atoi(value);
+    }
+    return reg->expires;
+}
+
+static void reg_schedule_retry(sip_registration_t *reg) {
+    log_with_timestamp("註冊 #%d 將在 %d 秒後重試\n", reg->index, reg->retry_delay_ms / 1000);
+    sip_timer_start(&reg->refresh_timer, reg->retry_delay_ms);
+    reg->retry_delay_ms = reg->retry_delay_ms * 2 < SIP_REGISTER_RETRY_MAX_MS ?
+                          reg->retry_delay_ms * 2 : SIP_REGISTER_RETRY_MAX_MS;
+}
+
+static void on_register_event(sip_transaction_t *txn, int status_code, const sip_msg_t *msg, void *user_data) {
+    sip_registration_t *reg = (sip_registration_t *)user_data;
+    (void)txn;
+
+    if (status_code < 200) return;
+    reg->txn = NULL;
+    reg->last_status = status_code;
+
+    if ((status_code == 401 || status_code == 407) && !reg->auth_attempted && msg &&
+        sip_auth_handle_challenge(&reg->servaddr, status_code, msg) == 0) {
+        reg->auth_attempted = 1;
+        reg_send(reg);
+        return;
+    }
+
+    if (reg->unregister_requested) {
+        log_with_timestamp("註冊 #%d 註銷結果: %d\n", reg->index, status_code);
+        reg_set_state(reg, REG_UNREGISTERED);
+        return;
+    }
+
+    if (status_code >= 200 && status_code < 300) {
+        if (msg) sip_auth_update_from_response(&reg->servaddr, msg);
+        reg->granted_expires = reg_granted_expires(reg, msg);
+        reg->auth_attempted = 0;
+        reg->retry_delay_ms = SIP_REGISTER_RETRY_MIN_MS;
+        log_with_timestamp("註冊 #%d 成功，有效期 %d 秒\n", reg->index, reg->granted_expires);
+        if (reg->granted_expires > 0) {
+            sip_timer_start(&reg->refresh_timer, reg_refresh_interval_ms(reg->granted_expires));
+        }
+        reg_set_state(reg, REG_REGISTERED);
+    } else if (status_code == 423 && msg) {
+        // Interval Too Brief：依 Min-Expires 調整後重新發送
+        const sip_header_t *min = sip_msg_header_by_name(msg, "Min-Expires");
+        char value[16];
+        if (min && sip_slice_copy(msg, min->value, value, sizeof(value)) == 0 && atoi(value) > reg->expires) {
+            reg->expires = atoi(value);
+            log_with_timestamp("註冊 #%d 有效期過短，改為 %d 秒\n", reg->index, reg->expires);
+            reg_send(reg);
+        } else {
+            reg_set_state(reg, REG_FAILED);
+            reg_schedule_retry(reg);
+        }
+    } else {
+        log_with_timestamp("註冊 #%d 失敗，狀態碼: %d\n", reg->index, status_code);
+        if (status_code == 401 || status_code == 407) {
+            sip_auth_invalidate(&reg->servaddr);
+        }
+        reg->auth_attempted = 0;
+        reg_set_state(reg, REG_FAILED);
+        reg_schedule_retry(reg);
+    }
+}
+
+// 發送 REGISTER (更新或註銷)：每次使用新的 branch 與遞增的 CSeq
+static void reg_send(sip_registration_t *reg) {
+    struct iovec iov[SIP_TPL_MAX_SEGMENTS];
+    char branch[64], cseq[16], expires[16], uri[128];
+    char auth_header[1024] = "";
+
+    get_branch(branch, sizeof(branch));
+    snprintf(cseq, sizeof(cseq), "%u", reg->cseq++);
+    snprintf(expires, sizeof(expires), "%d", reg->unregister_requested ? 0 : reg->expires);
+    snprintf(uri, sizeof(uri), "sip:%s", reg->host);
+
+    // 剛收到挑戰時必定帶認證；否則只在快取支援 qop=auth 時預先帶上
+    if (sip_auth_build_header(&reg->servaddr, "REGISTER", uri, !reg->auth_attempted,
+                              auth_header, sizeof(auth_header)) <= 0) {
+        auth_header[0] = '\0';
+    }
+
+    const char *values[SIP_TPL_FIELD_COUNT] = { 0 };
+    values[SIP_TPL_BRANCH] = branch;
+    values[SIP_TPL_CSEQ] = cseq;
+    values[SIP_TPL_EXPIRES] = expires;
+    values[SIP_TPL_AUTH] = auth_header;
+    int iovcnt = sip_template_iov(&reg->tpl, values, iov, SIP_TPL_MAX_SEGMENTS, NULL);
+
+    if (iovcnt > 0) {
+        reg->txn = sip_txn_client_start_iov(reg->sockfd, &reg->servaddr, "REGISTER", branch,
+                                            iov, iovcnt, on_register_event, reg);
+    }
+    if (!reg->txn) {
+        log_with_timestamp("錯誤: 註冊 #%d 無法發送 REGISTER\n", reg->index);
+        if (reg->unregister_requested) {
+            reg_set_state(reg, REG_UNREGISTERED);
+        } else {
+            reg_set_state(reg, REG_FAILED);
+            reg_schedule_retry(reg);
+        }
+        return;
+    }
+
+    log_with_timestamp("發送 REGISTER (註冊 #%d，CSeq %s，Expires %s)%s\n", reg->index, cseq, expires,
+                     auth_header[0] ? "，帶認證" : "");
+    // 更新期間綁定仍然有效，維持已註冊狀態
+    if (reg->unregister_requested) {
+        reg_set_state(reg, REG_UNREGISTERING);
+    } else if (reg->state != REG_REGISTERED) {
+        reg_set_state(reg, REG_REGISTERING);
+    }
+}
+
+static void reg_refresh_expired(void *arg) {
+    sip_registration_t *reg = (sip_registration_t *)arg;
+    if (reg->txn || reg->unregister_requested) return;
+    reg_send(reg);
+}
+
+static void reg_start_task(void *arg) {
+    sip_registration_t *reg = (sip_registration_t *)arg;
+    if (!reg->in_use || reg->txn) return;
+
+    reg->unregister_requested = 0;
+    reg->auth_attempted = 0;
+    sip_timer_stop(&reg->refresh_timer);
+    reg_send(reg);
+}
+
+static void reg_stop_task(void *arg) {
+    sip_registration_t *reg = (sip_registration_t *)arg;
+    if (!reg->in_use) return;
+
+    sip_timer_stop(&reg->refresh_timer);
+    if (reg->txn) {
+        sip_txn_detach(reg->txn);
+        reg->txn = NULL;
+    }
+    int was_registered = reg->state == REG_REGISTERED || reg->state == REG_REGISTERING;
+    reg->unregister_requested = 1;
+    reg->auth_attempted = 0;
+    if (was_registered) {
+        reg_send(reg);
+    } else {
+        reg_set_state(reg, REG_UNREGISTERED);
+    }
+}
+
+// 開始註冊並在到期前自動更新
+int sip_register_start(sip_registration_t *reg) {
+    if (!reg || !reg->in_use) return -1;
+    return sip_reactor_post(reg_start_task, reg);
+}
+
+// 註銷 (Expires: 0) 並停止更新
+int sip_register_stop(sip_registration_t *reg) {
+    if (!reg || !reg->in_use) return -1;
+    return sip_reactor_post(reg_stop_task, reg);
+}
+
+// 在事件循環線程中釋放：與事務脫鉤並停止計時器
+static void reg_release_task(void *arg) {
+    sip_registration_t *reg = (sip_registration_t *)arg;
+
+    sip_timer_stop(&reg->refresh_timer);
+    if (reg->txn) {
+        sip_txn_detach(reg->txn);
+        reg->txn = NULL;
+    }
+    reg->on_state_change = NULL;
+
+    pthread_mutex_lock(&reg_lock);
+    reg->in_use = 0;
+    pthread_mutex_unlock(&reg_lock);
+    sip_transport_release();
+}
+
+void sip_register_destroy(sip_registration_t *reg) {
+    if (!reg || !reg->in_use) return;
+
+    if (sip_reactor_run_sync(reg_release_task, reg) != 0) {
+        reg_release_task(reg);
+    }
+    log_with_timestamp("註冊 #%d 已釋放\n", reg->index);
+}
+
+// 關閉前註銷所有綁定 (只發送一次，不等待回應) 並釋放
+static void reg_shutdown_task(void *arg) {
+    (void)arg;
+    for (int i = 0; i < SIP_MAX_REGISTRATIONS; i++) {
+        sip_registration_t *reg = &registrations[i];
+        if (!reg->in_use) continue;
+        reg->on_state_change = NULL;
+        reg_stop_task(reg);
+        reg_release_task(reg);
+    }
+}
+
+void sip_register_shutdown(void) {
+    if (sip_reactor_run_sync(reg_shutdown_task, NULL) != 0) {
+        for (int i = 0; i < SIP_MAX_REGISTRATIONS; i++) {
+            if (registrations[i].in_use) reg_release_task(&registrations[i]);
+        }
+    }
+}
+
+sip_reg_state_t sip_register_get_state(const sip_registration_t *reg) {
+    return reg ? reg->state : REG_UNREGISTERED;
+}
+
+// 目前有效的註冊數
+int sip_register_active_count(void) {
+    int count = 0;
+    pthread_mutex_lock(&reg_lock);
+    for (int i = 0; i < SIP_MAX_REGISTRATIONS; i++) {
+        if (registrations[i].in_use && registrations[i].state == REG_REGISTERED) count++;
+    }
+    pthread_mutex_unlock(&reg_lock);
+    return count;
+}
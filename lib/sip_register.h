@@ -0,0 +1,63 @@
+// sip_register.h - SIP 註冊管理：在共享SIP socket上維持一或多個綁定，到期前自動更新
+#ifndef SIP_REGISTER_H
+#define SIP_REGISTER_H
+
+#include "sip_client.h"
+
+#define SIP_MAX_REGISTRATIONS 8          // 同時維持的註冊數上限
+#define SIP_REGISTER_EXPIRES 3600        // 預設請求的註冊有效期 (秒)
+#define SIP_REGISTER_RETRY_MIN_MS 30000  // 註冊失敗後的重試間隔 (每次加倍)
+#define SIP_REGISTER_RETRY_MAX_MS 300000
+
+// 註冊狀態
+typedef enum {
+    REG_UNREGISTERED = 0,  // 未註冊 (或已註銷)
+    REG_REGISTERING,       // REGISTER 已發送，等待最終回應
+    REG_REGISTERED,        // 綁定有效，等待更新計時器
+    REG_FAILED,            // 註冊失敗，等待重試
+    REG_UNREGISTERING      // 已發送 Expires: 0
+} sip_reg_state_t;
+
+typedef struct sip_registration {
+    int index;
+    int in_use;
+    volatile sip_reg_state_t state;
+    char user[64];                       // 註冊的 AOR 使用者部分
+    char host[64];                       // 註冊伺服器 (Request-URI 與 AOR 的網域部分)
+    int sockfd;                          // 共用SIP傳輸的socket
+    struct sockaddr_in servaddr;
+    int expires;                         // 請求的有效期 (秒)
+    int granted_expires;                 // 伺服器允許的有效期 (秒)
+    int last_status;                     // 最近一次 REGISTER 的最終狀態碼
+
+    // 以下欄位只在事件循環線程中存取
+    char callid[64];                     // 同一綁定的所有 REGISTER 共用 Call-ID，CSeq 遞增
+    char tag[32];
+    unsigned int cseq;
+    int auth_attempted;
+    int unregister_requested;
+    int retry_delay_ms;
+    sip_template_t tpl;
+    struct sip_transaction *txn;
+    sip_timer_t refresh_timer;           // 到期前更新；失敗後重試
+
+    // 狀態變化通知 (在事件循環線程中調用)
+    void (*on_state_change)(struct sip_registration *reg);
+    void *user_data;
+} sip_registration_t;
+
+// 生命週期 (每個註冊持有一個共用SIP傳輸的引用)；host 為 NULL 時向 sip_server:sip_port 註冊
+sip_registration_t* sip_register_create(const char *user, int expires, const char *host, int port);
+void sip_register_destroy(sip_registration_t *reg);
+void sip_register_shutdown(void);
+
+// 非阻塞介面 (可從任意線程調用；結果經由 on_state_change 通知)
+int sip_register_start(sip_registration_t *reg);
+int sip_register_stop(sip_registration_t *reg);
+
+// 查詢
+sip_reg_state_t sip_register_get_state(const sip_registration_t *reg);
+const char* sip_register_state_name(sip_reg_state_t state);
+int sip_register_active_count(void);
+
+#endif // SIP_REGISTER_H
@@ -0,0 +1,294 @@
+// sip_sdp.c - 實現 SDP 解析與 offer/answer 協商
+#include "sip_sdp.h"
+#include "sip_client.h"
+#include <strings.h>
+
+#define SDP_MIN_PTIME 10
+#define SDP_MAX_PTIME (RTP_PACKET_MAX / 8)   // 8000Hz G.711 每毫秒 8 字節
+
+// RFC 3551 表 4：沒有 a=rtpmap 時的靜態音頻負載類型
+static const sip_sdp_format_t static_formats[] = {
+    { 0, "PCMU", 8000 },
+    { 3, "GSM", 8000 },
+    { 4, "G723", 8000 },
+    { 8, "PCMA", 8000 },
+    { 9, "G722", 8000 },
+    { 18, "G729", 8000 },
+};
+
+const char* sip_sdp_direction_name(sip_sdp_direction_t direction) {
+    switch (direction) {
+    case SIP_SDP_SENDRECV: return "sendrecv";
+    case SIP_SDP_SENDONLY: return "sendonly";
+    case SIP_SDP_RECVONLY: return "recvonly";
+    case SIP_SDP_INACTIVE: return "inactive";
+    }
+    return "未知";
+}
+
+// 以 "前綴" 開頭時返回其後的位置
+static const char* sdp_skip(const char *p, const char *eol, const char *prefix) {
+    size_t n = strlen(prefix);
+    return (size_t)(eol - p) >= n && memcmp(p, prefix, n) == 0 ? p + n : NULL;
+}
+
+static int sdp_number(const char **pp, const char *eol) {
+    const char *p = *pp;
+    int v = 0, digits = 0;
+
+    while (p < eol && *p == ' ') p++;
+    for (; p < eol && *p >= '0' && *p <= '9' && digits < 9; p++, digits++) {
+        v = v * 10 + (*p - '0');
+    }
+    *pp = p;
+    return digits ? v : -1;
+}
+
+static int sdp_direction(const char *p, const char *eol, sip_sdp_direction_t *direction) {
+    static const struct { const char *name; sip_sdp_direction_t dir; } attrs[] = {
+        { "a=sendrecv", SIP_SDP_SENDRECV }, { "a=sendonly", SIP_SDP_SENDONLY },
+        { "a=recvonly", SIP_SDP_RECVONLY }, { "a=inactive", SIP_SDP_INACTIVE },
+    };
+    for (size_t i = 0; i < sizeof(attrs) / sizeof(attrs[0]); i++) {
+        const char *rest = sdp_skip(p, eol, attrs[i].name);
+        if (rest && (rest == eol || *rest == ' ')) {
+            *direction = attrs[i].dir;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+// m=audio <port> RTP/AVP <fmt> ...
+static void sdp_parse_media(const char *p, const char *eol, sip_sdp_t *sdp) {
+    sdp->port = sdp_number(&p, eol);
+    if (sdp->port < 0) sdp->port = 0;
+    while (p < eol && *p != ' ') p++;       // 端口數 (/2) 與傳輸協議
+    while (p < eol && *p == ' ') p++;
+    while (p < eol && *p != ' ') p++;
+
+    sdp->format_count = 0;
+    while (p < eol && sdp->format_count < SIP_SDP_MAX_FORMATS) {
+        int pt = sdp_number(&p, eol);
+        if (pt < 0 || pt > 127) break;
+        sip_sdp_format_t *fmt = &sdp->formats[sdp->format_count++];
+        memset(fmt, 0, sizeof(*fmt));
+        fmt->payload_type = pt;
+        for (size_t i = 0; i < sizeof(static_formats) / sizeof(static_formats[0]); i++) {
+            if (static_formats[i].payload_type == pt) *fmt = static_formats[i];
+        }
+    }
+}
+
+// a=rtpmap:<pt> <encoding>/<clock rate>[/<channels>]
+static void sdp_parse_rtpmap(const char *p, const char *eol, sip_sdp_t *sdp) {
+    int pt = sdp_number(&p, eol);
+    if (pt < 0) return;
+    while (p < eol && *p == ' ') p++;
+
+    for (int i = 0; i < sdp->format_count; i++) {
+        sip_sdp_format_t *fmt = &sdp->formats[i];
+        if (fmt->payload_type != pt) continue;
+
+        const char *slash = memchr(p, '/', eol - p);
+        size_t n = slash ? (size_t)(slash - p) : (size_t)(eol - p);
+        if (n >= sizeof(fmt->encoding)) n = sizeof(fmt->encoding) - 1;
+        memcpy(fmt->encoding, p, n);
+        fmt->encoding[n] = '\0';
+        if (slash) {
+            const char *rate = slash + 1;
+            int clock_rate = sdp_number(&rate, eol);
+            if (clock_rate > 0) fmt->clock_rate = clock_rate;
+        }
+        return;
+    }
+}
+
+int sip_sdp_parse(const char *body, size_t len, sip_sdp_t *sdp) {
+    const char *p = body;
+    const char *end = body + len;
+    char session_addr[64] = "";
+    sip_sdp_direction_t session_dir = SIP_SDP_SENDRECV;
+    int media_dir_set = 0;
+    int in_media = 0, in_audio = 0, found = 0;
+
+    memset(sdp, 0, sizeof(*sdp));
+    sdp->direction = SIP_SDP_SENDRECV;
+
+    while (p < end) {
+        const char *eol = memchr(p, '\n', end - p);
+        const char *next = eol ? eol + 1 : end;
+        if (!eol) eol = end;
+        if (eol > p && eol[-1] == '\r') eol--;
+
+        const char *rest;
+        if (eol - p >= 2 && p[0] == 'm' && p[1] == '=') {
+            // 只協商第一個音頻媒體，其後的媒體行 (視訊等) 忽略
+            if (found) break;
+            in_media = 1;
+            in_audio = (rest = sdp_skip(p, eol, "m=audio ")) != NULL;
+            if (in_audio) {
+                found = 1;
+                sdp_parse_media(rest, eol, sdp);
+            }
+        } else if ((rest = sdp_skip(p, eol, "c=IN IP4 ")) != NULL && (!in_media || in_audio)) {
+            char *dst = in_audio ? sdp->connection : session_addr;
+            size_t n = 0;
+            while (rest + n < eol && rest[n] != ' ' && rest[n] != '/') n++;
+            if (n > 0 && n < sizeof(sdp->connection)) {
+                memcpy(dst, rest, n);
+                dst[n] = '\0';
+            }
+        } else if (in_audio && (rest = sdp_skip(p, eol, "a=rtpmap:")) != NULL) {
+            sdp_parse_rtpmap(rest, eol, sdp);
+        } else if ((!in_media || in_audio) && (rest = sdp_skip(p, eol, "a=ptime:")) != NULL) {
+            // 會話層的 ptime 不在規範內，但部分網關如此使用
+            int ptime = sdp_number(&rest, eol);
+            if (ptime > 0) sdp->ptime = ptime;
+        } else if (!in_media) {
+            sdp_direction(p, eol, &session_dir);
+        } else if (in_audio && sdp_direction(p, eol, &sdp->direction) == 0) {
+            media_dir_set = 1;
+        }
+        p = next;
+    }
+
+    if (!found) return -1;
+    if (!sdp->connection[0]) {
+        memcpy(sdp->connection, session_addr, sizeof(sdp->connection));
+    }
+    if (!media_dir_set) {
+        sdp->direction = session_dir;
+    }
+    return 0;
+}
+
+int sip_sdp_build_offer(char *buf, size_t buf_size, const char *local_ip, int rtp_port, int ptime,
+                        unsigned int version) {
+    return snprintf(buf, buf_size,
+        "v=0\r\n"
+        "o=- 0 %u IN IP4 %s\r\n"
+        "s=Custom SIP Client\r\n"
+        "c=IN IP4 %s\r\n"
+        "t=0 0\r\n"
+        "m=audio %d RTP/AVP 0 8 %d\r\n"
+        "a=rtpmap:0 PCMU/8000\r\n"
+        "a=rtpmap:8 PCMA/8000\r\n"
+        "a=rtpmap:%d telephone-event/8000\r\n"
+        "a=fmtp:%d 0-16\r\n"
+        "a=ptime:%d\r\n"
+        "a=sendrecv\r\n",
+        version, local_ip, local_ip, rtp_port,
+        SIP_SDP_DTMF_PT, SIP_SDP_DTMF_PT, SIP_SDP_DTMF_PT, ptime);
+}
+
+// answer 只列出協商選定的編碼 (與 DTMF)，負載類型沿用對方 offer 的編號
+int sip_sdp_build_answer(char *buf, size_t buf_size, const char *local_ip, int rtp_port,
+                         const sip_media_t *media, unsigned int version) {
+    char dtmf_pt[16] = "";
+    char dtmf_attrs[96] = "";
+
+    if (media->dtmf_payload_type >= 0) {
+        snprintf(dtmf_pt, sizeof(dtmf_pt), " %d", media->dtmf_payload_type);
+        snprintf(dtmf_attrs, sizeof(dtmf_attrs),
+                 "a=rtpmap:%d telephone-event/8000\r\n"
+                 "a=fmtp:%d 0-16\r\n",
+                 media->dtmf_payload_type, media->dtmf_payload_type);
+    }
+    return snprintf(buf, buf_size,
+        "v=0\r\n"
+        "o=- 0 %u IN IP4 %s\r\n"
+        "s=Custom SIP Client\r\n"
+        "c=IN IP4 %s\r\n"
+        "t=0 0\r\n"
+        "m=audio %d RTP/AVP %d%s\r\n"
+        "a=rtpmap:%d %s/%d\r\n"
+        "%s"
+        "a=ptime:%d\r\n"
+        "a=%s\r\n",
+        version, local_ip, local_ip, rtp_port, media->payload_type, dtmf_pt,
+        media->payload_type, media->encoding, media->clock_rate,
+        dtmf_attrs, media->ptime, sip_sdp_direction_name(media->direction));
+}
+
+void sip_media_init(sip_media_t *media, const struct in_addr *remote_addr, int remote_port) {
+    memset(media, 0, sizeof(*media));
+    media->remote_addr = *remote_addr;
+    media->remote_port = remote_port;
+    media->payload_type = 0;
+    snprintf(media->encoding, sizeof(media->encoding), "PCMU");
+    media->clock_rate = 8000;
+    media->ptime = SIP_SDP_DEFAULT_PTIME;
+    media->dtmf_payload_type = -1;
+    media->direction = SIP_SDP_SENDRECV;
+}
+
+// 對方的方向是從對方觀點描述的，轉為我方觀點
+static sip_sdp_direction_t sdp_local_direction(sip_sdp_direction_t remote) {
+    switch (remote) {
+    case SIP_SDP_SENDONLY: return SIP_SDP_RECVONLY;
+    case SIP_SDP_RECVONLY: return SIP_SDP_SENDONLY;
+    default: return remote;
+    }
+}
+
+int sip_sdp_negotiate(const sip_sdp_t *answer, const struct in_addr *fallback_addr, int offer_ptime,
+                      sip_media_t *media) {
+    const sip_sdp_format_t *audio = NULL;
+    int dtmf_pt = -1;
+
+    if (answer->port <= 0) {
+        log_with_timestamp("SDP 協商失敗: 對方拒絕音頻媒體 (端口 0)\n");
+        return -1;
+    }
+
+    // 依對方的順序選擇第一個我方支援的編碼；使用對方 answer 中的負載類型編號
+    for (int i = 0; i < answer->format_count; i++) {
+        const sip_sdp_format_t *fmt = &answer->formats[i];
+        if (fmt->clock_rate != 8000) continue;
+        if (!audio && (strcasecmp(fmt->encoding, "PCMU") == 0 || strcasecmp(fmt->encoding, "PCMA") == 0)) {
+            audio = fmt;
+        } else if (dtmf_pt < 0 && strcasecmp(fmt->encoding, "telephone-event") == 0) {
+            dtmf_pt = fmt->payload_type;
+        }
+    }
+    if (!audio) {
+        log_with_timestamp("SDP 協商失敗: 對方沒有接受 PCMU/PCMA\n");
+        return -1;
+    }
+
+    struct in_addr addr = *fallback_addr;
+    int hold = 0;
+    if (answer->connection[0]) {
+        if (inet_pton(AF_INET, answer->connection, &addr) != 1) {
+            log_with_timestamp("SDP 協商失敗: 無效的連接地址 %s\n", answer->connection);
+            return -1;
+        }
+        hold = addr.s_addr == htonl(INADDR_ANY);   // RFC 2543 式保持：c=0.0.0.0
+    }
+
+    int ptime = answer->ptime > 0 ? answer->ptime : offer_ptime;
+    if (ptime < SDP_MIN_PTIME) ptime = SDP_MIN_PTIME;
+    if (ptime > SDP_MAX_PTIME) ptime = SDP_MAX_PTIME;
+
+    sip_sdp_direction_t direction = sdp_local_direction(answer->direction);
+    if (hold) {
+        direction = direction == SIP_SDP_SENDRECV ? SIP_SDP_RECVONLY :
+                    direction == SIP_SDP_SENDONLY ? SIP_SDP_INACTIVE : direction;
+    }
+
+    media->remote_addr = addr;
+    media->remote_port = answer->port;
+    media->payload_type = audio->payload_type;
+    snprintf(media->encoding, sizeof(media->encoding), "%s", audio->encoding);
+    media->clock_rate = audio->clock_rate;
+    media->ptime = ptime;
+    media->dtmf_payload_type = dtmf_pt;
+    media->direction = direction;
+
+    log_with_timestamp("SDP 協商結果: %s:%d，%s/%d (PT %d)，ptime %d ms，DTMF PT %d，%s\n",
+                     inet_ntoa(media->remote_addr), media->remote_port, media->encoding,
+                     media->clock_rate, media->payload_type, media->ptime,
+                     media->dtmf_payload_type, sip_sdp_direction_name(media->direction));
+    return 0;
+}
@@ -0,0 +1,71 @@
+// sip_sdp.h - SDP 解析與 offer/answer 協商 (RFC 4566 / RFC 3264)：產生通話實際使用的媒體描述
+#ifndef SIP_SDP_H
+#define SIP_SDP_H
+
+#include <stddef.h>
+#include <netinet/in.h>
+
+#define SIP_SDP_MAX_FORMATS 16               // m= 行中記錄的格式數上限
+#define SIP_SDP_DEFAULT_PTIME 20             // 未指定 a=ptime 時的封包時長 (毫秒)
+#define SIP_SDP_DTMF_PT 101                  // 我方 offer 中 telephone-event 的動態負載類型
+
+// 媒體方向 (RFC 3264 6.1)
+typedef enum {
+    SIP_SDP_SENDRECV = 0,
+    SIP_SDP_SENDONLY,
+    SIP_SDP_RECVONLY,
+    SIP_SDP_INACTIVE
+} sip_sdp_direction_t;
+
+// m= 行中的一個格式 (沒有 a=rtpmap 的靜態負載類型依 RFC 3551 補上)
+typedef struct {
+    int payload_type;
+    char encoding[16];
+    int clock_rate;
+} sip_sdp_format_t;
+
+// 解析後的 SDP：只保留第一個 m=audio 媒體
+typedef struct {
+    char connection[64];                 // 媒體層 c= 優先，否則為會話層 c= (空字串表示沒有)
+    int port;                            // m=audio 的端口，0 表示對方拒絕此媒體
+    int format_count;
+    sip_sdp_format_t formats[SIP_SDP_MAX_FORMATS];   // 依 m= 行順序 (對方的優先順序)
+    int ptime;                           // a=ptime，0 表示未指定
+    sip_sdp_direction_t direction;       // 媒體層屬性優先，否則為會話層，預設 sendrecv
+} sip_sdp_t;
+
+// 協商結果：通話的媒體路徑依此發送與接收
+typedef struct {
+    struct in_addr remote_addr;          // 對方的媒體地址
+    int remote_port;
+    int payload_type;                    // 音頻編碼的負載類型 (0 PCMU 或 8 PCMA)
+    char encoding[16];
+    int clock_rate;
+    int ptime;                           // 每個封包的毫秒數
+    int dtmf_payload_type;               // telephone-event 的負載類型，-1 表示對方不支援
+    sip_sdp_direction_t direction;       // 我方觀點：SENDONLY 表示我方只發送
+} sip_media_t;
+
+// 解析 SDP 內容 (不需以 NUL 結尾)；沒有 m=audio 行時返回 -1
+int sip_sdp_parse(const char *body, size_t len, sip_sdp_t *sdp);
+
+// 產生我方的 offer (PCMU、PCMA 與 telephone-event)，返回長度；version 為 o= 行的會話版本，
+// 同一通話中每次發出新的 SDP 都必須遞增 (RFC 3264 8)
+int sip_sdp_build_offer(char *buf, size_t buf_size, const char *local_ip, int rtp_port, int ptime,
+                        unsigned int version);
+
+// 以協商結果回應對方的 offer (re-INVITE / UPDATE)，返回長度
+int sip_sdp_build_answer(char *buf, size_t buf_size, const char *local_ip, int rtp_port,
+                         const sip_media_t *media, unsigned int version);
+
+// 以對方的 answer (或對話中 re-INVITE 帶來的 offer) 協商媒體：fallback_addr 為沒有 c= 行時的媒體地址，offer_ptime 為對方未指定 ptime 時沿用的值
+// 沒有共同編碼或媒體被拒絕時返回 -1 (media 不變)
+int sip_sdp_negotiate(const sip_sdp_t *answer, const struct in_addr *fallback_addr, int offer_ptime,
+                      sip_media_t *media);
+
+// 未協商前的預設媒體描述 (PCMU、預設 ptime、sendrecv)
+void sip_media_init(sip_media_t *media, const struct in_addr *remote_addr, int remote_port);
+
+const char* sip_sdp_direction_name(sip_sdp_direction_t direction);
+
+#endif // SIP_SDP_H
@@ -0,0 +1,198 @@
+// sip_snapshot.c - 實現通話狀態快照 (MAP_SHARED 映射：進程崩潰後已寫入的頁面仍由內核寫回檔案)
+#include "sip_snapshot.h"
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t record_size;
+    uint32_t slots;
+} snapshot_header_t;
+
+typedef struct {
+    snapshot_header_t header;
+    sip_snapshot_record_t records[SIP_MAX_DIALOGS];
+} snapshot_file_t;
+
+static int snapshot_fd = -1;
+static snapshot_file_t *snapshot = NULL;
+
+// 上次進程留下的記錄 (開啟時複製出來，映射隨即清空供本進程使用)
+static sip_snapshot_record_t recovered[SIP_MAX_DIALOGS];
+static int recovered_count = 0;
+
+static int snapshot_header_valid(const snapshot_header_t *h) {
+    return h->magic == SIP_SNAPSHOT_MAGIC && h->version == SIP_SNAPSHOT_VERSION &&
+           h->record_size == sizeof(sip_snapshot_record_t) && h->slots == SIP_MAX_DIALOGS;
+}
+
+// 複製完整寫入 (seq 為偶數) 且仍在使用中的記錄
+static void snapshot_collect(void) {
+    recovered_count = 0;
+    if (!snapshot_header_valid(&snapshot->header)) return;
+
+    for (int i = 0; i < SIP_MAX_DIALOGS; i++) {
+        const sip_snapshot_record_t *rec = &snapshot->records[i];
+        if (rec->state == DIALOG_FREE || (rec->seq & 1) || rec->index != i) continue;
+        recovered[recovered_count] = *rec;
+        recovered[recovered_count].callee[sizeof(rec->callee) - 1] = '\0';
+        recovered[recovered_count].callid[sizeof(rec->callid) - 1] = '\0';
+        recovered[recovered_count].tag[sizeof(rec->tag) - 1] = '\0';
+        recovered[recovered_count].to_tag[sizeof(rec->to_tag) - 1] = '\0';
+        recovered[recovered_count].cseq[sizeof(rec->cseq) - 1] = '\0';
+        recovered[recovered_count].route_host[sizeof(rec->route_host) - 1] = '\0';
+        recovered[recovered_count].remote_target[sizeof(rec->remote_target) - 1] = '\0';
+        recovered[recovered_count].route_set[sizeof(rec->route_set) - 1] = '\0';
+        recovered_count++;
+    }
+}
+
+int sip_snapshot_open(const char *path) {
+    struct stat st;
+
+    if (snapshot) return 0;
+    if (!path || !path[0]) return 0;
+
+    snapshot_fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (snapshot_fd < 0) {
+        log_with_timestamp("警告: 無法開啟通話快照 %s: %s，停用快照\n", path, strerror(errno));
+        return -1;
+    }
+    // 同一個快照檔案只能由一個進程使用
+    if (flock(snapshot_fd, LOCK_EX | LOCK_NB) != 0) {
+        log_with_timestamp("警告: 通話快照 %s 正由其他進程使用，停用快照\n", path);
+        close(snapshot_fd);
+        snapshot_fd = -1;
+        return -1;
+    }
+
+    int existing = fstat(snapshot_fd, &st) == 0 && st.st_size >= (off_t)sizeof(snapshot_file_t);
+    if (ftruncate(snapshot_fd, sizeof(snapshot_file_t)) != 0) {
+        log_with_timestamp("警告: 無法設定通話快照 %s 的大小: %s，停用快照\n", path, strerror(errno));
+        close(snapshot_fd);
+        snapshot_fd = -1;
+        return -1;
+    }
+
+    void *map = mmap(NULL, sizeof(snapshot_file_t), PROT_READ | PROT_WRITE, MAP_SHARED, snapshot_fd, 0);
+    if (map == MAP_FAILED) {
+        log_with_timestamp("警告: 無法映射通話快照 %s: %s，停用快照\n", path, strerror(errno));
+        close(snapshot_fd);
+        snapshot_fd = -1;
+        return -1;
+    }
+    snapshot = (snapshot_file_t *)map;
+
+    if (existing) {
+        snapshot_collect();
+    }
+    memset(snapshot, 0, sizeof(snapshot_file_t));
+    snapshot->header.magic = SIP_SNAPSHOT_MAGIC;
+    snapshot->header.version = SIP_SNAPSHOT_VERSION;
+    snapshot->header.record_size = sizeof(sip_snapshot_record_t);
+    snapshot->header.slots = SIP_MAX_DIALOGS;
+
+    log_with_timestamp("通話快照: %s%s\n", path, recovered_count > 0 ? "" : "，沒有需要恢復的通話");
+    if (recovered_count > 0) {
+        log_with_timestamp("上次進程留下 %d 通未結束的通話\n", recovered_count);
+    }
+    return 0;
+}
+
+void sip_snapshot_close(void) {
+    if (!snapshot) return;
+    munmap(snapshot, sizeof(snapshot_file_t));
+    snapshot = NULL;
+    close(snapshot_fd);
+    snapshot_fd = -1;
+}
+
+void sip_snapshot_save(const sip_dialog_t *dialog) {
+    if (!snapshot || !dialog) return;
+
+    const sip_session_t *session = &dialog->session;
+    sip_snapshot_record_t *rec = &snapshot->records[dialog->index];
+    uint32_t seq = rec->seq;
+
+    __atomic_store_n(&rec->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    rec->state = dialog->state;
+    rec->index = dialog->index;
+    rec->local_rtp_port = session->local_rtp_port;
+    rec->last_status = dialog->last_status;
+    rec->sdp_version = session->sdp_version;
+    rec->updated_at = (int64_t)time(NULL);
+    memcpy(rec->callee, dialog->callee, sizeof(rec->callee));
+    memcpy(rec->callid, session->callid, sizeof(rec->callid));
+    memcpy(rec->tag, session->tag, sizeof(rec->tag));
+    memcpy(rec->to_tag, session->to_tag, sizeof(rec->to_tag));
+    memcpy(rec->cseq, session->cseq, sizeof(rec->cseq));
+    memcpy(rec->route_host, session->route_host, sizeof(rec->route_host));
+    memcpy(rec->remote_target, session->remote_target, sizeof(rec->remote_target));
+    memcpy(rec->route_set, session->route_set, sizeof(rec->route_set));
+    rec->servaddr = session->servaddr;
+    rec->media = session->media;
+    __atomic_store_n(&rec->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+void sip_snapshot_clear(int index) {
+    if (!snapshot || index < 0 || index >= SIP_MAX_DIALOGS) return;
+
+    sip_snapshot_record_t *rec = &snapshot->records[index];
+    uint32_t seq = rec->seq;
+    __atomic_store_n(&rec->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    rec->state = DIALOG_FREE;
+    __atomic_store_n(&rec->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+int sip_snapshot_pending(void) {
+    return recovered_count;
+}
+
+// 交由快照模組結束的對話：BYE 已發出 (或對方先掛斷) 後釋放槽位
+static void snapshot_dialog_state(sip_dialog_t *dialog) {
+    if (dialog->state == DIALOG_TERMINATED) {
+        sip_dialog_destroy(dialog);
+    }
+}
+
+int sip_snapshot_recover(sip_snapshot_resume_fn resume, void *user_data) {
+    uint64_t start_us = sip_now_us();
+    int restored = 0;
+    int ended = 0;
+
+    for (int i = 0; i < recovered_count; i++) {
+        const sip_snapshot_record_t *rec = &recovered[i];
+
+        if (rec->state != DIALOG_CONFIRMED) {
+            log_with_timestamp("快照: 通話 #%d (Call-ID %s) 尚未接通，無法恢復\n", rec->index, rec->callid);
+            continue;
+        }
+        sip_dialog_t *dialog = sip_dialog_restore(rec);
+        if (!dialog) {
+            log_with_timestamp("快照: 無法恢復通話 #%d (Call-ID %s)\n", rec->index, rec->callid);
+            continue;
+        }
+        restored++;
+        if (resume && resume(dialog, user_data) == 0) {
+            log_with_timestamp("快照: 通話 #%d 已恢復，本地RTP端口 %d，對方 %s:%d\n",
+                             dialog->index, dialog->session.local_rtp_port,
+                             inet_ntoa(dialog->session.media.remote_addr), dialog->session.media.remote_port);
+            continue;
+        }
+        dialog->on_state_change = snapshot_dialog_state;
+        sip_dialog_hangup(dialog);
+        ended++;
+    }
+
+    if (recovered_count > 0) {
+        log_with_timestamp("快照恢復完成: %d 通對話，其中 %d 通發送 BYE 結束 (%.2f ms)\n",
+                         restored, ended, (sip_now_us() - start_us) / 1000.0);
+    }
+    recovered_count = 0;
+    return restored;
+}
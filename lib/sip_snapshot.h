@@ -0,0 +1,52 @@
+// sip_snapshot.h - 通話狀態快照：每次對話狀態變化時寫入記憶體映射檔案，進程崩潰或重啟後
+// 依快照恢復已接通的對話 (沿用相同的 RTP 端口) 或立即以 BYE 結束，避免網關上殘留佔用中繼的通話
+#ifndef SIP_SNAPSHOT_H
+#define SIP_SNAPSHOT_H
+
+#include "sip_dialog.h"
+#include <stdint.h>
+
+#define SIP_SNAPSHOT_MAGIC 0x50414e53u     // "SNAP"
+#define SIP_SNAPSHOT_VERSION 2             // 記錄格式變更時遞增，舊版本的檔案不會被恢復
+
+// 一個對話槽位的記錄 (檔案中依槽位順序排列)
+typedef struct sip_snapshot_record {
+    uint32_t seq;                        // 寫入時先設為奇數，完成後為偶數；奇數表示寫入途中崩潰
+    int32_t state;                       // sip_dialog_state_t，DIALOG_FREE 表示槽位未使用
+    int32_t index;
+    int32_t local_rtp_port;
+    int32_t last_status;
+    uint32_t sdp_version;
+    int64_t updated_at;                  // 最後寫入的時間 (time())
+    char callee[64];
+    char callid[64];
+    char tag[32];
+    char to_tag[128];
+    char cseq[16];
+    char route_host[64];                 // Request-URI 的主機 (空字串表示 SIP_SERVER)
+    char remote_target[128];             // 對方 Contact 的 URI (空字串表示 sip:被叫@主機)
+    char route_set[512];                 // 對話的路由集合
+    struct sockaddr_in servaddr;         // 對話內請求的目的地 (選定的網關)
+    sip_media_t media;
+} sip_snapshot_record_t;
+
+// 恢復的對話交給應用層：返回 0 表示接手 (設置 rtp 與 on_state_change 後繼續通話)，
+// 返回 -1 則發送 BYE 結束
+typedef int (*sip_snapshot_resume_fn)(sip_dialog_t *dialog, void *user_data);
+
+// 開啟 (必要時建立) 快照檔案並讀出上次留下的記錄，之後清空檔案重新記錄 (由 sip_dialog_table_init 調用)；
+// path 為空字串時停用快照
+int sip_snapshot_open(const char *path);
+void sip_snapshot_close(void);
+
+// 寫入 / 清除對話的記錄 (狀態變化時由呼叫表調用)
+void sip_snapshot_save(const sip_dialog_t *dialog);
+void sip_snapshot_clear(int index);
+
+// 上次進程留下的記錄數 (sip_snapshot_open 之後、sip_snapshot_recover 之前)
+int sip_snapshot_pending(void);
+// 恢復上次留下的對話：已接通的對話在原槽位重建後交給 resume (NULL 表示全部發送 BYE)，
+// 尚未接通的呼叫沒有可用的 INVITE 事務，只記錄後丟棄 (由網關的逾時結束)；返回恢復的對話數
+int sip_snapshot_recover(sip_snapshot_resume_fn resume, void *user_data);
+
+#endif // SIP_SNAPSHOT_H
@@ -0,0 +1,601 @@
+// sip_stream.c - 實現 TCP/TLS 連接池、非阻塞連接與握手、Content-Length 分幀與 TLS 會話恢復
+#define _GNU_SOURCE  // memmem
+#include "sip_stream.h"
+#include <netinet/tcp.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/x509v3.h>
+
+typedef enum {
+    STREAM_IDLE = 0,      // 未連接 (槽位保留 TLS 會話供下次恢復)
+    STREAM_CONNECTING,    // 非阻塞 connect 進行中
+    STREAM_HANDSHAKE,     // TLS 握手進行中
+    STREAM_OPEN
+} sip_stream_state_t;
+
+typedef struct {
+    int in_use;                   // 槽位已綁定下一跳
+    sip_stream_state_t state;
+    int fd;
+    int tls;
+    unsigned int epoch;           // 每次關閉遞增，用於偵測回調期間連接被關閉
+    struct sockaddr_in dest;
+    SSL *ssl;
+    SSL_SESSION *resume;          // 最近一次握手取得的會話，重新連接時恢復
+    int want_write;
+    char rx[SIP_STREAM_RXBUF + 1];
+    int rx_len;
+    char *tx;                     // 待發送數據 (連接建立前或 socket 緩衝區已滿時累積)
+    int tx_len;
+    int tx_cap;
+    uint64_t last_activity_ms;
+    sip_timer_t connect_timer;
+    sip_timer_t keepalive_timer;
+} sip_stream_t;
+
+// 以下狀態只在事件循環線程中存取
+static sip_stream_t streams[SIP_MAX_STREAMS];
+static SSL_CTX *tls_ctx = NULL;
+static volatile int open_count = 0;
+static sip_stream_msg_handler_t message_handler = NULL;
+static sip_stream_error_handler_t error_handler = NULL;
+
+// 從其他線程發送時投遞的數據
+typedef struct {
+    struct sockaddr_in dest;
+    int tls;
+    int len;
+    char data[];
+} stream_job_t;
+
+static void stream_flush(sip_stream_t *s);
+
+void sip_stream_set_handlers(sip_stream_msg_handler_t on_message, sip_stream_error_handler_t on_error) {
+    message_handler = on_message;
+    error_handler = on_error;
+}
+
+static const char* stream_name(const sip_stream_t *s) {
+    return s->tls ? "TLS" : "TCP";
+}
+
+static void stream_watch_write(sip_stream_t *s, int enable) {
+    if (s->want_write != enable && sip_reactor_watch_write(s->fd, enable) == 0) {
+        s->want_write = enable;
+    }
+}
+
+// 連接中斷的通知延遲到下一輪事件循環，避免在發送路徑中重入事務層
+static void stream_error_task(void *arg) {
+    struct sockaddr_in *dest = (struct sockaddr_in *)arg;
+    if (error_handler) error_handler(dest);
+    free(dest);
+}
+
+static void stream_close(sip_stream_t *s, const char *reason, int notify) {
+    if (s->state == STREAM_IDLE) return;
+
+    log_with_timestamp("SIP %s 連接 %s:%d 已關閉: %s\n", stream_name(s),
+                     inet_ntoa(s->dest.sin_addr), ntohs(s->dest.sin_port), reason);
+    sip_timer_stop(&s->connect_timer);
+    sip_timer_stop(&s->keepalive_timer);
+    sip_reactor_remove_fd(s->fd);
+    if (s->ssl) {
+        if (s->state == STREAM_OPEN) SSL_shutdown(s->ssl);
+        SSL_free(s->ssl);
+        s->ssl = NULL;
+    }
+    close(s->fd);
+    if (s->state == STREAM_OPEN) open_count--;
+    s->fd = -1;
+    s->state = STREAM_IDLE;
+    s->want_write = 0;
+    s->rx_len = 0;
+    s->tx_len = 0;
+    s->epoch++;
+
+    if (notify) {
+        struct sockaddr_in *dest = malloc(sizeof(*dest));
+        if (dest) {
+            *dest = s->dest;
+            if (sip_reactor_post(stream_error_task, dest) != 0) free(dest);
+        }
+    }
+}
+
+static void stream_fail(sip_stream_t *s, const char *reason) {
+    stream_close(s, reason, 1);
+}
+
+// ---- TLS ----
+
+// 握手後伺服器發出的會話票據 (TLS 1.3 可能在握手完成後才到達)
+static int on_new_session(SSL *ssl, SSL_SESSION *session) {
+    sip_stream_t *s = (sip_stream_t *)SSL_get_app_data(ssl);
+    if (!s) return 0;
+    if (s->resume) SSL_SESSION_free(s->resume);
+    s->resume = session;
+    return 1;  // 保留引用
+}
+
+static SSL_CTX* stream_tls_context(void) {
+    if (tls_ctx) return tls_ctx;
+
+    const sip_config_t *cfg = sip_config();
+    SSL_CTX *ctx = SSL_CTX_new(TLS_client_method());
+    if (!ctx) return NULL;
+
+    SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+    SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+    SSL_CTX_sess_set_new_cb(ctx, on_new_session);
+#ifdef SSL_OP_IGNORE_UNEXPECTED_EOF
+    // 對方未發送 close_notify 直接關閉連接時視為正常關閉，否則會話會被標記為不可恢復
+    SSL_CTX_set_options(ctx, SSL_OP_IGNORE_UNEXPECTED_EOF);
+#endif
+
+    if (cfg->tls_verify) {
+        int loaded = cfg->tls_ca_file[0]
+                   ? SSL_CTX_load_verify_locations(ctx, cfg->tls_ca_file, NULL)
+                   : SSL_CTX_set_default_verify_paths(ctx);
+        if (loaded != 1) {
+            log_with_timestamp("錯誤: 無法載入 CA 憑證 %s\n", cfg->tls_ca_file[0] ? cfg->tls_ca_file : "(系統預設)");
+            SSL_CTX_free(ctx);
+            return NULL;
+        }
+        SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER, NULL);
+    } else {
+        SSL_CTX_set_verify(ctx, SSL_VERIFY_NONE, NULL);
+    }
+
+    tls_ctx = ctx;
+    return tls_ctx;
+}
+
+static void stream_opened(sip_stream_t *s) {
+    s->state = STREAM_OPEN;
+    s->last_activity_ms = sip_now_ms();
+    sip_timer_stop(&s->connect_timer);
+    sip_timer_start(&s->keepalive_timer, SIP_STREAM_KEEPALIVE_MS);
+    open_count++;
+
+    if (s->ssl) {
+        log_with_timestamp("SIP TLS 連接 %s:%d 已建立 (%s，%s)\n",
+                         inet_ntoa(s->dest.sin_addr), ntohs(s->dest.sin_port), SSL_get_version(s->ssl),
+                         SSL_session_reused(s->ssl) ? "會話恢復" : "完整握手");
+    } else {
+        log_with_timestamp("SIP TCP 連接 %s:%d 已建立\n", inet_ntoa(s->dest.sin_addr), ntohs(s->dest.sin_port));
+    }
+    stream_flush(s);
+}
+
+static void stream_handshake(sip_stream_t *s) {
+    int rc = SSL_connect(s->ssl);
+    if (rc == 1) {
+        stream_opened(s);
+        return;
+    }
+
+    int err = SSL_get_error(s->ssl, rc);
+    if (err == SSL_ERROR_WANT_READ) {
+        stream_watch_write(s, 0);
+    } else if (err == SSL_ERROR_WANT_WRITE) {
+        stream_watch_write(s, 1);
+    } else {
+        char reason[256];
+        unsigned long e = ERR_get_error();
+        long verify = SSL_get_verify_result(s->ssl);
+        if (verify != X509_V_OK) {
+            snprintf(reason, sizeof(reason), "TLS 握手失敗 (憑證驗證: %s)", X509_verify_cert_error_string(verify));
+        } else {
+            snprintf(reason, sizeof(reason), "TLS 握手失敗 (%s)", e ? ERR_error_string(e, NULL) : "連接中斷");
+        }
+        ERR_clear_error();
+        stream_fail(s, reason);
+    }
+}
+
+static int stream_start_tls(sip_stream_t *s) {
+    const sip_config_t *cfg = sip_config();
+    SSL_CTX *ctx = stream_tls_context();
+    if (!ctx || !(s->ssl = SSL_new(ctx))) return -1;
+
+    SSL_set_fd(s->ssl, s->fd);
+    SSL_set_app_data(s->ssl, s);
+
+    // SNI 與主機名驗證：優先使用 tls_server_name，否則使用 sip_server
+    const char *name = cfg->tls_server_name[0] ? cfg->tls_server_name : cfg->sip_server;
+    struct in_addr literal;
+    int is_ip = inet_pton(AF_INET, name, &literal) == 1;
+    if (!is_ip) {
+        SSL_set_tlsext_host_name(s->ssl, name);
+    }
+    if (cfg->tls_verify) {
+        if (is_ip) {
+            X509_VERIFY_PARAM_set1_ip_asc(SSL_get0_param(s->ssl), name);
+        } else {
+            SSL_set1_host(s->ssl, name);
+        }
+    }
+
+    if (s->resume) {
+        SSL_set_session(s->ssl, s->resume);
+    }
+
+    s->state = STREAM_HANDSHAKE;
+    stream_handshake(s);
+    return 0;
+}
+
+// ---- 讀寫 ----
+
+// 在標頭區段中找 Content-Length (或縮寫 l)；缺少時返回 -1
+static int header_content_length(const char *hdr, int hdr_len) {
+    const char *p = hdr, *end = hdr + hdr_len;
+    while (p < end) {
+        const char *eol = memchr(p, '\n', end - p);
+        if (!eol) eol = end;
+        int name_len;
+        if (eol - p >= 15 && strncasecmp(p, "Content-Length", 14) == 0) {
+            name_len = 14;
+        } else if (eol - p > 2 && (p[0] == 'l' || p[0] == 'L') && (p[1] == ':' || p[1] == ' ' || p[1] == '\t')) {
+            name_len = 1;
+        } else {
+            p = eol + 1;
+            continue;
+        }
+        const char *v = p + name_len;
+        while (v < eol && (*v == ' ' || *v == '\t')) v++;
+        if (v < eol && *v == ':') {
+            return atoi(v + 1);
+        }
+        p = eol + 1;
+    }
+    return -1;
+}
+
+// 從接收緩衝區取出所有完整的訊息
+static void stream_frame(sip_stream_t *s) {
+    unsigned int epoch = s->epoch;
+    int off = 0;
+
+    while (off < s->rx_len) {
+        // 保活用的 CRLF
+        if (s->rx[off] == '\r' || s->rx[off] == '\n') {
+            off++;
+            continue;
+        }
+
+        char *start = s->rx + off;
+        int avail = s->rx_len - off;
+        char *hdr_end = memmem(start, avail, "\r\n\r\n", 4);
+        if (!hdr_end) break;
+
+        int hdr_len = (int)(hdr_end - start) + 4;
+        int body_len = header_content_length(start, hdr_len);
+        if (body_len < 0 || hdr_len + body_len > SIP_STREAM_RXBUF) {
+            stream_fail(s, body_len < 0 ? "訊息缺少 Content-Length" : "訊息超過接收緩衝區");
+            return;
+        }
+        int total = hdr_len + body_len;
+        if (avail < total) break;
+
+        char saved = start[total];
+        start[total] = '\0';
+        if (message_handler) message_handler(start, total, &s->dest);
+        if (s->epoch != epoch) return;  // 處理期間連接被關閉
+        start[total] = saved;
+        off += total;
+    }
+
+    if (off > 0) {
+        memmove(s->rx, s->rx + off, s->rx_len - off);
+        s->rx_len -= off;
+    }
+}
+
+static void stream_read(sip_stream_t *s) {
+    unsigned int epoch = s->epoch;
+
+    for (;;) {
+        int space = SIP_STREAM_RXBUF - s->rx_len;
+        if (space <= 0) {
+            stream_fail(s, "訊息超過接收緩衝區");
+            return;
+        }
+
+        int n;
+        if (s->ssl) {
+            n = SSL_read(s->ssl, s->rx + s->rx_len, space);
+            if (n <= 0) {
+                int err = SSL_get_error(s->ssl, n);
+                if (err == SSL_ERROR_WANT_READ) return;
+                if (err == SSL_ERROR_WANT_WRITE) {
+                    stream_watch_write(s, 1);
+                    return;
+                }
+                ERR_clear_error();
+                stream_fail(s, err == SSL_ERROR_ZERO_RETURN ? "對方關閉連接" : "TLS 讀取錯誤");
+                return;
+            }
+        } else {
+            n = recv(s->fd, s->rx + s->rx_len, space, MSG_DONTWAIT);
+            if (n == 0) {
+                stream_fail(s, "對方關閉連接");
+                return;
+            }
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                if (errno != EAGAIN && errno != EWOULDBLOCK) stream_fail(s, strerror(errno));
+                return;
+            }
+        }
+
+        s->rx_len += n;
+        s->last_activity_ms = sip_now_ms();
+        stream_frame(s);
+        if (s->epoch != epoch) return;
+    }
+}
+
+static void stream_flush(sip_stream_t *s) {
+    while (s->tx_len > 0) {
+        int n;
+        if (s->ssl) {
+            n = SSL_write(s->ssl, s->tx, s->tx_len);
+            if (n <= 0) {
+                int err = SSL_get_error(s->ssl, n);
+                if (err == SSL_ERROR_WANT_WRITE) {
+                    stream_watch_write(s, 1);
+                    return;
+                }
+                if (err == SSL_ERROR_WANT_READ) return;
+                ERR_clear_error();
+                stream_fail(s, "TLS 寫入錯誤");
+                return;
+            }
+        } else {
+            n = send(s->fd, s->tx, s->tx_len, MSG_NOSIGNAL | MSG_DONTWAIT);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    stream_watch_write(s, 1);
+                    return;
+                }
+                stream_fail(s, strerror(errno));
+                return;
+            }
+        }
+        memmove(s->tx, s->tx + n, s->tx_len - n);
+        s->tx_len -= n;
+    }
+    s->last_activity_ms = sip_now_ms();
+    stream_watch_write(s, 0);
+}
+
+static int stream_queue(sip_stream_t *s, const struct iovec *iov, int iovcnt) {
+    size_t total = 0;
+    for (int i = 0; i < iovcnt; i++) total += iov[i].iov_len;
+    if (s->tx_len + total > SIP_STREAM_TXBUF_MAX) return -1;
+
+    if (s->tx_len + (int)total > s->tx_cap) {
+        int cap = s->tx_cap ? s->tx_cap : BUF_SIZE;
+        while (cap < s->tx_len + (int)total) cap *= 2;
+        char *tx = realloc(s->tx, cap);
+        if (!tx) return -1;
+        s->tx = tx;
+        s->tx_cap = cap;
+    }
+    for (int i = 0; i < iovcnt; i++) {
+        memcpy(s->tx + s->tx_len, iov[i].iov_base, iov[i].iov_len);
+        s->tx_len += iov[i].iov_len;
+    }
+    return 0;
+}
+
+// ---- 事件與計時器 ----
+
+static void on_stream_event(int fd, void *arg) {
+    sip_stream_t *s = (sip_stream_t *)arg;
+    (void)fd;
+
+    switch (s->state) {
+    case STREAM_CONNECTING: {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        getsockopt(s->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+        if (err == EINPROGRESS) return;
+        if (err != 0) {
+            stream_fail(s, strerror(err));
+            return;
+        }
+        stream_watch_write(s, 0);
+        if (!s->tls) {
+            stream_opened(s);
+        } else if (stream_start_tls(s) != 0) {
+            stream_fail(s, "無法建立 TLS 會話");
+        }
+        break;
+    }
+    case STREAM_HANDSHAKE:
+        stream_handshake(s);
+        break;
+    case STREAM_OPEN: {
+        unsigned int epoch = s->epoch;
+        if (s->tx_len > 0) stream_flush(s);
+        if (s->epoch == epoch) stream_read(s);
+        if (s->epoch == epoch && s->tx_len > 0) stream_flush(s);
+        break;
+    }
+    default:
+        break;
+    }
+}
+
+static void on_connect_timeout(void *arg) {
+    sip_stream_t *s = (sip_stream_t *)arg;
+    if (s->state == STREAM_CONNECTING || s->state == STREAM_HANDSHAKE) {
+        stream_fail(s, "連接逾時");
+    }
+}
+
+// 閒置時發送雙 CRLF，維持 NAT 綁定並及早發現斷線
+static void on_keepalive_timer(void *arg) {
+    sip_stream_t *s = (sip_stream_t *)arg;
+    if (s->state != STREAM_OPEN) return;
+
+    if (sip_now_ms() - s->last_activity_ms >= SIP_STREAM_KEEPALIVE_MS) {
+        struct iovec iov = { (void *)"\r\n\r\n", 4 };
+        if (stream_queue(s, &iov, 1) == 0) stream_flush(s);
+        if (s->state != STREAM_OPEN) return;
+    }
+    sip_timer_start(&s->keepalive_timer, SIP_STREAM_KEEPALIVE_MS);
+}
+
+// ---- 連接池 ----
+
+static int stream_connect(sip_stream_t *s) {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        log_with_timestamp("錯誤: 無法創建 SIP %s socket: %s\n", stream_name(s), strerror(errno));
+        return -1;
+    }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    if (connect(fd, (struct sockaddr *)&s->dest, sizeof(s->dest)) < 0 && errno != EINPROGRESS) {
+        log_with_timestamp("錯誤: 無法連接 %s:%d: %s\n",
+                         inet_ntoa(s->dest.sin_addr), ntohs(s->dest.sin_port), strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    s->fd = fd;
+    s->state = STREAM_CONNECTING;
+    s->want_write = 0;
+    if (sip_reactor_add_fd(fd, on_stream_event, s) != 0) {
+        close(fd);
+        s->fd = -1;
+        s->state = STREAM_IDLE;
+        return -1;
+    }
+    stream_watch_write(s, 1);
+    sip_timer_start(&s->connect_timer, SIP_STREAM_CONNECT_TIMEOUT_MS);
+    return 0;
+}
+
+// 找到或建立到 dest 的連接
+static sip_stream_t* stream_get(const struct sockaddr_in *dest, int tls) {
+    sip_stream_t *s = NULL, *free_slot = NULL, *idle_slot = NULL;
+
+    for (int i = 0; i < SIP_MAX_STREAMS; i++) {
+        sip_stream_t *c = &streams[i];
+        if (!c->in_use) {
+            if (!free_slot) free_slot = c;
+        } else if (c->tls == tls && c->dest.sin_addr.s_addr == dest->sin_addr.s_addr &&
+                   c->dest.sin_port == dest->sin_port) {
+            s = c;
+            break;
+        } else if (c->state == STREAM_IDLE && !idle_slot) {
+            idle_slot = c;
+        }
+    }
+
+    if (!s) {
+        s = free_slot ? free_slot : idle_slot;
+        if (!s) {
+            log_with_timestamp("錯誤: SIP 連接數已達上限 (%d)\n", SIP_MAX_STREAMS);
+            return NULL;
+        }
+        if (s->resume) {
+            SSL_SESSION_free(s->resume);
+            s->resume = NULL;
+        }
+        s->in_use = 1;
+        s->tls = tls;
+        s->dest = *dest;
+        s->fd = -1;
+        s->state = STREAM_IDLE;
+        sip_timer_init(&s->connect_timer, on_connect_timeout, s);
+        sip_timer_init(&s->keepalive_timer, on_keepalive_timer, s);
+    }
+
+    if (s->state == STREAM_IDLE && stream_connect(s) != 0) {
+        return NULL;
+    }
+    return s;
+}
+
+static int stream_send_now(const struct sockaddr_in *dest, int tls, const struct iovec *iov, int iovcnt) {
+    sip_stream_t *s = stream_get(dest, tls);
+    if (!s) return -1;
+
+    if (stream_queue(s, iov, iovcnt) != 0) {
+        stream_fail(s, "待發送數據過多");
+        return -1;
+    }
+    if (s->state == STREAM_OPEN) {
+        stream_flush(s);
+        if (s->state != STREAM_OPEN) return -1;
+    }
+    return 0;
+}
+
+static void stream_send_task(void *arg) {
+    stream_job_t *job = (stream_job_t *)arg;
+    struct iovec iov = { job->data, job->len };
+    stream_send_now(&job->dest, job->tls, &iov, 1);
+    free(job);
+}
+
+int sip_stream_send(const struct sockaddr_in *dest, int tls, const struct iovec *iov, int iovcnt) {
+    if (sip_reactor_in_thread()) {
+        return stream_send_now(dest, tls, iov, iovcnt);
+    }
+
+    size_t total = 0;
+    for (int i = 0; i < iovcnt; i++) total += iov[i].iov_len;
+    stream_job_t *job = malloc(sizeof(stream_job_t) + total + 1);
+    if (!job) return -1;
+    job->dest = *dest;
+    job->tls = tls;
+    job->len = sip_iov_flatten(iov, iovcnt, job->data, total + 1);
+    if (sip_reactor_start() != 0 || sip_reactor_post(stream_send_task, job) != 0) {
+        free(job);
+        return -1;
+    }
+    return 0;
+}
+
+static void stream_close_all_task(void *arg) {
+    (void)arg;
+    for (int i = 0; i < SIP_MAX_STREAMS; i++) {
+        sip_stream_t *s = &streams[i];
+        if (!s->in_use) continue;
+        stream_close(s, "傳輸關閉", 0);
+        if (s->resume) {
+            SSL_SESSION_free(s->resume);
+            s->resume = NULL;
+        }
+        free(s->tx);
+        s->tx = NULL;
+        s->tx_cap = 0;
+        s->in_use = 0;
+    }
+    if (tls_ctx) {
+        SSL_CTX_free(tls_ctx);
+        tls_ctx = NULL;
+    }
+}
+
+void sip_stream_close_all(void) {
+    if (sip_reactor_in_thread()) {
+        stream_close_all_task(NULL);
+    } else {
+        sip_reactor_run_sync(stream_close_all_task, NULL);
+    }
+}
+
+int sip_stream_connection_count(void) {
+    return open_count;
+}
@@ -0,0 +1,28 @@
+// sip_stream.h - SIP over TCP/TLS：每個下一跳維持一條持久連接，所有對話共用，以 Content-Length 分幀
+#ifndef SIP_STREAM_H
+#define SIP_STREAM_H
+
+#include "sip_client.h"
+#include <sys/uio.h>
+
+#define SIP_MAX_STREAMS 32                   // 同時維持的下一跳連接數
+#define SIP_STREAM_RXBUF (BUF_SIZE * 4)      // 接收緩衝區 (單則訊息上限)
+#define SIP_STREAM_TXBUF_MAX (256 * 1024)    // 待發送數據上限，超過視為連接故障
+#define SIP_STREAM_CONNECT_TIMEOUT_MS 5000   // TCP 連接與 TLS 握手逾時
+#define SIP_STREAM_KEEPALIVE_MS 30000        // 閒置時發送 CRLF 保活 (RFC 5626)
+
+// 收到一則完整的 SIP 訊息 (data 以 NUL 結尾；在事件循環線程中調用)
+typedef void (*sip_stream_msg_handler_t)(const char *data, int len, const struct sockaddr_in *from);
+// 連接失敗或中斷，經由該連接發出的請求不會再有回應
+typedef void (*sip_stream_error_handler_t)(const struct sockaddr_in *dest);
+
+void sip_stream_set_handlers(sip_stream_msg_handler_t on_message, sip_stream_error_handler_t on_error);
+
+// 經由到 dest 的連接發送 (沒有連接時建立；可從任意線程調用，非事件循環線程時複製後投遞)
+int sip_stream_send(const struct sockaddr_in *dest, int tls, const struct iovec *iov, int iovcnt);
+
+// 關閉所有連接並丟棄 TLS 會話快取
+void sip_stream_close_all(void);
+int sip_stream_connection_count(void);
+
+#endif // SIP_STREAM_H
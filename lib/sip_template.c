@@ -0,0 +1,114 @@
+// sip_template.c - 實現SIP請求模板的編譯、填值與分散發送
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <sys/socket.h>
+#include "sip_template.h"
+
+void sip_template_reset(sip_template_t *tpl) {
+    tpl->text_len = 0;
+    tpl->seg_count = 0;
+    tpl->error = 0;
+}
+
+// 加入靜態文字；與前一個靜態段相鄰時直接延長該段
+void sip_template_append(sip_template_t *tpl, const char *format, ...) {
+    va_list args;
+
+    if (tpl->error) return;
+
+    int room = SIP_TPL_TEXT_SIZE - tpl->text_len;
+    va_start(args, format);
+    int len = vsnprintf(tpl->text + tpl->text_len, room, format, args);
+    va_end(args);
+    if (len < 0 || len >= room) {
+        tpl->error = 1;
+        return;
+    }
+    if (len == 0) return;
+
+    sip_tpl_segment_t *last = tpl->seg_count > 0 ? &tpl->segs[tpl->seg_count - 1] : NULL;
+    if (last && last->field < 0 && last->off + last->len == tpl->text_len) {
+        last->len += len;
+    } else if (tpl->seg_count < SIP_TPL_MAX_SEGMENTS) {
+        tpl->segs[tpl->seg_count].field = -1;
+        tpl->segs[tpl->seg_count].off = tpl->text_len;
+        tpl->segs[tpl->seg_count].len = len;
+        tpl->seg_count++;
+    } else {
+        tpl->error = 1;
+        return;
+    }
+    tpl->text_len += len;
+}
+
+void sip_template_field(sip_template_t *tpl, sip_tpl_field_t field) {
+    if (tpl->error) return;
+    if (tpl->seg_count == SIP_TPL_MAX_SEGMENTS || field < 0 || field >= SIP_TPL_FIELD_COUNT) {
+        tpl->error = 1;
+        return;
+    }
+    tpl->segs[tpl->seg_count].field = field;
+    tpl->segs[tpl->seg_count].off = 0;
+    tpl->segs[tpl->seg_count].len = 0;
+    tpl->seg_count++;
+}
+
+int sip_template_ready(const sip_template_t *tpl) {
+    return tpl->seg_count > 0 && !tpl->error;
+}
+
+int sip_template_iov(const sip_template_t *tpl, const char *const values[SIP_TPL_FIELD_COUNT],
+                     struct iovec *iov, int max_iov, size_t *total_len) {
+    int count = 0;
+    size_t total = 0;
+
+    if (!sip_template_ready(tpl)) return -1;
+
+    for (int i = 0; i < tpl->seg_count; i++) {
+        const sip_tpl_segment_t *seg = &tpl->segs[i];
+        const char *base;
+        size_t len;
+
+        if (seg->field < 0) {
+            base = tpl->text + seg->off;
+            len = seg->len;
+        } else {
+            base = values[seg->field];
+            len = base ? strlen(base) : 0;
+        }
+        if (len == 0) continue;
+        if (count == max_iov) return -1;
+
+        iov[count].iov_base = (void *)base;
+        iov[count].iov_len = len;
+        count++;
+        total += len;
+    }
+
+    if (total_len) *total_len = total;
+    return count;
+}
+
+ssize_t sip_send_iov(int sockfd, const struct sockaddr_in *dest, const struct iovec *iov, int iovcnt) {
+    struct msghdr mh;
+
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_name = (void *)dest;
+    mh.msg_namelen = sizeof(*dest);
+    mh.msg_iov = (struct iovec *)iov;
+    mh.msg_iovlen = iovcnt;
+    return sendmsg(sockfd, &mh, 0);
+}
+
+int sip_iov_flatten(const struct iovec *iov, int iovcnt, char *buf, size_t buf_size) {
+    size_t off = 0;
+
+    for (int i = 0; i < iovcnt; i++) {
+        if (off + iov[i].iov_len >= buf_size) return -1;
+        memcpy(buf + off, iov[i].iov_base, iov[i].iov_len);
+        off += iov[i].iov_len;
+    }
+    buf[off] = '\0';
+    return (int)off;
+}
@@ -0,0 +1,57 @@
+// sip_template.h - 預先編譯的SIP請求模板：靜態段每個對話只格式化一次，發送時以 iovec 填入變動欄位
+#ifndef SIP_TEMPLATE_H
+#define SIP_TEMPLATE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+
+#define SIP_TPL_TEXT_SIZE 2048       // 單一模板靜態段的總長度上限 (含對話的路由集合)
+#define SIP_TPL_MAX_SEGMENTS 16      // 單一模板的段數上限 (靜態段 + 欄位)
+
+// 模板中的變動欄位
+typedef enum {
+    SIP_TPL_BRANCH = 0,       // Via branch
+    SIP_TPL_CSEQ,             // CSeq 序號
+    SIP_TPL_TO_TAG,           // 遠端 tag
+    SIP_TPL_AUTH,             // 認證標頭整行 (含 \r\n)，可為空字串
+    SIP_TPL_EXPIRES,          // Expires 秒數
+    SIP_TPL_FIELD_COUNT
+} sip_tpl_field_t;
+
+// 段：field 為 -1 表示 text 中的靜態文字
+typedef struct {
+    int16_t field;
+    uint16_t off;
+    uint16_t len;
+} sip_tpl_segment_t;
+
+typedef struct {
+    char text[SIP_TPL_TEXT_SIZE];
+    int text_len;
+    sip_tpl_segment_t segs[SIP_TPL_MAX_SEGMENTS];
+    int seg_count;
+    int error;                        // 編譯時超出容量
+} sip_template_t;
+
+// 編譯：依序加入靜態文字與欄位，最後以 sip_template_ready 檢查
+void sip_template_reset(sip_template_t *tpl);
+void sip_template_append(sip_template_t *tpl, const char *format, ...)
+    __attribute__((format(printf, 2, 3)));
+void sip_template_field(sip_template_t *tpl, sip_tpl_field_t field);
+int sip_template_ready(const sip_template_t *tpl);
+
+// 填入欄位值 (values 以 sip_tpl_field_t 為索引，NULL 視為空字串)，
+// 返回 iovec 數量並以 total_len 返回總長度；iovec 指向模板與 values，使用期間須保持有效
+int sip_template_iov(const sip_template_t *tpl, const char *const values[SIP_TPL_FIELD_COUNT],
+                     struct iovec *iov, int max_iov, size_t *total_len);
+
+// 以 sendmsg 發送分散的緩衝區，不組裝中間字串
+ssize_t sip_send_iov(int sockfd, const struct sockaddr_in *dest, const struct iovec *iov, int iovcnt);
+
+// 將分散的緩衝區複製為以 '\0' 結尾的字串 (buf_size 須大於 total_len)
+int sip_iov_flatten(const struct iovec *iov, int iovcnt, char *buf, size_t buf_size);
+
+#endif // SIP_TEMPLATE_H
@@ -0,0 +1,292 @@
+// sip_trace.c - 實現 SIP/RTP 事件追蹤環形緩衝區 (寫入端只有原子操作與 memcpy)
+#include "sip_trace.h"
+#include "sip_client.h"
+#include "sip_config.h"
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <fcntl.h>
+
+#define TRACE_RING_MASK (SIP_TRACE_RING_RECORDS - 1)
+#define TRACE_FLATTEN_MAX 2048           // 以 iovec 發送的訊息只展開前面這部分來尋找 Call-ID 與 CSeq
+
+static pthread_once_t trace_once = PTHREAD_ONCE_INIT;
+static pthread_key_t trace_key;
+static sip_trace_file_t *trace = NULL;
+static char trace_path[256] = "";
+static int trace_fd = -1;                 // 映射的檔案 (分配緩衝區時延長)；只在記憶體中追蹤時為 -1
+static pthread_mutex_t trace_grow_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static __thread sip_trace_ring_t *thread_ring = NULL;
+static __thread uint32_t thread_tid = 0;
+static __thread int thread_ring_failed = 0;
+
+static void trace_close(void) {
+    // 正常結束時刪除檔案；崩潰時檔案保留，供 sip_trace_dump 事後分析。
+    // fork 出的子進程繼承 atexit，子進程結束時不可刪除父進程的檔案
+    if (trace_path[0] && trace && trace->header.pid == (uint32_t)getpid()) {
+        unlink(trace_path);
+    }
+}
+
+// 線程結束時釋放專用的緩衝區，讓之後的線程使用 (已寫入的記錄保留到被覆寫)
+static void trace_thread_exit(void *arg) {
+    sip_trace_ring_t *ring = (sip_trace_ring_t *)arg;
+    if (ring && ring != &trace->rings[SIP_TRACE_MAX_RINGS - 1]) {
+        __atomic_store_n(&ring->owner_tid, 0, __ATOMIC_RELEASE);
+    }
+}
+
+// 設定中的 %d 替換為進程 ID (同一台機器上的多個進程各用一個檔案)
+static void trace_expand_path(const char *pattern, char *out, size_t size) {
+    const char *pid_token = strstr(pattern, "%d");
+    if (pid_token) {
+        snprintf(out, size, "%.*s%d%s", (int)(pid_token - pattern), pattern, (int)getpid(), pid_token + 2);
+    } else {
+        snprintf(out, size, "%s", pattern);
+    }
+}
+
+static void trace_open(void) {
+    const char *pattern = sip_config()->trace_file;
+    void *map = MAP_FAILED;
+    struct timespec mono, real;
+
+    pthread_key_create(&trace_key, trace_thread_exit);
+
+    // 映射所有緩衝區的地址範圍，但檔案只包含標頭；緩衝區在線程第一次記錄時才延長檔案並使用
+    if (pattern[0]) {
+        trace_expand_path(pattern, trace_path, sizeof(trace_path));
+        int fd = open(trace_path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+        if (fd >= 0 && ftruncate(fd, SIP_TRACE_FILE_SIZE(0)) == 0) {
+            map = mmap(NULL, sizeof(sip_trace_file_t), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_NORESERVE, fd, 0);
+        }
+        if (map == MAP_FAILED) {
+            log_with_timestamp("警告: 無法建立事件追蹤檔案 %s: %s，改為只在記憶體中追蹤\n",
+                             trace_path, strerror(errno));
+            if (fd >= 0) unlink(trace_path);
+            trace_path[0] = '\0';
+            if (fd >= 0) close(fd);
+        } else {
+            trace_fd = fd;
+        }
+    }
+    if (map == MAP_FAILED) {
+        map = mmap(NULL, sizeof(sip_trace_file_t), PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (map == MAP_FAILED) return;
+    }
+
+    sip_trace_file_t *t = (sip_trace_file_t *)map;
+    clock_gettime(CLOCK_MONOTONIC, &mono);
+    clock_gettime(CLOCK_REALTIME, &real);
+    t->header.record_size = sizeof(sip_trace_record_t);
+    t->header.rings = SIP_TRACE_MAX_RINGS;
+    t->header.ring_records = SIP_TRACE_RING_RECORDS;
+    t->header.pid = (uint32_t)getpid();
+    t->header.realtime_offset_ns = ((int64_t)real.tv_sec - mono.tv_sec) * 1000000000LL +
+                                   ((int64_t)real.tv_nsec - mono.tv_nsec);
+    t->header.version = SIP_TRACE_VERSION;
+    __atomic_store_n(&t->header.magic, SIP_TRACE_MAGIC, __ATOMIC_RELEASE);
+    trace = t;
+
+    if (trace_path[0]) {
+        atexit(trace_close);
+        log_with_timestamp("事件追蹤: %s (以 sip_trace_dump 解碼)\n", trace_path);
+    }
+}
+
+// 分配新的緩衝區並延長檔案；專用的緩衝區用完時改用共用的最後一個。無法延長檔案時返回 NULL
+static sip_trace_ring_t* trace_ring_add(void) {
+    sip_trace_ring_t *ring = NULL;
+
+    pthread_mutex_lock(&trace_grow_lock);
+    uint32_t used = trace->header.rings_used;
+    uint32_t want = used < SIP_TRACE_MAX_RINGS - 1 ? used + 1 : SIP_TRACE_MAX_RINGS;
+    if (want == used || trace_fd < 0 || ftruncate(trace_fd, SIP_TRACE_FILE_SIZE(want)) == 0) {
+        ring = &trace->rings[want - 1];
+        // 先設定擁有者再公開，其他線程尋找空閒緩衝區時不會佔用
+        if (want < SIP_TRACE_MAX_RINGS) {
+            __atomic_store_n(&ring->owner_tid, thread_tid, __ATOMIC_RELAXED);
+        }
+        __atomic_store_n(&trace->header.rings_used, want, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&trace_grow_lock);
+    return ring;
+}
+
+// 取得本線程的緩衝區：先嘗試佔用已結束線程釋放的緩衝區，沒有時分配新的
+static sip_trace_ring_t* trace_thread_ring(void) {
+    if (thread_ring) return thread_ring;
+    if (thread_ring_failed) return NULL;
+
+    pthread_once(&trace_once, trace_open);
+    if (!trace) return NULL;
+
+    thread_tid = (uint32_t)syscall(SYS_gettid);
+    uint32_t used = __atomic_load_n(&trace->header.rings_used, __ATOMIC_ACQUIRE);
+    for (uint32_t i = 0; i < used && i < SIP_TRACE_MAX_RINGS - 1; i++) {
+        uint32_t expected = 0;
+        if (__atomic_compare_exchange_n(&trace->rings[i].owner_tid, &expected, thread_tid, 0,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+            thread_ring = &trace->rings[i];
+            pthread_setspecific(trace_key, thread_ring);
+            return thread_ring;
+        }
+    }
+    thread_ring = trace_ring_add();
+    if (!thread_ring) {
+        thread_ring_failed = 1;
+    } else if (thread_ring != &trace->rings[SIP_TRACE_MAX_RINGS - 1]) {
+        pthread_setspecific(trace_key, thread_ring);
+    }
+    return thread_ring;
+}
+
+// 保留下一筆記錄：序號先清為 0，讀取端因此略過寫入中的記錄
+static sip_trace_record_t* trace_begin(sip_trace_event_t type, int call, uint64_t *index) {
+    sip_trace_ring_t *ring = trace_thread_ring();
+    struct timespec ts;
+
+    if (!ring) return NULL;
+    *index = __atomic_fetch_add(&ring->head, 1, __ATOMIC_RELAXED);
+    sip_trace_record_t *rec = &ring->records[*index & TRACE_RING_MASK];
+    __atomic_store_n(&rec->seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    rec->time_ns = (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    rec->tid = thread_tid;
+    rec->type = (uint16_t)type;
+    rec->call = (int16_t)call;
+    rec->addr = 0;
+    rec->port = 0;
+    rec->slice_len = 0;
+    rec->len = 0;
+    rec->aux = 0;
+    return rec;
+}
+
+static void trace_commit(sip_trace_record_t *rec, uint64_t index) {
+    __atomic_store_n(&rec->seq, index + 1, __ATOMIC_RELEASE);
+}
+
+static void trace_set_peer(sip_trace_record_t *rec, const struct sockaddr_in *peer) {
+    if (peer) {
+        rec->addr = peer->sin_addr.s_addr;
+        rec->port = ntohs(peer->sin_port);
+    }
+}
+
+// 附加一行 (不含行尾)，以 '\n' 與前一行分隔
+static size_t trace_append_line(char *dst, size_t used, const char *line, const char *end) {
+    const char *eol = memchr(line, '\r', end - line);
+    if (!eol) eol = memchr(line, '\n', end - line);
+    if (!eol) eol = end;
+
+    if (used > 0 && used < SIP_TRACE_SLICE) dst[used++] = '\n';
+    size_t n = eol - line;
+    if (n > SIP_TRACE_SLICE - used) n = SIP_TRACE_SLICE - used;
+    memcpy(dst + used, line, n);
+    return used + n;
+}
+
+// 逐行掃描訊息頭 (到空行為止)，找出 Call-ID (含緊湊形式 i:) 與 CSeq 的值所在行
+static void trace_scan_headers(const char *data, const char *end, const char **callid, const char **cseq) {
+    const char *line = memchr(data, '\n', end - data);
+
+    *callid = NULL;
+    *cseq = NULL;
+    while (line && ++line < end && *line != '\r' && *line != '\n' && !(*callid && *cseq)) {
+        size_t rest = end - line;
+        if (!*callid && ((rest > 8 && strncasecmp(line, "Call-ID:", 8) == 0) ||
+                         (rest > 2 && (line[0] == 'i' || line[0] == 'I') && line[1] == ':'))) {
+            *callid = line;
+        } else if (!*cseq && rest > 5 && strncasecmp(line, "CSeq:", 5) == 0) {
+            *cseq = line;
+        }
+        line = memchr(line, '\n', rest);
+    }
+}
+
+// data 為訊息開頭的 len 字節 (可能已截斷)，total 為完整長度
+static void trace_sip_record(sip_trace_event_t type, int call, const char *data, size_t len, size_t total,
+                             const struct sockaddr_in *peer) {
+    uint64_t index;
+    sip_trace_record_t *rec = trace_begin(type, call, &index);
+    if (!rec) return;
+
+    const char *end = data + len;
+    const char *callid, *cseq;
+    size_t used = trace_append_line(rec->slice, 0, data, end);
+    trace_scan_headers(data, end, &callid, &cseq);
+    if (callid) used = trace_append_line(rec->slice, used, callid, end);
+    if (cseq) used = trace_append_line(rec->slice, used, cseq, end);
+
+    rec->slice_len = (uint16_t)used;
+    rec->len = (uint32_t)total;
+    trace_set_peer(rec, peer);
+    trace_commit(rec, index);
+}
+
+void sip_trace_sip(sip_trace_event_t type, int call, const char *data, size_t len,
+                   const struct sockaddr_in *peer) {
+    trace_sip_record(type, call, data, len, len, peer);
+}
+
+void sip_trace_sip_iov(sip_trace_event_t type, int call, const struct iovec *iov, int iovcnt,
+                       const struct sockaddr_in *peer) {
+    char buf[TRACE_FLATTEN_MAX];
+    size_t used = 0;
+    size_t total = 0;
+
+    for (int i = 0; i < iovcnt; i++) {
+        size_t n = iov[i].iov_len;
+        total += n;
+        if (n > sizeof(buf) - used) n = sizeof(buf) - used;
+        memcpy(buf + used, iov[i].iov_base, n);
+        used += n;
+    }
+    trace_sip_record(type, call, buf, used, total, peer);
+}
+
+void sip_trace_rtp(sip_trace_event_t type, int local_port, const unsigned char *packet, size_t len,
+                   const struct sockaddr_in *peer) {
+    uint64_t index;
+    sip_trace_record_t *rec = trace_begin(type, -1, &index);
+    if (!rec) return;
+
+    size_t n = len < sizeof(rtp_header_t) ? len : sizeof(rtp_header_t);
+    memcpy(rec->slice, packet, n);
+    rec->slice_len = (uint16_t)n;
+    rec->len = (uint32_t)len;
+    rec->aux = (uint32_t)local_port;
+    trace_set_peer(rec, peer);
+    trace_commit(rec, index);
+}
+
+void sip_trace_dialog(int call, int state, const char *callid) {
+    uint64_t index;
+    sip_trace_record_t *rec = trace_begin(SIP_TRACE_DIALOG, call, &index);
+    if (!rec) return;
+
+    size_t n = strnlen(callid, SIP_TRACE_SLICE);
+    memcpy(rec->slice, callid, n);
+    rec->slice_len = (uint16_t)n;
+    rec->aux = (uint32_t)state;
+    trace_commit(rec, index);
+}
+
+void sip_trace_retransmit(sip_trace_event_t type, int call, const char *method, const char *branch, uint32_t aux) {
+    uint64_t index;
+    sip_trace_record_t *rec = trace_begin(type, call, &index);
+    if (!rec) return;
+
+    int n = snprintf(rec->slice, SIP_TRACE_SLICE, "%s %s", method, branch);
+    rec->slice_len = (uint16_t)(n < 0 ? 0 : n < SIP_TRACE_SLICE ? n : SIP_TRACE_SLICE - 1);
+    rec->aux = aux;
+    trace_commit(rec, index);
+}
+
+const char* sip_trace_path(void) {
+    return trace_path;
+}
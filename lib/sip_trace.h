@@ -0,0 +1,92 @@
+// sip_trace.h - 常駐的二進位 SIP/RTP 事件追蹤：每個線程寫入自己的無鎖環形緩衝區 (映射到檔案)，
+// 只記錄時間戳、事件類型、通話與訊息的關鍵行，由 sip_trace_dump 工具在需要時解碼輸出
+#ifndef SIP_TRACE_H
+#define SIP_TRACE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+
+#define SIP_TRACE_MAGIC 0x45434154u          // "TACE"
+#define SIP_TRACE_VERSION 2
+#define SIP_TRACE_MAX_RINGS 1024             // 環形緩衝區上限：線程第一次記錄時分配自己的一個，超過時共用最後一個
+#define SIP_TRACE_RING_RECORDS 2048          // 每個緩衝區的記錄數 (2 的冪次)
+#define SIP_TRACE_SLICE 152                  // 每筆記錄複製的內容 (SIP 起始行與 Call-ID、CSeq；RTP 頭)
+
+// 事件類型
+typedef enum {
+    SIP_TRACE_SIP_TX = 1,       // 發出的 SIP 訊息 (addr/port 為目的地)
+    SIP_TRACE_SIP_RX,           // 收到的 SIP 訊息 (addr/port 為來源)
+    SIP_TRACE_RTP_TX,           // 發出的 RTP 封包 (slice 為 RTP 頭，aux 為本地端口)
+    SIP_TRACE_RTP_RX,           // 收到的 RTP 封包 (slice 為 RTP 頭，aux 為本地端口)
+    SIP_TRACE_DIALOG,           // 對話狀態變化 (call 為槽位，aux 為 sip_dialog_state_t，slice 為 Call-ID)
+    SIP_TRACE_SIP_RETRANSMIT,   // 事務重傳請求 (slice 為方法與 branch，aux 為重傳間隔 ms)
+    SIP_TRACE_SIP_RESEND,       // 收到對方的重傳而重發 (slice 為方法與 branch；快取的回應：aux 為其狀態碼，
+                                // 2xx 重傳的 ACK：aux 為收到的 2xx 狀態碼)
+    SIP_TRACE_EVENT_COUNT
+} sip_trace_event_t;
+
+// 一筆記錄 (固定 192 字節)
+typedef struct {
+    uint64_t seq;                        // 在緩衝區中的寫入序號 + 1；0 表示正在寫入
+    uint64_t time_ns;                    // CLOCK_MONOTONIC 納秒
+    uint32_t tid;                        // 寫入的線程 ID
+    uint16_t type;                       // sip_trace_event_t
+    int16_t call;                        // 對話槽位，-1 表示未知
+    uint32_t addr;                       // 對方 IPv4 地址 (網路位元組序)
+    uint16_t port;                       // 對方端口 (主機位元組序)
+    uint16_t slice_len;
+    uint32_t len;                        // 原始訊息 / 封包長度
+    uint32_t aux;
+    char slice[SIP_TRACE_SLICE];
+} sip_trace_record_t;
+
+typedef struct {
+    uint64_t head;                       // 下一個寫入序號 (多個線程共用時以原子加法取得)
+    uint32_t owner_tid;                  // 目前擁有此緩衝區的線程，0 表示空閒或共用
+    uint32_t reserved;
+    char reserved_pad[48];               // 與記錄陣列分開快取行
+    sip_trace_record_t records[SIP_TRACE_RING_RECORDS];
+} sip_trace_ring_t;
+
+// 檔案格式：標頭後接 rings_used 個緩衝區 (分配新的緩衝區時檔案隨之延長)
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t record_size;
+    uint32_t rings;                      // 緩衝區上限 (SIP_TRACE_MAX_RINGS)
+    uint32_t ring_records;
+    uint32_t pid;
+    int64_t realtime_offset_ns;          // CLOCK_REALTIME - CLOCK_MONOTONIC (解碼時換算為實際時間)
+    uint32_t rings_used;                 // 已分配的緩衝區數 (檔案至少包含這麼多個)
+    char reserved[28];
+} sip_trace_header_t;
+
+typedef struct {
+    sip_trace_header_t header;           // 64 字節，緩衝區從快取行邊界開始
+    sip_trace_ring_t rings[SIP_TRACE_MAX_RINGS];
+} sip_trace_file_t;
+
+// 包含前 count 個緩衝區的檔案大小
+#define SIP_TRACE_FILE_SIZE(count) (offsetof(sip_trace_file_t, rings) + (size_t)(count) * sizeof(sip_trace_ring_t))
+
+// 以下函數可從任意線程調用，不加鎖、不進行系統調用 (每個線程第一次調用時分配緩衝區)
+
+// 記錄 SIP 訊息：只複製起始行與 Call-ID、CSeq
+void sip_trace_sip(sip_trace_event_t type, int call, const char *data, size_t len,
+                   const struct sockaddr_in *peer);
+void sip_trace_sip_iov(sip_trace_event_t type, int call, const struct iovec *iov, int iovcnt,
+                       const struct sockaddr_in *peer);
+// 記錄 RTP 封包：只複製 RTP 頭 (12 字節)
+void sip_trace_rtp(sip_trace_event_t type, int local_port, const unsigned char *packet, size_t len,
+                   const struct sockaddr_in *peer);
+// 記錄對話狀態變化
+void sip_trace_dialog(int call, int state, const char *callid);
+// 記錄重傳 (type 為 SIP_TRACE_SIP_RETRANSMIT 或 SIP_TRACE_SIP_RESEND)
+void sip_trace_retransmit(sip_trace_event_t type, int call, const char *method, const char *branch, uint32_t aux);
+
+// 追蹤檔案的路徑 (停用或尚未建立時為空字串)
+const char* sip_trace_path(void);
+
+#endif // SIP_TRACE_H
@@ -0,0 +1,660 @@
+// sip_transaction.c - 實現客戶端事務狀態機與SIP socket讀取
+#include "sip_transaction.h"
+#include "sip_transport.h"
+#include "sip_batch.h"
+#include "sip_trace.h"
+
+static sip_transaction_t transactions[SIP_MAX_TRANSACTIONS];
+static int txn_hash[SIP_TXN_HASH_SIZE];
+static int txn_table_ready = 0;
+static int txn_next_slot = 0;
+static int txn_active = 0;
+static unsigned int txn_serial = 0;
+
+// 已交給事件循環的SIP socket
+static int attached_sockets[SIP_MAX_SOCKETS];
+static int attached_count = 0;
+static pthread_mutex_t socket_lock = PTHREAD_MUTEX_INITIALIZER;
+static sip_unmatched_handler_t unmatched_handler = NULL;
+
+// 已發送給對方請求的回應 (只在事件循環線程中存取)：以 branch + 方法雜湊查找，
+// 依發送順序排列在環形緩衝區中，保留時間相同，到期的項目總是從最舊的一端移除
+typedef struct {
+    int in_use;
+    char branch[64];
+    char method[16];
+    int status_code;
+    uint64_t expires_ms;
+    char *response;
+    int response_len;
+    int hash_next;
+} txn_response_t;
+
+static txn_response_t responses[SIP_TXN_RESPONSE_CACHE];
+static int response_hash[SIP_TXN_HASH_SIZE];
+static int response_oldest = 0;           // 環形緩衝區中最舊的項目
+static int response_count = 0;            // 環形緩衝區中的項目數 (含已被取代的空位)
+static int response_ready = 0;
+static unsigned long response_evicted = 0;
+
+static void txn_table_init(void) {
+    if (txn_table_ready) return;
+    for (int i = 0; i < SIP_TXN_HASH_SIZE; i++) txn_hash[i] = -1;
+    for (int i = 0; i < SIP_MAX_TRANSACTIONS; i++) {
+        transactions[i].in_use = 0;
+        transactions[i].hash_next = -1;
+    }
+    txn_table_ready = 1;
+}
+
+// 事務鍵值為 branch + 方法 (CANCEL 與 INVITE 共用 branch)
+static unsigned int txn_hash_key(const char *branch, const char *method) {
+    unsigned int h = 2166136261u;
+    while (*branch) {
+        h ^= (unsigned char)*branch++;
+        h *= 16777619u;
+    }
+    while (*method) {
+        h ^= (unsigned char)*method++;
+        h *= 16777619u;
+    }
+    return h & (SIP_TXN_HASH_SIZE - 1);
+}
+
+static sip_transaction_t* txn_lookup(const char *branch, const char *method) {
+    int idx = txn_hash[txn_hash_key(branch, method)];
+    while (idx >= 0) {
+        sip_transaction_t *txn = &transactions[idx];
+        if (strcmp(txn->branch, branch) == 0 && strcmp(txn->method, method) == 0) {
+            return txn;
+        }
+        idx = txn->hash_next;
+    }
+    return NULL;
+}
+
+static void txn_hash_remove(sip_transaction_t *txn) {
+    int index = txn - transactions;
+    int *link = &txn_hash[txn_hash_key(txn->branch, txn->method)];
+    while (*link >= 0) {
+        if (*link == index) {
+            *link = txn->hash_next;
+            break;
+        }
+        link = &transactions[*link].hash_next;
+    }
+    txn->hash_next = -1;
+}
+
+// 釋放事務
+static void txn_free(sip_transaction_t *txn) {
+    sip_timer_stop(&txn->retransmit_timer);
+    sip_timer_stop(&txn->timeout_timer);
+    sip_timer_stop(&txn->wait_timer);
+    txn_hash_remove(txn);
+    free(txn->request);
+    free(txn->ack);
+    txn->request = txn->ack = NULL;
+    txn->state = TXN_TERMINATED;
+    txn->in_use = 0;
+    txn_active--;
+}
+
+static int txn_send(sip_transaction_t *txn, const char *data, int len) {
+    struct iovec iov = { (void *)data, (size_t)len };
+    if (sip_transport_send(txn->sockfd, &txn->dest, &iov, 1) < 0) {
+        log_with_timestamp("錯誤: 事務 %s %s 發送失敗: %s\n", txn->method, txn->branch, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+static void txn_notify(sip_transaction_t *txn, int status_code, const sip_msg_t *msg) {
+    if (txn->callback) {
+        txn->callback(txn, status_code, msg, txn->user_data);
+    }
+}
+
+// Timer A / E：重傳請求
+static void on_retransmit_timer(void *arg) {
+    sip_transaction_t *txn = (sip_transaction_t *)arg;
+
+    sip_trace_retransmit(SIP_TRACE_SIP_RETRANSMIT, -1, txn->method, txn->branch, (uint32_t)txn->retransmit_interval);
+    txn_send(txn, txn->request, txn->request_len);
+
+    if (txn->type == SIP_TXN_INVITE_CLIENT) {
+        txn->retransmit_interval *= 2;
+    } else if (txn->state == TXN_PROCEEDING) {
+        txn->retransmit_interval = SIP_T2_MS;
+    } else {
+        txn->retransmit_interval = txn->retransmit_interval * 2 < SIP_T2_MS ? txn->retransmit_interval * 2 : SIP_T2_MS;
+    }
+    sip_timer_start(&txn->retransmit_timer, txn->retransmit_interval);
+}
+
+// Timer B / F：事務逾時
+static void on_timeout_timer(void *arg) {
+    sip_transaction_t *txn = (sip_transaction_t *)arg;
+
+    log_with_timestamp("事務逾時: %s (branch %s)\n", txn->method, txn->branch);
+    txn->state = TXN_TERMINATED;
+    txn_notify(txn, 408, NULL);
+    txn_free(txn);
+}
+
+// Timer D / K：完成狀態結束
+static void on_wait_timer(void *arg) {
+    txn_free((sip_transaction_t *)arg);
+}
+
+// 從請求行取出 Request-URI
+static int request_uri(const char *request, char *uri, size_t uri_size) {
+    const char *start = strchr(request, ' ');
+    if (!start) return -1;
+    start++;
+    const char *end = strchr(start, ' ');
+    if (!end || (size_t)(end - start) >= uri_size) return -1;
+    memcpy(uri, start, end - start);
+    uri[end - start] = '\0';
+    return 0;
+}
+
+// 為非 2xx 最終回應產生 ACK (RFC 3261 17.1.1.3)：與 INVITE 使用相同 branch
+static void build_non2xx_ack(sip_transaction_t *txn, const sip_msg_t *response) {
+    char uri[256], via[512], from[256], to[256], callid[128], method[16];
+    char ack[BUF_SIZE];
+    int cseq_num = 0;
+
+    if (request_uri(txn->request, uri, sizeof(uri)) != 0 ||
+        !extract_header_value(txn->request, "Via", "v", via, sizeof(via)) ||
+        !extract_header_value(txn->request, "From", "f", from, sizeof(from)) ||
+        !extract_header_value(txn->request, "Call-ID", "i", callid, sizeof(callid)) ||
+        sip_msg_header_value(response, SIP_HDR_TO, to, sizeof(to)) != 0 ||
+        parse_cseq(txn->request, &cseq_num, method, sizeof(method)) != 0) {
+        log_with_timestamp("警告: 無法為 branch %s 產生 ACK\n", txn->branch);
+        return;
+    }
+
+    int len = snprintf(ack, sizeof(ack),
+        "ACK %s SIP/2.0\r\n"
+        "Via: %s\r\n"
+        "Max-Forwards: 70\r\n"
+        "From: %s\r\n"
+        "To: %s\r\n"
+        "Call-ID: %s\r\n"
+        "CSeq: %d ACK\r\n"
+        "Content-Length: 0\r\n"
+        "\r\n",
+        uri, via, from, to, callid, cseq_num);
+    if (len <= 0 || len >= (int)sizeof(ack)) return;
+
+    free(txn->ack);
+    txn->ack = strdup(ack);
+    txn->ack_len = len;
+}
+
+// 產生取消 INVITE 事務的 CANCEL 請求 (RFC 3261 9.1)
+int sip_txn_build_cancel(const sip_transaction_t *invite_txn, char *buf, size_t buf_size) {
+    char uri[256], via[512], from[256], to[256], callid[128], method[16];
+    int cseq_num = 0;
+
+    if (!invite_txn || invite_txn->type != SIP_TXN_INVITE_CLIENT) return -1;
+    if (request_uri(invite_txn->request, uri, sizeof(uri)) != 0 ||
+        !extract_header_value(invite_txn->request, "Via", "v", via, sizeof(via)) ||
+        !extract_header_value(invite_txn->request, "From", "f", from, sizeof(from)) ||
+        !extract_header_value(invite_txn->request, "To", "t", to, sizeof(to)) ||
+        !extract_header_value(invite_txn->request, "Call-ID", "i", callid, sizeof(callid)) ||
+        parse_cseq(invite_txn->request, &cseq_num, method, sizeof(method)) != 0) {
+        return -1;
+    }
+
+    int len = snprintf(buf, buf_size,
+        "CANCEL %s SIP/2.0\r\n"
+        "Via: %s\r\n"
+        "Max-Forwards: 70\r\n"
+        "From: %s\r\n"
+        "To: %s\r\n"
+        "Call-ID: %s\r\n"
+        "CSeq: %d CANCEL\r\n"
+        "User-Agent: Custom SIP Client\r\n"
+        "Content-Length: 0\r\n"
+        "\r\n",
+        uri, via, from, to, callid, cseq_num);
+    return (len > 0 && len < (int)buf_size) ? len : -1;
+}
+
+// 分配並登記事務 (不發送)；request 由呼叫者填入
+static sip_transaction_t* txn_create(int sockfd, const struct sockaddr_in *dest,
+                                     const char *method, const char *branch,
+                                     sip_txn_callback_t callback, void *user_data) {
+    txn_table_init();
+
+    if (strlen(branch) >= sizeof(((sip_transaction_t *)0)->branch) ||
+        strlen(method) >= sizeof(((sip_transaction_t *)0)->method)) {
+        return NULL;
+    }
+
+    sip_transaction_t *txn = NULL;
+    for (int i = 0; i < SIP_MAX_TRANSACTIONS; i++) {
+        int slot = (txn_next_slot + i) % SIP_MAX_TRANSACTIONS;
+        if (!transactions[slot].in_use) {
+            txn = &transactions[slot];
+            txn_next_slot = (slot + 1) % SIP_MAX_TRANSACTIONS;
+            break;
+        }
+    }
+    if (!txn) {
+        log_with_timestamp("錯誤: 事務表已滿 (%d)\n", SIP_MAX_TRANSACTIONS);
+        return NULL;
+    }
+
+    memset(txn, 0, sizeof(*txn));
+    txn->in_use = 1;
+    txn->type = strcmp(method, "INVITE") == 0 ? SIP_TXN_INVITE_CLIENT : SIP_TXN_NON_INVITE_CLIENT;
+    txn->state = txn->type == SIP_TXN_INVITE_CLIENT ? TXN_CALLING : TXN_TRYING;
+    snprintf(txn->branch, sizeof(txn->branch), "%s", branch);
+    snprintf(txn->method, sizeof(txn->method), "%s", method);
+    txn->sockfd = sockfd;
+    txn->dest = *dest;
+    txn->callback = callback;
+    txn->user_data = user_data;
+    txn->reliable = sip_transport_is_reliable(sockfd);
+    txn->serial = ++txn_serial;
+    txn->retransmit_interval = SIP_T1_MS;
+    sip_timer_init(&txn->retransmit_timer, on_retransmit_timer, txn);
+    sip_timer_init(&txn->timeout_timer, on_timeout_timer, txn);
+    sip_timer_init(&txn->wait_timer, on_wait_timer, txn);
+
+    unsigned int bucket = txn_hash_key(txn->branch, txn->method);
+    txn->hash_next = txn_hash[bucket];
+    txn_hash[bucket] = txn - transactions;
+    txn_active++;
+    return txn;
+}
+
+// 啟動重傳 (Timer A/E，只用於 UDP) 與事務逾時 (Timer B/F = 64*T1)
+static void txn_start_timers(sip_transaction_t *txn) {
+    if (!txn->reliable) {
+        sip_timer_start(&txn->retransmit_timer, txn->retransmit_interval);
+    }
+    sip_timer_start(&txn->timeout_timer, 64 * SIP_T1_MS);
+}
+
+// 建立並發送客戶端事務
+sip_transaction_t* sip_txn_client_start(int sockfd, const struct sockaddr_in *dest,
+                                        const char *request, int request_len,
+                                        sip_txn_callback_t callback, void *user_data) {
+    char branch[64];
+    char method[16];
+
+    if (!extract_via_branch(request, branch, sizeof(branch))) {
+        log_with_timestamp("錯誤: 請求缺少 Via branch，無法建立事務\n");
+        return NULL;
+    }
+    size_t method_len = strcspn(request, " ");
+    if (method_len == 0 || method_len >= sizeof(method)) return NULL;
+    memcpy(method, request, method_len);
+    method[method_len] = '\0';
+
+    sip_transaction_t *txn = txn_create(sockfd, dest, method, branch, callback, user_data);
+    if (!txn) return NULL;
+
+    txn->request = malloc(request_len + 1);
+    if (!txn->request) {
+        txn_free(txn);
+        return NULL;
+    }
+    memcpy(txn->request, request, request_len);
+    txn->request[request_len] = '\0';
+    txn->request_len = request_len;
+
+    if (txn_send(txn, txn->request, txn->request_len) != 0) {
+        txn_free(txn);
+        return NULL;
+    }
+    txn_start_timers(txn);
+    return txn;
+}
+
+// 以 iovec 建立並發送客戶端事務：呼叫者已知 method/branch，不需重新解析請求；
+// 首次發送直接使用 sendmsg，事務只保留一份連續副本供重傳與產生 ACK/CANCEL
+sip_transaction_t* sip_txn_client_start_iov(int sockfd, const struct sockaddr_in *dest,
+                                            const char *method, const char *branch,
+                                            const struct iovec *iov, int iovcnt,
+                                            sip_txn_callback_t callback, void *user_data) {
+    size_t total = 0;
+    for (int i = 0; i < iovcnt; i++) total += iov[i].iov_len;
+    if (total == 0 || total >= BUF_SIZE) return NULL;
+
+    sip_transaction_t *txn = txn_create(sockfd, dest, method, branch, callback, user_data);
+    if (!txn) return NULL;
+
+    if (sip_transport_send(sockfd, dest, iov, iovcnt) < 0) {
+        log_with_timestamp("錯誤: 事務 %s %s 發送失敗: %s\n", method, branch, strerror(errno));
+        txn_free(txn);
+        return NULL;
+    }
+
+    txn->request = malloc(total + 1);
+    if (!txn->request) {
+        txn_free(txn);
+        return NULL;
+    }
+    txn->request_len = sip_iov_flatten(iov, iovcnt, txn->request, total + 1);
+    txn_start_timers(txn);
+    return txn;
+}
+
+// 呼叫者不再關心此事務的結果 (事務本身仍完成重傳與吸收)
+void sip_txn_detach(sip_transaction_t *txn) {
+    if (txn && txn->in_use) {
+        txn->callback = NULL;
+        txn->user_data = NULL;
+    }
+}
+
+int sip_txn_active_count(void) {
+    return txn_active;
+}
+
+// 處理事務收到的回應
+static void txn_on_response(sip_transaction_t *txn, int status_code, const sip_msg_t *msg) {
+    if (txn->type == SIP_TXN_INVITE_CLIENT) {
+        if (txn->state == TXN_CALLING || txn->state == TXN_PROCEEDING) {
+            if (status_code < 200) {
+                // 1xx：停止重傳與 Timer B
+                txn->state = TXN_PROCEEDING;
+                sip_timer_stop(&txn->retransmit_timer);
+                sip_timer_stop(&txn->timeout_timer);
+                txn_notify(txn, status_code, msg);
+            } else if (status_code < 300) {
+                // 2xx：事務結束，ACK 由上層 (對話) 負責
+                txn->state = TXN_TERMINATED;
+                txn_notify(txn, status_code, msg);
+                txn_free(txn);
+            } else {
+                // 300-699：發送 ACK，進入完成狀態吸收重傳
+                txn->state = TXN_COMPLETED;
+                sip_timer_stop(&txn->retransmit_timer);
+                sip_timer_stop(&txn->timeout_timer);
+                build_non2xx_ack(txn, msg);
+                if (txn->ack) txn_send(txn, txn->ack, txn->ack_len);
+                sip_timer_start(&txn->wait_timer, txn->reliable ? 0 : SIP_TIMER_D_MS);
+                txn_notify(txn, status_code, msg);
+            }
+        } else if (txn->state == TXN_COMPLETED && status_code >= 300) {
+            // 最終回應重傳：重發 ACK
+            if (txn->ack) txn_send(txn, txn->ack, txn->ack_len);
+        }
+    } else {
+        if (txn->state == TXN_TRYING || txn->state == TXN_PROCEEDING) {
+            if (status_code < 200) {
+                txn->state = TXN_PROCEEDING;
+                txn_notify(txn, status_code, msg);
+            } else {
+                txn->state = TXN_COMPLETED;
+                sip_timer_stop(&txn->retransmit_timer);
+                sip_timer_stop(&txn->timeout_timer);
+                sip_timer_start(&txn->wait_timer, txn->reliable ? 0 : SIP_T4_MS);  // Timer K
+                txn_notify(txn, status_code, msg);
+            }
+        }
+        // 完成狀態下的重傳直接吸收
+    }
+}
+
+static void response_table_init(void) {
+    if (response_ready) return;
+    for (int i = 0; i < SIP_TXN_HASH_SIZE; i++) response_hash[i] = -1;
+    for (int i = 0; i < SIP_TXN_RESPONSE_CACHE; i++) responses[i].hash_next = -1;
+    response_ready = 1;
+}
+
+// 移出雜湊表並釋放內容；環形緩衝區中的位置在成為最舊的項目時回收
+static void response_release(txn_response_t *r) {
+    int index = r - responses;
+    int *link = &response_hash[txn_hash_key(r->branch, r->method)];
+    while (*link >= 0) {
+        if (*link == index) {
+            *link = r->hash_next;
+            break;
+        }
+        link = &responses[*link].hash_next;
+    }
+    r->hash_next = -1;
+    free(r->response);
+    r->response = NULL;
+    r->in_use = 0;
+}
+
+// 移除到期 (Timer J / H) 與已被取代的最舊項目
+static void response_expire(uint64_t now) {
+    while (response_count > 0) {
+        txn_response_t *r = &responses[response_oldest];
+        if (r->in_use && r->expires_ms > now) break;
+        if (r->in_use) response_release(r);
+        response_oldest = (response_oldest + 1) % SIP_TXN_RESPONSE_CACHE;
+        response_count--;
+    }
+}
+
+static txn_response_t* response_lookup(const char *branch, const char *method) {
+    response_table_init();
+    response_expire(sip_now_ms());
+    int idx = response_hash[txn_hash_key(branch, method)];
+    while (idx >= 0) {
+        txn_response_t *r = &responses[idx];
+        if (strcmp(r->branch, branch) == 0 && strcmp(r->method, method) == 0) {
+            return r;
+        }
+        idx = r->hash_next;
+    }
+    return NULL;
+}
+
+// 快取回應：同一請求的新回應取代舊的 (移到最新的一端)；已滿時提前移除最舊的項目
+static void response_store(const char *branch, const char *method, int status_code,
+                           const char *data, int len) {
+    txn_response_t *r = response_lookup(branch, method);
+    if (r) {
+        response_release(r);
+    }
+    if (response_count == SIP_TXN_RESPONSE_CACHE) {
+        r = &responses[response_oldest];
+        if (r->in_use) {
+            response_release(r);
+            if (response_evicted++ % 1000 == 0) {
+                log_with_timestamp("警告: 回應快取已滿 (%d)，到期前移除最舊的回應 (累計 %lu 次)\n",
+                                 SIP_TXN_RESPONSE_CACHE, response_evicted);
+            }
+        }
+        response_oldest = (response_oldest + 1) % SIP_TXN_RESPONSE_CACHE;
+        response_count--;
+    }
+    char *copy = malloc(len);
+    if (!copy) return;
+    memcpy(copy, data, len);
+
+    r = &responses[(response_oldest + response_count) % SIP_TXN_RESPONSE_CACHE];
+    response_count++;
+    snprintf(r->branch, sizeof(r->branch), "%s", branch);
+    snprintf(r->method, sizeof(r->method), "%s", method);
+    r->status_code = status_code;
+    r->expires_ms = sip_now_ms() + SIP_TXN_RESPONSE_KEEP_MS;
+    r->response = copy;
+    r->response_len = len;
+    r->in_use = 1;
+    unsigned int key = txn_hash_key(branch, method);
+    r->hash_next = response_hash[key];
+    response_hash[key] = r - responses;
+}
+
+// 逐段附加回應內容，超出容量時 *len 設為 -1
+static void response_append(char *buf, size_t size, int *len, const char *format, ...) {
+    if (*len < 0) return;
+    va_list args;
+    va_start(args, format);
+    int n = vsnprintf(buf + *len, size - *len, format, args);
+    va_end(args);
+    *len = (n < 0 || (size_t)n >= size - *len) ? -1 : *len + n;
+}
+
+static void response_append_header(char *buf, size_t size, int *len, const sip_msg_t *msg,
+                                   const char *name, const sip_header_t *hdr) {
+    response_append(buf, size, len, "%s: %.*s\r\n", name, (int)hdr->value.len, msg->buf + hdr->value.off);
+}
+
+int sip_txn_respond(int sockfd, const struct sockaddr_in *dest, const sip_msg_t *request,
+                    int status_code, const char *reason, const char *to_tag,
+                    const char *extra_headers, const char *body) {
+    char buf[BUF_SIZE];
+    char branch[64] = "", method[16] = "";
+    int len = 0;
+
+    sip_slice_copy(request, request->method, method, sizeof(method));
+    sip_msg_header_param(request, SIP_HDR_VIA, "branch", branch, sizeof(branch));
+
+    response_append(buf, sizeof(buf), &len, "SIP/2.0 %d %s\r\n", status_code, reason);
+    for (int i = 0; i < request->header_count; i++) {
+        const sip_header_t *hdr = &request->headers[i];
+        if (hdr->id == SIP_HDR_VIA) {
+            response_append_header(buf, sizeof(buf), &len, request, "Via", hdr);
+        }
+    }
+    const sip_header_t *from = sip_msg_header(request, SIP_HDR_FROM);
+    const sip_header_t *to = sip_msg_header(request, SIP_HDR_TO);
+    const sip_header_t *callid = sip_msg_header(request, SIP_HDR_CALL_ID);
+    const sip_header_t *cseq = sip_msg_header(request, SIP_HDR_CSEQ);
+    if (!from || !to || !callid || !cseq) {
+        log_with_timestamp("錯誤: %s 請求缺少必要標頭，無法回應\n", method);
+        return -1;
+    }
+    sip_slice_t tag;
+    response_append_header(buf, sizeof(buf), &len, request, "From", from);
+    response_append_header(buf, sizeof(buf), &len, request, "To", to);
+    if (len > 0 && to_tag && to_tag[0] && sip_header_param(request, to, "tag", &tag) != 0) {
+        len -= 2;   // 在 To 行的 CRLF 之前加上 tag
+        response_append(buf, sizeof(buf), &len, ";tag=%s\r\n", to_tag);
+    }
+    response_append_header(buf, sizeof(buf), &len, request, "Call-ID", callid);
+    response_append_header(buf, sizeof(buf), &len, request, "CSeq", cseq);
+    response_append(buf, sizeof(buf), &len, "Server: Custom SIP Client\r\n%s", extra_headers ? extra_headers : "");
+    response_append(buf, sizeof(buf), &len, "Content-Length: %zu\r\n\r\n%s",
+                    body ? strlen(body) : (size_t)0, body ? body : "");
+    if (len < 0) {
+        log_with_timestamp("錯誤: %s 的 %d 回應超出緩衝區容量\n", method, status_code);
+        return -1;
+    }
+
+    struct iovec iov = { buf, (size_t)len };
+    if (sip_transport_send(sockfd, dest, &iov, 1) < 0) {
+        log_with_timestamp("錯誤: 發送 %d 回應 (%s) 失敗: %s\n", status_code, method, strerror(errno));
+        return -1;
+    }
+    if (branch[0] && strcmp(method, "ACK") != 0) {
+        response_store(branch, method, status_code, buf, len);
+    }
+    return 0;
+}
+
+// 處理收到的一則SIP訊息：只解析一次，結果交給事務或上層 (每則訊息只記錄在事件追蹤中)
+void sip_txn_receive(int sockfd, const char *data, int len, const struct sockaddr_in *from) {
+    sip_msg_t msg;
+    char branch[64], method[16];
+
+    sip_trace_sip(SIP_TRACE_SIP_RX, -1, data, len, from);
+    if (sip_parse_message(data, len, &msg) != 0) {
+        log_with_timestamp("收到格式錯誤的 SIP 訊息 (%d 字節)，已丟棄\n", len);
+        return;
+    }
+
+    if (msg.is_response && msg.status_code >= 100 &&
+        sip_msg_header_param(&msg, SIP_HDR_VIA, "branch", branch, sizeof(branch)) == 0 &&
+        sip_slice_copy(&msg, msg.cseq_method, method, sizeof(method)) == 0) {
+        sip_transaction_t *txn = txn_lookup(branch, method);
+        if (txn) {
+            txn_on_response(txn, msg.status_code, &msg);
+            return;
+        }
+    }
+
+    // 對方請求的重傳：重發快取的回應
+    if (!msg.is_response &&
+        sip_msg_header_param(&msg, SIP_HDR_VIA, "branch", branch, sizeof(branch)) == 0 &&
+        sip_slice_copy(&msg, msg.method, method, sizeof(method)) == 0) {
+        txn_response_t *cached = response_lookup(branch, method);
+        if (cached) {
+            struct iovec iov = { cached->response, (size_t)cached->response_len };
+            sip_trace_retransmit(SIP_TRACE_SIP_RESEND, -1, method, branch, (uint32_t)cached->status_code);
+            sip_transport_send(sockfd, from, &iov, 1);
+            return;
+        }
+    }
+
+    if (unmatched_handler) {
+        unmatched_handler(sockfd, &msg, from);
+    } else {
+        log_with_timestamp("收到不屬於任何事務的 SIP 訊息 (%d 字節)，已丟棄\n", len);
+    }
+}
+
+// SIP socket 可讀：以 recvmmsg 批量讀取所有待處理的數據報
+static void on_sip_socket_readable(int fd, void *arg) {
+    (void)arg;
+    sip_batch_recv(fd, sip_txn_receive);
+}
+
+// 連接中斷：回調中可能建立新的事務 (例如改用其他路由重試)，只結束中斷前已存在的事務
+void sip_txn_transport_error(const struct sockaddr_in *dest) {
+    unsigned int serial_limit = txn_serial;
+
+    for (int i = 0; i < SIP_MAX_TRANSACTIONS && txn_table_ready; i++) {
+        sip_transaction_t *txn = &transactions[i];
+        if (!txn->in_use || (int)(txn->serial - serial_limit) > 0 ||
+            txn->dest.sin_addr.s_addr != dest->sin_addr.s_addr || txn->dest.sin_port != dest->sin_port) {
+            continue;
+        }
+        if (txn->state == TXN_COMPLETED || txn->state == TXN_TERMINATED) continue;
+
+        log_with_timestamp("事務因連接中斷而失敗: %s (branch %s)\n", txn->method, txn->branch);
+        txn->state = TXN_TERMINATED;
+        txn_notify(txn, 503, NULL);
+        txn_free(txn);
+    }
+}
+
+// 將SIP socket交給事件循環讀取 (重複調用無副作用)
+int sip_txn_attach_socket(int sockfd) {
+    pthread_mutex_lock(&socket_lock);
+    for (int i = 0; i < attached_count; i++) {
+        if (attached_sockets[i] == sockfd) {
+            pthread_mutex_unlock(&socket_lock);
+            return 0;
+        }
+    }
+    if (attached_count == SIP_MAX_SOCKETS || sip_reactor_start() != 0 ||
+        sip_reactor_add_fd(sockfd, on_sip_socket_readable, NULL) != 0) {
+        pthread_mutex_unlock(&socket_lock);
+        log_with_timestamp("錯誤: 無法將 SIP socket %d 加入事件循環\n", sockfd);
+        return -1;
+    }
+    attached_sockets[attached_count++] = sockfd;
+    pthread_mutex_unlock(&socket_lock);
+    return 0;
+}
+
+void sip_txn_detach_socket(int sockfd) {
+    pthread_mutex_lock(&socket_lock);
+    for (int i = 0; i < attached_count; i++) {
+        if (attached_sockets[i] == sockfd) {
+            attached_sockets[i] = attached_sockets[--attached_count];
+            sip_reactor_remove_fd(sockfd);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&socket_lock);
+}
+
+void sip_txn_set_unmatched_handler(sip_unmatched_handler_t handler) {
+    unmatched_handler = handler;
+}
@@ -0,0 +1,103 @@
+// sip_transaction.h - RFC 3261 客戶端事務 (INVITE / 非 INVITE) 與對方請求的回應
+#ifndef SIP_TRANSACTION_H
+#define SIP_TRANSACTION_H
+
+#include "sip_client.h"
+#include "sip_reactor.h"
+#include "sip_parser.h"
+#include "sip_template.h"
+
+// RFC 3261 計時器基準值
+#define SIP_T1_MS 500                 // RTT 估計值
+#define SIP_T2_MS 4000                // 非 INVITE 重傳間隔上限
+#define SIP_T4_MS 5000                // 訊息在網路中的最長存活時間
+#define SIP_TIMER_D_MS 32000          // INVITE 完成狀態等待重傳的時間 (UDP)
+
+#define SIP_MAX_TRANSACTIONS 4096     // 同時進行的事務數上限
+#define SIP_TXN_HASH_SIZE 8192        // branch 雜湊桶數 (2的冪次)
+#define SIP_MAX_SOCKETS 16            // 事務層可管理的SIP socket數
+#define SIP_TXN_RESPONSE_CACHE SIP_MAX_TRANSACTIONS   // 對方請求的回應快取 (吸收重傳；呼叫表滿載時每個對話約 8 個)
+#define SIP_TXN_RESPONSE_KEEP_MS (64 * SIP_T1_MS)   // 回應保留時間 (Timer J / H)
+
+// 回應對方請求時宣告的支援方法
+#define SIP_ALLOW_HEADER "Allow: INVITE, ACK, CANCEL, BYE, OPTIONS, UPDATE\r\n"
+
+typedef enum {
+    SIP_TXN_INVITE_CLIENT,
+    SIP_TXN_NON_INVITE_CLIENT
+} sip_txn_type_t;
+
+typedef enum {
+    TXN_CALLING,      // INVITE 已發送 (Timer A/B)
+    TXN_TRYING,       // 非 INVITE 已發送 (Timer E/F)
+    TXN_PROCEEDING,   // 已收到 1xx
+    TXN_COMPLETED,    // 已收到最終回應，吸收重傳 (Timer D/K)
+    TXN_TERMINATED
+} sip_txn_state_t;
+
+typedef struct sip_transaction sip_transaction_t;
+
+// 事務事件回調：每個 1xx 與最終回應各調用一次，msg 為已解析的回應；
+// 逾時 (Timer B/F) 以 408、傳送失敗以 503 回報，此時 msg 為 NULL。
+// 收到最終回應後事務可能隨時釋放，呼叫者不應再保留指標。
+typedef void (*sip_txn_callback_t)(sip_transaction_t *txn, int status_code,
+                                   const sip_msg_t *msg, void *user_data);
+
+// 不屬於任何事務的訊息 (對方請求、2xx 重傳等) 交給上層處理
+typedef void (*sip_unmatched_handler_t)(int sockfd, const sip_msg_t *msg,
+                                        const struct sockaddr_in *from);
+
+struct sip_transaction {
+    int in_use;
+    sip_txn_type_t type;
+    sip_txn_state_t state;
+    char branch[64];
+    char method[16];
+    int sockfd;
+    struct sockaddr_in dest;
+    char *request;                  // 原始請求，用於重傳與產生 ACK/CANCEL
+    int request_len;
+    char *ack;                      // 非 2xx 最終回應的 ACK，用於回應重傳
+    int ack_len;
+    int reliable;                   // TCP/TLS：不重傳，Timer D/K 為 0
+    unsigned int serial;            // 建立順序，用於區分傳輸錯誤發生後才建立的事務
+    int retransmit_interval;        // Timer A/E 當前間隔 (毫秒)
+    sip_timer_t retransmit_timer;   // Timer A / E
+    sip_timer_t timeout_timer;      // Timer B / F
+    sip_timer_t wait_timer;         // Timer D / K
+    sip_txn_callback_t callback;
+    void *user_data;
+    int hash_next;
+};
+
+// 以下函數須在事件循環線程中調用
+sip_transaction_t* sip_txn_client_start(int sockfd, const struct sockaddr_in *dest,
+                                        const char *request, int request_len,
+                                        sip_txn_callback_t callback, void *user_data);
+sip_transaction_t* sip_txn_client_start_iov(int sockfd, const struct sockaddr_in *dest,
+                                            const char *method, const char *branch,
+                                            const struct iovec *iov, int iovcnt,
+                                            sip_txn_callback_t callback, void *user_data);
+void sip_txn_detach(sip_transaction_t *txn);
+int sip_txn_build_cancel(const sip_transaction_t *invite_txn, char *buf, size_t buf_size);
+int sip_txn_active_count(void);
+
+// 伺服器端：回應對方的請求 (複製 Via/From/To/Call-ID/CSeq，To 沒有 tag 時加上 to_tag)。
+// extra_headers 為完整的標頭行 (含 CRLF) 或 NULL；body 為 NULL 時 Content-Length 為 0。
+// 回應會快取 SIP_TXN_RESPONSE_KEEP_MS，期間收到同一請求的重傳直接重發，不再交給上層。
+// 沒有發送 1xx，對方重傳 INVITE 直到收到 2xx，因此 re-INVITE 的 2xx 遺失時也由此恢復。
+int sip_txn_respond(int sockfd, const struct sockaddr_in *dest, const sip_msg_t *request,
+                    int status_code, const char *reason, const char *to_tag,
+                    const char *extra_headers, const char *body);
+
+// 傳輸層交來的一則完整 SIP 訊息 (UDP 數據報或 TCP/TLS 分幀結果)
+void sip_txn_receive(int sockfd, const char *data, int len, const struct sockaddr_in *from);
+// 到 dest 的連接中斷：仍在等待回應的事務以 503 結束
+void sip_txn_transport_error(const struct sockaddr_in *dest);
+
+// socket 管理 (可從任意線程調用)
+int sip_txn_attach_socket(int sockfd);
+void sip_txn_detach_socket(int sockfd);
+void sip_txn_set_unmatched_handler(sip_unmatched_handler_t handler);
+
+#endif // SIP_TRANSACTION_H
@@ -0,0 +1,271 @@
+// sip_transport.c - 實現共用SIP傳輸與依 Call-ID/tag 的訊息分派
+#include "sip_transport.h"
+#include "sip_transaction.h"
+#include "sip_stream.h"
+#include "sip_gateway.h"
+#include "sip_batch.h"
+#include "sip_trace.h"
+
+typedef enum { TRANSPORT_UDP = 0, TRANSPORT_TCP, TRANSPORT_TLS } transport_kind_t;
+
+static int transport_sockfd = -1;
+static transport_kind_t transport_kind = TRANSPORT_UDP;
+static int transport_refs = 0;
+static pthread_mutex_t transport_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// 已登記的會話 (以 Call-ID 雜湊，鏈結存放在會話中)
+static sip_session_t *session_buckets[SIP_SESSION_HASH_SIZE];
+static int session_count = 0;
+static pthread_mutex_t session_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// FNV-1a 雜湊
+static unsigned int callid_hash(const char *callid) {
+    unsigned int h = 2166136261u;
+    while (*callid) {
+        h ^= (unsigned char)*callid++;
+        h *= 16777619u;
+    }
+    return h & (SIP_SESSION_HASH_SIZE - 1);
+}
+
+// 需持有 session_lock
+static sip_session_t* find_locked(const char *callid, const char *local_tag) {
+    sip_session_t *s = session_buckets[callid_hash(callid)];
+    while (s) {
+        if (strcmp(s->callid, callid) == 0 && (!local_tag || strcmp(s->tag, local_tag) == 0)) {
+            return s;
+        }
+        s = s->transport_next;
+    }
+    return NULL;
+}
+
+// 不屬於任何會話的請求 (ACK 不回應)：對話外的 OPTIONS 為網關的存活探測，回應 200；
+// 本客戶端只發起呼叫，對話外的 INVITE 以 603 拒絕；其他請求的對話不存在，回應 481
+static void transport_reject_request(int sockfd, const sip_msg_t *msg, const struct sockaddr_in *from,
+                                     const char *callid, int in_dialog) {
+    char tag[32];
+
+    if (sip_slice_equals(msg, msg->method, "ACK")) return;
+    if (!in_dialog && sip_slice_equals(msg, msg->method, "OPTIONS")) {
+        get_tag(tag, sizeof(tag));
+        sip_txn_respond(sockfd, from, msg, 200, "OK", tag, SIP_ALLOW_HEADER, NULL);
+        return;
+    }
+    if (!in_dialog && sip_slice_equals(msg, msg->method, "INVITE")) {
+        log_with_timestamp("拒絕來電 (Call-ID: %s)\n", callid);
+        get_tag(tag, sizeof(tag));
+        sip_txn_respond(sockfd, from, msg, 603, "Decline", tag, NULL, NULL);
+        return;
+    }
+    log_with_timestamp("請求不屬於任何對話 (Call-ID: %s)，回應 481\n", callid);
+    sip_txn_respond(sockfd, from, msg, 481, "Call/Transaction Does Not Exist", NULL, NULL, NULL);
+}
+
+// 不屬於任何事務的訊息：回應以 From tag、請求以 To tag 找到本地會話
+static void transport_on_unmatched(int sockfd, const sip_msg_t *msg, const struct sockaddr_in *from) {
+    char callid[64], local_tag[128];
+
+    if (sip_msg_header_value(msg, SIP_HDR_CALL_ID, callid, sizeof(callid)) != 0) {
+        log_with_timestamp("收到無法解析 Call-ID 的 SIP 訊息 (%d 字節)，已丟棄\n", msg->len);
+        return;
+    }
+    if (sip_msg_header_param(msg, msg->is_response ? SIP_HDR_FROM : SIP_HDR_TO, "tag",
+                             local_tag, sizeof(local_tag)) != 0) {
+        local_tag[0] = '\0';
+    }
+
+    // 分派期間持有鎖：移除登記返回後，不會再有訊息交給該會話
+    pthread_mutex_lock(&session_lock);
+    sip_session_t *session = find_locked(callid, local_tag[0] ? local_tag : NULL);
+    if (session) {
+        sip_session_on_unmatched(session, msg, from);
+    }
+    pthread_mutex_unlock(&session_lock);
+
+    if (!session && !msg->is_response) {
+        transport_reject_request(sockfd, msg, from, callid, local_tag[0] != '\0');
+    } else if (!session) {
+        log_with_timestamp("收到不屬於任何會話的 SIP 訊息 (Call-ID: %s)，已丟棄\n", callid);
+    }
+}
+
+// TCP/TLS 連接上分幀後的訊息與 UDP 數據報走相同的處理路徑
+static void transport_on_stream_message(const char *data, int len, const struct sockaddr_in *from) {
+    sip_txn_receive(transport_sockfd, data, len, from);
+}
+
+// 每輪事件循環結束時送出本輪排入的 UDP 數據報
+static void transport_flush_task(void *arg) {
+    (void)arg;
+    sip_batch_flush();
+}
+
+// 建立並綁定共用SIP socket，交給事件循環讀取 (需持有 transport_lock)
+static int transport_open_locked(void) {
+    int sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sockfd < 0) {
+        log_with_timestamp("錯誤: 無法創建 SIP socket: %s\n", strerror(errno));
+        return -1;
+    }
+
+    // 所有會話共享此socket，使用較大的接收緩衝區
+    int rcvbuf_size = SIP_TRANSPORT_RCVBUF;
+    if (setsockopt(sockfd, SOL_SOCKET, SO_RCVBUF, &rcvbuf_size, sizeof(rcvbuf_size)) < 0) {
+        log_with_timestamp("警告: 無法設置接收緩衝區大小: %s\n", strerror(errno));
+    }
+
+    struct sockaddr_in localaddr;
+    memset(&localaddr, 0, sizeof(localaddr));
+    localaddr.sin_family = AF_INET;
+    localaddr.sin_addr.s_addr = inet_addr(LOCAL_IP);
+    localaddr.sin_port = htons(LOCAL_PORT);
+
+    if (bind(sockfd, (struct sockaddr *)&localaddr, sizeof(localaddr)) < 0) {
+        log_with_timestamp("錯誤: 無法綁定 SIP socket 到 %s:%d: %s\n", LOCAL_IP, LOCAL_PORT, strerror(errno));
+        close(sockfd);
+        return -1;
+    }
+
+    // 排空可能存在的舊封包
+    flush_socket(sockfd);
+
+    sip_txn_set_unmatched_handler(transport_on_unmatched);
+    if (sip_reactor_add_tick_hook(transport_flush_task, NULL) != 0 || sip_txn_attach_socket(sockfd) != 0) {
+        close(sockfd);
+        return -1;
+    }
+
+    // UDP socket 仍作為會話的傳輸標識並接收 UDP 訊息；TCP/TLS 連接在第一次發送時建立
+    const char *kind = sip_config()->transport;
+    transport_kind = strcmp(kind, "tls") == 0 ? TRANSPORT_TLS :
+                     strcmp(kind, "tcp") == 0 ? TRANSPORT_TCP : TRANSPORT_UDP;
+    sip_stream_set_handlers(transport_on_stream_message, sip_txn_transport_error);
+
+    transport_sockfd = sockfd;
+    log_with_timestamp("SIP 傳輸已開啟: %s:%d (socket %d，%s)\n", LOCAL_IP, LOCAL_PORT, sockfd, sip_transport_via());
+    return 0;
+}
+
+int sip_transport_acquire(void) {
+    pthread_mutex_lock(&transport_lock);
+    if (transport_refs == 0) {
+        if (transport_open_locked() != 0) {
+            pthread_mutex_unlock(&transport_lock);
+            return -1;
+        }
+        // 網關主機名在此預先解析，事件循環線程中只查詢快取
+        if (!sip_reactor_in_thread()) {
+            sip_gateway_prepare();
+        }
+    }
+    transport_refs++;
+    pthread_mutex_unlock(&transport_lock);
+    return 0;
+}
+
+void sip_transport_release(void) {
+    pthread_mutex_lock(&transport_lock);
+    if (transport_refs > 0 && --transport_refs == 0) {
+        sip_gateway_stop();
+        if (transport_kind != TRANSPORT_UDP) sip_stream_close_all();
+        sip_txn_detach_socket(transport_sockfd);
+        if (sip_reactor_in_thread()) {
+            transport_flush_task(NULL);
+        } else {
+            sip_reactor_run_sync(transport_flush_task, NULL);
+        }
+        close(transport_sockfd);
+        log_with_timestamp("SIP 傳輸已關閉\n");
+        transport_sockfd = -1;
+    }
+    pthread_mutex_unlock(&transport_lock);
+}
+
+int sip_transport_sockfd(void) {
+    return transport_sockfd;
+}
+
+int sip_transport_is_reliable(int sockfd) {
+    return sockfd >= 0 && sockfd == transport_sockfd && transport_kind != TRANSPORT_UDP;
+}
+
+const char* sip_transport_via(void) {
+    static const char *names[] = { "UDP", "TCP", "TLS" };
+    return names[transport_kind];
+}
+
+const char* sip_transport_uri_param(void) {
+    static const char *params[] = { "", ";transport=tcp", ";transport=tls" };
+    return params[transport_kind];
+}
+
+// 共用傳輸的socket改走 TCP/TLS 連接；其他socket (舊式獨立會話) 維持 UDP
+ssize_t sip_transport_send(int sockfd, const struct sockaddr_in *dest, const struct iovec *iov, int iovcnt) {
+    sip_trace_sip_iov(SIP_TRACE_SIP_TX, -1, iov, iovcnt, dest);
+    if (!sip_transport_is_reliable(sockfd)) {
+        // 事件循環線程中的發送 (請求、重傳、ACK、回應) 合併到本輪結束時以 sendmmsg 送出
+        if (sip_reactor_in_thread()) {
+            return sip_batch_send(sockfd, dest, iov, iovcnt);
+        }
+        return sip_send_iov(sockfd, dest, iov, iovcnt);
+    }
+
+    ssize_t total = 0;
+    for (int i = 0; i < iovcnt; i++) total += iov[i].iov_len;
+    if (sip_stream_send(dest, transport_kind == TRANSPORT_TLS, iov, iovcnt) != 0) {
+        errno = ECONNREFUSED;
+        return -1;
+    }
+    return total;
+}
+
+// 會話登記只操作雜湊表，不涉及任何系統調用
+int sip_transport_register(sip_session_t *session) {
+    if (!session || session->callid[0] == '\0') return -1;
+
+    pthread_mutex_lock(&session_lock);
+    if (!session->transport_registered) {
+        unsigned int bucket = callid_hash(session->callid);
+        session->transport_next = session_buckets[bucket];
+        session_buckets[bucket] = session;
+        session->transport_registered = 1;
+        session_count++;
+    }
+    pthread_mutex_unlock(&session_lock);
+    return 0;
+}
+
+void sip_transport_unregister(sip_session_t *session) {
+    if (!session) return;
+
+    pthread_mutex_lock(&session_lock);
+    if (session->transport_registered) {
+        sip_session_t **link = &session_buckets[callid_hash(session->callid)];
+        while (*link) {
+            if (*link == session) {
+                *link = session->transport_next;
+                break;
+            }
+            link = &(*link)->transport_next;
+        }
+        session->transport_next = NULL;
+        session->transport_registered = 0;
+        session_count--;
+    }
+    pthread_mutex_unlock(&session_lock);
+}
+
+sip_session_t* sip_transport_find(const char *callid, const char *local_tag) {
+    pthread_mutex_lock(&session_lock);
+    sip_session_t *session = find_locked(callid, local_tag);
+    pthread_mutex_unlock(&session_lock);
+    return session;
+}
+
+int sip_transport_session_count(void) {
+    pthread_mutex_lock(&session_lock);
+    int count = session_count;
+    pthread_mutex_unlock(&session_lock);
+    return count;
+}
@@ -0,0 +1,28 @@
+// sip_transport.h - 進程共用的SIP傳輸：擁有綁定 LOCAL_IP:LOCAL_PORT 的socket，依 Call-ID 與 tag 將訊息分派給會話
+#ifndef SIP_TRANSPORT_H
+#define SIP_TRANSPORT_H
+
+#include "sip_client.h"
+
+#define SIP_SESSION_HASH_SIZE 1024    // Call-ID 雜湊桶數 (2的冪次)
+#define SIP_TRANSPORT_RCVBUF (1024 * 1024)
+
+// 引用計數：第一次取得時建立、綁定並交給事件循環，最後一次釋放時關閉
+int sip_transport_acquire(void);
+void sip_transport_release(void);
+int sip_transport_sockfd(void);
+
+// 傳輸類型依設定的 transport 決定：UDP 經由共用socket發送 (事件循環線程中的發送每輪結束時以 sendmmsg 批量送出)，
+// TCP/TLS 經由到下一跳的持久連接
+int sip_transport_is_reliable(int sockfd);
+const char* sip_transport_via(void);          // Via 中的傳輸名稱 (UDP/TCP/TLS)
+const char* sip_transport_uri_param(void);    // Contact URI 參數 (UDP 為空字串)
+ssize_t sip_transport_send(int sockfd, const struct sockaddr_in *dest, const struct iovec *iov, int iovcnt);
+
+// 會話登記：不屬於任何事務的訊息依 Call-ID 與本地 tag 分派給會話
+int sip_transport_register(sip_session_t *session);
+void sip_transport_unregister(sip_session_t *session);
+sip_session_t* sip_transport_find(const char *callid, const char *local_tag);
+int sip_transport_session_count(void);
+
+#endif // SIP_TRANSPORT_H
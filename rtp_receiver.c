@@ -113,23 +113,24 @@ void wait_for_key_or_timeout(int timeout_seconds) {
 
 int main(int argc, char *argv[]) {
     sip_session_t session;
-    const char *callee = CALLEE;   // 使用默認被叫號碼
+    const char *callee = NULL;     // 未指定時使用設定中的默認被叫號碼
     const char *output_file = "received_audio.wav";  // 默認輸出文件名
     int timeout_seconds = 120;  // 默認通話時間限制為120秒
     
-    // 初始化隨機數種子
-    srand(time(NULL));
-    
     // 設置信號處理器以便從任何地方都能正確處理Ctrl+C
     signal(SIGINT, signal_handler);
     
     log_with_timestamp("RTP音頻接收器啟動\n");
     
-    // 處理命令行參數
-    if (argc > 1) {
-        callee = argv[1];
+    // 載入設定 (SIP_CONFIG 環境變數指定設定檔)
+    if (sip_config_load(NULL) != 0) {
+        log_with_timestamp("載入設定失敗\n");
+        return 1;
     }
     
+    // 處理命令行參數
+    callee = argc > 1 ? argv[1] : CALLEE;
+    
     if (argc > 2) {
         output_file = argv[2];
     }
@@ -158,7 +159,7 @@ int main(int argc, char *argv[]) {
         return 1;
     }
     
-    log_with_timestamp("呼叫建立成功！遠端RTP端口: %d\n", session.remote_rtp_port);
+    log_with_timestamp("呼叫建立成功！遠端RTP端口: %d\n", session.media.remote_port);
     log_with_timestamp("通話已接通，現在開始啟動RTP接收器...\n");
     
     // 在接通電話後才啟動RTP接收器
@@ -0,0 +1,825 @@
+// sip_gateway_emu.c - 本機回環 SIP/RTP 網關模擬器：以摘要認證挑戰 REGISTER/INVITE，依序回應 100、183 與 200 (帶 SDP)，
+// 接受 ACK/BYE/CANCEL (檢查對話內請求依 Contact 與 Record-Route 發出)，回送或產生 RTP，並可對發出的封包注入丟包、抖動、亂序、重複與回應延遲。
+// 與 ws_audio_server、rtp_receiver、sip_loadgen 使用相同的設定 (sip_server:sip_port、username/password)，
+// 因此不需真實網關即可在單機上做效能與壓力測試。
+#include "lib/sip_client.h"
+#include "lib/sip_sdp.h"
+#include "lib/sip_id.h"
+#include "lib/sip_transaction.h"
+#include <getopt.h>
+#include <poll.h>
+#include <signal.h>
+
+#define EMU_MAX_CALLS 512                 // 同時進行的通話數上限 (與呼叫表容量一致)
+#define EMU_QUEUE_MAX 8192                // 延遲佇列容量 (滿時不再延遲，直接發送)
+#define EMU_T2_MS 4000                    // 200 OK 重傳間隔上限 (RFC 3261 Timer T2)
+#define EMU_REALM "sip-gateway-emu"
+#define EMU_TONE_BYTES 8000               // 1 秒的 1kHz μ-law 測試音 (每 8 個樣本一個週期，可無縫循環)
+#define EMU_REORDER_MS 40                 // 被選中亂序的封包額外延遲，讓其後的封包先送達
+
+typedef enum {
+    EMU_RTP_ECHO = 0,                     // 把收到的 RTP 送回對方 SDP 中的地址
+    EMU_RTP_TONE,                         // 每 ptime 發送一個 1kHz 測試音封包
+    EMU_RTP_NONE
+} emu_rtp_mode_t;
+
+typedef struct {
+    const char *bind_ip;
+    int port;
+    int rtp_base_port;
+    int auth;                             // 1: 對 REGISTER/INVITE 發出 401 挑戰
+    int ring_ms;                          // 183 與 200 之間的時間
+    int delay_ms;                         // 每個 SIP 回應的額外延遲
+    int jitter_ms;                        // 每個發出封包的隨機延遲上限
+    double loss;                          // 發出封包的丟棄機率
+    double dup;                           // 發出封包的重複機率
+    double reorder;                       // 發出封包被延後 (亂序) 的機率
+    int faults_sip;                       // 故障注入是否套用到 SIP / RTP
+    int faults_rtp;
+    emu_rtp_mode_t rtp_mode;
+    int quiet;
+} emu_options_t;
+
+static emu_options_t opts = {
+    NULL, 0, 40000, 1, 200, 0, 0, 0, 0, 0, 1, 1, EMU_RTP_ECHO, 0
+};
+
+typedef struct {
+    unsigned long sip_in, sip_out;
+    unsigned long rtp_in, rtp_out;
+    unsigned long dropped, duplicated, reordered, delayed;
+    unsigned long challenges, auth_failures;
+    unsigned long calls, answered, confirmed, ended, cancelled, ack_timeouts, rejected;
+    unsigned long invite_retransmits, response_retransmits;
+    unsigned long registers;
+    unsigned long bad_targets;            // Request-URI 或 Route 錯誤的對話內請求
+} emu_stats_t;
+
+static emu_stats_t stats;
+static volatile sig_atomic_t running = 1;
+static int sip_fd = -1;
+static char nonce[40];
+static unsigned char tone[EMU_TONE_BYTES];
+
+// ---- 故障注入與延遲佇列 ----
+
+typedef struct {
+    uint64_t due_us;
+    uint64_t order;                       // 相同到期時間時保持加入順序
+    int fd;
+    int is_sip;
+    struct sockaddr_in dest;
+    int len;
+    char data[];
+} emu_packet_t;
+
+static emu_packet_t *queue[EMU_QUEUE_MAX];   // 以 due_us 排序的最小堆
+static int queue_len = 0;
+static uint64_t queue_order = 0;
+
+static int packet_before(const emu_packet_t *a, const emu_packet_t *b) {
+    return a->due_us < b->due_us || (a->due_us == b->due_us && a->order < b->order);
+}
+
+static void queue_push(emu_packet_t *pkt) {
+    int i = queue_len++;
+    while (i > 0) {
+        int parent = (i - 1) / 2;
+        if (!packet_before(pkt, queue[parent])) break;
+        queue[i] = queue[parent];
+        i = parent;
+    }
+    queue[i] = pkt;
+}
+
+static emu_packet_t* queue_pop(void) {
+    emu_packet_t *top = queue[0];
+    emu_packet_t *last = queue[--queue_len];
+    int i = 0;
+    for (;;) {
+        int child = 2 * i + 1;
+        if (child >= queue_len) break;
+        if (child + 1 < queue_len && packet_before(queue[child + 1], queue[child])) child++;
+        if (!packet_before(queue[child], last)) break;
+        queue[i] = queue[child];
+        i = child;
+    }
+    if (queue_len > 0) queue[i] = last;
+    return top;
+}
+
+static int chance(double p) {
+    return p > 0 && sip_id_u32() < p * 4294967296.0;
+}
+
+static void send_now(int fd, const struct sockaddr_in *dest, const void *data, int len, int is_sip) {
+    if (sendto(fd, data, len, 0, (const struct sockaddr *)dest, sizeof(*dest)) < 0) {
+        if (!opts.quiet) log_with_timestamp("發送到 %s:%d 失敗: %s\n",
+                                            inet_ntoa(dest->sin_addr), ntohs(dest->sin_port), strerror(errno));
+        return;
+    }
+    if (is_sip) stats.sip_out++;
+    else stats.rtp_out++;
+}
+
+// 經過故障注入發送一個封包：可能被丟棄、重複、加上抖動或延後；extra_ms 為固定延遲 (SIP 回應延遲)
+static void emu_send(int fd, const struct sockaddr_in *dest, const void *data, int len, int is_sip, int extra_ms) {
+    int faulty = is_sip ? opts.faults_sip : opts.faults_rtp;
+    int copies = 1;
+
+    if (faulty && chance(opts.loss)) {
+        stats.dropped++;
+        return;
+    }
+    if (faulty && chance(opts.dup)) {
+        stats.duplicated++;
+        copies = 2;
+    }
+
+    for (int c = 0; c < copies; c++) {
+        uint64_t delay_us = (uint64_t)extra_ms * 1000;
+        if (faulty && opts.jitter_ms > 0) {
+            delay_us += sip_id_u32() % ((uint32_t)opts.jitter_ms * 1000 + 1);
+        }
+        if (faulty && chance(opts.reorder)) {
+            stats.reordered++;
+            delay_us += (uint64_t)(EMU_REORDER_MS + opts.jitter_ms) * 1000;
+        }
+
+        emu_packet_t *pkt = delay_us > 0 && queue_len < EMU_QUEUE_MAX ? malloc(sizeof(*pkt) + len) : NULL;
+        if (!pkt) {
+            send_now(fd, dest, data, len, is_sip);
+            continue;
+        }
+        pkt->due_us = sip_now_us() + delay_us;
+        pkt->order = queue_order++;
+        pkt->fd = fd;
+        pkt->is_sip = is_sip;
+        pkt->dest = *dest;
+        pkt->len = len;
+        memcpy(pkt->data, data, len);
+        queue_push(pkt);
+        stats.delayed++;
+    }
+}
+
+static void queue_flush(uint64_t now) {
+    while (queue_len > 0 && queue[0]->due_us <= now) {
+        emu_packet_t *pkt = queue_pop();
+        send_now(pkt->fd, &pkt->dest, pkt->data, pkt->len, pkt->is_sip);
+        free(pkt);
+    }
+}
+
+// ---- 通話 ----
+
+typedef enum {
+    EMU_CALL_FREE = 0,
+    EMU_CALL_RINGING,                     // 已送出 100/183，等待應答時間到
+    EMU_CALL_ANSWERED,                    // 已送出 200，重傳直到收到 ACK
+    EMU_CALL_CONFIRMED,                   // 已收到 ACK
+    EMU_CALL_CANCELLED                    // 已送出 487，等待 ACK
+} emu_call_state_t;
+
+typedef struct {
+    emu_call_state_t state;
+    char callid[128];
+    char to_tag[32];
+    int invite_cseq;
+    char invite[BUF_SIZE];                // 原始 INVITE (延遲的 200 與 487 依此產生)
+    int invite_len;
+    struct sockaddr_in sip_peer;
+    char response[BUF_SIZE];              // 對 INVITE 的最後一個回應 (INVITE 重傳時重送)
+    int response_len;
+    uint64_t answer_due_us;
+    uint64_t retx_due_us;                 // 200/487 的下次重傳時間 (Timer G)
+    int retx_interval_ms;
+    uint64_t retx_deadline_us;            // 仍未收到 ACK 時放棄 (Timer H)
+    unsigned int sdp_version;
+    int rtp_fd;
+    int rtp_port;
+    sip_media_t media;
+    uint16_t seq;
+    uint32_t timestamp;
+    uint32_t ssrc;
+    uint64_t next_rtp_us;
+    int tone_pos;
+} emu_call_t;
+
+static emu_call_t calls[EMU_MAX_CALLS];
+
+static emu_call_t* find_call(const sip_msg_t *msg) {
+    char callid[128];
+    if (sip_msg_header_value(msg, SIP_HDR_CALL_ID, callid, sizeof(callid)) != 0) return NULL;
+    for (int i = 0; i < EMU_MAX_CALLS; i++) {
+        if (calls[i].state != EMU_CALL_FREE && strcmp(calls[i].callid, callid) == 0) return &calls[i];
+    }
+    return NULL;
+}
+
+static void free_call(emu_call_t *call) {
+    if (call->rtp_fd >= 0) close(call->rtp_fd);
+    call->rtp_fd = -1;
+    call->state = EMU_CALL_FREE;
+}
+
+static int open_udp(const char *ip, int port) {
+    struct sockaddr_in addr;
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    int buf_size = 4 * 1024 * 1024;
+
+    if (fd < 0) return -1;
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &buf_size, sizeof(buf_size));
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &(int){1}, sizeof(int));
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    if (inet_pton(AF_INET, ip, &addr.sin_addr) != 1 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        close(fd);
+        return -1;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    return fd;
+}
+
+// ---- SIP 回應 ----
+
+static void append(char *buf, size_t size, int *len, const char *format, ...) {
+    if (*len < 0) return;
+    va_list args;
+    va_start(args, format);
+    int n = vsnprintf(buf + *len, size - *len, format, args);
+    va_end(args);
+    *len = (n < 0 || (size_t)n >= size - *len) ? -1 : *len + n;
+}
+
+// 依請求產生回應：複製 Via/From/To/Call-ID/CSeq，To 沒有 tag 時加上 to_tag；返回長度，失敗返回 -1
+static int build_response(const sip_msg_t *req, const char *status, const char *to_tag,
+                          const char *extra_headers, const char *body, char *buf, size_t size) {
+    int len = 0;
+    sip_slice_t tag;
+
+    append(buf, size, &len, "SIP/2.0 %s\r\n", status);
+    for (int i = 0; i < req->header_count; i++) {
+        const sip_header_t *hdr = &req->headers[i];
+        const char *name = hdr->id == SIP_HDR_VIA ? "Via" : hdr->id == SIP_HDR_FROM ? "From" :
+                           hdr->id == SIP_HDR_TO ? "To" : hdr->id == SIP_HDR_CALL_ID ? "Call-ID" :
+                           hdr->id == SIP_HDR_CSEQ ? "CSeq" : NULL;
+        if (!name) continue;
+        append(buf, size, &len, "%s: %.*s", name, (int)hdr->value.len, req->buf + hdr->value.off);
+        if (hdr->id == SIP_HDR_TO && to_tag && sip_header_param(req, hdr, "tag", &tag) != 0) {
+            append(buf, size, &len, ";tag=%s", to_tag);
+        }
+        append(buf, size, &len, "\r\n");
+    }
+    append(buf, size, &len, "Server: sip_gateway_emu\r\n%s", extra_headers ? extra_headers : "");
+    if (body) {
+        append(buf, size, &len, "Content-Type: application/sdp\r\n");
+    }
+    append(buf, size, &len, "Content-Length: %zu\r\n\r\n%s", body ? strlen(body) : (size_t)0, body ? body : "");
+    return len;
+}
+
+static void respond(const sip_msg_t *req, const struct sockaddr_in *to, const char *status, const char *to_tag,
+                    const char *extra_headers, const char *body) {
+    char buf[BUF_SIZE];
+    int len = build_response(req, status, to_tag, extra_headers, body, buf, sizeof(buf));
+    if (len > 0) emu_send(sip_fd, to, buf, len, 1, opts.delay_ms);
+}
+
+// 對 INVITE 的回應：記錄下來供 INVITE 重傳時重送
+static void respond_invite(emu_call_t *call, const char *status, const char *body) {
+    sip_msg_t invite;
+    char contact[256];
+
+    if (sip_parse_message(call->invite, call->invite_len, &invite) != 0) return;
+    snprintf(contact, sizeof(contact), "Contact: <sip:gateway@%s:%d>\r\n%s", opts.bind_ip, opts.port,
+             strncmp(status, "100", 3) == 0 ? "" : SIP_ALLOW_HEADER);
+    if (strncmp(status, "2", 1) == 0) {
+        size_t len = strlen(contact);
+        snprintf(contact + len, sizeof(contact) - len, "Record-Route: <sip:%s:%d;lr>\r\n", opts.bind_ip, opts.port);
+    }
+    int len = build_response(&invite, status, strncmp(status, "100", 3) == 0 ? NULL : call->to_tag,
+                             strncmp(status, "487", 3) == 0 ? NULL : contact, body,
+                             call->response, sizeof(call->response));
+    call->response_len = len > 0 ? len : 0;
+    if (len > 0) emu_send(sip_fd, &call->sip_peer, call->response, len, 1, opts.delay_ms);
+}
+
+static void answer_sdp(emu_call_t *call, char *buf, size_t size) {
+    sip_sdp_build_answer(buf, size, opts.bind_ip, call->rtp_port, &call->media, ++call->sdp_version);
+}
+
+// ---- 摘要認證 ----
+
+static void send_challenge(const sip_msg_t *msg, const struct sockaddr_in *from) {
+    char header[256], tag[32];
+    snprintf(header, sizeof(header),
+             "WWW-Authenticate: Digest realm=\"%s\", nonce=\"%s\", algorithm=MD5, qop=\"auth\"\r\n",
+             EMU_REALM, nonce);
+    sip_id_tag(tag, sizeof(tag));
+    respond(msg, from, "401 Unauthorized", tag, header, NULL);
+    stats.challenges++;
+}
+
+static int auth_param(const sip_msg_t *msg, const sip_header_t *hdr, const char *name, char *buf, size_t size) {
+    sip_slice_t value;
+    if (sip_header_param(msg, hdr, name, &value) != 0) {
+        buf[0] = '\0';
+        return -1;
+    }
+    return sip_slice_copy(msg, value, buf, size);
+}
+
+// 驗證 Authorization 標頭 (設定中的 username/password，支援 qop=auth)；通過返回 0
+static int check_auth(const sip_msg_t *msg) {
+    const sip_header_t *hdr = sip_msg_header_by_name(msg, "Authorization");
+    char username[64], realm[64], got_nonce[64], uri[256], response[64], qop[16], nc[16], cnonce[64];
+    char method[16], a1[256], a2[300], kd[512], ha1[33], ha2[33], expected[33];
+
+    if (!hdr) return -1;
+    if (auth_param(msg, hdr, "username", username, sizeof(username)) != 0 ||
+        auth_param(msg, hdr, "realm", realm, sizeof(realm)) != 0 ||
+        auth_param(msg, hdr, "nonce", got_nonce, sizeof(got_nonce)) != 0 ||
+        auth_param(msg, hdr, "uri", uri, sizeof(uri)) != 0 ||
+        auth_param(msg, hdr, "response", response, sizeof(response)) != 0 ||
+        strcmp(username, USERNAME) != 0 || strcmp(realm, EMU_REALM) != 0 || strcmp(got_nonce, nonce) != 0) {
+        return -1;
+    }
+    auth_param(msg, hdr, "qop", qop, sizeof(qop));
+    auth_param(msg, hdr, "nc", nc, sizeof(nc));
+    auth_param(msg, hdr, "cnonce", cnonce, sizeof(cnonce));
+    sip_slice_copy(msg, msg->method, method, sizeof(method));
+
+    snprintf(a1, sizeof(a1), "%s:%s:%s", USERNAME, EMU_REALM, PASSWORD);
+    md5(a1, ha1);
+    snprintf(a2, sizeof(a2), "%s:%s", method, uri);
+    md5(a2, ha2);
+    if (qop[0]) {
+        snprintf(kd, sizeof(kd), "%s:%s:%s:%s:%s:%s", ha1, nonce, nc, cnonce, qop, ha2);
+    } else {
+        snprintf(kd, sizeof(kd), "%s:%s:%s", ha1, nonce, ha2);
+    }
+    md5(kd, expected);
+    return strcasecmp(expected, response) == 0 ? 0 : -1;
+}
+
+// 未通過認證時回應 401；返回 0 表示可以繼續處理
+static int require_auth(const sip_msg_t *msg, const struct sockaddr_in *from) {
+    if (!opts.auth) return 0;
+    if (check_auth(msg) == 0) return 0;
+    if (sip_msg_header_by_name(msg, "Authorization")) stats.auth_failures++;
+    send_challenge(msg, from);
+    return -1;
+}
+
+// ---- 請求處理 ----
+
+static void on_invite(const sip_msg_t *msg, const struct sockaddr_in *from) {
+    emu_call_t *call = find_call(msg);
+    char sdp[1024];
+    sip_sdp_t offer;
+    sip_media_t media;
+
+    if (call && msg->cseq_num == call->invite_cseq) {
+        // INVITE 重傳：重送最後一個回應
+        stats.invite_retransmits++;
+        if (call->response_len > 0) emu_send(sip_fd, from, call->response, call->response_len, 1, 0);
+        return;
+    }
+
+    sip_media_init(&media, &from->sin_addr, 0);
+    int has_offer = msg->body.len > 0 &&
+                    sip_sdp_parse(msg->buf + msg->body.off, msg->body.len, &offer) == 0 &&
+                    sip_sdp_negotiate(&offer, &from->sin_addr, SIP_SDP_DEFAULT_PTIME, &media) == 0;
+
+    if (call) {
+        // 對話中的 re-INVITE：接受新的 offer (沒有 offer 時沿用目前的媒體)
+        if (msg->body.len > 0 && !has_offer) {
+            respond(msg, from, "488 Not Acceptable Here", call->to_tag, NULL, NULL);
+            return;
+        }
+        if (has_offer) call->media = media;
+        answer_sdp(call, sdp, sizeof(sdp));
+        respond(msg, from, "200 OK", call->to_tag, SIP_ALLOW_HEADER, sdp);
+        return;
+    }
+
+    if (require_auth(msg, from) != 0) return;
+
+    if (!has_offer) {
+        respond(msg, from, "488 Not Acceptable Here", "emu", NULL, NULL);
+        stats.rejected++;
+        return;
+    }
+    for (int i = 0; i < EMU_MAX_CALLS && !call; i++) {
+        if (calls[i].state == EMU_CALL_FREE) call = &calls[i];
+    }
+    if (!call || msg->len > (int)sizeof(call->invite)) {
+        respond(msg, from, "503 Service Unavailable", "emu", NULL, NULL);
+        stats.rejected++;
+        return;
+    }
+
+    int index = (int)(call - calls);
+    memset(call, 0, sizeof(*call));
+    call->rtp_port = opts.rtp_base_port + 2 * index;
+    call->rtp_fd = open_udp(opts.bind_ip, call->rtp_port);
+    if (call->rtp_fd < 0) {
+        log_with_timestamp("錯誤: 無法綁定 RTP 端口 %s:%d: %s\n", opts.bind_ip, call->rtp_port, strerror(errno));
+        respond(msg, from, "503 Service Unavailable", "emu", NULL, NULL);
+        stats.rejected++;
+        return;
+    }
+    sip_msg_header_value(msg, SIP_HDR_CALL_ID, call->callid, sizeof(call->callid));
+    sip_id_tag(call->to_tag, sizeof(call->to_tag));
+    memcpy(call->invite, msg->buf, msg->len);
+    call->invite_len = msg->len;
+    call->invite_cseq = msg->cseq_num;
+    call->sip_peer = *from;
+    call->media = media;
+    call->ssrc = sip_id_ssrc();
+    call->state = EMU_CALL_RINGING;
+    stats.calls++;
+
+    if (!opts.quiet) {
+        log_with_timestamp("通話 #%d %s: 對方媒體 %s:%d (%s/%d, %d ms)，本地 RTP 端口 %d\n",
+                           index, call->callid, inet_ntoa(media.remote_addr), media.remote_port,
+                           media.encoding, media.clock_rate, media.ptime, call->rtp_port);
+    }
+
+    respond_invite(call, "100 Trying", NULL);
+    answer_sdp(call, sdp, sizeof(sdp));
+    respond_invite(call, "183 Session Progress", sdp);
+    call->answer_due_us = sip_now_us() + (uint64_t)opts.ring_ms * 1000;
+}
+
+static void answer_call(emu_call_t *call, uint64_t now) {
+    char sdp[1024];
+
+    answer_sdp(call, sdp, sizeof(sdp));
+    respond_invite(call, "200 OK", sdp);
+    call->state = EMU_CALL_ANSWERED;
+    call->retx_interval_ms = SIP_T1_MS;
+    call->retx_due_us = now + SIP_T1_MS * 1000;
+    call->retx_deadline_us = now + 64 * SIP_T1_MS * 1000;
+    call->next_rtp_us = now;
+    stats.answered++;
+}
+
+// 對話內請求 (2xx 的 ACK 與 BYE) 應以 200 的 Contact 為 Request-URI，並帶上 Record-Route 的路由
+static void check_target(const emu_call_t *call, const sip_msg_t *msg) {
+    char uri[128], route[128], expect_uri[128], expect_route[128];
+
+    snprintf(expect_uri, sizeof(expect_uri), "sip:gateway@%s:%d", opts.bind_ip, opts.port);
+    snprintf(expect_route, sizeof(expect_route), "<sip:%s:%d;lr>", opts.bind_ip, opts.port);
+    if (sip_slice_copy(msg, msg->request_uri, uri, sizeof(uri)) != 0 || strcmp(uri, expect_uri) != 0 ||
+        sip_msg_header_value(msg, SIP_HDR_ROUTE, route, sizeof(route)) != 0 || strcmp(route, expect_route) != 0) {
+        stats.bad_targets++;
+        if (!opts.quiet) {
+            log_with_timestamp("通話 #%d %s: 對話內請求的目標錯誤 (Request-URI %s)\n", (int)(call - calls),
+                               call->callid, uri);
+        }
+    }
+}
+
+static void on_ack(const sip_msg_t *msg) {
+    emu_call_t *call = find_call(msg);
+    if (!call || msg->cseq_num != call->invite_cseq) return;
+
+    if (call->state == EMU_CALL_ANSWERED) {
+        check_target(call, msg);
+        call->state = EMU_CALL_CONFIRMED;
+        stats.confirmed++;
+    } else if (call->state == EMU_CALL_CANCELLED) {
+        free_call(call);
+    }
+}
+
+static void on_bye(const sip_msg_t *msg, const struct sockaddr_in *from) {
+    emu_call_t *call = find_call(msg);
+    if (!call) {
+        respond(msg, from, "481 Call/Transaction Does Not Exist", "emu", NULL, NULL);
+        return;
+    }
+    respond(msg, from, "200 OK", call->to_tag, NULL, NULL);
+    check_target(call, msg);
+    if (!opts.quiet) log_with_timestamp("通話 #%d %s 結束 (BYE)\n", (int)(call - calls), call->callid);
+    stats.ended++;
+    free_call(call);
+}
+
+static void on_cancel(const sip_msg_t *msg, const struct sockaddr_in *from, uint64_t now) {
+    emu_call_t *call = find_call(msg);
+    if (!call) {
+        respond(msg, from, "481 Call/Transaction Does Not Exist", "emu", NULL, NULL);
+        return;
+    }
+    respond(msg, from, "200 OK", call->to_tag, NULL, NULL);
+    if (call->state != EMU_CALL_RINGING) return;
+
+    respond_invite(call, "487 Request Terminated", NULL);
+    call->state = EMU_CALL_CANCELLED;
+    call->retx_interval_ms = SIP_T1_MS;
+    call->retx_due_us = now + SIP_T1_MS * 1000;
+    call->retx_deadline_us = now + 64 * SIP_T1_MS * 1000;
+    stats.cancelled++;
+}
+
+static void on_register(const sip_msg_t *msg, const struct sockaddr_in *from) {
+    char contact[256], expires[16], extra[320];
+
+    if (require_auth(msg, from) != 0) return;
+    if (sip_msg_header_value(msg, SIP_HDR_EXPIRES, expires, sizeof(expires)) != 0) {
+        snprintf(expires, sizeof(expires), "3600");
+    }
+    if (sip_msg_header_value(msg, SIP_HDR_CONTACT, contact, sizeof(contact)) == 0) {
+        snprintf(extra, sizeof(extra), "Contact: %s;expires=%s\r\n", contact, expires);
+    } else {
+        extra[0] = '\0';
+    }
+    respond(msg, from, "200 OK", "emu", extra, NULL);
+    stats.registers++;
+}
+
+static void on_sip_message(const char *data, int len, const struct sockaddr_in *from, uint64_t now) {
+    sip_msg_t msg;
+
+    stats.sip_in++;
+    if (sip_parse_message(data, len, &msg) != 0 || msg.is_response) return;
+
+    if (sip_slice_equals(&msg, msg.method, "INVITE")) {
+        on_invite(&msg, from);
+    } else if (sip_slice_equals(&msg, msg.method, "ACK")) {
+        on_ack(&msg);
+    } else if (sip_slice_equals(&msg, msg.method, "BYE")) {
+        on_bye(&msg, from);
+    } else if (sip_slice_equals(&msg, msg.method, "CANCEL")) {
+        on_cancel(&msg, from, now);
+    } else if (sip_slice_equals(&msg, msg.method, "REGISTER")) {
+        on_register(&msg, from);
+    } else if (sip_slice_equals(&msg, msg.method, "OPTIONS")) {
+        respond(&msg, from, "200 OK", "emu", SIP_ALLOW_HEADER, NULL);
+    } else {
+        respond(&msg, from, "501 Not Implemented", "emu", NULL, NULL);
+    }
+}
+
+// ---- RTP ----
+
+static void on_rtp(emu_call_t *call) {
+    char buf[BUF_SIZE];
+    ssize_t n;
+
+    while ((n = recv(call->rtp_fd, buf, sizeof(buf), 0)) > 0) {
+        stats.rtp_in++;
+        if (opts.rtp_mode == EMU_RTP_ECHO && call->media.remote_port > 0) {
+            struct sockaddr_in dest = { .sin_family = AF_INET, .sin_addr = call->media.remote_addr,
+                                        .sin_port = htons(call->media.remote_port) };
+            emu_send(call->rtp_fd, &dest, buf, (int)n, 0, 0);
+        }
+    }
+}
+
+// 產生模式：從接通開始每 ptime 發送一個測試音封包
+static void send_tone(emu_call_t *call, uint64_t now) {
+    unsigned char packet[sizeof(rtp_header_t) + RTP_PACKET_MAX];
+    int samples = call->media.clock_rate / 1000 * call->media.ptime;
+    struct sockaddr_in dest = { .sin_family = AF_INET, .sin_addr = call->media.remote_addr,
+                                .sin_port = htons(call->media.remote_port) };
+
+    if (samples <= 0 || samples > RTP_PACKET_MAX || call->media.remote_port <= 0) return;
+    while (call->next_rtp_us <= now) {
+        unsigned char *payload = packet + sizeof(rtp_header_t);
+        init_rtp_header((rtp_header_t *)packet, call->media.payload_type, call->seq++, call->timestamp, call->ssrc);
+        for (int i = 0; i < samples; i++) {
+            payload[i] = tone[call->tone_pos];
+            call->tone_pos = (call->tone_pos + 1) % EMU_TONE_BYTES;
+        }
+        if (call->media.payload_type == 8) rtp_ulaw_to_alaw(payload, samples);
+        emu_send(call->rtp_fd, &dest, packet, sizeof(rtp_header_t) + samples, 0, 0);
+        call->timestamp += samples;
+        call->next_rtp_us += (uint64_t)call->media.ptime * 1000;
+    }
+}
+
+// ---- 計時 ----
+
+// 處理到期的應答、重傳與 RTP；返回下一個到期時間
+static uint64_t run_timers(uint64_t now) {
+    uint64_t next = now + 100 * 1000;
+
+    queue_flush(now);
+    if (queue_len > 0 && queue[0]->due_us < next) next = queue[0]->due_us;
+
+    for (int i = 0; i < EMU_MAX_CALLS; i++) {
+        emu_call_t *call = &calls[i];
+        if (call->state == EMU_CALL_FREE) continue;
+
+        if (call->state == EMU_CALL_RINGING && call->answer_due_us <= now) {
+            answer_call(call, now);
+        }
+        if (call->state == EMU_CALL_ANSWERED || call->state == EMU_CALL_CANCELLED) {
+            if (call->retx_deadline_us <= now) {
+                // 沒有收到 ACK (Timer H)：放棄通話
+                if (call->state == EMU_CALL_ANSWERED) {
+                    stats.ack_timeouts++;
+                    if (!opts.quiet) log_with_timestamp("通話 #%d %s 未收到 ACK，放棄\n", i, call->callid);
+                }
+                free_call(call);
+                continue;
+            }
+            if (call->retx_due_us <= now) {
+                emu_send(sip_fd, &call->sip_peer, call->response, call->response_len, 1, 0);
+                stats.response_retransmits++;
+                call->retx_interval_ms = call->retx_interval_ms * 2 > EMU_T2_MS ? EMU_T2_MS : call->retx_interval_ms * 2;
+                call->retx_due_us = now + (uint64_t)call->retx_interval_ms * 1000;
+            }
+            if (call->retx_due_us < next) next = call->retx_due_us;
+        }
+        if (call->state == EMU_CALL_RINGING && call->answer_due_us < next) {
+            next = call->answer_due_us;
+        }
+        if (opts.rtp_mode == EMU_RTP_TONE &&
+            (call->state == EMU_CALL_ANSWERED || call->state == EMU_CALL_CONFIRMED)) {
+            send_tone(call, now);
+            if (call->next_rtp_us < next) next = call->next_rtp_us;
+        }
+    }
+    return next;
+}
+
+static void print_stats(void) {
+    log_with_timestamp("統計: 通話 %lu (接通 %lu，收到 ACK %lu，BYE 結束 %lu，取消 %lu，未收到 ACK %lu，拒絕 %lu)，REGISTER %lu\n",
+                       stats.calls, stats.answered, stats.confirmed, stats.ended, stats.cancelled,
+                       stats.ack_timeouts, stats.rejected, stats.registers);
+    log_with_timestamp("  SIP 收 %lu / 發 %lu，INVITE 重傳 %lu，回應重傳 %lu，認證挑戰 %lu (失敗 %lu)，對話內請求目標錯誤 %lu\n",
+                       stats.sip_in, stats.sip_out, stats.invite_retransmits, stats.response_retransmits,
+                       stats.challenges, stats.auth_failures, stats.bad_targets);
+    log_with_timestamp("  RTP 收 %lu / 發 %lu；故障注入: 丟棄 %lu，重複 %lu，亂序 %lu，延遲 %lu\n",
+                       stats.rtp_in, stats.rtp_out, stats.dropped, stats.duplicated, stats.reordered, stats.delayed);
+}
+
+static void on_signal(int sig) {
+    (void)sig;
+    running = 0;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+        "用法: %s [選項]\n"
+        "  -f <設定檔>     SIP 設定檔 (監聽地址取 sip_server:sip_port，認證取 username/password)\n"
+        "  -a <地址>       監聽地址 (預設 sip_server)\n"
+        "  -p <端口>       SIP 端口 (預設 sip_port)\n"
+        "  -P <端口>       RTP 起始端口 (預設 %d，第 n 通使用 +2n)\n"
+        "  -N              不要求摘要認證\n"
+        "  -b <毫秒>       183 到 200 的振鈴時間 (預設 %d)\n"
+        "  -m <模式>       RTP: echo 回送 (預設)、tone 產生 1kHz 測試音、none\n"
+        "  -d <毫秒>       每個 SIP 回應的延遲\n"
+        "  -L <百分比>     發出封包的丟包率\n"
+        "  -J <毫秒>       發出封包的抖動上限\n"
+        "  -R <百分比>     發出封包的亂序率 (被選中的封包延後 %d ms + 抖動上限)\n"
+        "  -D <百分比>     發出封包的重複率\n"
+        "  -S <範圍>       故障注入套用於 sip、rtp 或 all (預設)\n"
+        "  -q              只在結束時輸出統計\n",
+        prog, opts.rtp_base_port, opts.ring_ms, EMU_REORDER_MS);
+}
+
+int main(int argc, char *argv[]) {
+    const char *config_path = NULL;
+    const char *bind_ip = NULL;
+    int c;
+
+    while ((c = getopt(argc, argv, "f:a:p:P:Nb:m:d:L:J:R:D:S:qh")) != -1) {
+        switch (c) {
+        case 'f': config_path = optarg; break;
+        case 'a': bind_ip = optarg; break;
+        case 'p': opts.port = atoi(optarg); break;
+        case 'P': opts.rtp_base_port = atoi(optarg); break;
+        case 'N': opts.auth = 0; break;
+        case 'b': opts.ring_ms = atoi(optarg); break;
+        case 'm':
+            opts.rtp_mode = strcmp(optarg, "tone") == 0 ? EMU_RTP_TONE :
+                            strcmp(optarg, "none") == 0 ? EMU_RTP_NONE : EMU_RTP_ECHO;
+            break;
+        case 'd': opts.delay_ms = atoi(optarg); break;
+        case 'L': opts.loss = atof(optarg) / 100.0; break;
+        case 'J': opts.jitter_ms = atoi(optarg); break;
+        case 'R': opts.reorder = atof(optarg) / 100.0; break;
+        case 'D': opts.dup = atof(optarg) / 100.0; break;
+        case 'S':
+            opts.faults_sip = strcmp(optarg, "rtp") != 0;
+            opts.faults_rtp = strcmp(optarg, "sip") != 0;
+            break;
+        case 'q': opts.quiet = 1; break;
+        default: usage(argv[0]); return c == 'h' ? 0 : 1;
+        }
+    }
+
+    // 安靜模式：函式庫的日誌丟棄，結束時恢復標準輸出再輸出統計
+    int saved_stdout = -1;
+    if (opts.quiet) {
+        fflush(stdout);
+        saved_stdout = dup(STDOUT_FILENO);
+        if (!freopen("/dev/null", "w", stdout)) opts.quiet = 0;
+    }
+
+    if (sip_config_load(config_path) != 0) {
+        fprintf(stderr, "載入設定失敗\n");
+        return 1;
+    }
+    opts.bind_ip = bind_ip ? bind_ip : SIP_SERVER;
+    if (opts.port <= 0) opts.port = SIP_PORT;
+    if (opts.ring_ms < 0 || opts.delay_ms < 0 || opts.jitter_ms < 0 ||
+        opts.rtp_base_port <= 0 || opts.rtp_base_port + 2 * EMU_MAX_CALLS > 65535) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    sip_fd = open_udp(opts.bind_ip, opts.port);
+    if (sip_fd < 0) {
+        log_with_timestamp("錯誤: 無法綁定 SIP 端口 %s:%d: %s\n", opts.bind_ip, opts.port, strerror(errno));
+        return 1;
+    }
+    for (int i = 0; i < EMU_MAX_CALLS; i++) calls[i].rtp_fd = -1;
+    sip_id_tag(nonce, sizeof(nonce));
+
+    FILE *tone_file = fmemopen(tone, sizeof(tone), "w");
+    if (tone_file) {
+        generate_test_audio(tone_file, EMU_TONE_BYTES / 8);
+        fclose(tone_file);
+    }
+
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+    signal(SIGPIPE, SIG_IGN);
+
+    log_with_timestamp("SIP 網關模擬器監聽 %s:%d (認證%s，振鈴 %d ms，RTP %s，端口 %d 起)\n",
+                       opts.bind_ip, opts.port, opts.auth ? "開啟" : "關閉", opts.ring_ms,
+                       opts.rtp_mode == EMU_RTP_ECHO ? "回送" : opts.rtp_mode == EMU_RTP_TONE ? "測試音" : "不發送",
+                       opts.rtp_base_port);
+    log_with_timestamp("故障注入 (%s%s): 丟包 %.1f%%，抖動 %d ms，亂序 %.1f%%，重複 %.1f%%，回應延遲 %d ms\n",
+                       opts.faults_sip ? "SIP " : "", opts.faults_rtp ? "RTP" : "",
+                       opts.loss * 100, opts.jitter_ms, opts.reorder * 100, opts.dup * 100, opts.delay_ms);
+
+    struct pollfd fds[EMU_MAX_CALLS + 1];
+    int fd_call[EMU_MAX_CALLS + 1];
+    char buf[BUF_SIZE];
+
+    while (running) {
+        uint64_t now = sip_now_us();
+        uint64_t next = run_timers(now);
+        int timeout_ms = next > now ? (int)((next - now + 999) / 1000) : 0;
+
+        int nfds = 0;
+        fds[nfds].fd = sip_fd;
+        fds[nfds].events = POLLIN;
+        fd_call[nfds++] = -1;
+        for (int i = 0; i < EMU_MAX_CALLS; i++) {
+            if (calls[i].state == EMU_CALL_FREE || calls[i].rtp_fd < 0) continue;
+            fds[nfds].fd = calls[i].rtp_fd;
+            fds[nfds].events = POLLIN;
+            fd_call[nfds++] = i;
+        }
+
+        int ready = poll(fds, nfds, timeout_ms);
+        if (ready < 0) {
+            if (errno == EINTR) continue;
+            log_with_timestamp("poll 錯誤: %s\n", strerror(errno));
+            break;
+        }
+        if (ready == 0) continue;
+
+        now = sip_now_us();
+        if (fds[0].revents & POLLIN) {
+            struct sockaddr_in from;
+            socklen_t from_len = sizeof(from);
+            ssize_t n;
+            while ((n = recvfrom(sip_fd, buf, sizeof(buf) - 1, 0, (struct sockaddr *)&from, &from_len)) > 0) {
+                buf[n] = '\0';
+                on_sip_message(buf, (int)n, &from, now);
+                from_len = sizeof(from);
+            }
+        }
+        for (int i = 1; i < nfds; i++) {
+            emu_call_t *call = &calls[fd_call[i]];
+            // 處理 SIP 訊息時通話可能已結束 (BYE)
+            if ((fds[i].revents & POLLIN) && call->state != EMU_CALL_FREE && call->rtp_fd == fds[i].fd) {
+                on_rtp(call);
+            }
+        }
+    }
+
+    if (saved_stdout >= 0) {
+        fflush(stdout);
+        dup2(saved_stdout, STDOUT_FILENO);
+        close(saved_stdout);
+    }
+    print_stats();
+    for (int i = 0; i < EMU_MAX_CALLS; i++) {
+        if (calls[i].state != EMU_CALL_FREE) free_call(&calls[i]);
+    }
+    while (queue_len > 0) free(queue_pop());
+    close(sip_fd);
+    return stats.bad_targets > 0 ? 1 : 0;
+}
@@ -0,0 +1,414 @@
+// sip_loadgen.c - 呼叫速率負載產生器：以設定的 CPS、並發數與通話保持時間發起呼叫 (類似 SIPp 的 UAC 情境)，
+// 報告實際 CPS、呼叫建立延遲百分位數、失敗狀態碼與每通 CPU 時間。
+// 使用 -g 時在進程內啟動回環替身網關 (INVITE 回應 100/200 與 SDP，BYE 回應 200)，不需網路即可在 CI 中執行。
+#include "lib/sip_client.h"
+#include "lib/sip_dialog.h"
+#include "lib/sip_metrics.h"
+#include "lib/sip_id.h"
+#include "lib/sip_transaction.h"
+#include <getopt.h>
+#include <sys/resource.h>
+#include <poll.h>
+
+#define LOADGEN_RTP_PAYLOAD 160          // 20ms PCMU
+#define LOADGEN_DRAIN_MS (64 * SIP_T1_MS + 10000)   // 停止發起後等待通話結束的額外時間 (涵蓋 INVITE 的 Timer B)
+
+typedef struct {
+    long total_calls;
+    double rate;
+    int concurrency;
+    int hold_ms;
+    int media;
+    int local_gateway;
+    const char *callee;
+    const char *log_path;
+} loadgen_options_t;
+
+static loadgen_options_t opts = { 100, 10.0, 100, 1000, 0, 0, "loadtest", "/dev/null" };
+static FILE *report;
+
+// 統計 (事件循環線程寫入，主線程讀取)
+static volatile int active_calls = 0;
+static volatile int peak_calls = 0;
+static volatile long answered = 0;
+static volatile long failed = 0;
+static volatile long finished = 0;
+static long status_counts[700];
+
+// 每個對話槽位的媒體狀態 (媒體線程發送 RTP)
+typedef struct {
+    volatile int active;
+    struct sockaddr_in dest;
+    unsigned short seq;
+    unsigned int timestamp;
+    unsigned int ssrc;
+} call_media_t;
+
+static call_media_t call_media[SIP_MAX_DIALOGS];
+static volatile int running = 1;
+static long rtp_sent = 0;
+
+// ---- 回環替身網關 ----
+
+static int gw_sockfd = -1;
+static int gw_rtp_sockfd = -1;
+static int gw_rtp_port = 0;
+static long gw_rtp_received = 0;
+static double gw_cpu_seconds = 0;
+
+static void gw_append(char *buf, size_t size, int *len, const char *format, ...) {
+    if (*len < 0) return;
+    va_list args;
+    va_start(args, format);
+    int n = vsnprintf(buf + *len, size - *len, format, args);
+    va_end(args);
+    *len = (n < 0 || (size_t)n >= size - *len) ? -1 : *len + n;
+}
+
+// 依請求產生回應：複製 Via/From/To/Call-ID/CSeq，To 沒有 tag 時加上 to_tag
+static int gw_respond(const sip_msg_t *req, const struct sockaddr_in *to_addr, const char *status,
+                      const char *to_tag, const char *body) {
+    char buf[BUF_SIZE];
+    int len = 0;
+    sip_slice_t tag;
+
+    gw_append(buf, sizeof(buf), &len, "SIP/2.0 %s\r\n", status);
+    for (int i = 0; i < req->header_count; i++) {
+        const sip_header_t *hdr = &req->headers[i];
+        const char *name = hdr->id == SIP_HDR_VIA ? "Via" : hdr->id == SIP_HDR_FROM ? "From" :
+                           hdr->id == SIP_HDR_TO ? "To" : hdr->id == SIP_HDR_CALL_ID ? "Call-ID" :
+                           hdr->id == SIP_HDR_CSEQ ? "CSeq" : NULL;
+        if (!name) continue;
+        gw_append(buf, sizeof(buf), &len, "%s: %.*s", name, (int)hdr->value.len, req->buf + hdr->value.off);
+        if (hdr->id == SIP_HDR_TO && to_tag && sip_header_param(req, hdr, "tag", &tag) != 0) {
+            gw_append(buf, sizeof(buf), &len, ";tag=%s", to_tag);
+        }
+        gw_append(buf, sizeof(buf), &len, "\r\n");
+    }
+    if (body) {
+        gw_append(buf, sizeof(buf), &len, "Contact: <sip:gateway@%s:%d>\r\nContent-Type: application/sdp\r\n",
+                  SIP_SERVER, SIP_PORT);
+    }
+    gw_append(buf, sizeof(buf), &len, "Content-Length: %zu\r\n\r\n%s", body ? strlen(body) : (size_t)0,
+              body ? body : "");
+    if (len < 0) return -1;
+    return sendto(gw_sockfd, buf, len, 0, (const struct sockaddr *)to_addr, sizeof(*to_addr)) < 0 ? -1 : 0;
+}
+
+static void gw_handle(const char *data, int len, const struct sockaddr_in *from) {
+    sip_msg_t msg;
+    char tag[32], sdp[512];
+
+    if (sip_parse_message(data, len, &msg) != 0 || msg.is_response) return;
+
+    if (sip_slice_equals(&msg, msg.method, "INVITE")) {
+        sip_id_tag(tag, sizeof(tag));
+        snprintf(sdp, sizeof(sdp),
+                 "v=0\r\n"
+                 "o=- 1 1 IN IP4 %s\r\n"
+                 "s=sip_loadgen\r\n"
+                 "c=IN IP4 %s\r\n"
+                 "t=0 0\r\n"
+                 "m=audio %d RTP/AVP 0 101\r\n"
+                 "a=rtpmap:0 PCMU/8000\r\n"
+                 "a=rtpmap:101 telephone-event/8000\r\n"
+                 "a=ptime:20\r\n",
+                 SIP_SERVER, SIP_SERVER, gw_rtp_port);
+        gw_respond(&msg, from, "100 Trying", NULL, NULL);
+        gw_respond(&msg, from, "200 OK", tag, sdp);
+    } else if (!sip_slice_equals(&msg, msg.method, "ACK")) {
+        // BYE、CANCEL、OPTIONS、REGISTER 一律接受
+        sip_id_tag(tag, sizeof(tag));
+        gw_respond(&msg, from, "200 OK", tag, NULL);
+    }
+}
+
+static void* gateway_thread(void *arg) {
+    char buf[BUF_SIZE];
+    char rtp_buf[RTP_PACKET_MAX + sizeof(rtp_header_t)];
+    struct sockaddr_in from;
+    (void)arg;
+
+    while (running) {
+        struct pollfd fds[2] = { { gw_sockfd, POLLIN, 0 }, { gw_rtp_sockfd, POLLIN, 0 } };
+        if (poll(fds, 2, 100) <= 0) continue;
+        if (fds[0].revents & POLLIN) {
+            socklen_t from_len = sizeof(from);
+            ssize_t n = recvfrom(gw_sockfd, buf, sizeof(buf) - 1, MSG_DONTWAIT, (struct sockaddr *)&from, &from_len);
+            if (n > 0) {
+                buf[n] = '\0';
+                gw_handle(buf, (int)n, &from);
+            }
+        }
+        if (fds[1].revents & POLLIN) {
+            while (recv(gw_rtp_sockfd, rtp_buf, sizeof(rtp_buf), MSG_DONTWAIT) > 0) {
+                gw_rtp_received++;
+            }
+        }
+    }
+
+    struct timespec cpu;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu);
+    gw_cpu_seconds = cpu.tv_sec + cpu.tv_nsec / 1e9;
+    return NULL;
+}
+
+static int bind_udp(const char *ip, int port, int *bound_port) {
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    int rcvbuf = 4 * 1024 * 1024;
+
+    if (fd < 0) return -1;
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    inet_pton(AF_INET, ip, &addr.sin_addr);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+        getsockname(fd, (struct sockaddr *)&addr, &len) != 0) {
+        close(fd);
+        return -1;
+    }
+    if (bound_port) *bound_port = ntohs(addr.sin_port);
+    return fd;
+}
+
+static int start_gateway(pthread_t *tid) {
+    gw_sockfd = bind_udp(SIP_SERVER, SIP_PORT, NULL);
+    gw_rtp_sockfd = bind_udp(SIP_SERVER, 0, &gw_rtp_port);
+    if (gw_sockfd < 0 || gw_rtp_sockfd < 0) {
+        fprintf(report, "錯誤: 無法在 %s:%d 啟動替身網關: %s\n", SIP_SERVER, SIP_PORT, strerror(errno));
+        return -1;
+    }
+    return pthread_create(tid, NULL, gateway_thread, NULL);
+}
+
+// ---- 媒體 ----
+
+// 每 20ms 向所有已接通的通話發送一個 PCMU 靜音封包 (共用一個發送socket)
+static void* media_thread(void *arg) {
+    unsigned char packet[sizeof(rtp_header_t) + LOADGEN_RTP_PAYLOAD];
+    struct timespec next;
+    int sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+    (void)arg;
+
+    memset(packet + sizeof(rtp_header_t), 0xFF, LOADGEN_RTP_PAYLOAD);
+    clock_gettime(CLOCK_MONOTONIC, &next);
+    while (running) {
+        for (int i = 0; i < SIP_MAX_DIALOGS; i++) {
+            call_media_t *m = &call_media[i];
+            if (!__atomic_load_n(&m->active, __ATOMIC_ACQUIRE)) continue;
+            init_rtp_header((rtp_header_t *)packet, 0, m->seq++, m->timestamp, m->ssrc);
+            m->timestamp += LOADGEN_RTP_PAYLOAD;
+            if (sendto(sockfd, packet, sizeof(packet), 0, (struct sockaddr *)&m->dest, sizeof(m->dest)) > 0) {
+                rtp_sent++;
+            }
+        }
+        next.tv_nsec += 20 * 1000000L;
+        if (next.tv_nsec >= 1000000000L) {
+            next.tv_sec++;
+            next.tv_nsec -= 1000000000L;
+        }
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+    }
+    close(sockfd);
+    return NULL;
+}
+
+// ---- 呼叫 ----
+
+// 通話狀態變化 (事件循環線程)
+static void on_state_change(sip_dialog_t *dialog) {
+    call_media_t *m = &call_media[dialog->index];
+
+    if (dialog->state == DIALOG_CONFIRMED) {
+        if (opts.media) {
+            memset(&m->dest, 0, sizeof(m->dest));
+            m->dest.sin_family = AF_INET;
+            m->dest.sin_addr = dialog->session.media.remote_addr;
+            m->dest.sin_port = htons(dialog->session.media.remote_port);
+            m->ssrc = sip_id_ssrc();
+            __atomic_store_n(&m->active, 1, __ATOMIC_RELEASE);
+        }
+        if (opts.hold_ms == 0) {
+            sip_dialog_hangup(dialog);
+        }
+    } else if (dialog->state == DIALOG_TERMINATED) {
+        __atomic_store_n(&m->active, 0, __ATOMIC_RELEASE);
+        int status = dialog->last_status;
+        if (status >= 200 && status < 300) {
+            answered++;
+        } else {
+            failed++;
+            status_counts[status > 0 && status < 700 ? status : 0]++;
+        }
+        sip_dialog_destroy(dialog);
+        __atomic_sub_fetch(&active_calls, 1, __ATOMIC_RELEASE);
+        __atomic_add_fetch(&finished, 1, __ATOMIC_RELEASE);
+    }
+}
+
+static void sleep_until_us(uint64_t target_us) {
+    uint64_t now = sip_now_us();
+    if (target_us > now) usleep(target_us - now);
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+        "用法: %s [選項]\n"
+        "  -n <通話數>    總通話數 (預設 %ld)\n"
+        "  -r <CPS>       每秒發起的通話數 (預設 %.0f)\n"
+        "  -c <並發數>    同時進行的通話數上限 (預設 %d，最多 %d)\n"
+        "  -H <毫秒>      接通後保持的時間 (預設 %d)\n"
+        "  -m             保持期間每通發送 20ms PCMU RTP\n"
+        "  -g             在進程內啟動回環替身網關 (設定中的 sip_server:sip_port)\n"
+        "  -t <號碼>      被叫號碼 (預設 %s)\n"
+        "  -f <設定檔>    SIP 設定檔 (未指定時 sip_server 與 local_ip 預設為 127.0.0.1)\n"
+        "  -l <檔案>      函式庫日誌輸出位置 (預設 %s)\n",
+        prog, opts.total_calls, opts.rate, opts.concurrency, SIP_MAX_DIALOGS, opts.hold_ms,
+        opts.callee, opts.log_path);
+}
+
+int main(int argc, char *argv[]) {
+    const char *config_path = NULL;
+    int c;
+
+    while ((c = getopt(argc, argv, "n:r:c:H:mgt:f:l:h")) != -1) {
+        switch (c) {
+        case 'n': opts.total_calls = atol(optarg); break;
+        case 'r': opts.rate = atof(optarg); break;
+        case 'c': opts.concurrency = atoi(optarg); break;
+        case 'H': opts.hold_ms = atoi(optarg); break;
+        case 'm': opts.media = 1; break;
+        case 'g': opts.local_gateway = 1; break;
+        case 't': opts.callee = optarg; break;
+        case 'f': config_path = optarg; break;
+        case 'l': opts.log_path = optarg; break;
+        default: usage(argv[0]); return c == 'h' ? 0 : 1;
+        }
+    }
+    if (opts.total_calls <= 0 || opts.rate <= 0 || opts.hold_ms < 0 ||
+        opts.concurrency <= 0 || opts.concurrency > SIP_MAX_DIALOGS) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    // 報告寫到原本的標準輸出，函式庫日誌改寫到 -l 指定的檔案
+    report = fdopen(dup(STDOUT_FILENO), "w");
+    if (!report || !freopen(opts.log_path, "w", stdout)) {
+        fprintf(stderr, "無法開啟日誌檔 %s\n", opts.log_path);
+        return 1;
+    }
+    setvbuf(report, NULL, _IOLBF, 0);
+
+    char max_calls[16];
+    snprintf(max_calls, sizeof(max_calls), "%d", opts.concurrency);
+    setenv("SIP_CFG_SIP_SERVER", "127.0.0.1", 0);
+    setenv("SIP_CFG_LOCAL_IP", "127.0.0.1", 0);
+    setenv("SIP_CFG_MAX_CALLS", max_calls, 1);
+    // 壓測的通話不需恢復，也不可覆寫同目錄下服務器的通話快照
+    setenv("SIP_CFG_SNAPSHOT_FILE", "", 0);
+    if (sip_config_load(config_path ? config_path : "/dev/null") != 0) {
+        fprintf(report, "載入設定失敗\n");
+        return 1;
+    }
+
+    pthread_t gw_tid, media_tid;
+    if (opts.local_gateway && start_gateway(&gw_tid) != 0) return 1;
+    if (sip_dialog_table_init() != 0) {
+        fprintf(report, "錯誤: 無法初始化呼叫表 (%s:%d)\n", LOCAL_IP, LOCAL_PORT);
+        return 1;
+    }
+    if (opts.media) pthread_create(&media_tid, NULL, media_thread, NULL);
+
+    fprintf(report, "sip_loadgen: %ld 通，%.1f CPS，並發上限 %d，保持 %d ms%s，網關 %s:%d%s\n",
+            opts.total_calls, opts.rate, opts.concurrency, opts.hold_ms, opts.media ? "，發送 RTP" : "",
+            SIP_SERVER, SIP_PORT, opts.local_gateway ? " (進程內替身)" : "");
+
+    struct rusage ru_start, ru_end;
+    getrusage(RUSAGE_SELF, &ru_start);
+    uint64_t t0 = sip_now_us();
+    long started = 0, create_failures = 0, throttled = 0;
+
+    // 開放式排程：第 i 通在 t0 + i/CPS 發起；達到並發上限時延後
+    for (long i = 0; i < opts.total_calls; i++) {
+        sleep_until_us(t0 + (uint64_t)(i * 1e6 / opts.rate));
+        if (__atomic_load_n(&active_calls, __ATOMIC_ACQUIRE) >= opts.concurrency) {
+            throttled++;
+            while (__atomic_load_n(&active_calls, __ATOMIC_ACQUIRE) >= opts.concurrency) usleep(1000);
+        }
+
+        sip_dialog_t *dialog = sip_dialog_create(opts.callee);
+        if (!dialog) {
+            create_failures++;
+            continue;
+        }
+        dialog->on_state_change = on_state_change;
+        dialog->max_duration_ms = opts.hold_ms;   // 接通後到期自動發送 BYE
+        int now_active = __atomic_add_fetch(&active_calls, 1, __ATOMIC_ACQ_REL);
+        if (now_active > peak_calls) peak_calls = now_active;
+        if (sip_dialog_start_call(dialog) != 0) {
+            __atomic_sub_fetch(&active_calls, 1, __ATOMIC_RELEASE);
+            sip_dialog_destroy(dialog);
+            create_failures++;
+            continue;
+        }
+        started++;
+    }
+    uint64_t t_issued = sip_now_us();
+
+    uint64_t deadline = t_issued + (uint64_t)(opts.hold_ms + SIP_NO_ANSWER_TIMEOUT_MS + LOADGEN_DRAIN_MS) * 1000;
+    while (__atomic_load_n(&finished, __ATOMIC_ACQUIRE) < started && sip_now_us() < deadline) {
+        usleep(10000);
+    }
+    uint64_t t_end = sip_now_us();
+    getrusage(RUSAGE_SELF, &ru_end);
+
+    running = 0;
+    if (opts.media) pthread_join(media_tid, NULL);
+    if (opts.local_gateway) pthread_join(gw_tid, NULL);
+
+    double issue_s = (t_issued - t0) / 1e6;
+    double total_s = (t_end - t0) / 1e6;
+    double user_s = (ru_end.ru_utime.tv_sec - ru_start.ru_utime.tv_sec) +
+                    (ru_end.ru_utime.tv_usec - ru_start.ru_utime.tv_usec) / 1e6;
+    double sys_s = (ru_end.ru_stime.tv_sec - ru_start.ru_stime.tv_sec) +
+                   (ru_end.ru_stime.tv_usec - ru_start.ru_stime.tv_usec) / 1e6;
+    double ua_cpu = user_s + sys_s - gw_cpu_seconds;
+    long unfinished = started - finished;
+
+    fprintf(report, "\n發起 %ld 通 (本地拒絕 %ld，因並發上限延後 %ld)，耗時 %.2f 秒：發起 %.1f CPS\n",
+            started, create_failures, throttled, issue_s, issue_s > 0 ? started / issue_s : 0);
+    fprintf(report, "接通 %ld，失敗 %ld，未結束 %ld，峰值並發 %d，總耗時 %.2f 秒：接通 %.1f CPS\n",
+            answered, failed, unfinished, peak_calls, total_s, total_s > 0 ? answered / total_s : 0);
+
+    sip_phase_stats_t setup;
+    if (sip_metrics_get(SIP_PHASE_SETUP, &setup) == 0 && setup.count > 0) {
+        fprintf(report, "呼叫建立延遲 (INVITE -> 200 OK): p50 %.2f ms，p99 %.2f ms，p99.9 %.2f ms，最大 %.2f ms\n",
+                setup.p50_us / 1000.0, setup.p99_us / 1000.0, setup.p999_us / 1000.0, setup.max_us / 1000.0);
+    }
+    if (failed > 0) {
+        fprintf(report, "失敗狀態碼:");
+        for (int code = 0; code < 700; code++) {
+            if (status_counts[code]) fprintf(report, " %d x%ld", code, status_counts[code]);
+        }
+        fprintf(report, "\n");
+    }
+    fprintf(report, "CPU: 用戶 %.3f 秒，系統 %.3f 秒 (替身網關 %.3f 秒)，UA 每通 %.3f ms\n",
+            user_s, sys_s, gw_cpu_seconds, started > 0 ? ua_cpu * 1000 / started : 0);
+    if (opts.media) {
+        fprintf(report, "RTP: 發送 %ld 個封包%s", rtp_sent, opts.local_gateway ? "" : "\n");
+        if (opts.local_gateway) fprintf(report, "，替身網關收到 %ld 個\n", gw_rtp_received);
+    }
+
+    char table[2048];
+    if (sip_metrics_format(table, sizeof(table)) > 0) {
+        fprintf(report, "\n%s", table);
+    }
+
+    sip_dialog_table_shutdown();
+    if (gw_sockfd >= 0) close(gw_sockfd);
+    if (gw_rtp_sockfd >= 0) close(gw_rtp_sockfd);
+    return failed == 0 && unfinished == 0 && create_failures == 0 ? 0 : 1;
+}
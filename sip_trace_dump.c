@@ -0,0 +1,297 @@
+// sip_trace_dump.c - 解碼 SIP/RTP 事件追蹤檔案 (見 lib/sip_trace.h)：合併各線程的環形緩衝區，
+// 依時間順序輸出 SIP 起始行與 Call-ID、CSeq，RTP 頭與對話狀態變化。
+// 可讀取執行中進程的檔案 (-f 持續輸出新記錄)，也可讀取崩潰後留下的檔案。
+#include "lib/sip_trace.h"
+#include "lib/sip_dialog.h"
+#include <getopt.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+
+#define DUMP_POLL_MS 200                  // -f 模式的輪詢間隔
+#define DUMP_CALLIDS 256                  // -c 模式記住的 Call-ID 數 (槽位重複使用時每通一個)
+
+typedef struct {
+    int count;                            // 每個緩衝區最多輸出的最新記錄數 (0 表示全部)
+    int call;                             // 只輸出指定對話槽位 (-1 表示全部)
+    int follow;
+    int rtp;                              // 是否輸出 RTP 記錄
+} dump_options_t;
+
+static dump_options_t opts = { 0, -1, 0, 1 };
+static volatile sig_atomic_t running = 1;
+
+// -c 模式：SIP 記錄沒有槽位，以該槽位對話狀態記錄中的 Call-ID 比對
+static char callids[DUMP_CALLIDS][SIP_TRACE_SLICE + 1];
+static int callid_count = 0;
+
+static const char *dialog_state_names[] = {
+    [DIALOG_FREE] = "FREE",
+    [DIALOG_CALLING] = "CALLING",
+    [DIALOG_EARLY] = "EARLY",
+    [DIALOG_CONFIRMED] = "CONFIRMED",
+    [DIALOG_TERMINATING] = "TERMINATING",
+    [DIALOG_TERMINATED] = "TERMINATED",
+};
+
+static const char *event_names[SIP_TRACE_EVENT_COUNT] = {
+    [SIP_TRACE_SIP_TX] = "SIP>",
+    [SIP_TRACE_SIP_RX] = "SIP<",
+    [SIP_TRACE_RTP_TX] = "RTP>",
+    [SIP_TRACE_RTP_RX] = "RTP<",
+    [SIP_TRACE_DIALOG] = "DLG ",
+    [SIP_TRACE_SIP_RETRANSMIT] = "RETX",
+    [SIP_TRACE_SIP_RESEND] = "RSND",
+};
+
+static void on_signal(int sig) {
+    (void)sig;
+    running = 0;
+}
+
+// 以序號檢查複製一筆記錄：複製前後序號都等於 index + 1 才是完整且未被覆寫的記錄
+static int read_record(const sip_trace_ring_t *ring, uint64_t index, sip_trace_record_t *out) {
+    const sip_trace_record_t *rec = &ring->records[index % SIP_TRACE_RING_RECORDS];
+
+    if (__atomic_load_n(&rec->seq, __ATOMIC_ACQUIRE) != index + 1) return -1;
+    memcpy(out, rec, sizeof(*out));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&rec->seq, __ATOMIC_RELAXED) != index + 1) return -1;
+    if (out->type == 0 || out->type >= SIP_TRACE_EVENT_COUNT || out->slice_len > SIP_TRACE_SLICE) return -1;
+    return 0;
+}
+
+static void remember_callid(const sip_trace_record_t *rec) {
+    char id[SIP_TRACE_SLICE + 1];
+
+    snprintf(id, sizeof(id), "%.*s", rec->slice_len, rec->slice);
+    for (int i = 0; i < callid_count && i < DUMP_CALLIDS; i++) {
+        if (strcmp(callids[i], id) == 0) return;
+    }
+    memcpy(callids[callid_count % DUMP_CALLIDS], id, sizeof(id));
+    callid_count++;
+}
+
+// SIP 記錄的第二行為 "Call-ID: ..." (或緊湊形式 "i: ...")
+static int record_matches_call(const sip_trace_record_t *rec) {
+    if (rec->type == SIP_TRACE_DIALOG) return rec->call == opts.call;
+    if (rec->type != SIP_TRACE_SIP_TX && rec->type != SIP_TRACE_SIP_RX) return 0;
+
+    const char *end = rec->slice + rec->slice_len;
+    const char *line = memchr(rec->slice, '\n', rec->slice_len);
+    if (!line) return 0;
+    line++;
+    const char *colon = memchr(line, ':', end - line);
+    if (!colon) return 0;
+    const char *id = colon + 1;
+    while (id < end && *id == ' ') id++;
+    const char *eol = memchr(id, '\n', end - id);
+    size_t len = (eol ? eol : end) - id;
+
+    for (int i = 0; i < callid_count && i < DUMP_CALLIDS; i++) {
+        if (strlen(callids[i]) == len && memcmp(callids[i], id, len) == 0) return 1;
+    }
+    return 0;
+}
+
+static int compare_time(const void *a, const void *b) {
+    const sip_trace_record_t *x = (const sip_trace_record_t *)a;
+    const sip_trace_record_t *y = (const sip_trace_record_t *)b;
+    if (x->time_ns != y->time_ns) return x->time_ns < y->time_ns ? -1 : 1;
+    return x->tid < y->tid ? -1 : x->tid > y->tid;
+}
+
+static void print_record(const sip_trace_header_t *header, const sip_trace_record_t *rec) {
+    int64_t real_ns = (int64_t)rec->time_ns + header->realtime_offset_ns;
+    time_t sec = (time_t)(real_ns / 1000000000LL);
+    struct tm tm;
+    char when[32];
+    char peer[32] = "-";
+
+    localtime_r(&sec, &tm);
+    strftime(when, sizeof(when), "%H:%M:%S", &tm);
+    if (rec->addr) {
+        struct in_addr addr = { rec->addr };
+        snprintf(peer, sizeof(peer), "%s:%u", inet_ntoa(addr), rec->port);
+    }
+    printf("%s.%06ld %6u %s ", when, (long)(real_ns % 1000000000LL) / 1000, rec->tid, event_names[rec->type]);
+    if (rec->call >= 0) printf("#%-3d ", rec->call); else printf("     ");
+
+    switch (rec->type) {
+    case SIP_TRACE_SIP_TX:
+    case SIP_TRACE_SIP_RX: {
+        // 第一行為起始行，其餘行 (Call-ID、CSeq) 接在同一行後面
+        const char *p = rec->slice;
+        const char *end = rec->slice + rec->slice_len;
+        const char *eol = memchr(p, '\n', end - p);
+        printf("%s %u 字節 %.*s", peer, rec->len, (int)((eol ? eol : end) - p), p);
+        while (eol) {
+            p = eol + 1;
+            eol = memchr(p, '\n', end - p);
+            printf(" | %.*s", (int)((eol ? eol : end) - p), p);
+        }
+        printf("\n");
+        break;
+    }
+    case SIP_TRACE_RTP_TX:
+    case SIP_TRACE_RTP_RX: {
+        const unsigned char *h = (const unsigned char *)rec->slice;
+        if (rec->slice_len < 12) {
+            printf("%s 本地端口 %u，%u 字節 (RTP 頭不完整)\n", peer, rec->aux, rec->len);
+            break;
+        }
+        printf("%s 本地端口 %u，%u 字節 PT=%u%s seq=%u ts=%u ssrc=%08x\n", peer, rec->aux, rec->len,
+               h[1] & 0x7F, (h[1] & 0x80) ? " M" : "",
+               (h[2] << 8) | h[3],
+               ((uint32_t)h[4] << 24) | ((uint32_t)h[5] << 16) | ((uint32_t)h[6] << 8) | h[7],
+               ((uint32_t)h[8] << 24) | ((uint32_t)h[9] << 16) | ((uint32_t)h[10] << 8) | h[11]);
+        break;
+    }
+    case SIP_TRACE_DIALOG:
+        printf("%s Call-ID %.*s\n",
+               rec->aux < sizeof(dialog_state_names) / sizeof(dialog_state_names[0]) ? dialog_state_names[rec->aux] : "?",
+               rec->slice_len, rec->slice);
+        break;
+    case SIP_TRACE_SIP_RETRANSMIT:
+        printf("重傳 %.*s，間隔 %u ms\n", rec->slice_len, rec->slice, rec->aux);
+        break;
+    case SIP_TRACE_SIP_RESEND:
+        printf("收到重傳，重發 %.*s (%u)\n", rec->slice_len, rec->slice, rec->aux);
+        break;
+    }
+}
+
+// 收集各緩衝區從 next[r] 到目前寫入位置的記錄，依時間排序後輸出；返回輸出的記錄數
+// (執行中的進程可能已分配新的緩衝區，批次空間隨已分配的緩衝區數增加)
+static int dump_pass(const sip_trace_file_t *file, uint64_t *next) {
+    static sip_trace_record_t *batch = NULL;
+    static uint32_t batch_rings = 0;
+    int n = 0;
+    int lost = 0;
+    uint32_t rings = __atomic_load_n(&file->header.rings_used, __ATOMIC_ACQUIRE);
+
+    if (rings > batch_rings) {
+        sip_trace_record_t *grown = realloc(batch, sizeof(sip_trace_record_t) * SIP_TRACE_RING_RECORDS * rings);
+        if (!grown) {
+            fprintf(stderr, "記憶體不足\n");
+            return 0;
+        }
+        batch = grown;
+        batch_rings = rings;
+    }
+    for (uint32_t r = 0; r < rings; r++) {
+        const sip_trace_ring_t *ring = &file->rings[r];
+        uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        uint64_t start = next[r];
+
+        // 已被覆寫的記錄無法讀取
+        if (head > start + SIP_TRACE_RING_RECORDS) {
+            lost += (int)(head - SIP_TRACE_RING_RECORDS - start);
+            start = head - SIP_TRACE_RING_RECORDS;
+        }
+        for (uint64_t i = start; i < head; i++) {
+            if (read_record(ring, i, &batch[n]) != 0) continue;
+            if (!opts.rtp && (batch[n].type == SIP_TRACE_RTP_TX || batch[n].type == SIP_TRACE_RTP_RX)) continue;
+            if (opts.call >= 0 && batch[n].type == SIP_TRACE_DIALOG && batch[n].call == opts.call) {
+                remember_callid(&batch[n]);
+            }
+            n++;
+        }
+        next[r] = head;
+    }
+
+    qsort(batch, n, sizeof(batch[0]), compare_time);
+    int printed = 0;
+    for (int i = 0; i < n; i++) {
+        if (opts.call >= 0 && !record_matches_call(&batch[i])) continue;
+        print_record(&file->header, &batch[i]);
+        printed++;
+    }
+    if (lost > 0 && opts.follow) {
+        printf("... 讀取跟不上寫入，略過 %d 筆記錄\n", lost);
+    }
+    fflush(stdout);
+    return printed;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+        "用法: %s [選項] <追蹤檔案>\n"
+        "  -n <數量>       每個線程只輸出最新的 N 筆記錄 (預設全部，每個線程最多 %d 筆)\n"
+        "  -c <槽位>       只輸出指定對話槽位的對話狀態與 SIP 訊息 (依 Call-ID 比對)\n"
+        "  -S              不輸出 RTP 記錄\n"
+        "  -f              輸出現有記錄後持續輸出新記錄 (Ctrl+C 結束)\n",
+        prog, SIP_TRACE_RING_RECORDS);
+}
+
+int main(int argc, char *argv[]) {
+    struct stat st;
+    int c;
+
+    while ((c = getopt(argc, argv, "n:c:Sfh")) != -1) {
+        switch (c) {
+        case 'n': opts.count = atoi(optarg); break;
+        case 'c': opts.call = atoi(optarg); break;
+        case 'S': opts.rtp = 0; break;
+        case 'f': opts.follow = 1; break;
+        default: usage(argv[0]); return c == 'h' ? 0 : 1;
+        }
+    }
+    if (optind >= argc || opts.count < 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    const char *path = argv[optind];
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        fprintf(stderr, "無法開啟追蹤檔案 %s: %s\n", path, strerror(errno));
+        return 1;
+    }
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t)SIP_TRACE_FILE_SIZE(0)) {
+        fprintf(stderr, "%s 不是追蹤檔案 (大小不符)\n", path);
+        close(fd);
+        return 1;
+    }
+    // 映射所有緩衝區的地址範圍 (檔案隨緩衝區分配延長，只讀取 rings_used 個)
+    const sip_trace_file_t *file = mmap(NULL, sizeof(sip_trace_file_t), PROT_READ, MAP_SHARED | MAP_NORESERVE, fd, 0);
+    close(fd);
+    if (file == MAP_FAILED) {
+        fprintf(stderr, "無法映射追蹤檔案 %s: %s\n", path, strerror(errno));
+        return 1;
+    }
+
+    const sip_trace_header_t *header = &file->header;
+    if (header->magic != SIP_TRACE_MAGIC || header->version != SIP_TRACE_VERSION ||
+        header->record_size != sizeof(sip_trace_record_t) || header->rings != SIP_TRACE_MAX_RINGS ||
+        header->ring_records != SIP_TRACE_RING_RECORDS ||
+        st.st_size < (off_t)SIP_TRACE_FILE_SIZE(header->rings_used)) {
+        fprintf(stderr, "%s 的格式或版本不符 (magic %08x，版本 %u)\n", path, header->magic, header->version);
+        return 1;
+    }
+
+    // 之後才分配的緩衝區從頭讀取
+    static uint64_t next[SIP_TRACE_MAX_RINGS];
+    uint32_t rings = __atomic_load_n(&header->rings_used, __ATOMIC_ACQUIRE);
+    for (uint32_t r = 0; r < rings; r++) {
+        uint64_t head = __atomic_load_n(&file->rings[r].head, __ATOMIC_ACQUIRE);
+        next[r] = opts.count > 0 && head > (uint64_t)opts.count ? head - opts.count : 0;
+    }
+
+    printf("追蹤檔案 %s (進程 %u，%u 個緩衝區)\n", path, header->pid, rings);
+    int total = dump_pass(file, next);
+
+    if (opts.follow) {
+        signal(SIGINT, on_signal);
+        signal(SIGTERM, on_signal);
+        while (running) {
+            usleep(DUMP_POLL_MS * 1000);
+            total += dump_pass(file, next);
+        }
+    }
+
+    fprintf(stderr, "共 %d 筆記錄\n", total);
+    munmap((void *)file, sizeof(sip_trace_file_t));
+    return 0;
+}
@@ -5,26 +5,45 @@
 #include <fcntl.h>
 #include <sys/stat.h>
 #include <sys/types.h>
-#include <sys/wait.h>
 #include <unistd.h>
 #include <errno.h>
 #include <time.h>
 #include <sched.h>
 #include <stdint.h>
 #include "lib/sip_client.h"
+#include "lib/sip_dialog.h"
+#include "lib/sip_register.h"
+#include "lib/sip_metrics.h"
+#include "lib/sip_admission.h"
+#include "lib/sip_snapshot.h"
+#include "lib/sip_id.h"
+#include "lib/sip_pacer.h"
+#include "lib/sip_media_cache.h"
 
-// WebSocket 服務端配置
-#define WS_PORT 8080
+// WebSocket 服務端配置 (端口與通話時長見 sip_config.h)
 #define MAX_PAYLOAD (200 * 1024)  // 200KB，足夠處理大部分 WAV 檔案
-#define RTP_LISTEN_TIMEOUT 300  // 通話最長持續時間（秒）
 #define MAX_FILE_SIZE (1024 * 1024)  // 最大 1MB WAV 檔案
 #define UPLOAD_DIR "uploaded_wavs"  // 上傳檔案目錄
+#define WS_OUT_QUEUE_MAX 1024  // 待發送消息上限，客戶端跟不上時丟棄新的消息
 
 // 全局變量
 static struct lws_context *context;
-static struct lws *client_wsi = NULL;
+static struct lws *client_wsi = NULL;  // 以 ws_out_lock 保護 (只在服務線程設定)
 static volatile int force_exit = 0;
-static pthread_t sip_thread;
+static volatile int latest_call_index = -1;  // 最近建立的通話，PLAY_WAV 未指定通話時使用
+static sip_registration_t *registrations[SIP_MAX_TRUNKS];  // 向每個中繼 (或 sip_server) 的註冊，背景自動更新
+static int registration_count = 0;
+
+// 各通話正在播放的 RTP 節拍器串流 (0 表示沒有)：通話結束時立即停止發送
+static int audio_streams[SIP_MAX_DIALOGS];
+static sip_prompt_t *audio_prompts[SIP_MAX_DIALOGS];   // 正在播放的提示音 (媒體改變時換用另一種編碼)
+static pthread_mutex_t audio_stream_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// 播放中的音頻 (串流結束時由節拍器通知並釋放快取項目的引用)
+typedef struct {
+    sip_prompt_t *prompt;
+    int dialog_index;
+} audio_playback_t;
 
 // 消息緩衝區用於處理分片消息
 typedef struct {
@@ -35,9 +54,20 @@ typedef struct {
 } message_buffer_t;
 
 static message_buffer_t msg_buffer = {NULL, 0, 0, 0};
-static volatile int sip_call_active = 0;
-static sip_session_t session;
-static volatile int rtp_packets_received = 0;
+
+// 待發送到客戶端的消息：lws_write 只能在服務線程調用，其他線程 (反應器回調、各通話的 RTP 接收線程)
+// 把消息放入佇列並喚醒服務線程，由 LWS_CALLBACK_SERVER_WRITEABLE 逐條寫出
+typedef struct ws_out_message {
+    struct ws_out_message *next;
+    size_t len;
+    unsigned char buf[];   // LWS_PRE 字節的預留空間 + 消息內容
+} ws_out_message_t;
+
+static ws_out_message_t *ws_out_head = NULL;
+static ws_out_message_t *ws_out_tail = NULL;
+static int ws_out_count = 0;
+static unsigned long ws_out_dropped = 0;
+static pthread_mutex_t ws_out_lock = PTHREAD_MUTEX_INITIALIZER;
 
 // Base64 解碼表
 static const unsigned char base64_decode_table[256] = {
@@ -60,7 +90,10 @@ static const unsigned char base64_decode_table[256] = {
 };
 
 // 自定義 RTP 處理回調函數的聲明
-void custom_rtp_callback(const unsigned char *rtp_data, size_t data_size);
+void custom_rtp_callback(void *user_data, const unsigned char *rtp_data, size_t data_size);
+void send_ws_text(const char *text);
+static void send_ws_message(const char *text, size_t len);
+static void ws_out_flush(void);
 
 // Base64 解碼函數
 unsigned char* base64_decode(const char* encoded_data, size_t input_length, size_t *output_length) {
@@ -128,163 +161,60 @@ int save_uploaded_wav(const char *filename, const unsigned char *data, size_t si
     }
     
     log_with_timestamp("成功保存上傳檔案: %s (%zu 字節)\n", filepath, size);
+    
+    // 預先轉為 RTP 負載放入快取，播放時不再讀檔 (失敗時播放時會再嘗試並記錄原因)
+    sip_media_cache_store(filepath, data, size);
     return 0;
 }
 
-// RTP 音頻傳送線程
-void* rtp_audio_thread(void *arg) {
-    void **args = (void**)arg;
-    int sockfd = *((int*)args[0]);
-    struct sockaddr_in *dest_addr = (struct sockaddr_in*)args[1];
-    const char *wav_file = (const char*)args[2];
-    int dest_port = *((int*)args[3]);
-    const char *callid = (const char*)args[4];
-    const char *tag = (const char*)args[5];
-    const char *to_tag = (const char*)args[6];
-    const char *cseq = (const char*)args[7];
-    struct sockaddr_in *servaddr = (struct sockaddr_in*)args[8];
-    int shared_rtp_sockfd = *((int*)args[9]);  // 共享的RTP socket
-    
-    log_with_timestamp("RTP 音頻傳送線程啟動，播放檔案: %s\n", wav_file);
-    
-    // 設置較低的線程優先級，確保接收線程優先
-    struct sched_param param;
-    param.sched_priority = 1;  // 設置較低優先級
-    if (pthread_setschedparam(pthread_self(), SCHED_OTHER, &param) == 0) {
-        log_with_timestamp("RTP發送線程優先級已降低\n");
-    } else {
-        log_with_timestamp("警告: 無法設置RTP發送線程優先級\n");
+// 音頻發送結束 (播放完成或失敗時在節拍線程中調用，被停止時在停止的線程中調用)
+static void on_audio_done(int stream, sip_pacer_result_t result, unsigned long packets, void *user_data) {
+    audio_playback_t *playback = (audio_playback_t *)user_data;
+
+    pthread_mutex_lock(&audio_stream_lock);
+    if (audio_streams[playback->dialog_index] == stream) {
+        audio_streams[playback->dialog_index] = 0;
+        audio_prompts[playback->dialog_index] = NULL;
     }
-    
-    // **進程分離方案**: 使用子進程處理RTP發送，避免與接收線程競爭資源
-    log_with_timestamp("使用子進程分離RTP發送，避免資源競爭...\n");
-    
-    pid_t audio_pid = fork();
-    
-    if (audio_pid == 0) {
-        // 子進程：專門處理RTP發送
-        log_with_timestamp("RTP發送子進程啟動，PID: %d\n", getpid());
-        
-        // 創建獨立的發送socket
-        int rtp_sockfd = shared_rtp_sockfd;  // 直接使用共享的RTP socket
-        if (rtp_sockfd < 0) {
-            log_with_timestamp("子進程：無效的共享RTP socket: %d\n", rtp_sockfd);
-            exit(1);
-        }
-        
-        log_with_timestamp("子進程：使用共享RTP socket %d，無需重新綁定端口\n", rtp_sockfd);
-        
-        // 打開WAV文件
-        FILE *wav_fp = fopen(wav_file, "rb");
-        if (!wav_fp) {
-            log_with_timestamp("子進程：無法打開 WAV 文件: %s\n", strerror(errno));
-            close(rtp_sockfd);
-            exit(1);
-        }
-        
-        // 跳過WAV文件頭
-        fseek(wav_fp, 64, SEEK_SET);
-        
-        // 設置目標地址 - 使用SIP協商確定的端口
-        dest_addr->sin_port = htons(dest_port);  // 直接使用協商的端口
-        
-        log_with_timestamp("子進程：RTP發送目標端口: %d（SIP協商確定）\n", dest_port);
-        
-        // 準備RTP包
-        unsigned char rtp_packet[172];
-        rtp_header_t *rtp_hdr = (rtp_header_t *)rtp_packet;
-        unsigned char *payload = rtp_packet + sizeof(rtp_header_t);
-        
-        unsigned short seq_num = 0;
-        unsigned int timestamp = 0;
-        unsigned int ssrc = rand();
-        
-        log_with_timestamp("子進程：開始RTP音頻發送到 %s:%d\n", 
-                          inet_ntoa(dest_addr->sin_addr), dest_port);
-        
-        int total_packets_sent = 0;
-        size_t bytes_read;
-        
-        // 正常連續播放
-        while ((bytes_read = fread(payload, 1, 160, wav_fp)) > 0) {
-            // 初始化RTP頭
-            memset(rtp_hdr, 0, sizeof(rtp_header_t));
-            init_rtp_header(rtp_hdr, 0, seq_num, timestamp, ssrc);
-            
-            // 發送RTP包
-            int packet_size = sizeof(rtp_header_t) + bytes_read;
-            ssize_t sent = sendto(rtp_sockfd, rtp_packet, packet_size, 0,
-                                 (struct sockaddr *)dest_addr, sizeof(*dest_addr));
-            
-            if (sent > 0) {
-                total_packets_sent++;
-                seq_num++;
-                timestamp += bytes_read;
-                
-                // 減少日誌頻率
-                if (total_packets_sent % 200 == 0) {
-                    log_with_timestamp("子進程：已發送 %d 個RTP包\n", total_packets_sent);
-                }
-                
-                // 標準G.711間隔
-                usleep(20000);
-                
-            } else {
-                log_with_timestamp("子進程：發送RTP包失敗: %s\n", strerror(errno));
-                break;
-            }
-        }
-        
-        log_with_timestamp("子進程：音檔播放完成，總共發送 %d 個RTP包\n", total_packets_sent);
-        
-        fclose(wav_fp);
-        // 不關閉socket，因為它是與父進程共享的
-        // close(rtp_sockfd);  
-        
-        log_with_timestamp("子進程：RTP發送完成，進程結束（共享socket未關閉）\n");
-        exit(0);  // 子進程正常結束
-        
-    } else if (audio_pid > 0) {
-        // 父進程：繼續接收RTP，同時子進程發送音頻
-        log_with_timestamp("父進程：RTP發送子進程已啟動 (PID: %d)\n", audio_pid);
-        log_with_timestamp("**關鍵**: 父子進程共享RTP socket，實現真正的雙向通話\n");
-        
-        // 等待子進程完成音頻發送
-        int status;
-        log_with_timestamp("父進程：等待子進程完成音頻發送...\n");
-        waitpid(audio_pid, &status, 0);
-        
-        if (WIFEXITED(status)) {
-            log_with_timestamp("父進程：子進程正常結束，退出碼: %d\n", WEXITSTATUS(status));
-        } else {
-            log_with_timestamp("父進程：子進程異常結束\n");
-        }
-        
-        log_with_timestamp("父進程：子進程結束，繼續正常的RTP接收...\n");
-        
+    pthread_mutex_unlock(&audio_stream_lock);
+
+    if (result == SIP_PACER_SEND_ERROR) {
+        log_with_timestamp("通話 #%d: 發送RTP包失敗，已發送 %lu 個RTP包\n", playback->dialog_index, packets);
     } else {
-        // fork失敗
-        log_with_timestamp("錯誤：無法創建RTP發送子進程: %s\n", strerror(errno));
+        log_with_timestamp("通話 #%d: 音檔播放%s，總共發送 %lu 個RTP包\n", playback->dialog_index,
+                          result == SIP_PACER_DONE ? "完成" : "已停止", packets);
     }
-    
-    // 釋放參數記憶體
-    for (int i = 0; i < 10; i++) {
-        if (args[i] && i != 2) { // 不釋放 wav_file
-            free(args[i]);
-        }
+    sip_media_cache_release(playback->prompt);
+    free(playback);
+}
+
+// 停止通話正在播放的音頻：返回後不再發送，可關閉通話的 RTP socket
+static void stop_audio(int dialog_index) {
+    pthread_mutex_lock(&audio_stream_lock);
+    int stream = audio_streams[dialog_index];
+    audio_streams[dialog_index] = 0;
+    audio_prompts[dialog_index] = NULL;
+    pthread_mutex_unlock(&audio_stream_lock);
+
+    if (stream > 0) {
+        sip_pacer_stop(stream);
     }
-    free(args);
-    
-    log_with_timestamp("RTP 音頻傳送線程結束\n");
-    return NULL;
 }
 
-// 播放指定的 WAV 檔案
-int play_wav_file(const char *filename) {
-    if (!sip_call_active) {
+// 在指定通話上播放 WAV 檔案
+int play_wav_file(sip_dialog_t *dialog, const char *filename) {
+    if (!dialog || dialog->state != DIALOG_CONFIRMED || !dialog->rtp) {
         log_with_timestamp("沒有活躍的通話，無法播放音頻\n");
         return -1;
     }
+    sip_session_t *session = &dialog->session;
+    
+    // 對方在 SDP 中表示不接收 (sendonly/inactive/保持) 時不發送媒體
+    if (session->media.direction == SIP_SDP_RECVONLY || session->media.direction == SIP_SDP_INACTIVE) {
+        log_with_timestamp("通話 #%d 的媒體方向為 %s，不發送音頻\n",
+                          dialog->index, sip_sdp_direction_name(session->media.direction));
+        return -1;
+    }
     
     // 檢查檔案是否存在
     char filepath[512];
@@ -295,144 +225,277 @@ int play_wav_file(const char *filename) {
         return -1;
     }
     
-    log_with_timestamp("開始播放 WAV 檔案: %s\n", filepath);
-    
-    // 創建 RTP 目標地址
-    struct sockaddr_in rtp_dest_addr;
-    memset(&rtp_dest_addr, 0, sizeof(rtp_dest_addr));
-    rtp_dest_addr.sin_family = AF_INET;
-    rtp_dest_addr.sin_addr.s_addr = inet_addr(SIP_SERVER);
-    
-    // 使用對方在SIP回應中指定的RTP端口
-    rtp_dest_addr.sin_port = htons(session.remote_rtp_port);
-    
-    // 創建音頻播放線程（內部會使用fork創建子進程）
-    void **audio_args = (void**)malloc(10 * sizeof(void*));
-    audio_args[0] = malloc(sizeof(int));
-    *((int*)audio_args[0]) = session.sockfd;
+    log_with_timestamp("通話 #%d 開始播放 WAV 檔案: %s\n", dialog->index, filepath);
     
-    audio_args[1] = malloc(sizeof(struct sockaddr_in));
-    memcpy(audio_args[1], &rtp_dest_addr, sizeof(struct sockaddr_in));
-    
-    audio_args[2] = strdup(filepath);  // 使用完整路徑
-    
-    audio_args[3] = malloc(sizeof(int));
-    *((int*)audio_args[3]) = session.remote_rtp_port;
-    
-    audio_args[4] = strdup(session.callid);
-    audio_args[5] = strdup(session.tag);
-    audio_args[6] = strdup(session.to_tag);
-    audio_args[7] = strdup(session.cseq);
-    
-    audio_args[8] = malloc(sizeof(struct sockaddr_in));
-    memcpy(audio_args[8], &session.servaddr, sizeof(struct sockaddr_in));
+    // 上傳時已轉為兩種編碼的負載，所有通話共用同一份 (不讀檔也不轉碼)
+    audio_playback_t *playback = calloc(1, sizeof(audio_playback_t));
+    if (!playback || !(playback->prompt = sip_media_cache_acquire(filepath))) {
+        free(playback);
+        return -1;
+    }
+    playback->dialog_index = dialog->index;
+    const unsigned char *payload = sip_prompt_payload(playback->prompt, session->media.payload_type);
+    if (!payload) {
+        log_with_timestamp("通話 #%d: 不支援的編碼 PT %d，無法播放\n", dialog->index, session->media.payload_type);
+        sip_media_cache_release(playback->prompt);
+        free(playback);
+        return -1;
+    }
     
-    // 新增：傳遞RTP socket文件描述符
-    audio_args[9] = malloc(sizeof(int));
-    int current_rtp_sockfd = get_rtp_sockfd();  // 獲取當前RTP socket
-    *((int*)audio_args[9]) = current_rtp_sockfd;  // 傳遞RTP socket給子進程
+    // 每個封包的樣本數由協商的 ptime 決定 (G.711 每個樣本 1 字節)
+    sip_pacer_stream_params_t params;
+    memset(&params, 0, sizeof(params));
+    params.packet_bytes = (size_t)session->media.clock_rate / 1000 * session->media.ptime;
+    params.ptime = session->media.ptime;
+    if (params.packet_bytes == 0 || params.packet_bytes > RTP_PACKET_MAX) {
+        params.packet_bytes = RTP_PACKET_SIZE;
+        params.ptime = RTP_PACKET_SIZE / 8;
+    }
     
-    // 創建音頻處理線程（線程內部會fork子進程）
-    pthread_t audio_thread;
-    if (pthread_create(&audio_thread, NULL, rtp_audio_thread, audio_args) == 0) {
-        log_with_timestamp("音頻處理線程已創建，正在播放: %s\n", filename);
-        
-        // 分離線程，讓它在背景中執行
-        pthread_detach(audio_thread);
-        
-        return 0;
-    } else {
-        log_with_timestamp("創建音頻處理線程失敗\n");
-        // 釋放參數記憶體
-        for (int i = 0; i < 10; i++) {
-            if (audio_args[i]) {
-                free(audio_args[i]);
-            }
-        }
-        free(audio_args);
+    // 使用對方在SIP回應中指定的RTP地址與端口 (經由不同網關的通話各自的媒體地址)，
+    // 從接收器的 socket 發出 (對稱 RTP)，接收器鎖定實際來源後改送到該地址
+    params.sockfd = rtp_receiver_get_sockfd(dialog->rtp);
+    params.dest.sin_family = AF_INET;
+    params.dest.sin_addr = session->media.remote_addr;
+    params.dest.sin_port = htons(session->media.remote_port);
+    params.latch = rtp_receiver_latch(dialog->rtp);
+    params.payload = payload;
+    params.length = sip_prompt_length(playback->prompt);
+    params.payload_type = session->media.payload_type;
+    params.ssrc = sip_id_ssrc();
+    params.done = on_audio_done;
+    params.user_data = playback;
+    log_with_timestamp("通話 #%d: 編碼 %s (PT %d)，每包 %zu 字節 (%d ms)，發送到 %s:%d\n",
+                      dialog->index, session->media.encoding, session->media.payload_type,
+                      params.packet_bytes, params.ptime, inet_ntoa(params.dest.sin_addr), session->media.remote_port);
+    
+    // 新的音頻取代仍在播放的音頻；開始與記錄在同一個鎖內，通話結束時必定能停止這個串流
+    stop_audio(dialog->index);
+    pthread_mutex_lock(&audio_stream_lock);
+    int stream = sip_pacer_start(&params);
+    if (stream > 0) {
+        audio_streams[dialog->index] = stream;
+        audio_prompts[dialog->index] = playback->prompt;
+    }
+    pthread_mutex_unlock(&audio_stream_lock);
+    if (stream < 0) {
+        log_with_timestamp("通話 #%d: 無法開始發送音頻\n", dialog->index);
+        sip_media_cache_release(playback->prompt);
+        free(playback);
         return -1;
     }
+    return 0;
 }
 
-// SIP 通話線程函數
-void* sip_call_thread(void* arg) {
-    const char *callee = (const char*)arg;
-    int rtp_timeout_counter = 0;
-    
-    log_with_timestamp("SIP 線程啟動，準備撥打電話到 %s\n", callee);
-    
-    // 初始化 SIP 會話
-    if (init_sip_session(&session) != 0) {
-        log_with_timestamp("初始化 SIP 會話失敗\n");
-        sip_call_active = 0;
-        free((void*)arg); // 釋放 callee_copy
-        return NULL;
+typedef struct {
+    sip_dialog_t *dialog;
+    rtp_receiver_t *rtp;
+} call_cleanup_t;
+
+// 停止接收器 (等待接收線程、關閉錄音並修復 WAV 頭，沒有收到音頻時還會產生測試音調) 後釋放對話槽位；
+// 槽位在此之前不會分配給新通話，每個槽位固定的 RTP 端口不會在舊 socket 關閉前被重新綁定
+static void* call_cleanup_thread(void *arg) {
+    call_cleanup_t *cleanup = (call_cleanup_t *)arg;
+
+    rtp_receiver_destroy(cleanup->rtp);
+    sip_dialog_destroy(cleanup->dialog);
+    sip_admission_release();
+    free(cleanup);
+    return NULL;
+}
+
+// 通話結束：磁碟 I/O 與等待線程不在事件循環線程中進行，交給獨立的線程後立即返回
+// (無法建立線程時才在目前線程中完成)
+static void release_call(sip_dialog_t *dialog) {
+    call_cleanup_t *cleanup = malloc(sizeof(call_cleanup_t));
+    pthread_t tid;
+
+    if (cleanup) {
+        cleanup->dialog = dialog;
+        cleanup->rtp = dialog->rtp;
+        dialog->rtp = NULL;
+        if (pthread_create(&tid, NULL, call_cleanup_thread, cleanup) == 0) {
+            pthread_detach(tid);
+            return;
+        }
+        dialog->rtp = cleanup->rtp;
+        free(cleanup);
     }
-    
-    // 發起 SIP 呼叫
-    if (make_sip_call(&session, callee) != 0) {
-        log_with_timestamp("SIP 呼叫失敗\n");
-        close_sip_session(&session);
-        sip_call_active = 0;
-        free((void*)arg); // 釋放 callee_copy
-        return NULL;
+    rtp_receiver_destroy(dialog->rtp);
+    dialog->rtp = NULL;
+    sip_dialog_destroy(dialog);
+    sip_admission_release();
+}
+
+// 通話狀態變化 (在 SIP 事件循環線程中調用，不為每個通話建立線程)
+static void on_call_state_change(sip_dialog_t *dialog) {
+    char notice[128];
+
+    switch (dialog->state) {
+    case DIALOG_EARLY:
+        // RTP 接收器在 INVITE 前已啟動，回鈴音與提示音直接轉送給客戶端並錄製
+        log_with_timestamp("通話 #%d: 收到 %d 早期媒體，對方 RTP 端口 %d\n",
+                          dialog->index, dialog->last_status, dialog->session.media.remote_port);
+        rtp_receiver_set_remote(dialog->rtp, &dialog->session.media);
+        snprintf(notice, sizeof(notice), "WAV_ACK:通話 #%d 早期媒體 (%d)", dialog->index, dialog->last_status);
+        send_ws_text(notice);
+        break;
+
+    case DIALOG_CONFIRMED: {
+        log_with_timestamp("通話 #%d: SIP 呼叫成功建立\n", dialog->index);
+
+        // 使用對方在SIP回應中指定的RTP端口
+        int our_rtp_port = dialog->session.local_rtp_port;  // 我們自己的端口，在SDP中已宣告
+        int their_rtp_port = dialog->session.media.remote_port;  // 對方的端口，從SDP中解析
+        log_with_timestamp("**正確配置**: 我方監聽端口 %d，對方監聽端口 %d\n",
+                          our_rtp_port, their_rtp_port);
+        rtp_receiver_set_remote(dialog->rtp, &dialog->session.media);
+        latest_call_index = dialog->index;
+
+        snprintf(notice, sizeof(notice), "WAV_ACK:通話 #%d 已接通 %s", dialog->index, dialog->callee);
+        send_ws_text(notice);
+        log_with_timestamp("保持通話並監聽 RTP 封包，最多 %d 秒，等待客戶端指令播放音頻檔案\n", sip_config()->rtp_listen_timeout);
+        break;
     }
-    
-    log_with_timestamp("SIP 呼叫成功建立\n");
-    
-    // 使用對方在SIP回應中指定的RTP端口
-    int our_rtp_port = LOCAL_RTP_PORT;  // 我們自己的端口，在SDP中已宣告
-    int their_rtp_port = session.remote_rtp_port;  // 對方的端口，從SDP中解析
-    
-    log_with_timestamp("**正確配置**: 我方監聽端口 %d，對方監聽端口 %d\n", 
-                      our_rtp_port, their_rtp_port);
-    
-    // 設置RTP回調函數
-    set_rtp_callback(custom_rtp_callback);
-    
-    // 啟動 RTP 接收器來接收對方的音頻
-    log_with_timestamp("啟動 RTP 接收器...\n");
-    start_rtp_receiver(our_rtp_port, "received_from_server.wav");
-    
-    // 不自動播放檔案，等待客戶端指令
-    log_with_timestamp("通話建立完成，等待客戶端指令播放音頻檔案\n");
-    
-    // 持續監聽 RTP 封包，不立即掛斷
-    log_with_timestamp("保持通話並監聽 RTP 封包，最多 %d 秒...\n", RTP_LISTEN_TIMEOUT);
-    
-    // 等待掛斷請求或超時
-    while (sip_call_active && rtp_timeout_counter < RTP_LISTEN_TIMEOUT) {
-        sleep(1);
-        rtp_timeout_counter++;
-        
-        // 每 10 秒顯示一次通話統計
-        if (rtp_timeout_counter % 10 == 0) {
-            log_with_timestamp("通話持續 %d 秒，已接收 %d 個 RTP 封包\n", 
-                              rtp_timeout_counter, rtp_packets_received);
+
+    case DIALOG_TERMINATING:
+        log_with_timestamp("通話 #%d: 發送 BYE 結束通話\n", dialog->index);
+        break;
+
+    case DIALOG_TERMINATED:
+        // 對方掛斷或我方結束：停止仍在發送的音頻
+        stop_audio(dialog->index);
+        if (dialog->rtp) {
+            log_with_timestamp("通話 #%d: 停止 RTP 接收，共接收 %d 個 RTP 封包\n",
+                              dialog->index, rtp_receiver_packet_count(dialog->rtp));
+        }
+        if (dialog->last_status >= 200 && dialog->last_status < 300) {
+            snprintf(notice, sizeof(notice), "WAV_ACK:通話 #%d 已結束", dialog->index);
+        } else {
+            log_with_timestamp("通話 #%d: SIP 呼叫失敗 (狀態碼 %d)\n", dialog->index, dialog->last_status);
+            snprintf(notice, sizeof(notice), "WAV_ACK:通話 #%d 呼叫 %s 失敗", dialog->index, dialog->callee);
         }
+        send_ws_text(notice);
+
+        if (latest_call_index == dialog->index) {
+            latest_call_index = -1;
+        }
+        log_with_timestamp("通話 #%d: SIP 通話結束\n", dialog->index);
+        release_call(dialog);
+        break;
+
+    default:
+        break;
     }
-    
-    log_with_timestamp("通話循環結束，準備清理資源\n");
-    
-    // 停止 RTP 接收和清除回調
-    log_with_timestamp("停止 RTP 接收...\n");
-    clear_rtp_callback();
-    stop_rtp_receiver();
-    
-    // 發送 BYE 結束通話
-    log_with_timestamp("發送 BYE 結束通話\n");
-    send_bye(session.sockfd, &session.servaddr, session.callid, 
-             session.tag, session.to_tag, session.cseq);
-    
-    // 關閉 SIP 會話
-    close_sip_session(&session);
-    
-    sip_call_active = 0;
-    rtp_packets_received = 0;
-    log_with_timestamp("SIP 通話結束\n");
-    
-    free((void*)arg); // 釋放 callee_copy
-    return NULL;
+}
+
+// 對方在通話中改變媒體 (re-INVITE/UPDATE)：接收器重新鎖定新的來源，正在播放的音頻改送到新的地址與編碼
+static void on_call_media_change(sip_dialog_t *dialog) {
+    sip_media_t *media = &dialog->session.media;
+
+    log_with_timestamp("通話 #%d: 對方媒體改為 %s:%d，編碼 %s (PT %d)，方向 %s\n", dialog->index,
+                      inet_ntoa(media->remote_addr), media->remote_port, media->encoding,
+                      media->payload_type, sip_sdp_direction_name(media->direction));
+    if (dialog->rtp) {
+        rtp_receiver_set_remote(dialog->rtp, media);
+    }
+
+    // 對方改為不接收 (保持) 時停止發送
+    if (media->direction == SIP_SDP_RECVONLY || media->direction == SIP_SDP_INACTIVE) {
+        stop_audio(dialog->index);
+        return;
+    }
+
+    struct sockaddr_in dest;
+    memset(&dest, 0, sizeof(dest));
+    dest.sin_family = AF_INET;
+    dest.sin_addr = media->remote_addr;
+    dest.sin_port = htons(media->remote_port);
+
+    // 持有鎖時提示音不會被釋放 (on_audio_done 在同一個鎖內清除)；ptime 不變，只換目的地與編碼
+    pthread_mutex_lock(&audio_stream_lock);
+    int stream = audio_streams[dialog->index];
+    const unsigned char *payload = stream > 0 ? sip_prompt_payload(audio_prompts[dialog->index], media->payload_type) : NULL;
+    int redirected = payload && sip_pacer_redirect(stream, &dest, media->payload_type, payload) == 0;
+    pthread_mutex_unlock(&audio_stream_lock);
+
+    if (stream > 0 && !redirected) {
+        log_with_timestamp("通話 #%d: 無法以新的編碼 PT %d 繼續播放，停止音頻\n", dialog->index, media->payload_type);
+        stop_audio(dialog->index);
+    }
+}
+
+// 准入結果 (在 SIP 事件循環線程中調用)：准入後在呼叫表中分配新對話，非阻塞地處理呼叫
+static void on_call_admission(sip_admit_result_t result, void *user_data) {
+    char *callee = (char *)user_data;
+    char notice[160];
+
+    if (result != SIP_ADMIT_OK) {
+        log_with_timestamp("呼叫 %s 未獲准入: %s\n", callee, sip_admission_reason(result));
+        snprintf(notice, sizeof(notice), "WAV_ACK:CALL_REJECTED:%s 呼叫 %s 被拒絕",
+                 sip_admission_reason(result), callee);
+        send_ws_text(notice);
+        free(callee);
+        return;
+    }
+
+    sip_dialog_t *dialog = sip_dialog_create(callee);
+    if (dialog) {
+        // INVITE 發出前先綁定RTP端口並啟動接收器，早期媒體與接通後的第一個封包都不會遺失
+        char output_filename[64];
+        snprintf(output_filename, sizeof(output_filename), "received_from_server_%d.wav", dialog->index);
+        dialog->rtp = rtp_receiver_create(dialog->session.local_rtp_port, output_filename,
+                                          custom_rtp_callback, dialog);
+        dialog->on_state_change = on_call_state_change;
+        dialog->on_media_change = on_call_media_change;
+        sip_dialog_set_max_duration(dialog, sip_config()->rtp_listen_timeout);
+        if (!dialog->rtp || sip_dialog_start_call(dialog) != 0) {
+            log_with_timestamp("發起 SIP 呼叫失敗\n");
+            release_call(dialog);
+            send_ws_text("WAV_ACK:發起 SIP 呼叫失敗");
+        }
+    } else {
+        log_with_timestamp("呼叫表已滿，拒絕新的通話請求\n");
+        sip_admission_release();
+        send_ws_text("WAV_ACK:CALL_REJECTED:CALL_LIMIT 通話數已達上限，無法撥打");
+    }
+    free(callee);
+}
+
+// 要求所有通話掛斷 (排隊等待准入的呼叫一併取消)
+static void hangup_all_calls(void) {
+    sip_admission_flush();
+    for (int i = 0; i < SIP_MAX_DIALOGS; i++) {
+        sip_dialog_t *dialog = sip_dialog_get(i);
+        if (dialog) {
+            sip_dialog_hangup(dialog);
+        }
+    }
+}
+
+// 向每個設定的中繼註冊 (未設定中繼時向 sip_server)：呼叫可能經由任一網關送出，每個網關都需要綁定
+static void start_registrations(void) {
+    const sip_config_t *cfg = sip_config();
+    int count = cfg->trunk_count > 0 ? cfg->trunk_count : 1;
+
+    for (int i = 0; i < count; i++) {
+        const char *host = cfg->trunk_count > 0 ? cfg->trunks[i].host : NULL;
+        int port = cfg->trunk_count > 0 ? cfg->trunks[i].port : 0;
+        sip_registration_t *reg = sip_register_create(USERNAME, SIP_REGISTER_EXPIRES, host, port);
+        if (!reg || sip_register_start(reg) != 0) {
+            log_with_timestamp("警告: 無法啟動向 %s 的註冊，通話仍可直接撥打\n", host ? host : SIP_SERVER);
+            continue;
+        }
+        registrations[registration_count++] = reg;
+    }
+}
+
+// 是否至少有一個網關已註冊
+static int any_registered(void) {
+    for (int i = 0; i < registration_count; i++) {
+        if (sip_register_get_state(registrations[i]) == REG_REGISTERED) return 1;
+    }
+    return 0;
 }
 
 // WebSocket 回調函數
@@ -442,7 +505,45 @@ static int callback_http(struct lws *wsi, enum lws_callback_reasons reason,
     switch (reason) {
         case LWS_CALLBACK_ESTABLISHED:
             log_with_timestamp("WebSocket 連接建立\n");
+            pthread_mutex_lock(&ws_out_lock);
             client_wsi = wsi;
+            pthread_mutex_unlock(&ws_out_lock);
+            break;
+            
+        case LWS_CALLBACK_EVENT_WAIT_CANCELLED:
+            // 其他線程放入了待發送消息 (lws_cancel_service 喚醒)
+            pthread_mutex_lock(&ws_out_lock);
+            if (client_wsi && ws_out_head) {
+                lws_callback_on_writable(client_wsi);
+            }
+            pthread_mutex_unlock(&ws_out_lock);
+            break;
+            
+        case LWS_CALLBACK_SERVER_WRITEABLE:
+            {
+                // 每次可寫回調只寫一條消息，還有剩餘時再次請求
+                pthread_mutex_lock(&ws_out_lock);
+                ws_out_message_t *msg = ws_out_head;
+                if (msg) {
+                    ws_out_head = msg->next;
+                    if (!ws_out_head) {
+                        ws_out_tail = NULL;
+                    }
+                    ws_out_count--;
+                }
+                int more = ws_out_head != NULL;
+                pthread_mutex_unlock(&ws_out_lock);
+                
+                if (msg) {
+                    if (lws_write(wsi, msg->buf + LWS_PRE, msg->len, LWS_WRITE_TEXT) < (int)msg->len) {
+                        log_with_timestamp("發送消息到客戶端失敗\n");
+                    }
+                    free(msg);
+                }
+                if (more) {
+                    lws_callback_on_writable(wsi);
+                }
+            }
             break;
             
         case LWS_CALLBACK_RECEIVE:
@@ -529,25 +630,30 @@ static int callback_http(struct lws *wsi, enum lws_callback_reasons reason,
                 }
                 
                 log_with_timestamp("收到打電話請求，目標號碼: %s\n", callee);
+                if (registration_count > 0 && !any_registered()) {
+                    log_with_timestamp("警告: 沒有已註冊的網關 (%d 個註冊)，仍嘗試撥打\n", registration_count);
+                }
                 
-                if (!sip_call_active) {
-                    sip_call_active = 1;
-                    rtp_packets_received = 0;
-                    
-                    // 創建 SIP 線程
-                    char *callee_copy = strdup(callee);
-                    if (pthread_create(&sip_thread, NULL, sip_call_thread, callee_copy) != 0) {
-                        log_with_timestamp("創建 SIP 線程失敗\n");
-                        sip_call_active = 0;
-                        free(callee_copy);
-                    }
-                } else {
-                    log_with_timestamp("已有通話進行中，忽略新的通話請求\n");
+                // 經由准入控制 (CPS、同時通話數與排隊) 後才分配對話並發起呼叫
+                char *pending = strdup(callee);
+                if (!pending || sip_admission_submit(on_call_admission, pending) != 0) {
+                    free(pending);
+                    send_ws_text("WAV_ACK:發起 SIP 呼叫失敗");
                 }
             }
             else if (strncmp(full_msg, "HANGUP", 6) == 0) {
-                log_with_timestamp("收到掛斷請求\n");
-                sip_call_active = 0;
+                // HANGUP 掛斷所有通話；HANGUP:<通話編號> 只掛斷指定通話
+                if (full_len > 7 && full_msg[6] == ':') {
+                    int index = atoi(full_msg + 7);
+                    sip_dialog_t *dialog = sip_dialog_get(index);
+                    log_with_timestamp("收到掛斷請求: 通話 #%d\n", index);
+                    if (dialog) {
+                        sip_dialog_hangup(dialog);
+                    }
+                } else {
+                    log_with_timestamp("收到掛斷請求: 所有通話\n");
+                    hangup_all_calls();
+                }
             }
             else if (strncmp(full_msg, "WAV_UPLOAD:", 11) == 0) {
                 // 處理 WAV 檔案上傳
@@ -581,18 +687,7 @@ static int callback_http(struct lws *wsi, enum lws_callback_reasons reason,
                                 snprintf(ack_msg, sizeof(ack_msg), "WAV_ACK:檔案 %s 上傳成功 (%zu 字節)", 
                                         filename, decoded_len);
                                 
-                                if (client_wsi) {
-                                    unsigned char buf[LWS_PRE + MAX_PAYLOAD];
-                                    unsigned char *p = &buf[LWS_PRE];
-                                    
-                                    size_t msg_len = strlen(ack_msg);
-                                    if (msg_len > MAX_PAYLOAD - 1) {
-                                        msg_len = MAX_PAYLOAD - 1;
-                                    }
-                                    
-                                    memcpy(p, ack_msg, msg_len);
-                                    lws_write(client_wsi, p, msg_len, LWS_WRITE_TEXT);
-                                }
+                                send_ws_text(ack_msg);
                             }
                             
                             free(decoded_data);
@@ -606,10 +701,23 @@ static int callback_http(struct lws *wsi, enum lws_callback_reasons reason,
                     log_with_timestamp("無效的上傳格式\n");
                 }
             }
-            else if (strncmp(full_msg, "PLAY_WAV:", 9) == 0) {
-                // 處理播放 WAV 檔案請求
+            else if (strncmp(full_msg, "PLAY_WAV:", 9) == 0 || strncmp(full_msg, "PLAY_WAV@", 9) == 0) {
+                // 處理播放 WAV 檔案請求：PLAY_WAV:<檔名> 播放到最近的通話，
+                // PLAY_WAV@<通話編號>:<檔名> 播放到指定通話
                 char *filename = full_msg + 9;
                 size_t filename_len = full_len - 9;
+                int call_index = latest_call_index;
+                
+                if (full_msg[8] == '@') {
+                    char *sep = memchr(filename, ':', filename_len);
+                    if (!sep) {
+                        log_with_timestamp("無效的播放格式\n");
+                        break;
+                    }
+                    call_index = atoi(filename);
+                    filename_len -= (sep + 1) - filename;
+                    filename = sep + 1;
+                }
                 
                 // 創建以 null 結尾的檔案名稱
                 char wav_filename[256] = {0};
@@ -627,52 +735,56 @@ static int callback_http(struct lws *wsi, enum lws_callback_reasons reason,
                     
                     log_with_timestamp("收到播放 WAV 檔案請求: %s\n", wav_filename);
                     
-                    if (play_wav_file(wav_filename) == 0) {
+                    if (play_wav_file(sip_dialog_get(call_index), wav_filename) == 0) {
                         // 發送確認消息
                         char ack_msg[300];
                         snprintf(ack_msg, sizeof(ack_msg), "WAV_ACK:開始播放檔案 %s", wav_filename);
                         
-                        if (client_wsi) {
-                            unsigned char buf[LWS_PRE + MAX_PAYLOAD];
-                            unsigned char *p = &buf[LWS_PRE];
-                            
-                            size_t msg_len = strlen(ack_msg);
-                            if (msg_len > MAX_PAYLOAD - 1) {
-                                msg_len = MAX_PAYLOAD - 1;
-                            }
-                            
-                            memcpy(p, ack_msg, msg_len);
-                            lws_write(client_wsi, p, msg_len, LWS_WRITE_TEXT);
-                        }
+                        send_ws_text(ack_msg);
                     } else {
                         // 發送錯誤消息
                         char error_msg[300];
                         snprintf(error_msg, sizeof(error_msg), "WAV_ACK:播放檔案 %s 失敗", wav_filename);
                         
-                        if (client_wsi) {
-                            unsigned char buf[LWS_PRE + MAX_PAYLOAD];
-                            unsigned char *p = &buf[LWS_PRE];
-                            
-                            size_t msg_len = strlen(error_msg);
-                            if (msg_len > MAX_PAYLOAD - 1) {
-                                msg_len = MAX_PAYLOAD - 1;
-                            }
-                            
-                            memcpy(p, error_msg, msg_len);
-                            lws_write(client_wsi, p, msg_len, LWS_WRITE_TEXT);
-                        }
+                        send_ws_text(error_msg);
                     }
                 } else {
                     log_with_timestamp("檔案名稱太長\n");
                 }
             }
+            else if (strncmp(full_msg, "METRICS", 7) == 0) {
+                // 查詢呼叫建立各階段與 RTP 發送時間的延遲統計、准入控制、RTP 鎖定、節拍器與提示音快取計數
+                char p[2048];
+                
+                int msg_len = snprintf(p, sizeof(p), "METRICS:");
+                msg_len += sip_metrics_format(p + msg_len, sizeof(p) - msg_len);
+                if (msg_len < (int)sizeof(p) - 1) {
+                    msg_len += sip_admission_format(p + msg_len, sizeof(p) - msg_len);
+                }
+                if (msg_len < (int)sizeof(p) - 1) {
+                    msg_len += rtp_latch_format(p + msg_len, sizeof(p) - msg_len);
+                }
+                if (msg_len < (int)sizeof(p) - 1) {
+                    msg_len += sip_pacer_format(p + msg_len, sizeof(p) - msg_len);
+                }
+                if (msg_len < (int)sizeof(p) - 1) {
+                    msg_len += sip_media_cache_format(p + msg_len, sizeof(p) - msg_len);
+                }
+                if (msg_len > (int)sizeof(p) - 1) {
+                    msg_len = sizeof(p) - 1;
+                }
+                send_ws_message(p, msg_len);
+            }
             }
             break;
             
         case LWS_CALLBACK_CLOSED:
             log_with_timestamp("WebSocket 連接關閉\n");
+            pthread_mutex_lock(&ws_out_lock);
             client_wsi = NULL;
-            sip_call_active = 0;
+            ws_out_flush();
+            pthread_mutex_unlock(&ws_out_lock);
+            hangup_all_calls();
             break;
             
         default:
@@ -697,71 +809,146 @@ static struct lws_protocols protocols[] = {
 void sigint_handler(int sig) {
     log_with_timestamp("收到中斷信號，正在關閉服務器...\n");
     force_exit = 1;
-    sip_call_active = 0;
     lws_cancel_service(context);
 }
 
-// 發送 RTP 數據到 WebSocket 客戶端
-void send_rtp_to_client(const unsigned char *rtp_data, size_t data_size) {
-    if (client_wsi) {
-        unsigned char buf[LWS_PRE + MAX_PAYLOAD];
-        unsigned char *p = &buf[LWS_PRE];
-        
-        // 準備消息：RTP: 前綴 + base64 編碼的 RTP 數據
-        strcpy((char*)p, "RTP:");
-        p += 4;
-        
-        // 簡單的十六進制編碼 (為了演示，實際應用中應該使用 base64)
-        for (size_t i = 0; i < data_size && (p - &buf[LWS_PRE]) < MAX_PAYLOAD - 10; i++) {
-            sprintf((char*)p, "%02X", rtp_data[i]);
-            p += 2;
-        }
-        
-        size_t msg_len = p - &buf[LWS_PRE];
-        
-        if (lws_write(client_wsi, &buf[LWS_PRE], msg_len, LWS_WRITE_TEXT) < 0) {
-            log_with_timestamp("發送 RTP 數據到客戶端失敗\n");
+// 分配一條待發送消息 (內容之前預留 LWS_PRE 字節)
+static ws_out_message_t* ws_out_alloc(size_t len) {
+    ws_out_message_t *msg = malloc(sizeof(ws_out_message_t) + LWS_PRE + len);
+    if (msg) {
+        msg->next = NULL;
+        msg->len = len;
+    }
+    return msg;
+}
+
+// 放入發送佇列並喚醒服務線程 (可從任意線程調用)；沒有客戶端或佇列已滿時丟棄
+static int ws_out_push(ws_out_message_t *msg) {
+    pthread_mutex_lock(&ws_out_lock);
+    if (!client_wsi || ws_out_count >= WS_OUT_QUEUE_MAX) {
+        unsigned long dropped = client_wsi ? ++ws_out_dropped : 0;
+        pthread_mutex_unlock(&ws_out_lock);
+        free(msg);
+        if (dropped % 1000 == 1) {
+            log_with_timestamp("WebSocket 發送佇列已滿，已丟棄 %lu 條消息\n", dropped);
         }
+        return -1;
+    }
+    if (ws_out_tail) {
+        ws_out_tail->next = msg;
+    } else {
+        ws_out_head = msg;
+    }
+    ws_out_tail = msg;
+    ws_out_count++;
+    pthread_mutex_unlock(&ws_out_lock);
+
+    // 服務線程在 LWS_CALLBACK_EVENT_WAIT_CANCELLED 中請求可寫回調
+    lws_cancel_service(context);
+    return 0;
+}
+
+// 丟棄所有待發送消息 (調用者持有 ws_out_lock)
+static void ws_out_flush(void) {
+    while (ws_out_head) {
+        ws_out_message_t *next = ws_out_head->next;
+        free(ws_out_head);
+        ws_out_head = next;
+    }
+    ws_out_tail = NULL;
+    ws_out_count = 0;
+}
+
+// 發送消息到 WebSocket 客戶端 (可從任意線程調用)
+static void send_ws_message(const char *text, size_t len) {
+    if (len > MAX_PAYLOAD - 1) {
+        len = MAX_PAYLOAD - 1;
+    }
+    ws_out_message_t *msg = ws_out_alloc(len);
+    if (!msg) {
+        return;
+    }
+    memcpy(msg->buf + LWS_PRE, text, len);
+    ws_out_push(msg);
+}
+
+// 發送文字消息到 WebSocket 客戶端
+void send_ws_text(const char *text) {
+    send_ws_message(text, strlen(text));
+}
+
+// 發送 RTP 數據到 WebSocket 客戶端 (在 RTP 接收線程中調用)
+void send_rtp_to_client(const unsigned char *rtp_data, size_t data_size) {
+    // 準備消息：RTP: 前綴 + 十六進制編碼的 RTP 數據
+    if (data_size > (MAX_PAYLOAD - 10) / 2) {
+        data_size = (MAX_PAYLOAD - 10) / 2;
     }
+    ws_out_message_t *msg = ws_out_alloc(4 + data_size * 2 + 1);
+    if (!msg) {
+        return;
+    }
+    char *p = (char *)msg->buf + LWS_PRE;
+    memcpy(p, "RTP:", 4);
+    p += 4;
+    
+    // 簡單的十六進制編碼 (為了演示，實際應用中應該使用 base64)
+    for (size_t i = 0; i < data_size; i++) {
+        sprintf(p, "%02X", rtp_data[i]);
+        p += 2;
+    }
+    msg->len = 4 + data_size * 2;
+    ws_out_push(msg);
 }
 
 // 自定義 RTP 數據處理回調函數
-void custom_rtp_callback(const unsigned char *rtp_data, size_t data_size) {
-    rtp_packets_received++;
+void custom_rtp_callback(void *user_data, const unsigned char *rtp_data, size_t data_size) {
+    sip_dialog_t *dialog = (sip_dialog_t*)user_data;
+    int rtp_packets_received = rtp_receiver_packet_count(dialog->rtp);
     
-    // 正常處理RTP數據
-    // 詳細記錄 RTP 包信息
+    // 正常處理RTP數據 (每個封包的 RTP 頭已記錄在事件追蹤中)
     if (rtp_packets_received <= 5 || rtp_packets_received % 50 == 0) {
         log_with_timestamp("接收到 RTP 封包 #%d，大小: %zu 字節\n", rtp_packets_received, data_size);
-        
-        // 顯示前 20 個字節的十六進制表示，有助於調試
-        if (data_size > 0 && rtp_packets_received <= 3) {
-            printf("  RTP 數據前12字節: ");
-            for (int i = 0; i < 12 && i < data_size; i++) {
-                printf("%02X ", rtp_data[i]);
-            }
-            printf("\n");
-        }
     }
     
     // 發送到 WebSocket 客戶端
     send_rtp_to_client(rtp_data, data_size);
 }
 
-int main(void) {
+int main(int argc, char **argv) {
     struct lws_context_creation_info info;
     
     log_with_timestamp("WebSocket SIP 音頻服務器啟動\n");
     
+    // 載入設定 (可用第一個參數或 SIP_CONFIG 環境變數指定設定檔)
+    if (sip_config_load(argc > 1 ? argv[1] : NULL) != 0) {
+        log_with_timestamp("載入設定失敗\n");
+        return -1;
+    }
+    
     // 確保上傳目錄存在
     ensure_upload_directory();
     
-    // 設置信號處理
+    // 初始化呼叫表與共享 SIP socket
+    if (sip_dialog_table_init() != 0) {
+        log_with_timestamp("初始化呼叫表失敗\n");
+        return -1;
+    }
+    
+    // 上次進程崩潰或重啟時留下的通話：WebSocket 客戶端已斷線，無法接手媒體，立即以 BYE 結束以釋放中繼
+    if (sip_snapshot_pending() > 0) {
+        sip_snapshot_recover(NULL, NULL);
+    }
+    
+    // 向網關註冊：通話沿用同一個 SIP socket 與註冊時取得的認證快取
+    start_registrations();
+    
+    // 設置信號處理 (SIGHUP 重新載入設定，不影響進行中的通話)
     signal(SIGINT, sigint_handler);
+    sip_config_watch_sighup();
     
     // 初始化 libwebsockets
     memset(&info, 0, sizeof(info));
-    info.port = WS_PORT;
+    info.port = sip_config()->ws_port;
     info.protocols = protocols;
     info.gid = -1;
     info.uid = -1;
@@ -774,7 +961,7 @@ int main(void) {
         return -1;
     }
     
-    log_with_timestamp("WebSocket 音頻服務器監聽所有網路介面上的端口 %d\n", WS_PORT);
+    log_with_timestamp("WebSocket 音頻服務器監聽所有網路介面上的端口 %d\n", sip_config()->ws_port);
     log_with_timestamp("上傳目錄: %s\n", UPLOAD_DIR);
     
     // 主循環
@@ -782,11 +969,14 @@ int main(void) {
         lws_service(context, 50);
     }
     
-    // 清理
-    if (sip_call_active) {
-        sip_call_active = 0;
-        pthread_join(sip_thread, NULL);
+    // 清理：掛斷所有通話並等待 BYE/CANCEL 完成
+    hangup_all_calls();
+    for (int waited = 0; sip_dialog_active_count() > 0 && waited < 100; waited++) {
+        usleep(100000);
     }
+    sip_register_shutdown();
+    sip_dialog_table_shutdown();
+    sip_pacer_shutdown();
     
     lws_context_destroy(context);
     log_with_timestamp("WebSocket 音頻服務器已關閉\n");
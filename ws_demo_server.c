@@ -11,11 +11,10 @@
 #include <time.h>
 #include <sched.h>
 #include "lib/sip_client.h"
+#include "lib/sip_id.h"
 
-// WebSocket 服務端配置
-#define WS_PORT 8080
+// WebSocket 服務端配置 (端口與通話時長見 sip_config.h)
 #define MAX_PAYLOAD 4096
-#define RTP_LISTEN_TIMEOUT 300  // 通話最長持續時間（秒）
 #define WAV_FILE_PATH "output_ulaw.wav"  // 默認播放的WAV文件路徑
 
 // 全局變量
@@ -24,6 +23,8 @@ static struct lws *client_wsi = NULL;
 static volatile int force_exit = 0;
 static pthread_t sip_thread;
 static volatile int sip_call_active = 0;
+static pid_t audio_child_pid = 0;  // 正在發送音頻的子進程 (0 表示沒有)，對方掛斷時立即停止
+static pthread_mutex_t audio_child_lock = PTHREAD_MUTEX_INITIALIZER;
 static sip_session_t session;
 static volatile int rtp_packets_received = 0;
 static volatile int rtp_processing_paused = 0;  // 新增：控制RTP處理的標誌
@@ -44,6 +45,7 @@ void* rtp_audio_thread(void *arg) {
     const char *cseq = (const char*)args[7];
     struct sockaddr_in *servaddr = (struct sockaddr_in*)args[8];
     int shared_rtp_sockfd = *((int*)args[9]);  // 共享的RTP socket
+    const sip_media_t *media = (const sip_media_t*)args[10];  // SDP 協商的編碼與 ptime
     
     log_with_timestamp("RTP 音頻傳送線程啟動\n");
     
@@ -125,13 +127,13 @@ void* rtp_audio_thread(void *arg) {
         log_with_timestamp("子進程：RTP發送目標端口: %d（SIP協商確定）\n", dest_port);
         
         // 準備RTP包
-        unsigned char rtp_packet[172];
+        unsigned char rtp_packet[RTP_PACKET_MAX + sizeof(rtp_header_t)];
         rtp_header_t *rtp_hdr = (rtp_header_t *)rtp_packet;
         unsigned char *payload = rtp_packet + sizeof(rtp_header_t);
         
         unsigned short seq_num = 0;
         unsigned int timestamp = 0;
-        unsigned int ssrc = rand();
+        unsigned int ssrc = sip_id_ssrc();  // 子進程中產生，fork 後自動重新播種
         
         log_with_timestamp("子進程：開始RTP音頻發送到 %s:%d\n", 
                           inet_ntoa(dest_addr->sin_addr), dest_port);
@@ -139,11 +141,22 @@ void* rtp_audio_thread(void *arg) {
         int total_packets_sent = 0;
         size_t bytes_read;
         
+        // 每個封包的樣本數由協商的 ptime 決定 (G.711 每個樣本 1 字節)
+        size_t packet_bytes = (size_t)media->clock_rate / 1000 * media->ptime;
+        if (packet_bytes == 0 || packet_bytes > RTP_PACKET_MAX) packet_bytes = RTP_PACKET_SIZE;
+        log_with_timestamp("子進程：編碼 %s (PT %d)，每包 %zu 字節 (%d ms)\n",
+                          media->encoding, media->payload_type, packet_bytes, media->ptime);
+        
         // 正常連續播放
-        while ((bytes_read = fread(payload, 1, 160, wav_fp)) > 0) {
+        while ((bytes_read = fread(payload, 1, packet_bytes, wav_fp)) > 0) {
+            // 音檔為 μ-law；協商為 PCMA 時轉碼
+            if (media->payload_type == 8) {
+                rtp_ulaw_to_alaw(payload, bytes_read);
+            }
+            
             // 初始化RTP頭
             memset(rtp_hdr, 0, sizeof(rtp_header_t));
-            init_rtp_header(rtp_hdr, 0, seq_num, timestamp, ssrc);
+            init_rtp_header(rtp_hdr, media->payload_type, seq_num, timestamp, ssrc);
             
             // 發送RTP包
             int packet_size = sizeof(rtp_header_t) + bytes_read;
@@ -160,8 +173,8 @@ void* rtp_audio_thread(void *arg) {
                     log_with_timestamp("子進程：已發送 %d 個RTP包\n", total_packets_sent);
                 }
                 
-                // 標準G.711間隔
-                usleep(20000);
+                // 標準G.711間隔 (每個樣本 125 微秒)
+                usleep(bytes_read * 125);
                 
             } else {
                 log_with_timestamp("子進程：發送RTP包失敗: %s\n", strerror(errno));
@@ -182,6 +195,9 @@ void* rtp_audio_thread(void *arg) {
         // 父進程：繼續接收RTP，同時子進程發送音頻
         log_with_timestamp("父進程：RTP發送子進程已啟動 (PID: %d)\n", audio_pid);
         log_with_timestamp("**關鍵**: 父子進程共享RTP socket，實現真正的雙向通話\n");
+        pthread_mutex_lock(&audio_child_lock);
+        audio_child_pid = audio_pid;
+        pthread_mutex_unlock(&audio_child_lock);
         
         // 父進程監控RTP接收狀態，檢測何時中斷
         log_with_timestamp("父進程：繼續接收RTP，同時監控接收狀態...\n");
@@ -209,6 +225,12 @@ void* rtp_audio_thread(void *arg) {
         // 等待子進程完成音頻發送
         int status;
         log_with_timestamp("父進程：等待子進程完成音頻發送...\n");
+        // 先等待結束但不回收：殭屍進程保留 PID，掛斷時的 kill 不會誤殺重用此 PID 的進程
+        siginfo_t info;
+        waitid(P_PID, audio_pid, &info, WEXITED | WNOWAIT);
+        pthread_mutex_lock(&audio_child_lock);
+        audio_child_pid = 0;
+        pthread_mutex_unlock(&audio_child_lock);
         waitpid(audio_pid, &status, 0);
         
         if (WIFEXITED(status)) {
@@ -226,7 +248,7 @@ void* rtp_audio_thread(void *arg) {
     
 cleanup:
     // 釋放參數記憶體
-    for (int i = 0; i < 10; i++) {
+    for (int i = 0; i < 11; i++) {
         if (args[i] && i != 2) { // 不釋放 wav_file
             free(args[i]);
         }
@@ -255,9 +277,23 @@ void* sip_call_thread(void* arg) {
         return NULL;
     }
     
+    // INVITE 發出前先綁定RTP端口並啟動接收器，早期媒體 (回鈴音、提示音) 與接通後的第一個封包都不會遺失
+    set_rtp_callback(custom_rtp_callback);
+    log_with_timestamp("啟動 RTP 接收器...\n");
+    if (start_rtp_receiver(LOCAL_RTP_PORT, "received_from_server.wav") != 0) {
+        log_with_timestamp("啟動 RTP 接收器失敗\n");
+        clear_rtp_callback();
+        close_sip_session(&session);
+        sip_call_active = 0;
+        free((void*)arg); // 釋放 callee_copy
+        return NULL;
+    }
+    
     // 發起 SIP 呼叫
     if (make_sip_call(&session, callee) != 0) {
         log_with_timestamp("SIP 呼叫失敗\n");
+        clear_rtp_callback();
+        stop_rtp_receiver();
         close_sip_session(&session);
         sip_call_active = 0;
         free((void*)arg); // 釋放 callee_copy
@@ -270,35 +306,30 @@ void* sip_call_thread(void* arg) {
     struct sockaddr_in rtp_dest_addr;
     memset(&rtp_dest_addr, 0, sizeof(rtp_dest_addr));
     rtp_dest_addr.sin_family = AF_INET;
-    rtp_dest_addr.sin_addr.s_addr = inet_addr(SIP_SERVER);
+    rtp_dest_addr.sin_addr = session.media.remote_addr;
     
-    // 使用對方在SIP回應中指定的RTP端口
-    rtp_dest_addr.sin_port = htons(session.remote_rtp_port);
+    // 使用對方在SIP回應中指定的RTP地址與端口 (經由不同網關的通話各自的媒體地址)
+    rtp_dest_addr.sin_port = htons(session.media.remote_port);
     
     log_with_timestamp("對方 RTP 端口: %d，我方 RTP 接收端口: %d\n", 
-                      session.remote_rtp_port, LOCAL_RTP_PORT);
+                      session.media.remote_port, LOCAL_RTP_PORT);
     
     // **關鍵修復**: 正確的RTP端口配置
     // 我們應該監聽自己在SDP中宣告的端口，而不是對方的端口
     int our_rtp_port = LOCAL_RTP_PORT;  // 我們自己的端口，在SDP中已宣告
-    int their_rtp_port = session.remote_rtp_port;  // 對方的端口，從SDP中解析
+    int their_rtp_port = session.media.remote_port;  // 對方的端口，從SDP中解析
     
     log_with_timestamp("**正確配置**: 我方監聽端口 %d，對方監聽端口 %d\n", 
                       our_rtp_port, their_rtp_port);
     
-    // 設置RTP回調函數
-    set_rtp_callback(custom_rtp_callback);
-    
-    // 啟動 RTP 接收器來接收對方的音頻
-    log_with_timestamp("啟動 RTP 接收器...\n");
-    start_rtp_receiver(our_rtp_port, "received_from_server.wav");
-    
     // 檢查 WAV 文件是否存在並啟動音頻播放進程
-    if (access(WAV_FILE_PATH, F_OK) == 0) {
+    if (session.media.direction == SIP_SDP_RECVONLY || session.media.direction == SIP_SDP_INACTIVE) {
+        log_with_timestamp("媒體方向為 %s，不發送音頻\n", sip_sdp_direction_name(session.media.direction));
+    } else if (access(WAV_FILE_PATH, F_OK) == 0) {
         log_with_timestamp("準備播放 WAV 文件: %s\n", WAV_FILE_PATH);
         
         // 創建音頻播放線程（內部會使用fork創建子進程）
-        void **audio_args = (void**)malloc(10 * sizeof(void*));
+        void **audio_args = (void**)malloc(11 * sizeof(void*));
         audio_args[0] = malloc(sizeof(int));
         *((int*)audio_args[0]) = session.sockfd;
         
@@ -323,6 +354,10 @@ void* sip_call_thread(void* arg) {
         int current_rtp_sockfd = get_rtp_sockfd();  // 獲取當前RTP socket
         *((int*)audio_args[9]) = current_rtp_sockfd;  // 傳遞RTP socket給子進程
         
+        // 傳遞協商的媒體描述 (負載類型、ptime)
+        audio_args[10] = malloc(sizeof(sip_media_t));
+        memcpy(audio_args[10], &session.media, sizeof(sip_media_t));
+        
         // 創建音頻處理線程（線程內部會fork子進程）
         if (pthread_create(&audio_thread, NULL, rtp_audio_thread, audio_args) == 0) {
             log_with_timestamp("音頻處理線程已創建（將使用子進程發送RTP）\n");
@@ -331,7 +366,7 @@ void* sip_call_thread(void* arg) {
         } else {
             log_with_timestamp("創建音頻處理線程失敗\n");
             // 釋放參數記憶體
-            for (int i = 0; i < 10; i++) {
+            for (int i = 0; i < 11; i++) {
                 if (audio_args[i] && i != 2) {
                     free(audio_args[i]);
                 }
@@ -343,10 +378,10 @@ void* sip_call_thread(void* arg) {
     }
     
     // 持續監聽 RTP 封包，不立即掛斷
-    log_with_timestamp("保持通話並監聽 RTP 封包，最多 %d 秒...\n", RTP_LISTEN_TIMEOUT);
+    log_with_timestamp("保持通話並監聽 RTP 封包，最多 %d 秒...\n", sip_config()->rtp_listen_timeout);
     
     // 等待掛斷請求或超時
-    while (sip_call_active && rtp_timeout_counter < RTP_LISTEN_TIMEOUT) {
+    while (sip_call_active && !session.remote_bye && rtp_timeout_counter < sip_config()->rtp_listen_timeout) {
         sleep(1);
         rtp_timeout_counter++;
         
@@ -365,6 +400,17 @@ void* sip_call_thread(void* arg) {
     
     log_with_timestamp("通話循環結束，準備清理資源\n");
 
+    // 對方已掛斷：立即停止音頻發送，不等待檔案播放完畢
+    if (session.remote_bye) {
+        log_with_timestamp("對方已掛斷，停止音頻發送\n");
+        sip_call_active = 0;
+        pthread_mutex_lock(&audio_child_lock);
+        if (audio_child_pid > 0) {
+            kill(audio_child_pid, SIGTERM);
+        }
+        pthread_mutex_unlock(&audio_child_lock);
+    }
+
     // 等待音頻線程結束（如果它被創建了）
     if (audio_process_created) {
         log_with_timestamp("等待音頻處理線程結束...\n");
@@ -377,10 +423,12 @@ void* sip_call_thread(void* arg) {
     clear_rtp_callback();
     stop_rtp_receiver();
     
-    // 發送 BYE 結束通話
-    log_with_timestamp("發送 BYE 結束通話\n");
-    send_bye(session.sockfd, &session.servaddr, session.callid, 
-             session.tag, session.to_tag, session.cseq);
+    // 發送 BYE 結束通話 (對方已發送 BYE 時不需要)
+    if (!session.remote_bye) {
+        log_with_timestamp("發送 BYE 結束通話\n");
+        send_bye(session.sockfd, &session.servaddr, session.callid, 
+                 session.tag, session.to_tag, session.cseq);
+    }
     
     // 關閉 SIP 會話
     close_sip_session(&session);
@@ -537,17 +585,24 @@ void custom_rtp_callback(const unsigned char *rtp_data, size_t data_size) {
     send_rtp_to_client(rtp_data, data_size);
 }
 
-int main(void) {
+int main(int argc, char **argv) {
     struct lws_context_creation_info info;
     
     log_with_timestamp("WebSocket SIP Demo 服務器啟動\n");
     
-    // 設置信號處理
+    // 載入設定 (可用第一個參數或 SIP_CONFIG 環境變數指定設定檔)
+    if (sip_config_load(argc > 1 ? argv[1] : NULL) != 0) {
+        log_with_timestamp("載入設定失敗\n");
+        return -1;
+    }
+    
+    // 設置信號處理 (SIGHUP 重新載入設定)
     signal(SIGINT, sigint_handler);
+    sip_config_watch_sighup();
     
     // 初始化 libwebsockets
     memset(&info, 0, sizeof(info));
-    info.port = WS_PORT;
+    info.port = sip_config()->ws_port;
     info.protocols = protocols;
     info.gid = -1;
     info.uid = -1;
@@ -560,7 +615,7 @@ int main(void) {
         return -1;
     }
     
-    log_with_timestamp("WebSocket 服務器監聽所有網路介面上的端口 %d\n", WS_PORT);
+    log_with_timestamp("WebSocket 服務器監聽所有網路介面上的端口 %d\n", sip_config()->ws_port);
     
     // 主循環
     while (!force_exit) {